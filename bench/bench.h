@@ -0,0 +1,66 @@
+/**
+ * filename: bench.h
+ * description: Timing and allocation counting shared by the benchmarks.
+ *              Every benchmark is a single file linked with the allocator
+ *              wrapped (see BENCH_LDFLAGS in the makefile), so it includes
+ *              this exactly once.
+ */
+
+#pragma once
+
+// C includes
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// defines
+#define BENCH_NS_PER_SEC 1000000000LL
+#define BENCH_NS_PER_US 1000
+#define BENCH_BYTES_PER_MB (1024.0 * 1024.0)
+
+// every malloc, calloc and realloc made by the agent's code or the benchmark
+static atomic_ullong g_bench_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t count, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&g_bench_allocs, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&g_bench_allocs, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&g_bench_allocs, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+static inline unsigned long long bench_allocs(void)
+{
+    return atomic_load_explicit(&g_bench_allocs, memory_order_relaxed);
+}
+
+static inline long long bench_now_ns(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * BENCH_NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Throughput of `bytes` moved in `ns`. */
+static inline double bench_mb_per_s(double bytes, long long ns)
+{
+    return (ns > 0) ? bytes / BENCH_BYTES_PER_MB * BENCH_NS_PER_SEC / (double)ns : 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * filename: codec_bench.c
+ * description: Time and allocations per exec command for the payload parser
+ *              and the response builder, with the arena reset between commands
+ *              as the session does.
+ *
+ * usage: codec_bench [iterations] [args]
+ */
+
+// C includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// User includes
+#include "network.h"
+#include "arena.h"
+#include "bench.h"
+
+// defines
+#define DEFAULT_ITERATIONS 1000000
+#define DEFAULT_ARGS 8
+#define MAX_ARGS 1024
+#define BENCH_PATH "/bin/echo"
+#define BENCH_ARG "argument"
+#define BENCH_TIMEOUT_MS 1000
+#define BENCH_OUTPUT_SIZE 4096
+
+/* A CMD_EXEC_COMMAND payload the way the controller encodes it, with the output caps. */
+static uint8_t *build_payload(int args, size_t *out_len)
+{
+    size_t path_len = strlen(BENCH_PATH);
+    size_t args_len = (size_t)args * sizeof(BENCH_ARG);
+    size_t len = sizeof(uint32_t) * 5 + path_len + args_len;
+    uint8_t *payload = malloc(len);
+    uint8_t *cursor = payload;
+    uint32_t field = 0;
+
+    if (NULL == payload)
+    {
+        return NULL;
+    }
+
+    field = htonl(BENCH_TIMEOUT_MS);
+    memcpy(cursor, &field, sizeof(field));
+    cursor += sizeof(field);
+    field = htonl((uint32_t)path_len);
+    memcpy(cursor, &field, sizeof(field));
+    cursor += sizeof(field);
+    memcpy(cursor, BENCH_PATH, path_len);
+    cursor += path_len;
+    field = htonl((uint32_t)args_len);
+    memcpy(cursor, &field, sizeof(field));
+    cursor += sizeof(field);
+    for (int i = 0; i < args; ++i)
+    {
+        // sizeof keeps the NUL separating the args
+        memcpy(cursor, BENCH_ARG, sizeof(BENCH_ARG));
+        cursor += sizeof(BENCH_ARG);
+    }
+    field = htonl(BENCH_OUTPUT_SIZE);
+    memcpy(cursor, &field, sizeof(field));
+    cursor += sizeof(field);
+    memcpy(cursor, &field, sizeof(field));
+
+    *out_len = len;
+    return payload;
+}
+
+static void report(const char *op, int args, long long iterations, long long ns, unsigned long long allocs)
+{
+    printf("bench=codec op=%s args=%d iterations=%lld ns_per_op=%lld allocs_per_op=%.3f\n",
+           op, args, iterations, ns / iterations, (double)allocs / (double)iterations);
+}
+
+static int bench_parse(arena_t *arena, const uint8_t *payload, size_t payload_len, int args, long long iterations)
+{
+    uint32_t timeout_ms = 0;
+    char *path = NULL;
+    char **argv = NULL;
+    exec_limits_t limits = {0};
+    int capped = 0;
+    unsigned long long allocs = bench_allocs();
+    long long start = bench_now_ns();
+
+    for (long long i = 0; i < iterations; ++i)
+    {
+        if (CMD_OK != parse_exec_payload(arena, payload, payload_len, &timeout_ms, &path, &argv, &limits, &capped) ||
+            NULL == argv[0])
+        {
+            return 1;
+        }
+        arena_reset(arena);
+    }
+    report("parse_exec_payload", args, iterations, bench_now_ns() - start, bench_allocs() - allocs);
+
+    return 0;
+}
+
+static int bench_build(arena_t *arena, long long iterations)
+{
+    char out[BENCH_OUTPUT_SIZE] = {0};
+    exec_output_t out_stdout = {out, sizeof(out), sizeof(out) * 2};
+    exec_output_t out_stderr = {NULL, 0, 0};
+    struct iovec parts[EXEC_RESPONSE_PARTS_MAX];
+    int part_count = 0;
+    unsigned long long allocs = bench_allocs();
+    long long start = bench_now_ns();
+
+    for (long long i = 0; i < iterations; ++i)
+    {
+        if (CMD_OK != build_exec_response(arena, 0, &out_stdout, &out_stderr, 1, parts, &part_count) ||
+            EXEC_RESPONSE_PARTS_MAX != part_count)
+        {
+            return 1;
+        }
+        arena_reset(arena);
+    }
+    report("build_exec_response", 0, iterations, bench_now_ns() - start, bench_allocs() - allocs);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long long iterations = (argc > 1) ? atoll(argv[1]) : DEFAULT_ITERATIONS;
+    int args = (argc > 2) ? atoi(argv[2]) : DEFAULT_ARGS;
+    arena_t arena = {0};
+    uint8_t *payload = NULL;
+    size_t payload_len = 0;
+    int ret = 1;
+
+    if (iterations <= 0 || args < 0 || args > MAX_ARGS)
+    {
+        fprintf(stderr, "usage: %s [iterations] [args <= %d]\n", argv[0], MAX_ARGS);
+        return 1;
+    }
+
+    payload = build_payload(args, &payload_len);
+    if (NULL == payload || ARENA_OK != arena_init(&arena, ARENA_DEFAULT_SIZE))
+    {
+        free(payload);
+        return 1;
+    }
+
+    if (0 != bench_parse(&arena, payload, payload_len, args, iterations) ||
+        0 != bench_build(&arena, iterations))
+    {
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    arena_destroy(&arena);
+    free(payload);
+    return ret;
+}
@@ -0,0 +1,935 @@
+/**
+ * filename: ctl_bench.c
+ * description: Stand-in controller for end to end benchmarks. Starts an agent
+ *              talking to it over loopback, replays a script of commands and
+ *              reports latency percentiles and throughput for each step,
+ *              optionally through a link that adds delay and limits bandwidth.
+ *
+ * usage: ctl_bench [-s script | -s @file] [-d depth] [-z] [-l delay_ms] [-b kib_per_s]
+ *
+ * A script is a list of steps separated by commas or new lines, each one
+ * `op[:size][*count]` (sizes take a k or m suffix, `#` starts a comment):
+ *
+ *   get:SIZE     CMD_GET_FILE of a SIZE byte file
+ *   exec[:SIZE]  CMD_EXEC_COMMAND of a child writing SIZE bytes to stdout
+ *   logs         CMD_UNLOAD_LOGS from the cursor the previous one returned
+ *   sleep        CMD_SLEEP for 0 seconds, until the agent is back with a hello
+ *
+ * A depth above 1 enables CAP_MUX and keeps up to depth commands of a step
+ * in flight, -z enables CAP_LZ. The delay is added to each direction.
+ */
+
+// C includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// User includes
+#include "core.h"
+#include "network.h"
+#include "frame.h"
+#include "file.h"
+#include "lz.h"
+#include "bench.h"
+
+// defines
+#define DEFAULT_SCRIPT "get:4k*500,get:1m*50,exec*100,exec:64k*50,logs*20,sleep*2"
+#define STEPS_MAX 64
+#define DEPTH_MAX 256
+#define AGENT_NAME "BNCH"
+#define LOOPBACK "127.0.0.1"
+#define FILE_PATH_FORMAT "/tmp/ctl_bench.%zu"
+#define PATH_SIZE 64
+#define EXEC_TIMEOUT_MS 10000
+#define EXEC_ARGS_SIZE 64
+#define LINK_CHUNK_SIZE (16 * 1024)
+// bytes a link direction holds, bandwidth-delay products past it are cut short
+#define LINK_CHUNKS 256
+#define NS_PER_MS 1000000LL
+#define BYTES_PER_KIB 1024.0
+
+typedef enum step_op_e
+{
+    OP_GET = 0,
+    OP_EXEC,
+    OP_LOGS,
+    OP_SLEEP,
+} step_op_t;
+
+typedef struct step_s
+{
+    step_op_t op;
+    size_t size;
+    int count;
+} step_t;
+
+typedef struct ctl_s
+{
+    int listen_fd;
+    int fd;                     // current session, -1 between sessions
+    frame_conn_t *conn;
+    uint32_t wanted_caps;
+    uint32_t caps;              // enabled on the current session
+    int depth;
+    int in_flight;
+    long long sent_ns[DEPTH_MAX];   // by request id
+    uint32_t free_ids[DEPTH_MAX];
+    int free_count;
+    uint64_t log_cursor;
+    byte_buf_t wire;            // reply payload as received
+    byte_buf_t raw;             // and decompressed
+} ctl_t;
+
+typedef struct link_chunk_s
+{
+    long long due_ns;
+    size_t len;
+    uint8_t data[LINK_CHUNK_SIZE];
+} link_chunk_t;
+
+/* One direction of the link: bytes read from `in` come out of `out` once due. */
+typedef struct link_pipe_s
+{
+    int in;
+    int out;
+    long long delay_ns;
+    double ns_per_byte;         // 0 for no bandwidth limit
+    link_chunk_t *chunks;
+} link_pipe_t;
+
+typedef struct link_s
+{
+    int listen_fd;              // where the agent connects
+    uint16_t ctl_port;          // where the link connects on its behalf
+    link_pipe_t up;             // agent to controller
+    link_pipe_t down;           // controller to agent
+} link_t;
+
+static const char *const g_op_names[] = {
+    [OP_GET] = "get", [OP_EXEC] = "exec", [OP_LOGS] = "logs", [OP_SLEEP] = "sleep",
+};
+
+static int compare_ns(const void *a, const void *b)
+{
+    long long left = *(const long long *)a;
+    long long right = *(const long long *)b;
+
+    return (left > right) - (left < right);
+}
+
+static size_t parse_size(const char *str, char **out_end)
+{
+    size_t size = strtoull(str, out_end, 10);
+
+    switch (**out_end)
+    {
+        case 'k':
+        case 'K':
+            size *= 1024;
+            ++*out_end;
+            break;
+
+        case 'm':
+        case 'M':
+            size *= 1024 * 1024;
+            ++*out_end;
+            break;
+    }
+
+    return size;
+}
+
+/* Fills `steps` from a script, returns 0 on success. */
+static int parse_script(const char *script, step_t *steps, int *out_count)
+{
+    const char *cursor = script;
+    const char *start = NULL;
+    char *end = NULL;
+    size_t len = 0;
+    int count = 0;
+    int op = 0;
+
+    while ('\0' != *cursor)
+    {
+        cursor += strspn(cursor, ", \t\r\n");
+        if ('#' == *cursor)
+        {
+            cursor += strcspn(cursor, "\n");
+            continue;
+        }
+        if ('\0' == *cursor)
+        {
+            break;
+        }
+        if (STEPS_MAX == count)
+        {
+            fprintf(stderr, "more than %d steps\n", STEPS_MAX);
+            return 1;
+        }
+
+        start = cursor;
+        len = strcspn(cursor, ":*, \t\r\n");
+        for (op = OP_GET; op <= OP_SLEEP; ++op)
+        {
+            if (strlen(g_op_names[op]) == len && 0 == strncmp(cursor, g_op_names[op], len))
+            {
+                break;
+            }
+        }
+
+        steps[count].op = op;
+        steps[count].size = 0;
+        steps[count].count = 1;
+        end = (char *)cursor + len;
+        if (':' == *end)
+        {
+            steps[count].size = parse_size(end + 1, &end);
+        }
+        if ('*' == *end)
+        {
+            steps[count].count = (int)strtol(end + 1, &end, 10);
+        }
+        if (op > OP_SLEEP || steps[count].count <= 0 || (OP_GET == op && 0 == steps[count].size) ||
+            NULL == strchr(", \t\r\n#", *end))
+        {
+            fprintf(stderr, "bad step: %.*s\n", (int)strcspn(start, ", \t\r\n"), start);
+            return 1;
+        }
+        cursor = end;
+        ++count;
+    }
+
+    *out_count = count;
+    return (0 == count);
+}
+
+/* Creates the files the get steps ask for, if an earlier run didn't. */
+static int prepare_files(const step_t *steps, int count)
+{
+    char path[PATH_SIZE];
+    uint8_t chunk[LINK_CHUNK_SIZE];
+    file_info_t info = {0};
+    size_t len = 0;
+    int fd = -1;
+
+    memset(chunk, 'x', sizeof(chunk));
+    for (int i = 0; i < count; ++i)
+    {
+        if (OP_GET != steps[i].op)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), FILE_PATH_FORMAT, steps[i].size);
+        if (FILE_OK == open_regular_file(path, &fd, &info))
+        {
+            close(fd);
+            if (info.size == steps[i].size)
+            {
+                continue;
+            }
+        }
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (-1 == fd)
+        {
+            return 1;
+        }
+        for (size_t done = 0; done < steps[i].size; done += len)
+        {
+            len = (steps[i].size - done < sizeof(chunk)) ? steps[i].size - done : sizeof(chunk);
+            if (FILE_OK != write_all(fd, chunk, len))
+            {
+                close(fd);
+                return 1;
+            }
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+static int listen_loopback(uint16_t *out_port)
+{
+    struct sockaddr_in addr = {0};
+    socklen_t addr_len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (-1 == fd)
+    {
+        return -1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || 0 != listen(fd, 1) ||
+        0 != getsockname(fd, (struct sockaddr *)&addr, &addr_len))
+    {
+        close(fd);
+        return -1;
+    }
+
+    *out_port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* Runs a persistent agent in a child, connecting to `port`. */
+static pid_t start_agent(uint16_t port)
+{
+    tool_t tool = {0};
+    pid_t pid = fork();
+
+    if (0 != pid)
+    {
+        return pid;
+    }
+
+    memcpy(tool.name, AGENT_NAME, TOOL_NAME_SIZE);
+    strcpy(tool.conf.ip, LOOPBACK);
+    tool.conf.port = port;
+    tool.conf.persistent = 1;
+    run(&tool);
+    _exit(0);
+}
+
+static void *link_pump(void *arg)
+{
+    link_pipe_t *pipe = arg;
+    struct pollfd pfd = { .fd = pipe->in };
+    link_chunk_t *chunk = NULL;
+    long long now = 0;
+    long long sent_ns = 0;      // when the last chunk is through the bandwidth limit
+    size_t head = 0;
+    size_t count = 0;
+    int timeout_ms = 0;
+    int eof = 0;
+
+    while (0 == eof || 0 != count)
+    {
+        now = bench_now_ns();
+        for (; 0 != count && pipe->chunks[head].due_ns <= now; head = (head + 1) % LINK_CHUNKS, --count)
+        {
+            if (FILE_OK != write_all(pipe->out, pipe->chunks[head].data, pipe->chunks[head].len))
+            {
+                goto cleanup;
+            }
+        }
+        if (0 != eof && 0 == count)
+        {
+            break;
+        }
+
+        // ms rounded up, a chunk is never early
+        timeout_ms = (0 == count) ? -1 : (int)((pipe->chunks[head].due_ns - now + NS_PER_MS - 1) / NS_PER_MS);
+        pfd.events = (0 == eof && count < LINK_CHUNKS) ? POLLIN : 0;
+        if (-1 == poll(&pfd, 1, timeout_ms) && EINTR != errno)
+        {
+            goto cleanup;
+        }
+        if (0 == (pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            continue;
+        }
+
+        chunk = &pipe->chunks[(head + count) % LINK_CHUNKS];
+        if (FILE_OK != read_partial(pipe->in, chunk->data, sizeof(chunk->data), &chunk->len) || 0 == chunk->len)
+        {
+            eof = 1;
+            continue;
+        }
+
+        now = bench_now_ns();
+        sent_ns = ((sent_ns > now) ? sent_ns : now) + (long long)(pipe->ns_per_byte * (double)chunk->len);
+        chunk->due_ns = sent_ns + pipe->delay_ns;
+        ++count;
+    }
+
+cleanup:
+    shutdown(pipe->out, SHUT_WR);
+    return NULL;
+}
+
+/* Relays every session of the agent to the controller, one at a time. */
+static void *link_main(void *arg)
+{
+    link_t *link = arg;
+    struct sockaddr_in addr = {0};
+    pthread_t up;
+    pthread_t down;
+    int agent_fd = -1;
+    int ctl_fd = -1;
+    int nodelay = 1;
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(link->ctl_port);
+
+    while (-1 != (agent_fd = accept(link->listen_fd, NULL, NULL)))
+    {
+        ctl_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (-1 == ctl_fd || 0 != connect(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            break;
+        }
+
+        // chunks leave when due, Nagle holding back the last one of a reply would add an ack delay
+        (void)setsockopt(agent_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        (void)setsockopt(ctl_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        link->up.in = agent_fd;
+        link->up.out = ctl_fd;
+        link->down.in = ctl_fd;
+        link->down.out = agent_fd;
+        pthread_create(&up, NULL, link_pump, &link->up);
+        pthread_create(&down, NULL, link_pump, &link->down);
+        pthread_join(up, NULL);
+        pthread_join(down, NULL);
+        close(ctl_fd);
+        close(agent_fd);
+    }
+
+    return NULL;
+}
+
+/*
+ * Puts a link in front of the controller's port, returns the port the agent
+ * should use. Nothing is relayed before link_main runs.
+ */
+static int open_link(link_t *link, uint16_t ctl_port, long long delay_ms, long long kib_per_s,
+                     uint16_t *out_port)
+{
+    link->ctl_port = ctl_port;
+    link->up.delay_ns = delay_ms * NS_PER_MS;
+    link->up.ns_per_byte = (kib_per_s > 0) ? BENCH_NS_PER_SEC / ((double)kib_per_s * BYTES_PER_KIB) : 0;
+    link->down = link->up;
+    link->up.chunks = malloc(LINK_CHUNKS * sizeof(*link->up.chunks));
+    link->down.chunks = malloc(LINK_CHUNKS * sizeof(*link->down.chunks));
+    link->listen_fd = listen_loopback(out_port);
+
+    return (NULL == link->up.chunks || NULL == link->down.chunks || -1 == link->listen_fd);
+}
+
+static int ctl_send(ctl_t *ctl, uint8_t code, uint32_t request_id, const void *payload, size_t payload_len)
+{
+    uint8_t header[sizeof(uint8_t) + sizeof(uint32_t) * 2];
+    uint32_t field = htonl(request_id);
+    size_t header_len = sizeof(uint8_t);
+    struct iovec iov[2];
+
+    header[0] = code;
+    if (0 != (ctl->caps & CAP_MUX))
+    {
+        memcpy(header + header_len, &field, sizeof(field));
+        header_len += sizeof(field);
+    }
+    field = htonl((uint32_t)payload_len);
+    memcpy(header + header_len, &field, sizeof(field));
+    header_len += sizeof(field);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payload_len;
+
+    return (FRAME_OK != frame_write(ctl->conn, iov, (0 != payload_len) ? 2 : 1));
+}
+
+/*
+ * Reads a result frame, framed the way the caps enabled so far say. The
+ * payload, decompressed if need be, is in ctl->raw. `*out_wire` counts the
+ * bytes that crossed the socket.
+ */
+static int ctl_receive(ctl_t *ctl, uint32_t *out_request_id, int32_t *out_ret_code, size_t *out_wire)
+{
+    uint32_t field = 0;
+    uint8_t flags = 0;
+    size_t raw_len = 0;
+    size_t header_len = sizeof(int32_t) + sizeof(uint32_t);
+
+    *out_request_id = 0;
+    if (0 != (ctl->caps & CAP_MUX))
+    {
+        if (FRAME_OK != frame_read(ctl->conn, &field, sizeof(field)))
+        {
+            return 1;
+        }
+        *out_request_id = ntohl(field);
+        header_len += sizeof(field);
+    }
+
+    if (FRAME_OK != frame_read(ctl->conn, &field, sizeof(field)))
+    {
+        return 1;
+    }
+    *out_ret_code = (int32_t)ntohl(field);
+
+    if (0 != (ctl->caps & CAP_LZ))
+    {
+        if (FRAME_OK != frame_read(ctl->conn, &flags, sizeof(flags)))
+        {
+            return 1;
+        }
+        header_len += sizeof(flags);
+    }
+
+    if (FRAME_OK != frame_read(ctl->conn, &field, sizeof(field)))
+    {
+        return 1;
+    }
+
+    ctl->wire.size = 0;
+    ctl->raw.size = 0;
+    field = ntohl(field);
+    if (FILE_OK != byte_buf_reserve(&ctl->wire, field) ||
+        (0 != field && FRAME_OK != frame_read(ctl->conn, ctl->wire.data, field)))
+    {
+        return 1;
+    }
+    ctl->wire.size = field;
+    *out_wire = header_len + field;
+
+    if (0 == (flags & RESULT_FLAG_LZ))
+    {
+        return (FILE_OK != byte_buf_append(&ctl->raw, ctl->wire.data, ctl->wire.size));
+    }
+
+    if (ctl->wire.size < sizeof(field))
+    {
+        return 1;
+    }
+    memcpy(&field, ctl->wire.data, sizeof(field));
+    field = ntohl(field);
+    if (FILE_OK != byte_buf_reserve(&ctl->raw, field) ||
+        LZ_OK != lz_decompress(ctl->wire.data + sizeof(field), ctl->wire.size - sizeof(field),
+                               ctl->raw.data, field, &raw_len) || raw_len != field)
+    {
+        return 1;
+    }
+    ctl->raw.size = raw_len;
+
+    return 0;
+}
+
+/* Waits for the agent, reads its hello and enables the caps asked for. */
+static int ctl_accept(ctl_t *ctl)
+{
+    uint8_t hello[sizeof(uint8_t) + TOOL_NAME_SIZE + sizeof(uint32_t)];
+    uint32_t caps = 0;
+    uint32_t request_id = 0;
+    int32_t ret_code = 0;
+    size_t wire = 0;
+
+    ctl->fd = accept(ctl->listen_fd, NULL, NULL);
+    if (-1 == ctl->fd)
+    {
+        return 1;
+    }
+    frame_init(ctl->conn, ctl->fd);
+    ctl->caps = 0;
+
+    if (FRAME_OK != frame_read(ctl->conn, hello, sizeof(hello)) || PROTOCOL_VERSION != hello[0])
+    {
+        fprintf(stderr, "no version %d hello from the agent\n", PROTOCOL_VERSION);
+        return 1;
+    }
+    memcpy(&caps, hello + sizeof(uint8_t) + TOOL_NAME_SIZE, sizeof(caps));
+    if ((ntohl(caps) & ctl->wanted_caps) != ctl->wanted_caps)
+    {
+        fprintf(stderr, "the agent lacks caps 0x%x\n", ctl->wanted_caps & ~ntohl(caps));
+        return 1;
+    }
+    if (0 == ctl->wanted_caps)
+    {
+        return 0;
+    }
+
+    caps = htonl(ctl->wanted_caps);
+    if (0 != ctl_send(ctl, CMD_SET_CAPS, 0, &caps, sizeof(caps)) || FRAME_OK != frame_flush(ctl->conn) ||
+        0 != ctl_receive(ctl, &request_id, &ret_code, &wire) || 0 != ret_code || ctl->raw.size < sizeof(caps))
+    {
+        return 1;
+    }
+    memcpy(&caps, ctl->raw.data, sizeof(caps));
+    ctl->caps = ntohl(caps);
+
+    return (ctl->caps != ctl->wanted_caps);
+}
+
+static void ctl_close(ctl_t *ctl)
+{
+    if (-1 != ctl->fd)
+    {
+        close(ctl->fd);
+        ctl->fd = -1;
+    }
+}
+
+/* Builds the payload every command of the step shares, the log cursor aside. */
+static int build_step_payload(const step_t *step, byte_buf_t *payload)
+{
+    char path[PATH_SIZE];
+    char args[EXEC_ARGS_SIZE];
+    uint32_t field = 0;
+    int args_len = 0;
+
+    payload->size = 0;
+    switch (step->op)
+    {
+        case OP_GET:
+            snprintf(path, sizeof(path), FILE_PATH_FORMAT, step->size);
+            return (FILE_OK != byte_buf_append(payload, path, strlen(path)));
+
+        case OP_EXEC:
+            // the agent wants a path it can access(), args are argv[0] on, NUL separated
+            snprintf(path, sizeof(path), "%s", (0 != step->size) ? "/bin/head" : "/bin/true");
+            if (0 != step->size)
+            {
+                args_len = snprintf(args, sizeof(args), "head%c-c%c%zu%c/dev/zero", '\0', '\0', step->size, '\0');
+            }
+            field = htonl(EXEC_TIMEOUT_MS);
+            if (FILE_OK != byte_buf_append(payload, &field, sizeof(field)))
+            {
+                return 1;
+            }
+            field = htonl((uint32_t)strlen(path));
+            if (FILE_OK != byte_buf_append(payload, &field, sizeof(field)) ||
+                FILE_OK != byte_buf_append(payload, path, strlen(path)))
+            {
+                return 1;
+            }
+            field = htonl((uint32_t)args_len);
+            return (FILE_OK != byte_buf_append(payload, &field, sizeof(field)) ||
+                    FILE_OK != byte_buf_append(payload, args, (size_t)args_len));
+
+        case OP_LOGS:
+        case OP_SLEEP:
+            // the cursor, or a sleep of 0 seconds
+            return (FILE_OK != byte_buf_reserve(payload, sizeof(uint64_t)));
+    }
+
+    return 1;
+}
+
+/* Tells whether a reply is what the step's command should get, and follows the log cursor. */
+static int check_reply(ctl_t *ctl, const step_t *step, int32_t ret_code)
+{
+    uint64_t next = 0;
+    int32_t exit_code = 0;
+
+    if (0 != ret_code)
+    {
+        return 0;
+    }
+
+    switch (step->op)
+    {
+        case OP_GET:
+            return (ctl->raw.size == step->size);
+
+        case OP_EXEC:
+            if (ctl->raw.size < sizeof(exit_code))
+            {
+                return 0;
+            }
+            memcpy(&exit_code, ctl->raw.data, sizeof(exit_code));
+            return (0 == exit_code);
+
+        case OP_LOGS:
+            if (ctl->raw.size < sizeof(uint64_t) * UNLOAD_LOGS_POSITIONS)
+            {
+                return 0;
+            }
+            memcpy(&next, ctl->raw.data + sizeof(uint64_t), sizeof(next));
+            ctl->log_cursor = be64toh(next);
+            return 1;
+
+        case OP_SLEEP:
+            return 1;
+    }
+
+    return 0;
+}
+
+/* CMD_SLEEP for 0 seconds, timed until the agent reconnected. */
+static int ctl_sleep(ctl_t *ctl, long long *out_ns, size_t *out_wire)
+{
+    uint32_t seconds = 0;
+    uint32_t request_id = 0;
+    int32_t ret_code = 0;
+    long long start = bench_now_ns();
+
+    if (0 != ctl_send(ctl, CMD_SLEEP, 0, &seconds, sizeof(seconds)) || FRAME_OK != frame_flush(ctl->conn) ||
+        0 != ctl_receive(ctl, &request_id, &ret_code, out_wire) || 0 != ret_code)
+    {
+        return 1;
+    }
+
+    ctl_close(ctl);
+    if (0 != ctl_accept(ctl))
+    {
+        return 1;
+    }
+
+    *out_ns = bench_now_ns() - start;
+    return 0;
+}
+
+static void report(const ctl_t *ctl, const step_t *step, long long *latencies, int errors, uint64_t wire,
+                   long long ns)
+{
+    qsort(latencies, (size_t)step->count, sizeof(*latencies), compare_ns);
+
+    printf("bench=ctl op=%s size=%zu count=%d depth=%d caps=0x%x p50_us=%lld p90_us=%lld p99_us=%lld "
+           "max_us=%lld cmds_per_s=%.0f mb_per_s=%.1f errors=%d\n",
+           g_op_names[step->op], step->size, step->count, ctl->depth, ctl->caps,
+           latencies[step->count / 2] / BENCH_NS_PER_US,
+           latencies[(long long)step->count * 90 / 100] / BENCH_NS_PER_US,
+           latencies[(long long)step->count * 99 / 100] / BENCH_NS_PER_US,
+           latencies[step->count - 1] / BENCH_NS_PER_US,
+           (double)step->count * BENCH_NS_PER_SEC / (double)ns, bench_mb_per_s((double)wire, ns), errors);
+}
+
+/*
+ * Sends the step's commands keeping up to ctl->depth of them in flight,
+ * and waits for every reply before the next step.
+ */
+static int run_step(ctl_t *ctl, const step_t *step)
+{
+    byte_buf_t payload = {0};
+    long long *latencies = calloc((size_t)step->count, sizeof(*latencies));
+    uint64_t cursor = 0;
+    uint64_t wire = 0;
+    size_t reply_wire = 0;
+    uint32_t request_id = 0;
+    int32_t ret_code = 0;
+    long long start = 0;
+    int sent = 0;
+    int done = 0;
+    int errors = 0;
+    int ret = 1;
+
+    if (NULL == latencies || 0 != build_step_payload(step, &payload))
+    {
+        goto cleanup;
+    }
+
+    start = bench_now_ns();
+    while (done < step->count)
+    {
+        if (OP_SLEEP == step->op)
+        {
+            if (0 != ctl_sleep(ctl, &latencies[done++], &reply_wire))
+            {
+                goto cleanup;
+            }
+            wire += reply_wire;
+            continue;
+        }
+
+        for (; sent < step->count && ctl->in_flight < ctl->depth; ++sent, ++ctl->in_flight)
+        {
+            if (OP_LOGS == step->op)
+            {
+                cursor = htobe64(ctl->log_cursor);
+                memcpy(payload.data, &cursor, sizeof(cursor));
+                payload.size = sizeof(cursor);
+            }
+
+            request_id = ctl->free_ids[--ctl->free_count];
+            ctl->sent_ns[request_id] = bench_now_ns();
+            if (0 != ctl_send(ctl, (OP_GET == step->op) ? CMD_GET_FILE :
+                              (OP_EXEC == step->op) ? CMD_EXEC_COMMAND : CMD_UNLOAD_LOGS,
+                              request_id, payload.data, payload.size))
+            {
+                goto cleanup;
+            }
+        }
+
+        if (FRAME_OK != frame_flush(ctl->conn) || 0 != ctl_receive(ctl, &request_id, &ret_code, &reply_wire) ||
+            request_id >= DEPTH_MAX)
+        {
+            goto cleanup;
+        }
+        latencies[done++] = bench_now_ns() - ctl->sent_ns[request_id];
+        ctl->free_ids[ctl->free_count++] = request_id;
+        --ctl->in_flight;
+        wire += reply_wire;
+        errors += !check_reply(ctl, step, ret_code);
+    }
+
+    report(ctl, step, latencies, errors, wire, bench_now_ns() - start);
+    ret = 0;
+cleanup:
+    byte_buf_release(&payload);
+    free(latencies);
+    return ret;
+}
+
+static int load_script(const char *arg, char **out_script)
+{
+    uint8_t *buf = NULL;
+    size_t size = 0;
+
+    if ('@' != arg[0])
+    {
+        *out_script = strdup(arg);
+        return (NULL == *out_script);
+    }
+
+    if (FILE_OK != read_file_from_path(arg + 1, &buf, &size))
+    {
+        fprintf(stderr, "couldn't read %s\n", arg + 1);
+        return 1;
+    }
+
+    *out_script = realloc(buf, size + 1);
+    if (NULL == *out_script)
+    {
+        free(buf);
+        return 1;
+    }
+    (*out_script)[size] = '\0';
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static ctl_t ctl = {0};
+    static link_t link = {0};
+    step_t steps[STEPS_MAX];
+    pthread_t link_thread;
+    char *script = NULL;
+    const char *script_arg = DEFAULT_SCRIPT;
+    long long delay_ms = 0;
+    long long kib_per_s = 0;
+    uint16_t ctl_port = 0;
+    uint16_t agent_port = 0;
+    uint32_t request_id = 0;
+    int32_t ret_code = 0;
+    size_t wire = 0;
+    int step_count = 0;
+    pid_t agent = -1;
+    int opt = 0;
+    int ret = 1;
+
+    ctl.fd = -1;
+    ctl.listen_fd = -1;
+    ctl.depth = 1;
+    while (-1 != (opt = getopt(argc, argv, "s:d:zl:b:")))
+    {
+        switch (opt)
+        {
+            case 's': script_arg = optarg; break;
+            case 'd': ctl.depth = atoi(optarg); break;
+            case 'z': ctl.wanted_caps |= CAP_LZ; break;
+            case 'l': delay_ms = atoll(optarg); break;
+            case 'b': kib_per_s = atoll(optarg); break;
+            default: ctl.depth = 0; break;
+        }
+    }
+    if (ctl.depth <= 0 || ctl.depth > DEPTH_MAX || delay_ms < 0 || kib_per_s < 0 || optind != argc)
+    {
+        fprintf(stderr, "usage: %s [-s script | -s @file] [-d depth <= %d] [-z] [-l delay_ms] [-b kib_per_s]\n",
+                argv[0], DEPTH_MAX);
+        return 1;
+    }
+    ctl.wanted_caps |= (ctl.depth > 1) ? CAP_MUX : 0;
+    for (ctl.free_count = 0; ctl.free_count < ctl.depth; ++ctl.free_count)
+    {
+        ctl.free_ids[ctl.free_count] = (uint32_t)ctl.free_count;
+    }
+
+    if (0 != load_script(script_arg, &script) || 0 != parse_script(script, steps, &step_count) ||
+        0 != prepare_files(steps, step_count))
+    {
+        goto cleanup;
+    }
+
+    ctl.conn = malloc(sizeof(*ctl.conn));
+    ctl.listen_fd = listen_loopback(&ctl_port);
+    if (NULL == ctl.conn || -1 == ctl.listen_fd)
+    {
+        goto cleanup;
+    }
+
+    agent_port = ctl_port;
+    link.listen_fd = -1;
+    if ((0 != delay_ms || 0 != kib_per_s) && 0 != open_link(&link, ctl_port, delay_ms, kib_per_s, &agent_port))
+    {
+        goto cleanup;
+    }
+
+    // forked before any thread, the agent starts its own
+    agent = start_agent(agent_port);
+    if (-1 == agent)
+    {
+        goto cleanup;
+    }
+
+    // lives until the process exits, blocked in accept once the agent is gone
+    if (-1 != link.listen_fd)
+    {
+        if (0 != pthread_create(&link_thread, NULL, link_main, &link))
+        {
+            goto cleanup;
+        }
+        pthread_detach(link_thread);
+    }
+    // a session the agent dropped shows up as a failed read, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    if (0 != ctl_accept(&ctl))
+    {
+        goto cleanup;
+    }
+
+    for (int i = 0; i < step_count; ++i)
+    {
+        if (0 != run_step(&ctl, &steps[i]))
+        {
+            fprintf(stderr, "step %d (%s) failed\n", i, g_op_names[steps[i].op]);
+            goto cleanup;
+        }
+    }
+
+    if (0 != ctl_send(&ctl, CMD_DIE, 0, NULL, 0) || FRAME_OK != frame_flush(ctl.conn) ||
+        0 != ctl_receive(&ctl, &request_id, &ret_code, &wire))
+    {
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    ctl_close(&ctl);
+    if (-1 != agent)
+    {
+        if (0 != ret)
+        {
+            kill(agent, SIGTERM);
+        }
+        waitpid(agent, NULL, 0);
+    }
+    if (-1 != ctl.listen_fd)
+    {
+        close(ctl.listen_fd);
+    }
+    byte_buf_release(&ctl.wire);
+    byte_buf_release(&ctl.raw);
+    free(ctl.conn);
+    free(script);
+    return ret;
+}
@@ -0,0 +1,120 @@
+/**
+ * filename: exec_bench.c
+ * description: Compares exec_run latency of the fork and posix_spawn backends,
+ *              with a small heap and after the heap was inflated.
+ *
+ * usage: exec_bench [iterations] [heap_mb]
+ */
+
+// C includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// User includes
+#include "exec.h"
+#include "bench.h"
+
+// defines
+#define DEFAULT_ITERATIONS 200
+#define DEFAULT_HEAP_MB 256
+#define BYTES_PER_MB (1024 * 1024)
+#define EXEC_TIMEOUT_MS 5000
+
+static int compare_ll(const void *a, const void *b)
+{
+    long long lhs = *(const long long *)a;
+    long long rhs = *(const long long *)b;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static int bench_backend(const char *name, exec_backend_t backend, size_t heap_mb, int iterations)
+{
+    char *args[] = { "true", NULL };
+    long long *samples = NULL;
+    long long total = 0;
+    long long start = 0;
+    size_t out_size = 0;
+    size_t err_size = 0;
+    char *out = NULL;
+    char *err = NULL;
+    int exit_code = -1;
+    int ret = 1;
+
+    samples = calloc((size_t)iterations, sizeof(*samples));
+    if (NULL == samples)
+    {
+        goto cleanup;
+    }
+
+    exec_set_backend(backend);
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        start = bench_now_ns() / BENCH_NS_PER_US;
+        if (EXEC_OK != exec_run("/bin/true", args, &out_size, &out, &err_size, &err, &exit_code, EXEC_TIMEOUT_MS))
+        {
+            fprintf(stderr, "exec_run failed on iteration %d\n", i);
+            goto cleanup;
+        }
+        samples[i] = bench_now_ns() / BENCH_NS_PER_US - start;
+        total += samples[i];
+
+        free(out);
+        free(err);
+        out = NULL;
+        err = NULL;
+    }
+
+    qsort(samples, (size_t)iterations, sizeof(*samples), compare_ll);
+    printf("bench=exec backend=%s heap_mb=%zu iterations=%d mean_us=%lld p50_us=%lld p99_us=%lld\n",
+           name, heap_mb, iterations, total / iterations,
+           samples[iterations / 2], samples[(iterations * 99) / 100]);
+
+    ret = 0;
+cleanup:
+    free(samples);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    size_t heap_mb = (argc > 2) ? (size_t)atoi(argv[2]) : DEFAULT_HEAP_MB;
+    char *heap = NULL;
+    int ret = 1;
+
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [iterations] [heap_mb]\n", argv[0]);
+        goto cleanup;
+    }
+
+    if (0 != bench_backend("fork", EXEC_BACKEND_FORK, 0, iterations) ||
+        0 != bench_backend("spawn", EXEC_BACKEND_SPAWN, 0, iterations))
+    {
+        goto cleanup;
+    }
+
+    // touch every page, like the heap right after a large file transfer
+    heap = malloc(heap_mb * BYTES_PER_MB);
+    if (NULL == heap)
+    {
+        fprintf(stderr, "couldn't allocate %zu MB\n", heap_mb);
+        goto cleanup;
+    }
+    memset(heap, 1, heap_mb * BYTES_PER_MB);
+
+    if (0 != bench_backend("fork", EXEC_BACKEND_FORK, heap_mb, iterations) ||
+        0 != bench_backend("spawn", EXEC_BACKEND_SPAWN, heap_mb, iterations))
+    {
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    free(heap);
+    return ret;
+}
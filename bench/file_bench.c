@@ -0,0 +1,258 @@
+/**
+ * filename: file_bench.c
+ * description: Throughput of the file primitives: read_all/write_all at several
+ *              chunk sizes, read_until_eof growing its buffer from a pipe, and
+ *              read_file on a small and a large file.
+ *
+ * usage: file_bench [total_mb]
+ */
+
+// C includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// User includes
+#include "file.h"
+#include "bench.h"
+
+// defines
+#define DEFAULT_TOTAL_MB 64
+#define BENCH_FILE_PATH "/tmp/file_bench.dat"
+#define SMALL_FILE_SIZE 4096
+#define SMALL_FILE_READS 20000
+#define LARGE_FILE_READS 4
+#define PIPE_CHUNK (64 * 1024)
+
+static const size_t g_chunks[] = {4 * 1024, 64 * 1024, 1024 * 1024};
+// read_until_eof has no size hint on a pipe, so it grows from nothing
+static const size_t g_pipe_sizes[] = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+
+typedef struct feeder_s
+{
+    int fd;
+    size_t size;
+    const uint8_t *buf;     // at least PIPE_CHUNK bytes
+} feeder_t;
+
+static void report(const char *op, size_t op_size, long long ops, double bytes, long long ns,
+                   unsigned long long allocs)
+{
+    printf("bench=file op=%s bytes_per_op=%zu ops=%lld ns_per_op=%lld mb_per_s=%.1f allocs_per_op=%.3f\n",
+           op, op_size, ops, ns / ops, bench_mb_per_s(bytes, ns), (double)allocs / (double)ops);
+}
+
+/* Writes `total` bytes to BENCH_FILE_PATH, `chunk` bytes per write_all. */
+static int bench_write_all(const uint8_t *buf, size_t chunk, size_t total)
+{
+    long long start = 0;
+    unsigned long long allocs = 0;
+    long long ops = 0;
+    int fd = open(BENCH_FILE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (-1 == fd)
+    {
+        return 1;
+    }
+
+    allocs = bench_allocs();
+    start = bench_now_ns();
+    for (size_t done = 0; done < total; done += chunk, ++ops)
+    {
+        if (FILE_OK != write_all(fd, buf, chunk))
+        {
+            close(fd);
+            return 1;
+        }
+    }
+    report("write_all", chunk, ops, (double)total, bench_now_ns() - start, bench_allocs() - allocs);
+
+    close(fd);
+    return 0;
+}
+
+/* Reads back what bench_write_all left, from the page cache. */
+static int bench_read_all(uint8_t *buf, size_t chunk, size_t total)
+{
+    long long start = 0;
+    unsigned long long allocs = 0;
+    long long ops = 0;
+    int fd = open(BENCH_FILE_PATH, O_RDONLY);
+
+    if (-1 == fd)
+    {
+        return 1;
+    }
+
+    allocs = bench_allocs();
+    start = bench_now_ns();
+    for (size_t done = 0; done < total; done += chunk, ++ops)
+    {
+        if (FILE_OK != read_all(fd, buf, chunk))
+        {
+            close(fd);
+            return 1;
+        }
+    }
+    report("read_all", chunk, ops, (double)total, bench_now_ns() - start, bench_allocs() - allocs);
+
+    close(fd);
+    return 0;
+}
+
+static void *feed_pipe(void *arg)
+{
+    feeder_t *feeder = arg;
+    size_t len = 0;
+
+    for (size_t done = 0; done < feeder->size; done += len)
+    {
+        len = (feeder->size - done < PIPE_CHUNK) ? feeder->size - done : PIPE_CHUNK;
+        if (FILE_OK != write_all(feeder->fd, feeder->buf, len))
+        {
+            break;
+        }
+    }
+    close(feeder->fd);
+
+    return NULL;
+}
+
+/* One read_until_eof of `size` bytes from a pipe, the cost of growing the buffer. */
+static int bench_read_until_eof(const uint8_t *buf, size_t size)
+{
+    int fds[2] = {-1, -1};
+    feeder_t feeder = {0};
+    pthread_t handle;
+    uint8_t *out = NULL;
+    size_t out_size = 0;
+    long long start = 0;
+    long long ns = 0;
+    unsigned long long allocs = 0;
+    file_status_t status = FILE_FAILED;
+
+    if (0 != pipe(fds))
+    {
+        return 1;
+    }
+
+    feeder.fd = fds[1];
+    feeder.size = size;
+    feeder.buf = buf;
+
+    allocs = bench_allocs();
+    start = bench_now_ns();
+    pthread_create(&handle, NULL, feed_pipe, &feeder);
+    status = read_until_eof(fds[0], &out, &out_size);
+    ns = bench_now_ns() - start;
+    pthread_join(handle, NULL);
+    allocs = bench_allocs() - allocs;
+    close(fds[0]);
+
+    if (FILE_OK != status || out_size != size)
+    {
+        free(out);
+        return 1;
+    }
+    free(out);
+
+    report("read_until_eof_pipe", size, 1, (double)size, ns, allocs);
+    return 0;
+}
+
+/* read_file of a `size` byte file, `reads` times over. */
+static int bench_read_file(const uint8_t *buf, size_t size, long long reads)
+{
+    uint8_t *out = NULL;
+    size_t out_size = 0;
+    long long start = 0;
+    unsigned long long allocs = 0;
+    int fd = open(BENCH_FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (-1 == fd)
+    {
+        return 1;
+    }
+
+    for (size_t done = 0; done < size; done += PIPE_CHUNK)
+    {
+        if (FILE_OK != write_all(fd, buf, (size - done < PIPE_CHUNK) ? size - done : PIPE_CHUNK))
+        {
+            close(fd);
+            return 1;
+        }
+    }
+
+    allocs = bench_allocs();
+    start = bench_now_ns();
+    for (long long i = 0; i < reads; ++i)
+    {
+        if (-1 == lseek(fd, 0, SEEK_SET) || FILE_OK != read_file(fd, &out, &out_size) || out_size != size)
+        {
+            free(out);
+            close(fd);
+            return 1;
+        }
+        free(out);
+        out = NULL;
+    }
+    report("read_file", size, reads, (double)size * (double)reads, bench_now_ns() - start,
+           bench_allocs() - allocs);
+
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long total_mb = (argc > 1) ? atol(argv[1]) : DEFAULT_TOTAL_MB;
+    size_t total = 0;
+    size_t max_chunk = g_chunks[sizeof(g_chunks) / sizeof(*g_chunks) - 1];
+    uint8_t *buf = NULL;
+    int ret = 1;
+
+    if (total_mb <= 0)
+    {
+        fprintf(stderr, "usage: %s [total_mb]\n", argv[0]);
+        return 1;
+    }
+    total = (size_t)total_mb * 1024 * 1024;
+
+    buf = malloc(max_chunk);
+    if (NULL == buf)
+    {
+        return 1;
+    }
+    memset(buf, 'x', max_chunk);
+
+    for (size_t i = 0; i < sizeof(g_chunks) / sizeof(*g_chunks); ++i)
+    {
+        if (0 != bench_write_all(buf, g_chunks[i], total) || 0 != bench_read_all(buf, g_chunks[i], total))
+        {
+            goto cleanup;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(g_pipe_sizes) / sizeof(*g_pipe_sizes); ++i)
+    {
+        if (0 != bench_read_until_eof(buf, g_pipe_sizes[i]))
+        {
+            goto cleanup;
+        }
+    }
+
+    if (0 != bench_read_file(buf, SMALL_FILE_SIZE, SMALL_FILE_READS) ||
+        0 != bench_read_file(buf, total, LARGE_FILE_READS))
+    {
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    free(buf);
+    unlink(BENCH_FILE_PATH);
+    return ret;
+}
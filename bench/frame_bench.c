@@ -0,0 +1,195 @@
+/**
+ * filename: frame_bench.c
+ * description: Syscalls and time per command for the frame layer against plain
+ *              read_all/write_all, over a socketpair with pipelined commands.
+ *
+ * usage: frame_bench [commands] [payload_size]
+ */
+
+// C includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+// User includes
+#include "frame.h"
+#include "file.h"
+#include "bench.h"
+
+// defines
+#define DEFAULT_COMMANDS 100000
+#define DEFAULT_PAYLOAD_SIZE 16
+#define MAX_PAYLOAD_SIZE 4096
+// commands the controller side keeps in flight
+#define PIPELINE_DEPTH 64
+
+typedef struct peer_s
+{
+    int fd;
+    int commands;
+    size_t payload_size;
+} peer_t;
+
+/* Controller side: sends commands and drains results, staying PIPELINE_DEPTH ahead. */
+static void *peer_main(void *arg)
+{
+    peer_t *peer = arg;
+    uint8_t frame[sizeof(uint8_t) + sizeof(uint32_t) + MAX_PAYLOAD_SIZE] = {0};
+    uint8_t result[sizeof(int32_t) + sizeof(uint32_t) + MAX_PAYLOAD_SIZE] = {0};
+    uint32_t net_len = htonl((uint32_t)peer->payload_size);
+    size_t frame_len = sizeof(uint8_t) + sizeof(net_len) + peer->payload_size;
+    size_t result_len = sizeof(int32_t) + sizeof(uint32_t) + peer->payload_size;
+    int sent = 0;
+    int received = 0;
+
+    memcpy(frame + sizeof(uint8_t), &net_len, sizeof(net_len));
+
+    while (received < peer->commands)
+    {
+        while (sent < peer->commands && sent - received < PIPELINE_DEPTH)
+        {
+            if (FILE_OK != write_all(peer->fd, frame, frame_len))
+            {
+                return NULL;
+            }
+            ++sent;
+        }
+
+        if (FILE_OK != read_all(peer->fd, result, result_len))
+        {
+            return NULL;
+        }
+        ++received;
+    }
+
+    return NULL;
+}
+
+/* Agent side without the frame layer: 3 reads per command, 3 writes per result. */
+static void serve_plain(int fd, int commands, uint64_t *out_calls)
+{
+    uint8_t payload[MAX_PAYLOAD_SIZE] = {0};
+    uint8_t code = 0;
+    uint32_t net_len = 0;
+    int32_t ret_code = 0;
+
+    for (int i = 0; i < commands; ++i)
+    {
+        if (FILE_OK != read_all(fd, &code, sizeof(code)) ||
+            FILE_OK != read_all(fd, (uint8_t *)&net_len, sizeof(net_len)) ||
+            FILE_OK != read_all(fd, payload, ntohl(net_len)) ||
+            FILE_OK != write_all(fd, (uint8_t *)&ret_code, sizeof(ret_code)) ||
+            FILE_OK != write_all(fd, (uint8_t *)&net_len, sizeof(net_len)) ||
+            FILE_OK != write_all(fd, payload, ntohl(net_len)))
+        {
+            return;
+        }
+        // at least one call each, more only on short reads or writes
+        *out_calls += 6;
+    }
+}
+
+/* Agent side with the frame layer, flushing only before it would block. */
+static void serve_framed(int fd, int commands, uint64_t *out_calls)
+{
+    static frame_conn_t conn;
+    uint8_t payload[MAX_PAYLOAD_SIZE] = {0};
+    uint8_t code = 0;
+    uint32_t net_len = 0;
+    int32_t ret_code = 0;
+    struct iovec iov[3];
+
+    frame_init(&conn, fd);
+
+    for (int i = 0; i < commands; ++i)
+    {
+        if (0 == frame_buffered(&conn) && FRAME_OK != frame_flush(&conn))
+        {
+            return;
+        }
+
+        if (FRAME_OK != frame_read(&conn, &code, sizeof(code)) ||
+            FRAME_OK != frame_read(&conn, &net_len, sizeof(net_len)) ||
+            FRAME_OK != frame_read(&conn, payload, ntohl(net_len)))
+        {
+            return;
+        }
+
+        iov[0].iov_base = &ret_code;
+        iov[0].iov_len = sizeof(ret_code);
+        iov[1].iov_base = &net_len;
+        iov[1].iov_len = sizeof(net_len);
+        iov[2].iov_base = payload;
+        iov[2].iov_len = ntohl(net_len);
+        if (FRAME_OK != frame_write(&conn, iov, 3))
+        {
+            return;
+        }
+    }
+
+    (void)frame_flush(&conn);
+    *out_calls = conn.stats.read_calls + conn.stats.write_calls;
+}
+
+static int bench_mode(const char *name, int framed, int commands, size_t payload_size)
+{
+    int fds[2] = { -1, -1 };
+    peer_t peer = {0};
+    pthread_t thread;
+    uint64_t calls = 0;
+    long long start = 0;
+    long long elapsed = 0;
+
+    if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+    {
+        return 1;
+    }
+
+    peer.fd = fds[1];
+    peer.commands = commands;
+    peer.payload_size = payload_size;
+
+    start = bench_now_ns();
+    pthread_create(&thread, NULL, peer_main, &peer);
+    if (framed)
+    {
+        serve_framed(fds[0], commands, &calls);
+    }
+    else
+    {
+        serve_plain(fds[0], commands, &calls);
+    }
+    pthread_join(thread, NULL);
+    elapsed = bench_now_ns() - start;
+
+    printf("bench=frame mode=%s commands=%d payload=%zu syscalls=%llu syscalls_per_cmd=%.2f ns_per_cmd=%lld\n",
+           name, commands, payload_size, (unsigned long long)calls, (double)calls / commands, elapsed / commands);
+
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int commands = (argc > 1) ? atoi(argv[1]) : DEFAULT_COMMANDS;
+    size_t payload_size = (argc > 2) ? (size_t)atoi(argv[2]) : DEFAULT_PAYLOAD_SIZE;
+
+    if (commands <= 0 || payload_size > MAX_PAYLOAD_SIZE)
+    {
+        fprintf(stderr, "usage: %s [commands] [payload_size <= %d]\n", argv[0], MAX_PAYLOAD_SIZE);
+        return 1;
+    }
+
+    if (0 != bench_mode("plain", 0, commands, payload_size) ||
+        0 != bench_mode("framed", 1, commands, payload_size))
+    {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,261 @@
+/**
+ * filename: log_bench.c
+ * description: Time per line of INFO and of log_str from several threads
+ *              against a plain write() of each formatted line, the log's size
+ *              on disk, and checks that no line was lost or torn, but those
+ *              rotated out.
+ *
+ * usage: log_bench [threads] [lines_per_thread]
+ */
+
+// C includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// User includes
+#include "log.h"
+#include "file.h"
+#include "bench.h"
+
+// defines
+#define DEFAULT_THREADS 4
+#define DEFAULT_LINES 100000
+#define MAX_THREADS 64
+#define LINE_SIZE 350
+#define BENCH_LOG_PATH "/tmp/log_bench.log"
+#define PATH_SIZE 64
+
+typedef enum bench_mode_e
+{
+    MODE_WRITE = 0,     // what every INFO used to cost
+    MODE_RECORD,        // INFO, binary records formatted on unload
+    MODE_STR,           // log_str, formatted when logged
+} bench_mode_t;
+
+typedef struct producer_s
+{
+    int id;
+    int lines;
+    int fd;             // plain mode only
+} producer_t;
+
+static void *produce_logged(void *arg)
+{
+    producer_t *producer = arg;
+
+    for (int i = 0; i < producer->lines; ++i)
+    {
+        INFO("thread %d line %d", producer->id, i);
+    }
+
+    return NULL;
+}
+
+static void *produce_str(void *arg)
+{
+    producer_t *producer = arg;
+
+    for (int i = 0; i < producer->lines; ++i)
+    {
+        (void)log_str(" %-12s | %-4d | %-18s| [INFO] thread %d line %d",
+                      __FILE__, __LINE__, __func__, producer->id, i);
+    }
+
+    return NULL;
+}
+
+/* What every INFO used to cost: format, then a write() of its own. */
+static void *produce_plain(void *arg)
+{
+    producer_t *producer = arg;
+    char line[LINE_SIZE];
+    int len = 0;
+
+    for (int i = 0; i < producer->lines; ++i)
+    {
+        len = snprintf(line, sizeof(line), " %-12s | %-4d | %-18s| [INFO] thread %d line %d",
+                       __FILE__, __LINE__, __func__, producer->id, i);
+        if (FILE_OK != write_all(producer->fd, (const uint8_t *)line, (size_t)len + 1))
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Each thread's lines are in order and end with its last one. The oldest
+ * may have been rotated out, every line after the first one kept is there.
+ */
+static int verify(uint8_t *buf, size_t size, int threads, int lines, int *out_kept)
+{
+    int next[MAX_THREADS];
+    int id = 0;
+    int line = 0;
+    int total = 0;
+    int ok = 1;
+    const char *marker = NULL;
+
+    *out_kept = 0;
+    if (NULL == buf)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < threads; ++i)
+    {
+        next[i] = -1;
+    }
+
+    for (size_t pos = 0; pos < size; pos += strlen((char *)buf + pos) + 1)
+    {
+        marker = strstr((char *)buf + pos, "thread ");
+        if (NULL == marker || 2 != sscanf(marker, "thread %d line %d", &id, &line))
+        {
+            continue;
+        }
+        if (id < 0 || id >= threads || (-1 != next[id] && line != next[id]))
+        {
+            ok = 0;
+            break;
+        }
+        next[id] = line + 1;
+        ++total;
+    }
+
+    for (int i = 0; i < threads; ++i)
+    {
+        ok &= (lines == next[i]);
+    }
+
+    *out_kept = total;
+    return ok;
+}
+
+static int bench_mode(const char *name, bench_mode_t mode, int threads, int lines)
+{
+    static void *(*const produce[])(void *) = {
+        [MODE_WRITE] = produce_plain, [MODE_RECORD] = produce_logged, [MODE_STR] = produce_str,
+    };
+    producer_t producers[MAX_THREADS];
+    pthread_t handles[MAX_THREADS];
+    long long start = 0;
+    long long produced = 0;
+    long long flushed = 0;
+    struct stat st = {0};
+    char path[PATH_SIZE];
+    long long disk = 0;
+    uint8_t *text = NULL;
+    size_t text_size = 0;
+    int intact = 0;
+    int kept = 0;
+    int fd = -1;
+    int logged = (MODE_WRITE != mode);
+    long long total = (long long)threads * lines;
+    unsigned long long allocs = 0;
+
+    if (logged)
+    {
+        if (LOG_OK != log_init(BENCH_LOG_PATH))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        fd = open(BENCH_LOG_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (-1 == fd)
+        {
+            return 1;
+        }
+    }
+
+    allocs = bench_allocs();
+    start = bench_now_ns();
+    for (int i = 0; i < threads; ++i)
+    {
+        producers[i].id = i;
+        producers[i].lines = lines;
+        producers[i].fd = fd;
+        pthread_create(&handles[i], NULL, produce[mode], &producers[i]);
+    }
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(handles[i], NULL);
+    }
+    produced = bench_now_ns() - start;
+    allocs = bench_allocs() - allocs;
+
+    // until every line is on disk
+    if (logged)
+    {
+        log_flush();
+    }
+    flushed = bench_now_ns() - start;
+
+    if (logged)
+    {
+        for (int i = 0; i < LOG_SEGMENT_COUNT; ++i)
+        {
+            snprintf(path, sizeof(path), "%s.%d", BENCH_LOG_PATH, i);
+            disk += (0 == stat(path, &st)) ? (long long)st.st_size : 0;
+        }
+        (void)log_read_all(&text, &text_size);
+        log_destroy();
+    }
+    else
+    {
+        disk = (0 == stat(BENCH_LOG_PATH, &st)) ? (long long)st.st_size : 0;
+        close(fd);
+        fd = open(BENCH_LOG_PATH, O_RDONLY);
+        if (-1 != fd && FILE_OK != read_until_eof(fd, &text, &text_size))
+        {
+            text = NULL;
+        }
+        close(fd);
+    }
+    intact = verify(text, text_size, threads, lines, &kept);
+    free(text);
+
+    printf("bench=log mode=%s threads=%d lines=%lld ns_per_line=%lld lines_per_s=%.0f ns_per_line_flushed=%lld "
+           "allocs_per_line=%.3f bytes_per_line=%lld disk_bytes=%lld kept=%d intact=%d\n",
+           name, threads, total, produced / total, (double)total * BENCH_NS_PER_SEC / (double)produced,
+           flushed / total, (double)allocs / (double)total, disk / ((kept > 0) ? kept : 1), disk, kept, intact);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int threads = (argc > 1) ? atoi(argv[1]) : DEFAULT_THREADS;
+    int lines = (argc > 2) ? atoi(argv[2]) : DEFAULT_LINES;
+
+    if (threads <= 0 || threads > MAX_THREADS || lines <= 0)
+    {
+        fprintf(stderr, "usage: %s [threads <= %d] [lines_per_thread]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    if (0 != bench_mode("write", MODE_WRITE, threads, lines) ||
+        0 != bench_mode("ring", MODE_RECORD, threads, lines) ||
+        0 != bench_mode("str", MODE_STR, threads, lines))
+    {
+        return 1;
+    }
+
+    unlink(BENCH_LOG_PATH);
+    for (int i = 0; i < LOG_SEGMENT_COUNT; ++i)
+    {
+        char path[PATH_SIZE];
+
+        snprintf(path, sizeof(path), "%s.%d", BENCH_LOG_PATH, i);
+        unlink(path);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+/**
+ * filename: arena.h
+ * description: Bump allocator for memory that lives exactly one command cycle.
+ */
+
+#pragma once
+
+// C includes
+#include <stddef.h>
+#include <stdint.h>
+
+// defines
+#define ARENA_DEFAULT_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef enum arena_status_e
+{
+    ARENA_OK = 0,
+    ARENA_FAILED,
+    ARENA_NOMEM,
+} arena_status_t;
+
+typedef struct arena_owned_s arena_owned_t;
+
+typedef void (*arena_release_t)(void *ptr);
+
+typedef struct arena_s
+{
+    uint8_t *base;
+    size_t capacity;
+    size_t used;
+    arena_owned_t *owned;   // resources released on reset
+} arena_t;
+
+/**
+ * Reserves `capacity` bytes up front.
+ *
+ * @param arena     Arena to initialize.
+ * @param capacity  Size of the bump region (e.g. ARENA_DEFAULT_SIZE).
+ * @return arena_status_t (ARENA_OK on success)
+ */
+arena_status_t arena_init(arena_t *arena, size_t capacity);
+
+/**
+ * Returns `size` bytes aligned to ARENA_ALIGN, valid until the next
+ * arena_reset. Requests that don't fit the bump region fall back to
+ * malloc and are freed by the reset all the same.
+ * Returns NULL if out of memory.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/** arena_alloc of `len` + 1 bytes holding a NUL terminated copy of `src`. */
+char *arena_strndup(arena_t *arena, const void *src, size_t len);
+
+/**
+ * Hands a malloc'ed block to the arena so the next reset frees it,
+ * for buffers other modules allocate. On failure `ptr` is freed.
+ */
+arena_status_t arena_adopt(arena_t *arena, void *ptr);
+
+/**
+ * Like arena_adopt for resources that aren't plain heap blocks: the next
+ * reset calls `release(ptr)`. On failure `release(ptr)` is called right away.
+ * Resources are released in reverse order of registration.
+ */
+arena_status_t arena_defer(arena_t *arena, arena_release_t release, void *ptr);
+
+/** Releases every fallback block and adopted resource and rewinds the bump region. */
+void arena_reset(arena_t *arena);
+
+/** Resets the arena and releases its bump region. */
+void arena_destroy(arena_t *arena);
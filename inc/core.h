@@ -1,6 +1,6 @@
 /**
  * filename: core.h
- * description: handle commands and sleep in a loop
+ * description: handle commands and sleep between sessions on an event loop
  */
 
 #pragma once
@@ -8,4 +8,9 @@
 // User includes
 #include "tool.h"
 
+/**
+ * Runs the agent until the controller says CMD_DIE, a non persistent
+ * session fails, or SIGTERM / SIGINT arrives. Sessions, their children and
+ * the wait between sessions all share one reactor.
+ */
 void run(const tool_t *tool);
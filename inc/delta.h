@@ -0,0 +1,84 @@
+/**
+ * filename: delta.h
+ * description: rsync style delta generation against a remote copy's block signatures
+ */
+
+#pragma once
+
+// C includes
+#include <stddef.h>
+#include <stdint.h>
+
+// defines
+#define DELTA_MIN_BLOCK_SIZE (64)
+#define DELTA_MAX_BLOCK_SIZE (1024 * 1024)
+#define DELTA_READ_SIZE (256 * 1024)
+
+typedef enum delta_status_e
+{
+    DELTA_OK = 0,
+    DELTA_FAILED,
+    DELTA_INVALID,
+    DELTA_NOMEM,
+} delta_status_t;
+
+/**
+ * Delta ops, as written to the output (integers in network byte order):
+ *
+ *   DELTA_OP_LITERAL | len (uint32) | data
+ *   DELTA_OP_COPY    | first_block (uint32) | block_count (uint32)
+ *   DELTA_OP_END     | file_size (uint64) | file_hash (uint64)
+ *
+ * COPY refers to blocks of the remote copy by their signature index.
+ * file_hash is delta_strong_hash over the whole local file, so the
+ * remote side can verify the reconstructed result.
+ */
+typedef enum delta_op_e
+{
+    DELTA_OP_LITERAL = 1,
+    DELTA_OP_COPY    = 2,
+    DELTA_OP_END     = 3,
+} delta_op_t;
+
+typedef struct delta_sig_s
+{
+    uint32_t weak;
+    uint64_t strong;
+} delta_sig_t;
+
+/**
+ * Called with consecutive pieces of the encoded delta.
+ * Returns DELTA_OK to continue, anything else aborts delta_generate.
+ */
+typedef delta_status_t (*delta_emit_t)(void *ctx, const uint8_t *buf, size_t len);
+
+/**
+ * Called to fill `buf` with exactly `len` bytes of the local file from `offset`.
+ * The file is read front to back, each byte once.
+ * Returns DELTA_OK once `len` bytes were read, anything else aborts delta_generate.
+ */
+typedef delta_status_t (*delta_read_t)(void *ctx, uint64_t offset, uint8_t *buf, size_t len);
+
+/** Rolling (Adler style) checksum of a block, as used for the signatures. */
+uint32_t delta_weak_checksum(const uint8_t *buf, size_t len);
+
+/** Strong 64-bit hash of a block, used to confirm weak checksum matches. */
+uint64_t delta_strong_hash(const uint8_t *buf, size_t len);
+
+/**
+ * Generates the delta turning the remote copy described by `sigs` into the local file.
+ * The file is pulled through `read` in windows of DELTA_READ_SIZE bytes, so memory
+ * use stays bounded by the block size whatever the file size.
+ *
+ * @param size        Size of the local file in bytes.
+ * @param block_size  Block size the signatures were computed with.
+ * @param sigs        Signatures of the full blocks of the remote copy, in order.
+ * @param sig_count   Number of signatures.
+ * @param read        Supplies the local file content.
+ * @param emit        Receives the encoded ops.
+ * @param ctx         Passed to `read` and `emit` as is.
+ * @return delta_status_t (DELTA_OK on success)
+ */
+delta_status_t delta_generate(uint64_t size, size_t block_size,
+			      const delta_sig_t *sigs, uint32_t sig_count,
+			      delta_read_t read, delta_emit_t emit, void *ctx);
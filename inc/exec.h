@@ -7,6 +7,13 @@
 
 // C includes
 #include <stddef.h>
+#include <stdint.h>
+
+// User includes
+#include "reactor.h"
+
+// defines
+#define EXEC_UNLIMITED SIZE_MAX
 
 typedef enum exec_status_e
 {
@@ -17,6 +24,107 @@ typedef enum exec_status_e
     EXEC_INACCESSIBLE,
 } exec_status_t;
 
+/* How much of each output stream is kept: the first `head` bytes and the last `tail` bytes. */
+typedef struct exec_limits_s
+{
+    size_t head;
+    size_t tail;
+} exec_limits_t;
+
+typedef struct exec_output_s
+{
+    char *buf;          // head followed by tail, NULL if empty (must be freed by caller)
+    size_t size;        // bytes in buf
+    uint64_t total;     // bytes the child wrote, more than size if output was dropped
+} exec_output_t;
+
+typedef enum exec_backend_e
+{
+    EXEC_BACKEND_FORK = 0,   // fork() + execvp(), cost grows with the agent's memory
+    EXEC_BACKEND_SPAWN,      // posix_spawnp(), vfork style and the default
+} exec_backend_t;
+
+typedef enum exec_stream_e
+{
+    EXEC_STDOUT = 0,
+    EXEC_STDERR = 1,
+} exec_stream_t;
+
+/**
+ * Receives child output while it runs.
+ * `fd` is the child's pipe for `stream` with `available` bytes buffered;
+ * the callback must consume exactly that many bytes from it
+ * (e.g. read_all or splice them somewhere else).
+ * Returns EXEC_OK to continue, anything else kills the run.
+ */
+typedef exec_status_t (*exec_output_cb_t)(void *ctx, exec_stream_t stream, int fd, size_t available);
+
+/**
+ * Called once when a job started with exec_start_stream is over, from the
+ * reactor's thread. `exit_code` is only meaningful when `status` is EXEC_OK.
+ */
+typedef void (*exec_exit_cb_t)(void *ctx, exec_status_t status, int exit_code);
+
+/**
+ * Called once when a job started with exec_start_capped is over. The
+ * caller owns the output buffers from then on, they are empty unless
+ * `status` is EXEC_OK.
+ */
+typedef void (*exec_capped_cb_t)(void *ctx, exec_status_t status, exec_output_t *out_stdout,
+				 exec_output_t *out_stderr, int exit_code);
+
+/** A child supervised by a reactor, valid until its last callback returned. */
+typedef struct exec_job_s exec_job_t;
+
+/**
+ * Selects how children are launched. Not thread safe, call it before any
+ * exec runs. The build time default is EXEC_DEFAULT_BACKEND.
+ */
+void exec_set_backend(exec_backend_t backend);
+
+/**
+ * Launches an executable and lets `reactor` supervise it: output is handed
+ * to `on_output` as it arrives, the child is reaped through a pidfd and
+ * killed once `timeout_ms` passed, then `on_exit` reports the result.
+ * Nothing blocks, so one reactor runs any number of children at once.
+ *
+ * @param reactor        Loop the pipes, the child and the deadline are registered with.
+ * @param path           Path to executable.
+ * @param argv           Argument vector, only used during the call.
+ * @param on_output      Output callback, see exec_output_cb_t.
+ * @param on_exit        Completion callback, not called when the launch fails.
+ * @param ctx            Passed to both callbacks as is.
+ * @param timeout_ms     Timeout for the command in miliseconds.
+ * @param out_job        Optional handle for exec_cancel.
+ * @return exec_status_t (EXEC_OK if the child runs, EXEC_INACCESSIBLE for a bad path).
+ */
+exec_status_t exec_start_stream(reactor_t *reactor, const char *path, char **args,
+				exec_output_cb_t on_output, exec_exit_cb_t on_exit, void *ctx,
+				unsigned int timeout_ms, exec_job_t **out_job);
+
+/**
+ * exec_start_stream capturing the output like exec_run_capped.
+ *
+ * @param reactor        Loop supervising the child.
+ * @param path           Path to executable.
+ * @param argv           Argument vector, only used during the call.
+ * @param limits         Head and tail sizes kept per stream.
+ * @param on_done        Completion callback with the captured output.
+ * @param ctx            Passed to `on_done` as is.
+ * @param timeout_ms     Timeout for the command in miliseconds.
+ * @param out_job        Optional handle for exec_cancel.
+ * @return exec_status_t (EXEC_OK if the child runs).
+ */
+exec_status_t exec_start_capped(reactor_t *reactor, const char *path, char **args,
+				const exec_limits_t *limits, exec_capped_cb_t on_done, void *ctx,
+				unsigned int timeout_ms, exec_job_t **out_job);
+
+/**
+ * Kills a running job and stops reading its output. Its callback still
+ * comes, from the reactor and with EXEC_FAILED, once the child is reaped.
+ */
+void exec_cancel(exec_job_t *job);
+
 /**
  * Runs an executable with arguments and captures its stdout and stderr output.
  *
@@ -31,3 +139,37 @@ typedef enum exec_status_e
 exec_status_t exec_run(const char *path, char **args, size_t *out_stdout_size,
 		       char **out_stdout, size_t *out_stderr_size, char **out_stderr,
 		       int *out_exit_code, unsigned int timeout_ms);
+
+/**
+ * Runs an executable with arguments and hands its stdout and stderr to
+ * `on_output` as the child produces them, instead of buffering them.
+ *
+ * @param path           Path to executable.
+ * @param argv           Argument vector (argv[0] should be the executable name).
+ * @param on_output      Output callback, see exec_output_cb_t.
+ * @param ctx            Passed to `on_output` as is.
+ * @param out_exit_code  Pointer to hold process exit code.
+ * @param timeout_ms     Timeout for the command in miliseconds.
+ * @return exec_status_t Execution status (EXEC_OK on success).
+ */
+exec_status_t exec_run_stream(const char *path, char **args, exec_output_cb_t on_output,
+			      void *ctx, int *out_exit_code, unsigned int timeout_ms);
+
+/**
+ * Like exec_run, but memory stays bounded by `limits`: once the head of a
+ * stream is full only its last `limits->tail` bytes are kept, in a ring
+ * buffer, and the bytes between are read and dropped.
+ *
+ * @param path           Path to executable.
+ * @param argv           Argument vector (argv[0] should be the executable name).
+ * @param limits         Head and tail sizes kept per stream
+ *                       (EXEC_UNLIMITED head keeps everything).
+ * @param out_stdout     Captured stdout.
+ * @param out_stderr     Captured stderr.
+ * @param out_exit_code  Pointer to hold process exit code.
+ * @param timeout_ms     Timeout for the command in miliseconds.
+ * @return exec_status_t Execution status (EXEC_OK on success).
+ */
+exec_status_t exec_run_capped(const char *path, char **args, const exec_limits_t *limits,
+			      exec_output_t *out_stdout, exec_output_t *out_stderr,
+			      int *out_exit_code, unsigned int timeout_ms);
@@ -9,6 +9,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 typedef enum file_status_e
 {
@@ -21,6 +22,50 @@ typedef enum file_status_e
     FILE_INACCESSIBLE,
 } file_status_t;
 
+// defines
+#define BYTE_BUF_MIN_CAPACITY 4096
+#define BYTE_BUF_POOL_SIZE 8
+#define BYTE_BUF_POOL_MAX_CAPACITY (1024 * 1024)
+#define FILE_BATCH_DEPTH 32
+
+typedef struct file_info_s
+{
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+} file_info_t;
+
+/*
+ * Growable byte buffer. Zero initialize it, grow it with byte_buf_reserve
+ * and hand it back with byte_buf_release or byte_buf_detach.
+ */
+typedef struct byte_buf_s
+{
+    uint8_t *data;
+    size_t size;        // bytes in use, the caller advances it
+    size_t capacity;
+    size_t limit;       // growth stops here unless more is needed, 0 for none
+} byte_buf_t;
+
+typedef enum file_backend_e
+{
+    FILE_BACKEND_POSIX = 0,  // one blocking pread per read
+    FILE_BACKEND_URING,      // io_uring when the kernel allows it, the default
+} file_backend_t;
+
+/* One read of a batch, filled until `len` bytes or end of file. */
+typedef struct file_read_s
+{
+    int fd;
+    uint8_t *buf;
+    size_t len;
+    uint64_t offset;
+    size_t done;            // bytes read so far
+    file_status_t status;   // FILE_OK once complete, FILE_EOF if the file ended first
+} file_read_t;
+
+typedef struct file_batch_s file_batch_t;
+
 /**
  * Attempts to read up to `count` bytes from `fd` into `buf`.
  *
@@ -32,6 +77,19 @@ typedef enum file_status_e
  */
 file_status_t read_partial(int fd, uint8_t *buf, size_t count, size_t *out_bytes_read);
 
+/**
+ * Attempts to read up to `count` bytes from `fd` at `offset` into `buf`
+ * using pread, so the file position of `fd` is left untouched.
+ *
+ * @param fd              A valid file descriptor open for reading.
+ * @param buf             Buffer to read into.
+ * @param count           Max number of bytes to read.
+ * @param offset          Offset in the file to read from.
+ * @param out_bytes_read  Actual number of bytes read (0 at end of file).
+ * @return file_status_t (FILE_OK on success)
+ */
+file_status_t read_partial_at(int fd, uint8_t *buf, size_t count, uint64_t offset, size_t *out_bytes_read);
+
 /**
  * Attempts to write up to `count` bytes from `buf` to `fd`.
  *
@@ -65,10 +123,59 @@ file_status_t read_all(int fd, uint8_t *buf, size_t count);
  */
 file_status_t write_all(int fd, const uint8_t *buf, size_t count);
 
+/**
+ * Writes every byte described by `iov` to `fd`, with as few writev calls
+ * as the kernel allows.
+ *
+ * @param fd      File descriptor open for writing.
+ * @param iov     Buffers to write, in order. Consumed: entries are
+ *                advanced past what was written.
+ * @param iovcnt  Number of entries in `iov` (at most IOV_MAX).
+ * @return file_status_t (FILE_OK on success)
+ */
+file_status_t write_vec_all(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Transfers exactly `count` bytes from `in_fd` to `out_fd` inside the kernel,
+ * starting at the current offset of `in_fd`.
+ * Uses sendfile, falls back to splice for sources sendfile can't read
+ * (pipes and other non-regular files), and to read/write if both are refused.
+ *
+ * @param out_fd  File descriptor open for writing (e.g. a socket).
+ * @param in_fd   File descriptor open for reading.
+ * @param count   Total number of bytes to transfer.
+ * @param out_bytes_sent  Number of bytes actually transferred, may be NULL.
+ *                        Less than `count` only when FILE_EOF is returned.
+ * @return file_status_t (FILE_OK on success, FILE_EOF if `in_fd` ended early)
+ */
+file_status_t send_file_all(int out_fd, int in_fd, size_t count, size_t *out_bytes_sent);
+
+/**
+ * Same as send_file_all, but transfers `count` bytes starting at `offset`
+ * without moving the file position of `in_fd` (like pread).
+ * `in_fd` must be seekable.
+ *
+ * @return file_status_t (FILE_OK on success, FILE_EOF if the file ended early)
+ */
+file_status_t send_file_range(int out_fd, int in_fd, uint64_t offset, size_t count, size_t *out_bytes_sent);
+
+/**
+ * Moves exactly `count` bytes from a pipe to `out_fd` with splice, so the
+ * data never passes through a user space buffer. Falls back to read/write
+ * if the kernel can't splice into `out_fd`.
+ *
+ * @param out_fd   File descriptor open for writing (e.g. a socket).
+ * @param pipe_fd  Read end of a pipe.
+ * @param count    Total number of bytes to move.
+ * @return file_status_t (FILE_OK on success, FILE_EOF if the pipe closed early)
+ */
+file_status_t send_pipe_all(int out_fd, int pipe_fd, size_t count);
+
 /**
  * read_until_eof:
  * Reads all available data from `fd` until EOF.
- * Dynamically allocates a buffer that must be freed by the caller.
+ * Dynamically allocates a buffer that must be freed by the caller,
+ * sized from fstat up front when `fd` is a regular file.
  *
  * @param fd           File descriptor to read from.
  * @param out_buffer   Pointer to buffer pointer which will receive
@@ -100,4 +207,78 @@ file_status_t read_file(int fd, uint8_t **out_buf, size_t *out_size);
  */
 file_status_t read_file_from_path(const char *path, uint8_t **out_buf, size_t *out_size);
 
+/**
+ * Opens a regular file for reading without loading it into memory.
+ * The size is reported as 64 bits so files past 4 GiB are handled.
+ *
+ * @param path      The path for the file
+ * @param out_fd    Output descriptor (caller must close).
+ * @param out_info  Output size and modification time of the file.
+ * @return file_status_t (FILE_OK on success, FILE_INACCESSIBLE if it couldn't be opened,
+ *         FILE_UNSUPPORTED if it isn't a regular file)
+ */
+file_status_t open_regular_file(const char *path, int *out_fd, file_info_t *out_info);
+
+/**
+ * Makes room for at least `extra` more bytes past `buf->size`.
+ * The first reservation is taken as a size hint and allocated as is
+ * (at least BYTE_BUF_MIN_CAPACITY), later ones double the capacity so
+ * appending n bytes costs O(n) copying overall. A fresh buffer is
+ * recycled from a small pool of released buffers when one is big enough.
+ *
+ * @param buf    Buffer to grow.
+ * @param extra  Number of bytes that must fit after `buf->size`.
+ * @return file_status_t (FILE_OK on success, FILE_NOMEM if out of memory)
+ */
+file_status_t byte_buf_reserve(byte_buf_t *buf, size_t extra);
+
+/** byte_buf_reserve followed by a copy of `len` bytes from `src`. */
+file_status_t byte_buf_append(byte_buf_t *buf, const void *src, size_t len);
+
+/**
+ * Hands the content to the caller, who must free it. An empty buffer is
+ * released and NULL is returned. `buf` is left empty either way.
+ */
+uint8_t *byte_buf_detach(byte_buf_t *buf, size_t *out_size);
+
+/**
+ * Releases the buffer. Buffers up to BYTE_BUF_POOL_MAX_CAPACITY go to a pool
+ * of BYTE_BUF_POOL_SIZE entries shared by all threads, bigger ones are freed.
+ */
+void byte_buf_release(byte_buf_t *buf);
+
+/**
+ * Selects how file_batch_t runs its reads. Not thread safe, call it before
+ * any batch is created. The build time default is FILE_DEFAULT_BACKEND.
+ */
+void file_set_backend(file_backend_t backend);
+
+/**
+ * Creates a read batch. With FILE_BACKEND_URING it sets up an io_uring of
+ * FILE_BATCH_DEPTH entries so a whole set of reads costs one submission and
+ * runs in the background until file_batch_wait. If io_uring is unavailable
+ * (old kernel, seccomp, kernel.io_uring_disabled) it silently falls back to
+ * plain preads in file_batch_wait; that is detected once per process.
+ *
+ * @param out_batch  Output batch (release with file_batch_destroy).
+ * @return file_status_t (FILE_OK on success)
+ */
+file_status_t file_batch_create(file_batch_t **out_batch);
+
+/**
+ * Queues `reads` (at most FILE_BATCH_DEPTH, none may be in flight) and starts
+ * them without waiting. `reads` must stay valid until file_batch_wait.
+ */
+file_status_t file_batch_submit(file_batch_t *batch, file_read_t *reads, size_t count);
+
+/**
+ * Blocks until every read of the last file_batch_submit completed. Short
+ * reads are resubmitted, so each entry ends up either full, at end of file
+ * or failed; its status tells which.
+ *
+ * @return file_status_t (FILE_OK unless the batch itself failed)
+ */
+file_status_t file_batch_wait(file_batch_t *batch);
 
+/** Waits for reads still in flight and releases the batch. */
+void file_batch_destroy(file_batch_t *batch);
@@ -0,0 +1,84 @@
+/**
+ * filename: frame.h
+ * description: Buffered reads and vectored, coalescing writes for the protocol socket.
+ */
+
+#pragma once
+
+// C includes
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// defines
+#define FRAME_READ_BUF_SIZE (64 * 1024)
+#define FRAME_WRITE_BUF_SIZE (16 * 1024)
+#define FRAME_IOV_MAX 8
+
+typedef enum frame_status_e
+{
+    FRAME_OK = 0,
+    FRAME_FAILED,
+    FRAME_INVALID,
+    FRAME_EOF,
+    FRAME_AGAIN,
+} frame_status_t;
+
+typedef struct frame_stats_s
+{
+    uint64_t read_calls;
+    uint64_t write_calls;
+} frame_stats_t;
+
+typedef struct frame_conn_s
+{
+    int fd;
+    uint8_t rbuf[FRAME_READ_BUF_SIZE];
+    size_t rpos;
+    size_t rlen;
+    uint8_t wbuf[FRAME_WRITE_BUF_SIZE];     // small frames waiting to go out together
+    size_t wlen;
+    frame_stats_t stats;
+} frame_conn_t;
+
+/** Starts buffering on `fd`. The caller keeps owning `fd`. */
+void frame_init(frame_conn_t *conn, int fd);
+
+/**
+ * Reads exactly `len` bytes. Small reads are served from a read buffer
+ * that is refilled with one read() of up to FRAME_READ_BUF_SIZE bytes, so
+ * a header and its payload, or several pipelined commands, usually cost
+ * a single syscall.
+ *
+ * @return frame_status_t (FRAME_OK on success, FRAME_EOF if the peer closed
+ *         before the first byte)
+ */
+frame_status_t frame_read(frame_conn_t *conn, void *buf, size_t len);
+
+/**
+ * frame_read that never blocks, for a caller driven by readiness events.
+ * Fills `buf` from `*done` on and advances `*done`, so a message can be
+ * read in as many calls as it takes to arrive.
+ *
+ * @return frame_status_t (FRAME_OK once `len` bytes are in, FRAME_AGAIN when
+ *         the socket has nothing more for now, FRAME_EOF if the peer closed
+ *         before the first byte)
+ */
+frame_status_t frame_read_some(frame_conn_t *conn, void *buf, size_t len, size_t *done);
+
+/** Number of bytes already read from the socket and not consumed yet. */
+size_t frame_buffered(const frame_conn_t *conn);
+
+/**
+ * Queues the buffers described by `iov` (at most FRAME_IOV_MAX entries).
+ * While the pending bytes fit FRAME_WRITE_BUF_SIZE they are only copied,
+ * otherwise they go out with whatever is pending in one writev, without
+ * copying the large entries.
+ */
+frame_status_t frame_write(frame_conn_t *conn, const struct iovec *iov, int iovcnt);
+
+/**
+ * Sends whatever frame_write queued. Must be called before blocking on
+ * the peer and before writing to the fd directly.
+ */
+frame_status_t frame_flush(frame_conn_t *conn);
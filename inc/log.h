@@ -7,6 +7,27 @@
 
 // C includes
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// User includes
+#include "file.h"
+
+// defines
+#define LOG_SEGMENT_COUNT 4
+#define LOG_SEGMENT_SIZE (1024 * 1024)      // records per segment file, in bytes
+#define LOG_REPEAT_WINDOW_MS 1000           // identical lines of a site are collapsed for this long
+
+// levels, a line is kept when its level is at least the one of its module
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_ERROR 2
+#define LOG_LEVEL_NONE  3
+
+// lines below this level are compiled out, e.g. `make LOG_LEVEL=INFO`
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
 
 typedef enum log_status_e
 {
@@ -17,51 +38,146 @@ typedef enum log_status_e
 } log_status_t;
 
 /**
- * Initializes the logger by opening the given file path.
- * Creates/truncates the file for appending.
+ * A LOG call site. Each LOG statement owns a static one, the first time it
+ * is reached gives it a small id that every record of it carries instead of
+ * the file, line, function and format text.
+ * Its module is its file's name without directory and extension (e.g. "exec").
+ */
+typedef struct log_site_s
+{
+    const char *file;
+    const char *func;
+    const char *format;
+    int line;
+    int level;
+    atomic_uint id;     // 0 until the site is first reached
+} log_site_t;
+
+/**
+ * Initializes the logger and starts the flusher thread.
+ * The log is kept in LOG_SEGMENT_COUNT files `<path>.0`, `<path>.1`, ...
+ * (created or truncated here) written in turn: once the last one is full
+ * the oldest is emptied and reused, so the log never takes more than
+ * LOG_SEGMENT_COUNT * LOG_SEGMENT_SIZE bytes on disk.
  */
 log_status_t log_init(const char *path);
 
-/** Closes the log file descriptor if open. */
+/** Writes out the lines still queued, stops the flusher and closes the log file. */
 void log_destroy(void);
 
-/** Logs an info message with formatting. */
-log_status_t log_str(const char *format, ...);
+/**
+ * Logs a line of `site` (use the LOG macros rather than calling it).
+ * The line is stored as a binary record of timestamp, site id and the raw
+ * arguments, it is only formatted when the log is read back. Arguments
+ * must match the site's format exactly, like for printf.
+ * A line identical to the site's previous one within LOG_REPEAT_WINDOW_MS
+ * is only counted, the count is logged as one line once the site logs
+ * something else, the window ends or the log is flushed.
+ * Records are queued in a lock-free ring and written out in batches by a
+ * flusher thread, so logging costs no syscall unless the ring is full.
+ * Safe from any thread, records keep the order in which they were queued.
+ */
+log_status_t log_record(log_site_t *site, ...);
+
+/**
+ * Whether a line of `site` would be kept at the current levels, checked by
+ * the LOG macros before the arguments are even evaluated.
+ */
+int log_enabled(log_site_t *site);
+
+/**
+ * Sets the level of `module` (e.g. "network"), or of every module and of
+ * those not seen yet when `module` is NULL. Modules start at LOG_LEVEL_INFO.
+ */
+log_status_t log_set_level(const char *module, int level);
+
+/**
+ * Applies a comma separated list of levels, e.g. "error,exec=debug": a bare
+ * level is for every module, `module=level` for one. Level names are
+ * debug, info, error and none. Stops at the first item it can't parse.
+ */
+log_status_t log_set_levels(const char *spec);
+
+/** Logs a line without a call site, formatted right away, whatever the levels. */
+log_status_t log_str(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/** Writes out every line queued so far and the pending repeat counts, before returning. */
+void log_flush(void);
 
 /**
- * Reads entire log file content into a dynamicly allocated buffer.
- * Caller must free. Rewinds file before reading.
+ * Reads every line still kept into a dynamicly allocated buffer, formatted
+ * as text lines each ended by `\0`.
+ * Caller must free. Flushes the queued lines before reading.
  */
 log_status_t log_read_all(uint8_t **out_buf, size_t *out_size);
 
+/**
+ * Reads the lines logged since `cursor`, formatted like log_read_all.
+ * Positions count the bytes of records logged since log_init, so a cursor
+ * stays valid across segment rotations.
+ *
+ * @param cursor     0, or the `out_next` of an earlier call.
+ * @param limit      Most record bytes to format, bounds the time and memory of one call.
+ * @param out_buf    Output text (caller must free, NULL when there is none).
+ * @param out_size   Output text size.
+ * @param out_start  Position of the first line returned, past `cursor` when
+ *                   the lines in between were already rotated out.
+ * @param out_next   Cursor for the next call.
+ * @param out_end    Position of the end of the log, more is pending while out_next is short of it.
+ * @return log_status_t (LOG_OK on success, LOG_INVALID for a cursor past the end)
+ */
+log_status_t log_read_from(uint64_t cursor, size_t limit, uint8_t **out_buf, size_t *out_size,
+			   uint64_t *out_start, uint64_t *out_next, uint64_t *out_end);
+
 
 // Logging Macros
 // note: the macros are wrapped in do while in order to be able to add `;` after calling them
 // e.g INFO(...);
 
-#define LOG(fmt, ...) \
-    do { (void)log_str(" %-12s | %-4d | %-18s| "fmt, __FILE__, __LINE__, __func__, ##__VA_ARGS__); } while(0)
+// never called, only lets the compiler check the arguments against the format
+static inline __attribute__((format(printf, 1, 2))) void log_check_format(const char *fmt, ...)
+{
+    (void)fmt;
+}
+
+#define LOG(level, fmt, ...) \
+    do { \
+        static log_site_t log_site_ = { __FILE__, __func__, fmt, __LINE__, level, 0 }; \
+        if (0) { log_check_format(fmt, ##__VA_ARGS__); } \
+        if ((level) >= LOG_COMPILE_LEVEL && log_enabled(&log_site_)) { \
+            (void)log_record(&log_site_, ##__VA_ARGS__); \
+        } \
+    } while(0)
+
+// for lines only worth their cost while chasing a problem, e.g. once per read
+#define DEBUG(fmt, ...) \
+    LOG(LOG_LEVEL_DEBUG, "[DBG]  "fmt, ##__VA_ARGS__)
 
 #define INFO(fmt, ...) \
-    LOG("[INFO] "fmt, ##__VA_ARGS__)
+    LOG(LOG_LEVEL_INFO, "[INFO] "fmt, ##__VA_ARGS__)
 
 #define ERROR(label, fmt, ...) \
     do { \
-        LOG("[ERR]  " fmt, ##__VA_ARGS__); \
+        LOG(LOG_LEVEL_ERROR, "[ERR]  " fmt, ##__VA_ARGS__); \
         goto label; \
     } while(0)
 
+// result_code is evaluated once, it is often the call being checked. The copy keeps
+// its type so the comparison converts the operands as a direct one would.
 #define ASSERT_RET_EQ(expected_code, result_code, label, fmt, ...) \
     do { \
-        if ((expected_code) != (result_code)) { \
-            ERROR(label, "(EXPECTED: %d, RETCODE: %d)    "fmt, (expected_code), (result_code), ##__VA_ARGS__); \
+        __typeof__(result_code) assert_ret_ = (result_code); \
+        if ((expected_code) != assert_ret_) { \
+            ERROR(label, "(EXPECTED: %lld, RETCODE: %lld)    "fmt, \
+                  (long long)(expected_code), (long long)assert_ret_, ##__VA_ARGS__); \
         } \
     } while(0)
 
 #define ASSERT_RET_NE(expected_code, result_code, label, fmt, ...) \
     do { \
-        if ((expected_code) == (result_code)) { \
-            ERROR(label, "(UNEXPECTED RET: %d)    "fmt, (result_code), ##__VA_ARGS__); \
+        __typeof__(result_code) assert_ret_ = (result_code); \
+        if ((expected_code) == assert_ret_) { \
+            ERROR(label, "(UNEXPECTED RET: %lld)    "fmt, (long long)assert_ret_, ##__VA_ARGS__); \
         } \
     } while(0)
 
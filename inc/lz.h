@@ -0,0 +1,47 @@
+/**
+ * filename: lz.h
+ * description: Fast LZ77 block codec (LZ4 block format compatible)
+ */
+
+#pragma once
+
+// C includes
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum lz_status_e
+{
+    LZ_OK = 0,
+    LZ_FAILED,
+    LZ_INVALID,
+    LZ_NOSPACE,
+} lz_status_t;
+
+/**
+ * Compresses `src` into `dst` as a single LZ4 format block.
+ * Compression gives up with LZ_NOSPACE as soon as the output would not fit
+ * `dst_capacity`, so passing a capacity smaller than `src_len` doubles as a
+ * "only if it actually shrinks" check.
+ *
+ * @param src           Data to compress.
+ * @param src_len       Size of `src` in bytes.
+ * @param dst           Output buffer.
+ * @param dst_capacity  Size of `dst` in bytes.
+ * @param out_len       Number of bytes written to `dst`.
+ * @return lz_status_t (LZ_OK on success)
+ */
+lz_status_t lz_compress(const uint8_t *src, size_t src_len,
+			uint8_t *dst, size_t dst_capacity, size_t *out_len);
+
+/**
+ * Decompresses a single LZ4 format block.
+ *
+ * @param src           Compressed block.
+ * @param src_len       Size of `src` in bytes.
+ * @param dst           Output buffer.
+ * @param dst_capacity  Size of `dst` in bytes (the original size).
+ * @param out_len       Number of bytes written to `dst`.
+ * @return lz_status_t (LZ_OK on success, LZ_INVALID on malformed input)
+ */
+lz_status_t lz_decompress(const uint8_t *src, size_t src_len,
+			  uint8_t *dst, size_t dst_capacity, size_t *out_len);
@@ -7,9 +7,13 @@
 
 // C includes
 #include <stdint.h>
+#include <sys/uio.h>
 
 // User includes
 #include "tool.h"
+#include "reactor.h"
+#include "arena.h"
+#include "exec.h"
 
 typedef enum network_status_e
 {
@@ -18,6 +22,7 @@ typedef enum network_status_e
     NETWORK_FAILED,
     NETWORK_INVALID,
     NETWORK_NOMEM,
+    NETWORK_AGAIN,
 } network_status_t;
 
 typedef enum cmd_status_e
@@ -33,17 +38,251 @@ typedef enum command_code_e
     CMD_UNLOAD_LOGS  = 1,
     CMD_GET_FILE     = 2,
     CMD_EXEC_COMMAND = 3,
+    CMD_GET_FILE_STREAM = 4,
+    CMD_GET_FILE_RANGE  = 5,
+    CMD_GET_FILE_DELTA  = 6,
+    CMD_SET_CAPS        = 7,
+    CMD_GET_FILES       = 8,
+    CMD_EXEC_STREAM     = 9,
     CMD_DIE          = 254,
     CMD_SLEEP        = 255,
 } command_code_t;
 
 /**
- * Communicates with the tool.
- * Opens a socket using tool->conf.ip and tool->conf.port,
- * sends hello result,
- * handle commands
- * closes socket on finish.
+ * Hello and capabilities
+ * ----------------------
+ * On connect the agent sends:
  *
- * Returns network_state_t (NETWORK_OK on success)
+ *   version (uint8) | name (TOOL_NAME_SIZE bytes) | caps (uint32)
+ *
+ * caps is the set of capability_t bits the agent supports. None of them
+ * are used until the controller enables them with CMD_SET_CAPS, whose
+ * payload is the requested caps (uint32) and whose result payload is the
+ * accepted subset (uint32). From the next result on, with CAP_LZ enabled,
+ * result frames carry a flags byte:
+ *
+ *   ret_code (int32) | flags (uint8) | len (uint32) | payload
+ *
+ * and when flags has RESULT_FLAG_LZ the payload is
+ * `raw_len (uint32) | LZ4 block` (see lz.h).
+ */
+#define PROTOCOL_VERSION (2)
+#define RESULT_FLAG_LZ   (1 << 0)
+
+typedef enum capability_e
+{
+    CAP_LZ  = 1 << 0,
+    CAP_MUX = 1 << 1,
+} capability_t;
+
+/**
+ * Multiplexing
+ * ------------
+ * With CAP_MUX enabled every command frame carries a request id chosen by
+ * the controller:
+ *
+ *   code (uint8) | request_id (uint32) | len (uint32) | payload
+ *
+ * and every reply, buffered or streamed, is prefixed with the id of the
+ * command it answers. Commands run concurrently and their replies come back
+ * in completion order, so a slow exec no longer holds up the commands
+ * queued behind it. CMD_EXEC_COMMAND children are supervised by the
+ * session's reactor, at most MUX_EXECS_MAX at a time, the other
+ * commands run on a worker pool.
+ *
+ * A reply is written as a whole: the file and stream commands keep the
+ * socket until their reply is complete, other results wait for them.
+ * CMD_EXEC_STREAM is the exception, as its child may run for any time: its
+ * ret_code and each of its frames go out as pieces of their own, each
+ * prefixed with the request id, and other replies may come in between.
+ * For a given id the first piece is the ret_code, the following ones are
+ * frames up to the exit frame. CMD_SET_CAPS, CMD_SLEEP and CMD_DIE are
+ * barriers, they run once every earlier command replied.
+ */
+#define MUX_EXECS_MAX (64)
+
+/**
+ * Stream results
+ * --------------
+ * Commands that may produce more than fits in a 32-bit result frame
+ * (e.g. CMD_GET_FILE_STREAM) reply with a stream instead:
+ *
+ *   ret_code (int32) | total_len (uint64) | chunk* | end marker
+ *
+ * where each chunk is `chunk_len (uint32) | data` and the end marker is a
+ * chunk_len of STREAM_CHUNK_END, or STREAM_CHUNK_ABORT if the agent failed
+ * mid-stream. When ret_code is not 0 nothing follows the header.
+ * total_len is STREAM_LEN_UNKNOWN when the size isn't known upfront.
+ * All integers are in network byte order.
+ */
+#define STREAM_CHUNK_SIZE  (1024 * 1024)
+#define STREAM_CHUNK_END   (0)
+#define STREAM_CHUNK_ABORT (UINT32_MAX)
+#define STREAM_LEN_UNKNOWN (UINT64_MAX)
+
+/**
+ * Log unload
+ * ----------
+ * CMD_UNLOAD_LOGS without a payload replies with every log line the agent
+ * still keeps (see log.h for the rotation), each ended by `\0`.
+ * With a cursor (uint64) payload it only replies with the lines logged
+ * since, at most UNLOAD_LOGS_MAX bytes of log records at a time:
+ *
+ *   start (uint64) | next (uint64) | end (uint64) | lines
+ *
+ * start is past the cursor when the lines in between were rotated out, the
+ * next unload passes `next` as its cursor, and more is waiting while next
+ * is short of end. The first unload passes 0, later ones a `next` the agent
+ * returned, other positions may fall inside a record. A cursor past the end
+ * is an error.
+ */
+#define UNLOAD_LOGS_MAX       (256 * 1024)
+#define UNLOAD_LOGS_POSITIONS (3)
+
+/**
+ * Ranged reads
+ * ------------
+ * CMD_GET_FILE_RANGE payload: offset (uint64) | length (uint64) | path
+ * A length past the end of the file (e.g. RANGE_LEN_TO_END) is clamped.
+ * The reply is a stream whose header is followed by the file info,
+ * so an interrupted transfer can be resumed and checked for changes:
+ *
+ *   ret_code | total_len | file_size (uint64) | mtime_sec (int64) | mtime_nsec (uint32) | chunk* | end marker
+ *
+ * total_len is the clamped range length. An offset past the end of the file
+ * is an error.
+ */
+#define RANGE_LEN_TO_END   (UINT64_MAX)
+
+/**
+ * Delta transfer
+ * --------------
+ * CMD_GET_FILE_DELTA payload:
+ *
+ *   block_size (uint32) | block_count (uint32) | path_len (uint32) | path | sig*
+ *
+ * where each sig is `weak (uint32) | strong (uint64)` for one full block of
+ * the controller's copy (see delta.h for the checksums). A trailing partial
+ * block has no signature. The reply is a stream of unknown length whose
+ * chunks carry the delta ops described in delta.h.
+ */
+
+/**
+ * Batch collection
+ * ----------------
+ * CMD_GET_FILES payload: count (uint32) | (path_len (uint32) | path)*
+ * The reply is an archive of the files in request order:
+ *
+ *   ret_code (int32) | count (uint32) | entry*
+ *   entry: status (int32) | size (uint64) | chunk* | end marker
+ *
+ * Entries whose status is not 0 (e.g. missing files) have size 0 and no
+ * chunks or end marker, the rest of the batch carries on.
+ */
+
+/**
+ * Exec output caps
+ * ----------------
+ * The CMD_EXEC_COMMAND payload may end with two optional fields:
+ *
+ *   ... | args | head_cap (uint32) | tail_cap (uint32)
+ *
+ * With them the agent keeps at most the first head_cap and the last
+ * tail_cap bytes of each stream, and the result ends with a trailer:
+ *
+ *   ... | stderr | truncated (uint8) | stdout_total (uint64) | stderr_total (uint64)
+ *
+ * truncated has EXEC_TRUNCATED_STDOUT / EXEC_TRUNCATED_STDERR set for the
+ * streams whose bytes between head and tail were dropped; such a stream's
+ * data is its head_cap first bytes directly followed by its tail.
+ */
+#define EXEC_TRUNCATED_STDOUT (1 << 0)
+#define EXEC_TRUNCATED_STDERR (1 << 1)
+
+/**
+ * Streaming exec
+ * --------------
+ * CMD_EXEC_STREAM takes the CMD_EXEC_COMMAND payload and relays output
+ * while the child runs:
+ *
+ *   ret_code (int32) | frame* | exit frame
+ *   frame: tag (uint8) | len (uint32) | data
+ *
+ * Output frames are tagged EXEC_FRAME_STDOUT / EXEC_FRAME_STDERR, the last
+ * frame is EXEC_FRAME_EXIT with `status (int32) | exit_code (int32)`, status
+ * being -1 if the child was killed on timeout. When ret_code is not 0
+ * (e.g. the executable is inaccessible) no frames follow.
+ * With CAP_MUX each frame carries the request id as well (see Multiplexing):
+ *
+ *   request_id | ret_code (int32), then per frame: request_id | frame
+ */
+#define EXEC_FRAME_STDOUT (1)
+#define EXEC_FRAME_STDERR (2)
+#define EXEC_FRAME_EXIT   (3)
+
+#define EXEC_RESPONSE_PARTS_MAX (5)
+
+/**
+ * Parses a CMD_EXEC_COMMAND payload, the strings are copied to `arena`.
+ * The output caps are only looked for when `limits_out` and `capped_out`
+ * are given, `capped_out` tells whether the payload had them.
+ *
+ * @return cmd_status_t (CMD_OK on success, CMD_FATAL for a malformed payload)
+ */
+cmd_status_t parse_exec_payload(arena_t *arena,
+                                const uint8_t *payload,
+                                size_t payload_len,
+                                uint32_t *timeout_ms_out,
+                                char **path_out,
+                                char ***argv_out,
+                                exec_limits_t *limits_out,
+                                int *capped_out);
+
+/**
+ * Describes the exec result as `exit_code | stdout_len | stdout | stderr_len |
+ * stderr [| trailer]` pointing straight at the output buffers, so the output
+ * is neither copied nor held twice. Only the fixed size fields live in the arena.
+ *
+ * @param parts           At least EXEC_RESPONSE_PARTS_MAX entries.
+ * @param out_part_count  Entries of `parts` used.
+ * @return cmd_status_t (CMD_OK on success)
+ */
+cmd_status_t build_exec_response(arena_t *arena,
+                                 int exit_code,
+                                 const exec_output_t *out_stdout,
+                                 const exec_output_t *out_stderr,
+                                 int capped,
+                                 struct iovec *parts,
+                                 int *out_part_count);
+
+/**
+ * Called once when a session started with network_session_start is over.
+ *
+ * @param status          NETWORK_OK if the session ended cleanly.
+ * @param sleep_duration  Seconds the controller asked to be left alone (CMD_SLEEP), 0 if it didn't.
+ * @param should_die      Set when the controller sent CMD_DIE.
+ */
+typedef void (*network_done_cb_t)(void *ctx, network_status_t status, unsigned int sleep_duration, int should_die);
+
+/**
+ * Starts a session with the controller on `reactor`.
+ * Connects to tool->conf.ip and tool->conf.port without blocking, sends the
+ * hello and handles commands as they arrive until the controller says
+ * CMD_SLEEP or CMD_DIE, closes the connection, or the session fails.
+ *
+ * Reading commands never blocks the reactor, so children of exec commands,
+ * timers and other sources progress while the session waits for the
+ * controller. Replies are written as they are ready, with the socket in
+ * blocking mode, so a slow reader pushes back on the agent.
+ *
+ * In persistent mode (tool->conf.persistent) the controller simply keeps
+ * the connection open and pushes commands whenever it has them; TCP
+ * keepalive is enabled to notice a peer that went away.
+ *
+ * @param reactor  Loop the session registers with.
+ * @param tool     Tool configuration, must outlive the session.
+ * @param on_done  Completion callback, not called when the start fails.
+ * @param ctx      Passed to `on_done` as is.
+ * @return network_status_t (NETWORK_OK if the session is under way)
  */
-network_status_t communicate(const tool_t *tool, unsigned int * out_sleep_duration, int * out_should_die);
+network_status_t network_session_start(reactor_t *reactor, const tool_t *tool, network_done_cb_t on_done, void *ctx);
@@ -0,0 +1,49 @@
+/**
+ * filename: prefetch.h
+ * description: Opens and reads ahead a list of files on a small pool of reader threads.
+ */
+
+#pragma once
+
+// C includes
+#include <stddef.h>
+
+// User includes
+#include "file.h"
+
+// defines
+#define PREFETCH_THREADS 4
+#define PREFETCH_WINDOW 8
+
+typedef struct prefetch_entry_s
+{
+    const char *path;
+    int fd;
+    file_info_t info;
+    file_status_t status;
+} prefetch_entry_t;
+
+typedef struct prefetch_s prefetch_t;
+
+/**
+ * Starts reader threads that open `entries` in order and pull their content
+ * into the page cache, staying at most PREFETCH_WINDOW entries ahead of the
+ * consumer so the number of open descriptors stays bounded.
+ *
+ * @param entries    Entries with `path` set, the rest is filled by the readers.
+ *                   Must stay valid until prefetch_destroy.
+ * @param count      Number of entries.
+ * @param out_pool   Output prefetch handle (release with prefetch_destroy).
+ * @return file_status_t (FILE_OK on success)
+ */
+file_status_t prefetch_start(prefetch_entry_t *entries, size_t count, prefetch_t **out_pool);
+
+/**
+ * Blocks until entry `index` was opened (or failed to).
+ * Entries must be waited for in order. On return entries[index].status
+ * tells whether entries[index].fd is usable; the caller owns the fd.
+ */
+file_status_t prefetch_wait(prefetch_t *pool, size_t index);
+
+/** Stops the readers and closes descriptors of entries that were never consumed. */
+void prefetch_destroy(prefetch_t *pool);
@@ -0,0 +1,116 @@
+/**
+ * filename: reactor.h
+ * description: Single threaded epoll event loop for sockets, pipes, timers, children, signals
+ *              and wakeups from other threads.
+ */
+
+#pragma once
+
+// C includes
+#include <stdint.h>
+#include <sys/types.h>
+
+// defines
+#define REACTOR_READ  (1 << 0)
+#define REACTOR_WRITE (1 << 1)
+#define REACTOR_HUP   (1 << 2)    // hang up or error, reported whatever was asked for
+#define REACTOR_CHILD_POLL_MS 10
+
+typedef enum reactor_status_e
+{
+    REACTOR_OK = 0,
+    REACTOR_FAILED,
+    REACTOR_INVALID,
+    REACTOR_NOMEM,
+} reactor_status_t;
+
+typedef struct reactor_s reactor_t;
+typedef struct reactor_source_s reactor_source_t;
+
+/**
+ * Called from reactor_run when a source is ready.
+ * `events` is a set of REACTOR_READ / REACTOR_WRITE / REACTOR_HUP bits, timers,
+ * children and signals always fire with REACTOR_READ.
+ * Callbacks may add and remove any source, including their own.
+ */
+typedef void (*reactor_cb_t)(void *ctx, uint32_t events);
+
+/**
+ * Creates an empty event loop.
+ *
+ * @param out_reactor  Output handle (release with reactor_destroy).
+ * @return reactor_status_t (REACTOR_OK on success)
+ */
+reactor_status_t reactor_create(reactor_t **out_reactor);
+
+/** Removes every source left and closes the loop. */
+void reactor_destroy(reactor_t *reactor);
+
+/**
+ * Watches `fd` for `events` (REACTOR_READ and/or REACTOR_WRITE).
+ * The caller keeps owning `fd` and must remove the source before closing it.
+ * Level triggered: a callback that leaves data unread is called again.
+ */
+reactor_status_t reactor_add_fd(reactor_t *reactor, int fd, uint32_t events,
+				reactor_cb_t cb, void *ctx, reactor_source_t **out_source);
+
+/** Changes what an fd source waits for, 0 pauses it without removing it. */
+reactor_status_t reactor_set_events(reactor_source_t *source, uint32_t events);
+
+/**
+ * Creates a timer, disarmed until reactor_timer_arm.
+ * Backed by a timerfd, so it costs no syscalls while it isn't due.
+ */
+reactor_status_t reactor_add_timer(reactor_t *reactor, reactor_cb_t cb, void *ctx,
+				   reactor_source_t **out_source);
+
+/**
+ * Fires the timer in `delay_ms`, then every `interval_ms` (0 for once).
+ * Re-arming replaces the previous schedule, a delay of 0 disarms.
+ */
+reactor_status_t reactor_timer_arm(reactor_source_t *source, uint64_t delay_ms, uint64_t interval_ms);
+
+/**
+ * Fires once `pid` exited. The callback reaps it (e.g. waitpid) and removes
+ * the source, until then it keeps firing.
+ * Uses a pidfd, or polls every REACTOR_CHILD_POLL_MS on kernels without one.
+ */
+reactor_status_t reactor_add_child(reactor_t *reactor, pid_t pid, reactor_cb_t cb, void *ctx,
+				   reactor_source_t **out_source);
+
+/**
+ * Delivers `signo` through a signalfd instead of an asynchronous handler.
+ * The signal is blocked in the calling thread, so add signal sources before
+ * starting any thread that shouldn't receive it, and spawned children have
+ * to restore their mask (see exec.c).
+ */
+reactor_status_t reactor_add_signal(reactor_t *reactor, int signo, reactor_cb_t cb, void *ctx,
+				    reactor_source_t **out_source);
+
+/**
+ * Creates a source that fires after reactor_wake, the one way for another
+ * thread to get the loop to run something. Backed by an eventfd.
+ */
+reactor_status_t reactor_add_wake(reactor_t *reactor, reactor_cb_t cb, void *ctx, reactor_source_t **out_source);
+
+/**
+ * Makes a wake source fire. Safe from any thread, as long as the source
+ * isn't removed in the meantime. Wakes before the callback runs are merged.
+ */
+reactor_status_t reactor_wake(reactor_source_t *source);
+
+/**
+ * Stops watching and releases the source. Safe on NULL and from any
+ * callback, an event already reported for it is dropped.
+ */
+void reactor_remove(reactor_source_t *source);
+
+/**
+ * Dispatches events until reactor_stop is called or no source is left.
+ *
+ * @return reactor_status_t (REACTOR_OK on success)
+ */
+reactor_status_t reactor_run(reactor_t *reactor);
+
+/** Makes reactor_run return once the current callback is done. */
+void reactor_stop(reactor_t *reactor);
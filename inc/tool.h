@@ -17,6 +17,8 @@ typedef struct tool_conf_s
     char ip[IP_STR_MAX_LEN];
     uint16_t port;
     uint32_t default_sleep;
+    uint8_t persistent;     // keep one session open, reconnect with backoff when it breaks
+    const char *log_levels; // e.g. "error,exec=debug" (see log_set_levels), NULL for the defaults
 } tool_conf_t;
 
 typedef struct tool_s
@@ -0,0 +1,47 @@
+/**
+ * filename: worker.h
+ * description: Fixed size thread pool running queued jobs in submission order.
+ */
+
+#pragma once
+
+// C includes
+#include <stddef.h>
+
+// defines
+#define WORKER_THREADS 8
+#define WORKER_QUEUE_MAX 64
+
+typedef enum worker_status_e
+{
+    WORKER_OK = 0,
+    WORKER_FAILED,
+    WORKER_NOMEM,
+} worker_status_t;
+
+typedef void (*worker_job_t)(void *arg);
+
+typedef struct worker_pool_s worker_pool_t;
+
+/**
+ * Starts `thread_count` (at most WORKER_THREADS) worker threads.
+ *
+ * @param thread_count  Number of threads to start.
+ * @param out_pool      Output pool handle (release with worker_pool_destroy).
+ * @return worker_status_t (WORKER_OK on success)
+ */
+worker_status_t worker_pool_create(size_t thread_count, worker_pool_t **out_pool);
+
+/**
+ * Queues `job(arg)` to run on one of the workers. Blocks while
+ * WORKER_QUEUE_MAX jobs are already waiting, which pushes back on whoever
+ * produces the work instead of growing the queue without bound.
+ * The job owns `arg`.
+ */
+worker_status_t worker_pool_submit(worker_pool_t *pool, worker_job_t job, void *arg);
+
+/** Blocks until every queued job has finished. */
+void worker_pool_drain(worker_pool_t *pool);
+
+/** Runs the jobs still queued, then stops and joins the workers. */
+void worker_pool_destroy(worker_pool_t *pool);
@@ -0,0 +1,175 @@
+/**
+ * filename: arena.c
+ * description: Bump allocator for memory that lives exactly one command cycle.
+ */
+
+// C includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// User includes
+#include "arena.h"
+#include "log.h"
+
+struct arena_owned_s
+{
+    void *ptr;
+    arena_release_t release;
+    struct arena_owned_s *next;
+};
+
+/* Bump allocation only, NULL when the region is full. */
+static void *arena_bump(arena_t *arena, size_t size)
+{
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+    if (start > arena->capacity || size > arena->capacity - start)
+    {
+        return NULL;
+    }
+
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+arena_status_t arena_init(arena_t *arena, size_t capacity)
+{
+    arena_status_t status = ARENA_FAILED;
+
+    ASSERT_NOT_NULL(arena, cleanup, "arena is NULL");
+
+    arena->used = 0;
+    arena->owned = NULL;
+    arena->capacity = capacity;
+
+    status = ARENA_NOMEM;
+    arena->base = malloc(capacity);
+    ASSERT_NOT_NULL(arena->base, cleanup, "malloc failed: %s", strerror(errno));
+
+    status = ARENA_OK;
+cleanup:
+    return status;
+}
+
+arena_status_t arena_adopt(arena_t *arena, void *ptr)
+{
+    return arena_defer(arena, free, ptr);
+}
+
+arena_status_t arena_defer(arena_t *arena, arena_release_t release, void *ptr)
+{
+    arena_status_t status = ARENA_NOMEM;
+    arena_owned_t *node = NULL;
+
+    if (NULL == ptr)
+    {
+        return ARENA_OK;
+    }
+
+    // the bookkeeping comes from the arena too, it goes away on reset anyway
+    node = arena_bump(arena, sizeof(*node));
+    if (NULL == node)
+    {
+        node = malloc(sizeof(*node) * 2);
+        ASSERT_NOT_NULL(node, cleanup, "malloc failed: %s", strerror(errno));
+
+        // the node owns itself through its twin
+        node[1].ptr = node;
+        node[1].release = free;
+        node[1].next = arena->owned;
+        arena->owned = &node[1];
+    }
+
+    node->ptr = ptr;
+    node->release = release;
+    node->next = arena->owned;
+    arena->owned = node;
+    ptr = NULL;
+
+    status = ARENA_OK;
+cleanup:
+    if (NULL != ptr)
+    {
+        release(ptr);
+    }
+    return status;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    void *ptr = NULL;
+
+    if (NULL == arena)
+    {
+        return NULL;
+    }
+
+    ptr = arena_bump(arena, size);
+    if (NULL != ptr)
+    {
+        return ptr;
+    }
+
+    // oversized request, or the region is spent for this cycle
+    ptr = malloc(size);
+    if (NULL == ptr || ARENA_OK != arena_adopt(arena, ptr))
+    {
+        return NULL;
+    }
+
+    return ptr;
+}
+
+char *arena_strndup(arena_t *arena, const void *src, size_t len)
+{
+    char *copy = NULL;
+
+    if (len == SIZE_MAX)
+    {
+        return NULL;
+    }
+
+    copy = arena_alloc(arena, len + 1);
+    if (NULL != copy)
+    {
+        memcpy(copy, src, len);
+        copy[len] = '\0';
+    }
+
+    return copy;
+}
+
+void arena_reset(arena_t *arena)
+{
+    arena_owned_t *node = NULL;
+    arena_owned_t *next = NULL;
+
+    if (NULL == arena)
+    {
+        return;
+    }
+
+    // a node may free the block holding itself, so read next first
+    for (node = arena->owned; NULL != node; node = next)
+    {
+        next = node->next;
+        node->release(node->ptr);
+    }
+
+    arena->owned = NULL;
+    arena->used = 0;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    if (NULL == arena)
+    {
+        return;
+    }
+
+    arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+    arena->capacity = 0;
+}
@@ -1,50 +1,181 @@
 /**
  * filename: core.c
- * description: handle commands and sleep in a loop
+ * description: handle commands and sleep between sessions on an event loop
  */
 
 // C includes
 #include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
 
 // User includes
 #include "core.h"
 #include "network.h"
+#include "reactor.h"
 #include "log.h"
 
 // defines
 #define LOG_FILE_PATH ("/tmp/logs")
+#define RECONNECT_MIN_MS 100
+#define RECONNECT_MAX_MS (60 * 1000)
+// a clean session shorter than this doesn't reset the backoff
+#define SESSION_STABLE_MS (10 * 1000)
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+
+typedef struct core_s
+{
+    const tool_t *tool;
+    reactor_t *reactor;
+    reactor_source_t *beacon;   // fires when the next session is due
+    unsigned int backoff_ms;
+    uint64_t session_start_ms;
+} core_t;
+
+static void core_on_session_done(void *ctx, network_status_t status, unsigned int sleep_duration, int should_die);
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MS_PER_SEC + (uint64_t)ts.tv_nsec / NS_PER_MS;
+}
+
+/*
+ * Returns the wait before the next reconnect of a persistent session and
+ * doubles the backoff after it. Half of each wait is random so a controller
+ * restart doesn't get every agent back at the same moment.
+ */
+static unsigned int reconnect_backoff(core_t *core)
+{
+    unsigned int wait_ms = core->backoff_ms / 2 + (unsigned int)random() % (core->backoff_ms / 2 + 1);
+
+    core->backoff_ms = (core->backoff_ms < RECONNECT_MAX_MS / 2) ? core->backoff_ms * 2 : RECONNECT_MAX_MS;
+    return wait_ms;
+}
+
+static void core_schedule(core_t *core, uint64_t delay_ms)
+{
+    // a 0 delay would disarm the timer
+    if (REACTOR_OK != reactor_timer_arm(core->beacon, (0 != delay_ms) ? delay_ms : 1, 0))
+    {
+	INFO("couldn't arm the beacon, stopping");
+	reactor_stop(core->reactor);
+    }
+}
+
+static void core_on_beacon(void *ctx, uint32_t events)
+{
+    core_t *core = ctx;
+
+    (void)events;
+
+    core->session_start_ms = now_ms();
+    if (NETWORK_OK != network_session_start(core->reactor, core->tool, core_on_session_done, core))
+    {
+	core_on_session_done(core, NETWORK_FAILED, 0, 0);
+    }
+}
+
+static void core_on_session_done(void *ctx, network_status_t status, unsigned int sleep_duration, int should_die)
+{
+    core_t *core = ctx;
+    const tool_conf_t *conf = &core->tool->conf;
+
+    if (0 != should_die)
+    {
+	reactor_stop(core->reactor);
+	return;
+    }
+
+    if (0 != conf->persistent)
+    {
+	// the controller asked for quiet, otherwise reconnect right away
+	if (0 != sleep_duration)
+	{
+	    core->backoff_ms = RECONNECT_MIN_MS;
+	    core_schedule(core, (uint64_t)sleep_duration * MS_PER_SEC);
+	    return;
+	}
+
+	// a session that ended cleanly after a while starts the backoff over, a
+	// controller that accepts and closes right away is retried ever more slowly
+	if (NETWORK_OK == status && now_ms() - core->session_start_ms >= SESSION_STABLE_MS)
+	{
+	    core->backoff_ms = RECONNECT_MIN_MS;
+	}
+
+	INFO("session ended (status %d), reconnecting", status);
+	core_schedule(core, reconnect_backoff(core));
+	return;
+    }
+
+    if (NETWORK_OK != status)
+    {
+	reactor_stop(core->reactor);
+	return;
+    }
+
+    core_schedule(core, (uint64_t)((0 == sleep_duration) ? conf->default_sleep : sleep_duration) * MS_PER_SEC);
+}
+
+static void core_on_signal(void *ctx, uint32_t events)
+{
+    core_t *core = ctx;
+
+    (void)events;
+
+    INFO("asked to terminate");
+    reactor_stop(core->reactor);
+}
 
 void run(const tool_t *tool)
 {
-    unsigned int sleep_duration = 0;
-    int should_die = 0;
-    network_status_t network_status = NETWORK_FAILED;
+    core_t core = {0};
+    reactor_source_t *signals[2] = {0};
+    sigset_t pipe_mask;
+    int registered = 0;
+    int ret = 0;
 
     log_init(LOG_FILE_PATH);
 
     ASSERT_NOT_NULL(tool, cleanup, "tool was NULL");
 
-    while(1)
+    if (NULL != tool->conf.log_levels && LOG_OK != log_set_levels(tool->conf.log_levels))
     {
-        network_status = communicate(tool, &sleep_duration, &should_die);
-	
-	if (0 != should_die || NETWORK_OK != network_status)
-	{
-		break;
-	}
+        INFO("bad log levels, the rest is ignored: %s", tool->conf.log_levels);
+    }
 
-	if (0 == sleep_duration)
-        {
-            sleep(tool->conf.default_sleep);
-        }
-        else
-        {
-            sleep(sleep_duration);
-        }
-    } 
+    srandom((unsigned int)time(NULL) ^ (unsigned int)getpid());
+
+    core.tool = tool;
+    core.backoff_ms = RECONNECT_MIN_MS;
+    ASSERT_RET_EQ(REACTOR_OK, reactor_create(&core.reactor), cleanup, "reactor_create failed");
+
+    // before any thread starts, so they all inherit the blocked mask
+    registered = (REACTOR_OK == reactor_add_signal(core.reactor, SIGTERM, core_on_signal, &core, &signals[0]));
+    registered = registered && (REACTOR_OK == reactor_add_signal(core.reactor, SIGINT, core_on_signal, &core, &signals[1]));
+    registered = registered && (REACTOR_OK == reactor_add_timer(core.reactor, core_on_beacon, &core, &core.beacon));
+    ASSERT_RET_EQ(1, registered, cleanup, "couldn't register with the reactor");
+
+    // a controller hanging up mid reply is an EPIPE for the writer (a worker under CAP_MUX),
+    // not the end of the agent. Blocked rather than ignored, children start with an empty mask
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    ret = pthread_sigmask(SIG_BLOCK, &pipe_mask, NULL);
+    ASSERT_RET_EQ(0, ret, cleanup, "pthread_sigmask failed: %s", strerror(ret));
+
+    // the first session starts right away
+    core_schedule(&core, 0);
+
+    ASSERT_RET_EQ(REACTOR_OK, reactor_run(core.reactor), cleanup, "reactor_run failed");
 
 cleanup:
+    reactor_destroy(core.reactor);
     log_destroy();
     return;
 }
-
@@ -0,0 +1,520 @@
+/**
+ * filename: delta.c
+ * description: rsync style delta generation against a remote copy's block signatures
+ */
+
+// C includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+// User includes
+#include "delta.h"
+#include "log.h"
+
+// defines
+#define DELTA_OUT_SIZE (64 * 1024)
+#define DELTA_NO_INDEX (UINT32_MAX)
+#define DELTA_HASH_SEED (0x9e3779b97f4a7c15ULL)
+#define DELTA_HASH_MUL (0xc6a4a7935bd1e995ULL)
+#define DELTA_HASH_SHIFT (47)
+
+typedef struct delta_table_s
+{
+    uint32_t *buckets;
+    uint32_t *next;
+    uint32_t mask;
+} delta_table_t;
+
+/* MurmurHash64A state, fed the file as it is read. */
+typedef struct delta_hash_s
+{
+    uint64_t value;
+    uint8_t carry[8];   // bytes of a word not complete yet
+    size_t carry_len;
+} delta_hash_t;
+
+/* Window over the local file: holds bytes [base, base + filled). */
+typedef struct delta_window_s
+{
+    uint8_t *data;
+    size_t capacity;
+    size_t filled;
+    uint64_t base;
+    uint64_t size;      // of the whole file
+    delta_read_t read;
+    void *ctx;
+    delta_hash_t hash;
+} delta_window_t;
+
+typedef struct delta_out_s
+{
+    uint8_t buf[DELTA_OUT_SIZE];
+    size_t used;
+    delta_emit_t emit;
+    void *ctx;
+} delta_out_t;
+
+uint32_t delta_weak_checksum(const uint8_t *buf, size_t len)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        a += buf[i];
+        b += (uint32_t)(len - i) * buf[i];
+    }
+
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+static void hash_init(delta_hash_t *hash, uint64_t total_len)
+{
+    // MurmurHash64A, seeded with the length so it can be fed piecewise
+    hash->value = DELTA_HASH_SEED ^ (total_len * DELTA_HASH_MUL);
+    hash->carry_len = 0;
+}
+
+static void hash_word(delta_hash_t *hash, const uint8_t *cursor)
+{
+    uint64_t word = 0;
+
+    memcpy(&word, cursor, sizeof(word));
+    word *= DELTA_HASH_MUL;
+    word ^= word >> DELTA_HASH_SHIFT;
+    word *= DELTA_HASH_MUL;
+
+    hash->value ^= word;
+    hash->value *= DELTA_HASH_MUL;
+}
+
+static void hash_update(delta_hash_t *hash, const uint8_t *buf, size_t len)
+{
+    size_t part = 0;
+
+    // complete the word left over from the previous piece first
+    if (0 != hash->carry_len)
+    {
+        part = sizeof(hash->carry) - hash->carry_len;
+        part = (len < part) ? len : part;
+        memcpy(hash->carry + hash->carry_len, buf, part);
+        hash->carry_len += part;
+        buf += part;
+        len -= part;
+
+        if (sizeof(hash->carry) != hash->carry_len)
+        {
+            return;
+        }
+        hash_word(hash, hash->carry);
+        hash->carry_len = 0;
+    }
+
+    for (; len >= sizeof(hash->carry); buf += sizeof(hash->carry), len -= sizeof(hash->carry))
+    {
+        hash_word(hash, buf);
+    }
+
+    memcpy(hash->carry, buf, len);
+    hash->carry_len = len;
+}
+
+static uint64_t hash_final(delta_hash_t *hash)
+{
+    uint64_t value = hash->value;
+    uint64_t word = 0;
+
+    if (0 != hash->carry_len)
+    {
+        for (size_t i = hash->carry_len; i > 0; --i)
+        {
+            word = (word << 8) | hash->carry[i - 1];
+        }
+        value ^= word;
+        value *= DELTA_HASH_MUL;
+    }
+
+    value ^= value >> DELTA_HASH_SHIFT;
+    value *= DELTA_HASH_MUL;
+    value ^= value >> DELTA_HASH_SHIFT;
+
+    return value;
+}
+
+uint64_t delta_strong_hash(const uint8_t *buf, size_t len)
+{
+    delta_hash_t hash = {0};
+
+    hash_init(&hash, (uint64_t)len);
+    hash_update(&hash, buf, len);
+    return hash_final(&hash);
+}
+
+static delta_status_t table_build(delta_table_t *table, const delta_sig_t *sigs, uint32_t sig_count)
+{
+    delta_status_t status = DELTA_NOMEM;
+    size_t bucket_count = 1;
+    uint32_t slot = 0;
+
+    // keep the table at most half full so chains stay short
+    while (bucket_count < (size_t)sig_count * 2)
+    {
+        bucket_count <<= 1;
+    }
+
+    table->buckets = malloc(bucket_count * sizeof(*table->buckets));
+    ASSERT_NOT_NULL(table->buckets, cleanup, "malloc failed: %s", strerror(errno));
+    table->next = malloc(((size_t)sig_count + 1) * sizeof(*table->next));
+    ASSERT_NOT_NULL(table->next, cleanup, "malloc failed: %s", strerror(errno));
+
+    memset(table->buckets, 0xff, bucket_count * sizeof(*table->buckets));
+    table->mask = (uint32_t)(bucket_count - 1);
+
+    // insert backwards so each chain lists the lowest block index first
+    for (uint32_t i = sig_count; i > 0; --i)
+    {
+        slot = sigs[i - 1].weak & table->mask;
+        table->next[i - 1] = table->buckets[slot];
+        table->buckets[slot] = i - 1;
+    }
+
+    status = DELTA_OK;
+cleanup:
+    return status;
+}
+
+static void table_destroy(delta_table_t *table)
+{
+    free(table->buckets);
+    free(table->next);
+    table->buckets = NULL;
+    table->next = NULL;
+}
+
+static uint32_t table_find(const delta_table_t *table, const delta_sig_t *sigs,
+			   uint32_t weak, const uint8_t *block, size_t block_size)
+{
+    uint32_t index = table->buckets[weak & table->mask];
+    uint64_t strong = 0;
+    int have_strong = 0;
+
+    for (; DELTA_NO_INDEX != index; index = table->next[index])
+    {
+        if (sigs[index].weak != weak)
+        {
+            continue;
+        }
+
+        // the strong hash is only worth computing once the weak one matched
+        if (0 == have_strong)
+        {
+            strong = delta_strong_hash(block, block_size);
+            have_strong = 1;
+        }
+
+        if (sigs[index].strong == strong)
+        {
+            return index;
+        }
+    }
+
+    return DELTA_NO_INDEX;
+}
+
+static delta_status_t out_flush(delta_out_t *out)
+{
+    delta_status_t status = DELTA_OK;
+
+    if (out->used > 0)
+    {
+        status = out->emit(out->ctx, out->buf, out->used);
+        out->used = 0;
+    }
+
+    return status;
+}
+
+static delta_status_t out_append(delta_out_t *out, const void *buf, size_t len)
+{
+    delta_status_t status = DELTA_OK;
+
+    if (len > sizeof(out->buf) - out->used)
+    {
+        status = out_flush(out);
+        ASSERT_RET_EQ(DELTA_OK, status, cleanup, "emit failed");
+    }
+
+    if (len > sizeof(out->buf))
+    {
+        // large literal runs go out as is instead of through the buffer
+        status = out->emit(out->ctx, buf, len);
+        goto cleanup;
+    }
+
+    memcpy(out->buf + out->used, buf, len);
+    out->used += len;
+
+cleanup:
+    return status;
+}
+
+static delta_status_t emit_literal(delta_out_t *out, const uint8_t *data, size_t len)
+{
+    delta_status_t status = DELTA_OK;
+    uint8_t op = DELTA_OP_LITERAL;
+    uint32_t net_len = 0;
+    size_t part = 0;
+
+    while (len > 0)
+    {
+        part = (len > UINT32_MAX) ? UINT32_MAX : len;
+        net_len = htonl((uint32_t)part);
+
+        status = out_append(out, &op, sizeof(op));
+        ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append op failed");
+        status = out_append(out, &net_len, sizeof(net_len));
+        ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append length failed");
+        status = out_append(out, data, part);
+        ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append literal failed");
+
+        data += part;
+        len -= part;
+    }
+
+cleanup:
+    return status;
+}
+
+static delta_status_t emit_copy(delta_out_t *out, uint32_t first_block, uint32_t block_count)
+{
+    delta_status_t status = DELTA_OK;
+    uint8_t op = DELTA_OP_COPY;
+    uint32_t net_first = htonl(first_block);
+    uint32_t net_count = htonl(block_count);
+
+    status = out_append(out, &op, sizeof(op));
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append op failed");
+    status = out_append(out, &net_first, sizeof(net_first));
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append first block failed");
+    status = out_append(out, &net_count, sizeof(net_count));
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append block count failed");
+
+cleanup:
+    return status;
+}
+
+static delta_status_t emit_end(delta_out_t *out, uint64_t size, uint64_t hash)
+{
+    delta_status_t status = DELTA_OK;
+    uint8_t op = DELTA_OP_END;
+    uint64_t net_size = htobe64(size);
+    uint64_t net_hash = htobe64(hash);
+
+    status = out_append(out, &op, sizeof(op));
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append op failed");
+    status = out_append(out, &net_size, sizeof(net_size));
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append size failed");
+    status = out_append(out, &net_hash, sizeof(net_hash));
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "append hash failed");
+
+    status = out_flush(out);
+cleanup:
+    return status;
+}
+
+/*
+ * Drops the window's bytes before `keep_from` and reads on from the file,
+ * as much as fits or is left.
+ */
+static delta_status_t window_fill(delta_window_t *window, uint64_t keep_from)
+{
+    delta_status_t status = DELTA_OK;
+    uint64_t end = window->base + window->filled;
+    size_t kept = (size_t)(end - keep_from);
+    size_t count = window->capacity - kept;
+
+    if (count > window->size - end)
+    {
+        count = (size_t)(window->size - end);
+    }
+
+    memmove(window->data, window->data + (keep_from - window->base), kept);
+    window->base = keep_from;
+    window->filled = kept;
+
+    if (0 == count)
+    {
+        goto cleanup;
+    }
+
+    status = window->read(window->ctx, end, window->data + kept, count);
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "read failed at offset %llu", (unsigned long long)end);
+
+    hash_update(&window->hash, window->data + kept, count);
+    window->filled += count;
+
+cleanup:
+    return status;
+}
+
+delta_status_t delta_generate(uint64_t size, size_t block_size,
+			      const delta_sig_t *sigs, uint32_t sig_count,
+			      delta_read_t read, delta_emit_t emit, void *ctx)
+{
+    delta_status_t status = DELTA_INVALID;
+    delta_table_t table = {0};
+    delta_window_t window = {0};
+    delta_out_t *out = NULL;
+    const uint8_t *data = NULL;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t index = DELTA_NO_INDEX;
+    uint32_t run_first = DELTA_NO_INDEX;
+    uint32_t run_count = 0;
+    uint64_t pos = 0;
+    uint64_t literal_start = 0;
+    uint64_t need = 0;
+    int have_window = 0;
+
+    ASSERT_NOT_NULL(read, cleanup, "read is NULL");
+    ASSERT_NOT_NULL(emit, cleanup, "emit is NULL");
+    if (0 != sig_count)
+    {
+        ASSERT_NOT_NULL(sigs, cleanup, "sigs is NULL");
+    }
+    if (block_size < DELTA_MIN_BLOCK_SIZE || block_size > DELTA_MAX_BLOCK_SIZE)
+    {
+        ERROR(cleanup, "invalid block size %zu", block_size);
+    }
+
+    status = DELTA_NOMEM;
+    out = malloc(sizeof(*out));
+    ASSERT_NOT_NULL(out, cleanup, "malloc failed: %s", strerror(errno));
+    out->used = 0;
+    out->emit = emit;
+    out->ctx = ctx;
+
+    // a block plus the byte rolled in after it always fits next to a full read
+    window.capacity = block_size + DELTA_READ_SIZE;
+    window.data = malloc(window.capacity);
+    ASSERT_NOT_NULL(window.data, cleanup, "malloc failed: %s", strerror(errno));
+    window.size = size;
+    window.read = read;
+    window.ctx = ctx;
+    hash_init(&window.hash, size);
+
+    status = table_build(&table, sigs, sig_count);
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "table_build failed");
+
+    while (0 != sig_count && pos + block_size <= size)
+    {
+        // the block at pos and the byte after it, when there is one
+        need = (pos + block_size < size) ? pos + block_size + 1 : size;
+        if (window.base + window.filled < need)
+        {
+            // no run is pending while literal bytes are, so the literal can go out
+            // now and the window only has to keep the current block
+            status = emit_literal(out, window.data + (literal_start - window.base), (size_t)(pos - literal_start));
+            ASSERT_RET_EQ(DELTA_OK, status, cleanup, "emit_literal failed");
+            literal_start = pos;
+
+            status = window_fill(&window, pos);
+            ASSERT_RET_EQ(DELTA_OK, status, cleanup, "window_fill failed");
+        }
+        data = window.data + (pos - window.base);
+
+        if (0 == have_window)
+        {
+            a = 0;
+            b = 0;
+            for (size_t i = 0; i < block_size; ++i)
+            {
+                a += data[i];
+                b += (uint32_t)(block_size - i) * data[i];
+            }
+            have_window = 1;
+        }
+
+        index = table_find(&table, sigs, (a & 0xffff) | ((b & 0xffff) << 16), data, block_size);
+
+        if (DELTA_NO_INDEX != index)
+        {
+            // extend the current run of consecutive blocks if possible
+            if (literal_start == pos && DELTA_NO_INDEX != run_first && run_first + run_count == index)
+            {
+                ++run_count;
+            }
+            else
+            {
+                if (DELTA_NO_INDEX != run_first)
+                {
+                    status = emit_copy(out, run_first, run_count);
+                    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "emit_copy failed");
+                }
+                status = emit_literal(out, window.data + (literal_start - window.base), (size_t)(pos - literal_start));
+                ASSERT_RET_EQ(DELTA_OK, status, cleanup, "emit_literal failed");
+
+                run_first = index;
+                run_count = 1;
+            }
+
+            pos += block_size;
+            literal_start = pos;
+            have_window = 0;
+            continue;
+        }
+
+        if (pos + block_size == size)
+        {
+            break;
+        }
+
+        // roll the window one byte forward
+        a += (uint32_t)data[block_size] - data[0];
+        b += a - (uint32_t)block_size * data[0];
+        ++pos;
+
+        // a pending run is done once a literal byte follows it
+        if (DELTA_NO_INDEX != run_first && literal_start < pos)
+        {
+            status = emit_copy(out, run_first, run_count);
+            ASSERT_RET_EQ(DELTA_OK, status, cleanup, "emit_copy failed");
+            run_first = DELTA_NO_INDEX;
+            run_count = 0;
+        }
+    }
+
+    if (DELTA_NO_INDEX != run_first)
+    {
+        status = emit_copy(out, run_first, run_count);
+        ASSERT_RET_EQ(DELTA_OK, status, cleanup, "emit_copy failed");
+    }
+
+    // whatever is left of the file is literal, read on until its end
+    while (literal_start < size)
+    {
+        if (window.base + window.filled == literal_start)
+        {
+            status = window_fill(&window, literal_start);
+            ASSERT_RET_EQ(DELTA_OK, status, cleanup, "window_fill failed");
+        }
+
+        status = emit_literal(out, window.data + (literal_start - window.base),
+			      (size_t)(window.base + window.filled - literal_start));
+        ASSERT_RET_EQ(DELTA_OK, status, cleanup, "emit_literal failed");
+        literal_start = window.base + window.filled;
+    }
+
+    status = emit_end(out, size, hash_final(&window.hash));
+    ASSERT_RET_EQ(DELTA_OK, status, cleanup, "emit_end failed");
+
+    status = DELTA_OK;
+cleanup:
+    table_destroy(&table);
+    free(window.data);
+    free(out);
+    return status;
+}
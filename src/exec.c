@@ -3,25 +3,37 @@
  * description: Executes an external process, captures its output and exit code.
  */
 
+// needed for pipe2
+#define _GNU_SOURCE
+
 // C includes
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
 #include <signal.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <spawn.h>
 
 // User includes
 #include "exec.h"
 #include "log.h"
 #include "file.h"
+#include "reactor.h"
 
 // defines
-#define STEP_MS 10
+#define CAPTURE_MIN_READ 4096
+
+// build with -DEXEC_DEFAULT_BACKEND=EXEC_BACKEND_FORK to launch with fork() by default
+#ifndef EXEC_DEFAULT_BACKEND
+#define EXEC_DEFAULT_BACKEND EXEC_BACKEND_SPAWN
+#endif
 
 typedef enum pipe_end_e {
     PIPE_READ = 0,
@@ -29,16 +41,82 @@ typedef enum pipe_end_e {
     PIPE_SIZE = 2
 } pipe_end_t;
 
+typedef enum exec_slot_e {
+    SLOT_STDOUT = EXEC_STDOUT,
+    SLOT_STDERR = EXEC_STDERR,
+    SLOT_CHILD = 2,
+} exec_slot_t;
+
+static exec_backend_t g_exec_backend = EXEC_DEFAULT_BACKEND;
+
+typedef struct exec_capture_s
+{
+    byte_buf_t head;    // head of the output, grows up to head_cap
+    byte_buf_t ring;    // the last tail_cap bytes, once the head is full
+    size_t ring_pos;    // next write position in ring
+    size_t ring_used;
+    uint64_t total;
+    size_t head_cap;
+    size_t tail_cap;
+} exec_capture_t;
+
+typedef struct exec_pipe_s
+{
+    exec_job_t *job;
+    exec_stream_t stream;
+    int fd;
+    reactor_source_t *source;
+} exec_pipe_t;
+
+struct exec_job_s
+{
+    pid_t pid;
+    exec_pipe_t pipes[SLOT_CHILD];
+    reactor_source_t *child;
+    reactor_source_t *deadline;
+    int exited;
+    int wstatus;
+    exec_status_t status;       // EXEC_OK until something failed, timed out or cancelled
+    exec_output_cb_t on_output;
+    exec_exit_cb_t on_exit;
+    void *ctx;
+};
+
+/* exec_start_capped's state, the captures are filled from the job's output callback. */
+typedef struct exec_capped_s
+{
+    exec_capture_t captures[SLOT_CHILD];
+    exec_capped_cb_t on_done;
+    void *ctx;
+} exec_capped_t;
+
+/* Result of a blocking run, filled by the job's last callback. */
+typedef struct exec_sync_s
+{
+    reactor_t *reactor;
+    exec_job_t *job;            // until its last callback
+    exec_output_cb_t on_output;
+    void *ctx;
+    exec_status_t status;
+    int exit_code;
+    exec_output_t outputs[SLOT_CHILD];
+} exec_sync_t;
+
 static void exec_child(int stdout_pipe[PIPE_SIZE],
                        int stderr_pipe[PIPE_SIZE],
                        const char *path,
                        char **args)
 {
     int ret_val = -1;
+    sigset_t empty;
 
     ASSERT_NOT_NULL(path, failed, "path is NULL");
     ASSERT_NOT_NULL(args, failed, "args is NULL");
 
+    // signals the agent takes through a signalfd are blocked, the child expects them delivered
+    sigemptyset(&empty);
+    (void)sigprocmask(SIG_SETMASK, &empty, NULL);
+
     close(stdout_pipe[PIPE_READ]);
     stdout_pipe[PIPE_READ] = -1;
     close(stderr_pipe[PIPE_READ]);
@@ -60,34 +138,171 @@ failed:
     _exit(127);
 }
 
-static exec_status_t exec_wait_child(pid_t pid,
-                                     unsigned int timeout_ms,
-                                     int *wstatus)
+/*
+ * Launches `path` with its stdout and stderr on the pipes' write ends.
+ * glibc implements posix_spawn with clone(CLONE_VM | CLONE_VFORK), so unlike
+ * fork() the cost doesn't grow with the agent's mapped memory.
+ */
+static exec_status_t spawn_child(int stdout_pipe[PIPE_SIZE],
+                                 int stderr_pipe[PIPE_SIZE],
+                                 const char *path,
+                                 char **args,
+                                 pid_t *out_pid)
 {
     exec_status_t status = EXEC_FAILED;
-    unsigned int waited_ms = 0;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t empty;
+    int ret = -1;
 
-    ASSERT_NOT_NULL(wstatus, cleanup, "wstatus is NULL");
+    ret = posix_spawnattr_init(&attr);
+    ASSERT_RET_EQ(0, ret, done, "posix_spawnattr_init failed: %s", strerror(ret));
+    ret = posix_spawn_file_actions_init(&actions);
+    if (0 != ret)
+    {
+        posix_spawnattr_destroy(&attr);
+        ERROR(done, "posix_spawn_file_actions_init failed: %s", strerror(ret));
+    }
 
-    while (0 == waitpid(pid, wstatus, WNOHANG))
+    // signals the agent takes through a signalfd are blocked, the child expects them delivered
+    sigemptyset(&empty);
+    ret = posix_spawnattr_setsigmask(&attr, &empty);
+    ASSERT_RET_EQ(0, ret, cleanup, "posix_spawnattr_setsigmask failed: %s", strerror(ret));
+    ret = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    ASSERT_RET_EQ(0, ret, cleanup, "posix_spawnattr_setflags failed: %s", strerror(ret));
+
+    // the pipes are O_CLOEXEC, so only the duplicates survive the exec
+    ret = posix_spawn_file_actions_adddup2(&actions, stdout_pipe[PIPE_WRITE], STDOUT_FILENO);
+    ASSERT_RET_EQ(0, ret, cleanup, "adddup2 stdout failed: %s", strerror(ret));
+    ret = posix_spawn_file_actions_adddup2(&actions, stderr_pipe[PIPE_WRITE], STDERR_FILENO);
+    ASSERT_RET_EQ(0, ret, cleanup, "adddup2 stderr failed: %s", strerror(ret));
+
+    ret = posix_spawnp(out_pid, path, &actions, &attr, args, environ);
+    if (ENOENT == ret || EACCES == ret || ENOEXEC == ret)
     {
-        if (waited_ms >= timeout_ms)
-	{
-            INFO("Timeout reached, killing child process");
+        status = EXEC_INACCESSIBLE;
+    }
+    ASSERT_RET_EQ(0, ret, cleanup, "posix_spawnp(%s) failed: %s", path, strerror(ret));
 
-	    ASSERT_RET_NE(-1, kill(pid, SIGKILL), cleanup, "kill failed: %s", strerror(errno));
-    	    ASSERT_RET_NE(-1, waitpid(pid, wstatus, 0), cleanup, "waitpid failed");
+    status = EXEC_OK;
+cleanup:
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+done:
+    return status;
+}
+
+/* Appends what's available to the stream's head, which grows geometrically up to head_cap. */
+static exec_status_t capture_head(exec_capture_t *capture, int fd, size_t count)
+{
+    exec_status_t status = EXEC_FAILED;
+
+    ASSERT_RET_EQ(FILE_OK, byte_buf_reserve(&capture->head, count), cleanup, "byte_buf_reserve failed");
+    ASSERT_RET_EQ(FILE_OK, read_all(fd, capture->head.data + capture->head.size, count), cleanup, "read_all failed");
+    capture->head.size += count;
+
+    status = EXEC_OK;
+cleanup:
+    return status;
+}
+
+static exec_status_t capture_tail(exec_capture_t *capture, int fd, size_t count)
+{
+    exec_status_t status = EXEC_FAILED;
+    uint8_t discard[CAPTURE_MIN_READ];
+    size_t part = 0;
+
+    if (0 != capture->tail_cap && NULL == capture->ring.data)
+    {
+        ASSERT_RET_EQ(FILE_OK, byte_buf_reserve(&capture->ring, capture->tail_cap), cleanup,
+                      "byte_buf_reserve failed");
+    }
 
-            status = EXEC_TIMEOUT;
-            goto cleanup;
+    while (count > 0)
+    {
+        // bytes the ring would overwrite before this call returns are dropped in
+        // big reads, a small tail must not turn a flood into one read per tail_cap
+        if (count > capture->tail_cap)
+        {
+            part = count - capture->tail_cap;
+            part = (part < sizeof(discard)) ? part : sizeof(discard);
+            ASSERT_RET_EQ(FILE_OK, read_all(fd, discard, part), cleanup, "read_all failed");
         }
+        else
+        {
+            // at most up to the end of the ring, the rest wraps around on the next pass
+            part = capture->tail_cap - capture->ring_pos;
+            part = (count < part) ? count : part;
+            ASSERT_RET_EQ(FILE_OK, read_all(fd, capture->ring.data + capture->ring_pos, part), cleanup,
+                          "read_all failed");
+
+            capture->ring_pos = (capture->ring_pos + part) % capture->tail_cap;
+            capture->ring_used = (capture->ring_used + part < capture->tail_cap) ?
+                                 capture->ring_used + part : capture->tail_cap;
+        }
+        count -= part;
+    }
 
-        usleep(STEP_MS * 1000);
-        waited_ms += STEP_MS;
+    status = EXEC_OK;
+cleanup:
+    return status;
+}
+
+static exec_status_t capture_output(void *ctx, exec_stream_t stream, int fd, size_t available)
+{
+    exec_status_t status = EXEC_FAILED;
+    exec_capture_t *capture = &((exec_capped_t *)ctx)->captures[stream];
+    size_t to_head = capture->head_cap - capture->head.size;
+
+    to_head = (available < to_head) ? available : to_head;
+
+    if (0 != to_head)
+    {
+        status = capture_head(capture, fd, to_head);
+        ASSERT_RET_EQ(EXEC_OK, status, cleanup, "capture_head failed");
+    }
+
+    if (available > to_head)
+    {
+        status = capture_tail(capture, fd, available - to_head);
+        ASSERT_RET_EQ(EXEC_OK, status, cleanup, "capture_tail failed");
+    }
+
+    capture->total += available;
+
+    status = EXEC_OK;
+cleanup:
+    return status;
+}
+
+/*
+ * Appends the ring, oldest byte first, to the head and hands the result out.
+ * Like read_until_eof an empty output comes back as NULL.
+ */
+static exec_status_t capture_finish(exec_capture_t *capture, exec_output_t *out)
+{
+    exec_status_t status = EXEC_FAILED;
+    byte_buf_t *head = &capture->head;
+    size_t first = 0;
+
+    if (0 != capture->ring_used)
+    {
+        ASSERT_RET_EQ(FILE_OK, byte_buf_reserve(head, capture->ring_used), cleanup, "byte_buf_reserve failed");
+
+        // a ring that never wrapped starts at 0
+        first = (capture->ring_used < capture->tail_cap) ? 0 : capture->ring_pos;
+        memcpy(head->data + head->size, capture->ring.data + first, capture->ring_used - first);
+        memcpy(head->data + head->size + capture->ring_used - first, capture->ring.data, first);
+        head->size += capture->ring_used;
     }
 
+    // OK to cast from uint8_t* to char *
+    out->buf = (char *)byte_buf_detach(head, &out->size);
+    out->total = capture->total;
+
     status = EXEC_OK;
 cleanup:
+    byte_buf_release(&capture->ring);
     return status;
 }
 
@@ -99,6 +314,8 @@ static exec_status_t check_executable_access(const char *path)
 
     ASSERT_RET_NE(NULL, path, cleanup, "invalid path: NULL");
 
+    // a missing or non executable path is the caller's error, not ours
+    status = EXEC_INACCESSIBLE;
     ret = access(path, X_OK);
     ASSERT_RET_EQ(0, ret, cleanup, "access(%s, X_OK) failed: %s", path, strerror(errno));
 
@@ -106,7 +323,6 @@ static exec_status_t check_executable_access(const char *path)
     ASSERT_RET_EQ(0, ret, cleanup, "stat(%s) failed: %s", path, strerror(errno));
 
     if (!S_ISREG(st.st_mode)) {
-        status = EXEC_INACCESSIBLE;
         goto cleanup;
     }
 
@@ -116,37 +332,17 @@ cleanup:
     return status;
 }
 
-exec_status_t exec_run(const char *path,
-                       char ** args,
-                       size_t *out_stdout_size,
-                       char **out_stdout,
-                       size_t *out_stderr_size,
-                       char **out_stderr,
-                       int *out_exit_code,
-                       unsigned int timeout_ms)
+/*
+ * Launches `path` with the selected backend, handing back the read ends of its stdout and stderr pipes.
+ */
+static exec_status_t exec_start(const char *path, char **args, pid_t *out_pid, int out_pipes[SLOT_CHILD])
 {
     exec_status_t status = EXEC_FAILED;
     exec_status_t access_status = EXEC_FAILED;
-
     int stdout_pipe[PIPE_SIZE] = { -1, -1 };
     int stderr_pipe[PIPE_SIZE] = { -1, -1 };
     pid_t pid = -1;
-    int wstatus = 0;
 
-
-    uint8_t *stdout_buf = NULL;
-    uint8_t *stderr_buf = NULL;
-
-    file_status_t file_status = FILE_FAILED;
-
-    ASSERT_NOT_NULL(path, cleanup, "path is NULL");
-    ASSERT_NOT_NULL(args, cleanup, "args is NULL");
-    ASSERT_NOT_NULL(out_stdout_size, cleanup, "out_stdout_size is NULL");
-    ASSERT_NOT_NULL(out_stdout, cleanup, "out_stdout is NULL");
-    ASSERT_NOT_NULL(out_stderr_size, cleanup, "out_stderr_size is NULL");
-    ASSERT_NOT_NULL(out_stderr, cleanup, "out_stderr is NULL");
-    ASSERT_NOT_NULL(out_exit_code, cleanup, "out_exit_code is NULL");
-    
     access_status = check_executable_access(path);
     if (EXEC_INACCESSIBLE == access_status)
     {
@@ -154,59 +350,528 @@ exec_status_t exec_run(const char *path,
     }
     ASSERT_RET_EQ(EXEC_OK, access_status, cleanup, "check_executable_access failed");
 
-    INFO("Creating stdout and stderr pipes");
-    ASSERT_RET_EQ(0, pipe(stdout_pipe), cleanup, "pipe stdout failed: %s", strerror(errno));
-    ASSERT_RET_EQ(0, pipe(stderr_pipe), cleanup, "pipe stderr failed: %s", strerror(errno));
+    DEBUG("Creating stdout and stderr pipes");
+    ASSERT_RET_EQ(0, pipe2(stdout_pipe, O_CLOEXEC), cleanup, "pipe stdout failed: %s", strerror(errno));
+    ASSERT_RET_EQ(0, pipe2(stderr_pipe, O_CLOEXEC), cleanup, "pipe stderr failed: %s", strerror(errno));
 
-    INFO("Forking process to exec: %s", path);
-    pid = fork();
-    ASSERT_RET_NE(-1, pid, cleanup, "fork failed: %s", strerror(errno));
+    if (EXEC_BACKEND_SPAWN == g_exec_backend)
+    {
+        DEBUG("Spawning process to exec: %s", path);
+        status = spawn_child(stdout_pipe, stderr_pipe, path, args, &pid);
+        ASSERT_RET_EQ(EXEC_OK, status, cleanup, "spawn_child failed");
+        status = EXEC_FAILED;
+    }
+    else
+    {
+        DEBUG("Forking process to exec: %s", path);
+        pid = fork();
+        ASSERT_RET_NE(-1, pid, cleanup, "fork failed: %s", strerror(errno));
 
-    if (0 == pid) {
-        exec_child(stdout_pipe, stderr_pipe, path, args); /* never returns */
+        if (0 == pid) {
+            exec_child(stdout_pipe, stderr_pipe, path, args); /* never returns */
+        }
     }
 
     /* parent */
-    close(stdout_pipe[PIPE_WRITE]);
-    stdout_pipe[PIPE_WRITE] = -1;
-    close(stderr_pipe[PIPE_WRITE]);
-    stderr_pipe[PIPE_WRITE] = -1;
+    *out_pid = pid;
+    out_pipes[SLOT_STDOUT] = stdout_pipe[PIPE_READ];
+    out_pipes[SLOT_STDERR] = stderr_pipe[PIPE_READ];
+    stdout_pipe[PIPE_READ] = -1;
+    stderr_pipe[PIPE_READ] = -1;
+
+    status = EXEC_OK;
+cleanup:
+    for (int i = PIPE_READ; i < PIPE_SIZE; ++i)
+    {
+        if (-1 != stdout_pipe[i]) {
+            close(stdout_pipe[i]);
+        }
+        if (-1 != stderr_pipe[i]) {
+            close(stderr_pipe[i]);
+        }
+    }
+    return status;
+}
 
+void exec_set_backend(exec_backend_t backend)
+{
+    g_exec_backend = backend;
+}
 
-    INFO("Waiting for child process to finish");
-    if (EXEC_TIMEOUT == exec_wait_child(pid, timeout_ms, &wstatus)) {
-        status = EXEC_TIMEOUT;
-        goto cleanup;
+
+static void job_close_pipe(exec_pipe_t *pipe)
+{
+    reactor_remove(pipe->source);
+    pipe->source = NULL;
+    if (-1 != pipe->fd)
+    {
+        close(pipe->fd);
+        pipe->fd = -1;
     }
+}
+
+/* Reports the result once the child was reaped and both pipes are closed. */
+static void job_finish(exec_job_t *job)
+{
+    int exit_code = -1;
 
-    INFO("Reading stdout from child");
-    file_status = read_until_eof(stdout_pipe[PIPE_READ], &stdout_buf, out_stdout_size);
-    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "read stdout failed: %d", file_status);
+    reactor_remove(job->child);
+    reactor_remove(job->deadline);
+    job_close_pipe(&job->pipes[SLOT_STDOUT]);
+    job_close_pipe(&job->pipes[SLOT_STDERR]);
 
-    INFO("Reading stderr from child");
-    file_status = read_until_eof(stderr_pipe[PIPE_READ], &stderr_buf, out_stderr_size);
-    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "read stderr failed: %d", file_status);
+    if (EXEC_OK == job->status && 0 != WIFEXITED(job->wstatus))
+    {
+        exit_code = WEXITSTATUS(job->wstatus);
+    }
 
-    *out_exit_code = (0 != WIFEXITED(wstatus)) ? WEXITSTATUS(wstatus) : -1;
+    job->on_exit(job->ctx, job->status, exit_code);
+    free(job);
+}
 
-    // OK to cast from uint8_t* to char *
-    *out_stdout = (char *)stdout_buf;
-    *out_stderr = (char *)stderr_buf;
-    stdout_buf = NULL;
-    stderr_buf = NULL;
+static void job_check_done(exec_job_t *job)
+{
+    if (0 != job->exited && -1 == job->pipes[SLOT_STDOUT].fd && -1 == job->pipes[SLOT_STDERR].fd)
+    {
+        job_finish(job);
+    }
+}
+
+/* Kills the child and drops its output, the job finishes once the child is reaped. */
+static void job_abort(exec_job_t *job, exec_status_t status)
+{
+    if (EXEC_OK == job->status)
+    {
+        job->status = status;
+    }
+
+    if (0 == job->exited && -1 == kill(job->pid, SIGKILL))
+    {
+        INFO("kill failed: %s", strerror(errno));
+    }
+
+    job_close_pipe(&job->pipes[SLOT_STDOUT]);
+    job_close_pipe(&job->pipes[SLOT_STDERR]);
+
+    // already reaped, nothing else would wake the job up before its deadline
+    if (0 != job->exited && REACTOR_OK != reactor_timer_arm(job->deadline, 1, 0))
+    {
+        INFO("reactor_timer_arm failed");
+    }
+}
+
+/*
+ * Aborts the job and waits for the child right away, for a reactor that
+ * won't run again. The job is finished and gone afterwards.
+ */
+static void job_reap(exec_job_t *job)
+{
+    job_abort(job, EXEC_FAILED);
+
+    if (0 == job->exited)
+    {
+        if (-1 == waitpid(job->pid, &job->wstatus, 0))
+        {
+            INFO("waitpid failed: %s", strerror(errno));
+        }
+        job->exited = 1;
+    }
+
+    job_finish(job);
+}
+
+static void job_on_pipe(void *ctx, uint32_t events)
+{
+    exec_pipe_t *pipe = ctx;
+    exec_job_t *job = pipe->job;
+    exec_status_t status = EXEC_FAILED;
+    int available = 0;
+
+    (void)events;
+
+    ASSERT_RET_NE(-1, ioctl(pipe->fd, FIONREAD, &available), cleanup, "FIONREAD failed: %s", strerror(errno));
+
+    // readable with nothing buffered means the write end is gone
+    if (0 == available)
+    {
+        job_close_pipe(pipe);
+        job_check_done(job);
+        return;
+    }
+
+    status = job->on_output(job->ctx, pipe->stream, pipe->fd, (size_t)available);
+    ASSERT_RET_EQ(EXEC_OK, status, cleanup, "output callback failed");
+    return;
+
+cleanup:
+    job_abort(job, EXEC_FAILED);
+    job_check_done(job);
+}
+
+static void job_on_child(void *ctx, uint32_t events)
+{
+    exec_job_t *job = ctx;
+    pid_t ret = -1;
+
+    (void)events;
 
+    ret = waitpid(job->pid, &job->wstatus, WNOHANG);
+    if (0 == ret)
+    {
+        return;
+    }
+
+    if (-1 == ret)
+    {
+        // nothing left to wait for either way
+        INFO("waitpid failed: %s", strerror(errno));
+        job->status = EXEC_FAILED;
+    }
+
+    job->exited = 1;
+    reactor_remove(job->child);
+    job->child = NULL;
+    job_check_done(job);
+}
+
+static void job_on_deadline(void *ctx, uint32_t events)
+{
+    exec_job_t *job = ctx;
+
+    (void)events;
+
+    if (0 != job->exited)
+    {
+        // the child is gone but something it spawned may still hold the pipes,
+        // what was read until the deadline is all we get
+        job_finish(job);
+        return;
+    }
+
+    INFO("Timeout reached, killing child process");
+    job_abort(job, EXEC_TIMEOUT);
+}
+
+exec_status_t exec_start_stream(reactor_t *reactor,
+                                const char *path,
+                                char **args,
+                                exec_output_cb_t on_output,
+                                exec_exit_cb_t on_exit,
+                                void *ctx,
+                                unsigned int timeout_ms,
+                                exec_job_t **out_job)
+{
+    exec_status_t status = EXEC_FAILED;
+    exec_job_t *job = NULL;
+    int pipes[SLOT_CHILD] = { -1, -1 };
+    int registered = 0;
+
+    ASSERT_NOT_NULL(reactor, cleanup, "reactor is NULL");
+    ASSERT_NOT_NULL(path, cleanup, "path is NULL");
+    ASSERT_NOT_NULL(args, cleanup, "args is NULL");
+    ASSERT_NOT_NULL(on_output, cleanup, "on_output is NULL");
+    ASSERT_NOT_NULL(on_exit, cleanup, "on_exit is NULL");
+
+    job = calloc(1, sizeof(*job));
+    ASSERT_NOT_NULL(job, cleanup, "calloc failed: %s", strerror(errno));
+
+    job->on_output = on_output;
+    job->on_exit = on_exit;
+    job->ctx = ctx;
+    job->status = EXEC_OK;
+    for (int i = SLOT_STDOUT; i <= SLOT_STDERR; ++i)
+    {
+        job->pipes[i].job = job;
+        job->pipes[i].stream = (exec_stream_t)i;
+        job->pipes[i].fd = -1;
+    }
+
+    status = exec_start(path, args, &job->pid, pipes);
+    if (EXEC_OK != status)
+    {
+        goto cleanup;
+    }
+
+    status = EXEC_FAILED;
+    for (int i = SLOT_STDOUT; i <= SLOT_STDERR; ++i)
+    {
+        job->pipes[i].fd = pipes[i];
+        pipes[i] = -1;
+    }
+
+    DEBUG("Supervising child process");
+    registered = (REACTOR_OK == reactor_add_fd(reactor, job->pipes[SLOT_STDOUT].fd, REACTOR_READ, job_on_pipe,
+                                               &job->pipes[SLOT_STDOUT], &job->pipes[SLOT_STDOUT].source));
+    registered = registered && (REACTOR_OK == reactor_add_fd(reactor, job->pipes[SLOT_STDERR].fd, REACTOR_READ,
+                                                             job_on_pipe, &job->pipes[SLOT_STDERR],
+                                                             &job->pipes[SLOT_STDERR].source));
+    registered = registered && (REACTOR_OK == reactor_add_child(reactor, job->pid, job_on_child, job, &job->child));
+    registered = registered && (REACTOR_OK == reactor_add_timer(reactor, job_on_deadline, job, &job->deadline));
+    // a 0 ms timeout still has to fire, a 0 delay would disarm the timer
+    registered = registered && (REACTOR_OK == reactor_timer_arm(job->deadline, (0 != timeout_ms) ? timeout_ms : 1, 0));
+    if (!registered)
+    {
+        // nobody would ever reap it
+        (void)kill(job->pid, SIGKILL);
+        (void)waitpid(job->pid, NULL, 0);
+        ERROR(cleanup, "couldn't register the child with the reactor");
+    }
+
+    if (NULL != out_job)
+    {
+        *out_job = job;
+    }
+    job = NULL;
     status = EXEC_OK;
 
 cleanup:
-    if (-1 != stdout_pipe[PIPE_READ]) {
-        close(stdout_pipe[PIPE_READ]);
+    if (NULL != job)
+    {
+        reactor_remove(job->child);
+        reactor_remove(job->deadline);
+        job_close_pipe(&job->pipes[SLOT_STDOUT]);
+        job_close_pipe(&job->pipes[SLOT_STDERR]);
+        free(job);
+    }
+    return status;
+}
+
+static void capped_exit(void *ctx, exec_status_t status, int exit_code)
+{
+    exec_capped_t *capped = ctx;
+    exec_output_t outputs[SLOT_CHILD] = {0};
+
+    if (EXEC_OK == status && EXEC_OK != capture_finish(&capped->captures[SLOT_STDOUT], &outputs[SLOT_STDOUT]))
+    {
+        status = EXEC_FAILED;
+    }
+    if (EXEC_OK == status && EXEC_OK != capture_finish(&capped->captures[SLOT_STDERR], &outputs[SLOT_STDERR]))
+    {
+        free(outputs[SLOT_STDOUT].buf);
+        memset(&outputs[SLOT_STDOUT], 0, sizeof(outputs[SLOT_STDOUT]));
+        status = EXEC_FAILED;
+    }
+
+    for (int i = SLOT_STDOUT; i <= SLOT_STDERR; ++i)
+    {
+        byte_buf_release(&capped->captures[i].head);
+        byte_buf_release(&capped->captures[i].ring);
+    }
+
+    capped->on_done(capped->ctx, status, &outputs[SLOT_STDOUT], &outputs[SLOT_STDERR], exit_code);
+    free(capped);
+}
+
+exec_status_t exec_start_capped(reactor_t *reactor,
+                                const char *path,
+                                char **args,
+                                const exec_limits_t *limits,
+                                exec_capped_cb_t on_done,
+                                void *ctx,
+                                unsigned int timeout_ms,
+                                exec_job_t **out_job)
+{
+    exec_status_t status = EXEC_FAILED;
+    exec_capped_t *capped = NULL;
+
+    ASSERT_NOT_NULL(limits, cleanup, "limits is NULL");
+    ASSERT_NOT_NULL(on_done, cleanup, "on_done is NULL");
+
+    capped = calloc(1, sizeof(*capped));
+    ASSERT_NOT_NULL(capped, cleanup, "calloc failed: %s", strerror(errno));
+
+    capped->on_done = on_done;
+    capped->ctx = ctx;
+    for (int i = SLOT_STDOUT; i <= SLOT_STDERR; ++i)
+    {
+        capped->captures[i].head_cap = limits->head;
+        capped->captures[i].tail_cap = limits->tail;
+        // the final append of the ring may still go past the head's limit
+        capped->captures[i].head.limit = limits->head;
+        capped->captures[i].ring.limit = limits->tail;
+    }
+
+    status = exec_start_stream(reactor, path, args, capture_output, capped_exit, capped, timeout_ms, out_job);
+    if (EXEC_OK != status)
+    {
+        goto cleanup;
+    }
+
+    // owned by the job now
+    capped = NULL;
+
+cleanup:
+    if (NULL != capped)
+    {
+        for (int i = SLOT_STDOUT; i <= SLOT_STDERR; ++i)
+        {
+            byte_buf_release(&capped->captures[i].head);
+            byte_buf_release(&capped->captures[i].ring);
+        }
+        free(capped);
+    }
+    return status;
+}
+
+void exec_cancel(exec_job_t *job)
+{
+    if (NULL != job)
+    {
+        job_abort(job, EXEC_FAILED);
+    }
+}
+
+static exec_status_t sync_output(void *ctx, exec_stream_t stream, int fd, size_t available)
+{
+    exec_sync_t *sync = ctx;
+
+    return sync->on_output(sync->ctx, stream, fd, available);
+}
+
+static void sync_exit(void *ctx, exec_status_t status, int exit_code)
+{
+    exec_sync_t *sync = ctx;
+
+    sync->job = NULL;
+    sync->status = status;
+    sync->exit_code = exit_code;
+    reactor_stop(sync->reactor);
+}
+
+static void sync_capped_done(void *ctx, exec_status_t status, exec_output_t *out_stdout,
+                             exec_output_t *out_stderr, int exit_code)
+{
+    exec_sync_t *sync = ctx;
+
+    sync->outputs[SLOT_STDOUT] = *out_stdout;
+    sync->outputs[SLOT_STDERR] = *out_stderr;
+    sync_exit(ctx, status, exit_code);
+}
+
+/* Runs the job started on sync->reactor to completion. */
+static exec_status_t sync_wait(exec_sync_t *sync)
+{
+    exec_status_t status = EXEC_FAILED;
+
+    sync->status = EXEC_FAILED;
+    ASSERT_RET_EQ(REACTOR_OK, reactor_run(sync->reactor), cleanup, "reactor_run failed");
+
+    status = sync->status;
+cleanup:
+    // the loop is about to go, the child must not outlive it unreaped
+    if (NULL != sync->job)
+    {
+        job_reap(sync->job);
+        status = EXEC_FAILED;
+    }
+    return status;
+}
+
+exec_status_t exec_run_stream(const char *path,
+                              char **args,
+                              exec_output_cb_t on_output,
+                              void *ctx,
+                              int *out_exit_code,
+                              unsigned int timeout_ms)
+{
+    exec_status_t status = EXEC_FAILED;
+    exec_sync_t sync = {0};
+
+    ASSERT_NOT_NULL(on_output, cleanup, "on_output is NULL");
+    ASSERT_NOT_NULL(out_exit_code, cleanup, "out_exit_code is NULL");
+
+    // a private loop, so blocking callers (e.g. worker threads) run children the same way
+    ASSERT_RET_EQ(REACTOR_OK, reactor_create(&sync.reactor), cleanup, "reactor_create failed");
+    sync.on_output = on_output;
+    sync.ctx = ctx;
+
+    status = exec_start_stream(sync.reactor, path, args, sync_output, sync_exit, &sync, timeout_ms, &sync.job);
+    if (EXEC_OK != status)
+    {
+        goto cleanup;
+    }
+
+    status = sync_wait(&sync);
+    if (EXEC_OK != status)
+    {
+        goto cleanup;
+    }
+
+    *out_exit_code = sync.exit_code;
+
+cleanup:
+    reactor_destroy(sync.reactor);
+    return status;
+}
+
+exec_status_t exec_run_capped(const char *path,
+                              char **args,
+                              const exec_limits_t *limits,
+                              exec_output_t *out_stdout,
+                              exec_output_t *out_stderr,
+                              int *out_exit_code,
+                              unsigned int timeout_ms)
+{
+    exec_status_t status = EXEC_FAILED;
+    exec_sync_t sync = {0};
+
+    ASSERT_NOT_NULL(out_stdout, cleanup, "out_stdout is NULL");
+    ASSERT_NOT_NULL(out_stderr, cleanup, "out_stderr is NULL");
+    ASSERT_NOT_NULL(out_exit_code, cleanup, "out_exit_code is NULL");
+
+    ASSERT_RET_EQ(REACTOR_OK, reactor_create(&sync.reactor), cleanup, "reactor_create failed");
+
+    status = exec_start_capped(sync.reactor, path, args, limits, sync_capped_done, &sync, timeout_ms, &sync.job);
+    if (EXEC_OK != status)
+    {
+        goto cleanup;
+    }
+
+    status = sync_wait(&sync);
+    if (EXEC_OK != status)
+    {
+        goto cleanup;
     }
-    if (-1 != stderr_pipe[PIPE_READ]) {
-        close(stderr_pipe[PIPE_READ]);
+
+    *out_stdout = sync.outputs[SLOT_STDOUT];
+    *out_stderr = sync.outputs[SLOT_STDERR];
+    *out_exit_code = sync.exit_code;
+
+cleanup:
+    reactor_destroy(sync.reactor);
+    return status;
+}
+
+exec_status_t exec_run(const char *path,
+                       char ** args,
+                       size_t *out_stdout_size,
+                       char **out_stdout,
+                       size_t *out_stderr_size,
+                       char **out_stderr,
+                       int *out_exit_code,
+                       unsigned int timeout_ms)
+{
+    exec_status_t status = EXEC_FAILED;
+    exec_limits_t limits = { .head = EXEC_UNLIMITED, .tail = 0 };
+    exec_output_t outputs[SLOT_CHILD] = {0};
+
+    ASSERT_NOT_NULL(out_stdout_size, cleanup, "out_stdout_size is NULL");
+    ASSERT_NOT_NULL(out_stdout, cleanup, "out_stdout is NULL");
+    ASSERT_NOT_NULL(out_stderr_size, cleanup, "out_stderr_size is NULL");
+    ASSERT_NOT_NULL(out_stderr, cleanup, "out_stderr is NULL");
+
+    status = exec_run_capped(path, args, &limits, &outputs[SLOT_STDOUT], &outputs[SLOT_STDERR],
+                             out_exit_code, timeout_ms);
+    if (EXEC_OK != status)
+    {
+        goto cleanup;
     }
 
-    free(stdout_buf);
-    free(stderr_buf);
+    *out_stdout = outputs[SLOT_STDOUT].buf;
+    *out_stdout_size = outputs[SLOT_STDOUT].size;
+    *out_stderr = outputs[SLOT_STDERR].buf;
+    *out_stderr_size = outputs[SLOT_STDERR].size;
 
+cleanup:
     return status;
 }
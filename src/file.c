@@ -3,6 +3,9 @@
  * description: Implementation of minimal I/O helper functions.
  */
 
+// needed for splice and pipe2
+#define _GNU_SOURCE
+
 // C includes
 #include <stdlib.h>
 #include <errno.h>
@@ -10,7 +13,13 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 // User includes
 #include "file.h"
@@ -18,6 +27,63 @@
 
 // Defines
 #define READ_CHUNK_SIZE 4096
+#define COPY_CHUNK_SIZE (64 * 1024)
+
+// build with -DFILE_DEFAULT_BACKEND=FILE_BACKEND_POSIX to never try io_uring
+#ifndef FILE_DEFAULT_BACKEND
+#define FILE_DEFAULT_BACKEND FILE_BACKEND_URING
+#endif
+
+typedef enum uring_support_e
+{
+    URING_UNKNOWN = 0,
+    URING_AVAILABLE,
+    URING_UNAVAILABLE,
+} uring_support_t;
+
+/* Userspace side of an io_uring, mapped the way io_uring_setup(2) describes. */
+typedef struct uring_s
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;          // same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+struct file_batch_s
+{
+    uring_t ring;           // fd is -1 when reads fall back to pread
+    file_read_t *reads;     // the reads of the last submit
+    size_t count;
+    size_t in_flight;       // completions the ring still owes
+    size_t to_submit;       // queued entries io_uring_enter hasn't taken yet
+};
+
+static file_backend_t g_file_backend = FILE_DEFAULT_BACKEND;
+// batches are created from concurrent mux workers
+static _Atomic uring_support_t g_uring_support = URING_UNKNOWN;
+
+typedef struct pooled_buf_s
+{
+    uint8_t *data;
+    size_t capacity;
+} pooled_buf_t;
+
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pooled_buf_t g_pool[BYTE_BUF_POOL_SIZE];
+static size_t g_pool_count = 0;
 
 file_status_t read_partial(int fd, uint8_t *buffer, size_t requested_count, size_t *out_bytes_read)
 {
@@ -80,7 +146,7 @@ file_status_t read_all(int fd, uint8_t *buffer, size_t total_count)
 
         if (0 == chunk)
 	{
-            INFO("EOF reached before full read");
+            DEBUG("EOF reached before full read");
             status = FILE_EOF;
             goto cleanup;
         }
@@ -112,76 +178,515 @@ cleanup:
     return status;
 }
 
-file_status_t read_until_eof(int fd, uint8_t **out_buffer, size_t *out_bytes_read)
+file_status_t write_vec_all(int fd, struct iovec *iov, int iovcnt)
 {
     file_status_t status = FILE_FAILED;
-    uint8_t *buffer = NULL;
-    uint8_t *tmp = NULL;
-    size_t capacity = 0;
-    size_t total_read = 0;
-    size_t chunk = 0;
-    size_t new_capacity = 0;
+    ssize_t sys_bytes = -1;
 
-    ASSERT_NOT_NULL(out_buffer, cleanup, "out_buffer is NULL");
+    ASSERT_NOT_NULL(iov, cleanup, "iov is NULL");
+
+    while (iovcnt > 0)
+    {
+        if (0 == iov->iov_len)
+        {
+            ++iov;
+            --iovcnt;
+            continue;
+        }
+
+        do {
+            sys_bytes = writev(fd, iov, iovcnt);
+        } while (-1 == sys_bytes && (EINTR == errno || EAGAIN == errno));
+
+        ASSERT_RET_NE(-1, sys_bytes, cleanup, "writev() failed: %s", strerror(errno));
+
+        // step over what went out, a short write leaves us mid entry
+        while (sys_bytes > 0)
+        {
+            if ((size_t)sys_bytes >= iov->iov_len)
+            {
+                sys_bytes -= (ssize_t)iov->iov_len;
+                iov->iov_len = 0;
+                ++iov;
+                --iovcnt;
+            }
+            else
+            {
+                iov->iov_base = (uint8_t *)iov->iov_base + sys_bytes;
+                iov->iov_len -= (size_t)sys_bytes;
+                sys_bytes = 0;
+            }
+        }
+    }
+
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+file_status_t read_partial_at(int fd, uint8_t *buffer, size_t requested_count, uint64_t offset, size_t *out_bytes_read)
+{
+    file_status_t status = FILE_FAILED;
+    ssize_t sys_bytes = -1;
+
+    ASSERT_NOT_NULL(buffer, cleanup, "buffer is NULL");
     ASSERT_NOT_NULL(out_bytes_read, cleanup, "out_bytes_read is NULL");
 
-    *out_buffer = NULL;
     *out_bytes_read = 0;
 
-    capacity = READ_CHUNK_SIZE;
-    buffer = malloc(capacity);
-    ASSERT_NOT_NULL(buffer, cleanup, "malloc failed, %s", strerror(errno));
+    if (offset > INT64_MAX)
+    {
+        ERROR(cleanup, "offset too large");
+    }
 
-    while (1)
+    do {
+        sys_bytes = pread(fd, buffer, requested_count, (off_t)offset);
+    } while (-1 == sys_bytes && (EINTR == errno || EAGAIN == errno));
+
+    ASSERT_RET_NE(-1, sys_bytes, cleanup, "pread() failed: %s", strerror(errno));
+
+    *out_bytes_read = (size_t)sys_bytes;
+    status = FILE_OK;
+
+cleanup:
+    return status;
+}
+
+/*
+ * Kernel side transfer helpers for send_file_all/send_file_range.
+ * `offset` is NULL to use (and advance) the descriptor's own position,
+ * otherwise reading starts there and `*offset` is advanced instead.
+ * Each returns FILE_UNSUPPORTED when the kernel refuses the descriptors
+ * before anything was moved, so the caller can try the next method.
+ */
+static file_status_t sendfile_all(int out_fd, int in_fd, off_t *offset, size_t total_count, size_t *out_total_sent)
+{
+    file_status_t status = FILE_FAILED;
+    ssize_t sys_bytes = -1;
+
+    while (*out_total_sent < total_count)
     {
-        if (capacity - total_read < READ_CHUNK_SIZE)
-	{
-	    if (capacity > SIZE_MAX - READ_CHUNK_SIZE)
-	    {
-		ERROR(cleanup, "too many bytes to read! couldn't reach EOF");
-	    }
+        do {
+            sys_bytes = sendfile(out_fd, in_fd, offset, total_count - *out_total_sent);
+        } while (-1 == sys_bytes && (EINTR == errno || EAGAIN == errno));
 
-            new_capacity = capacity + READ_CHUNK_SIZE;
+        if (-1 == sys_bytes && 0 == *out_total_sent && (EINVAL == errno || ENOSYS == errno))
+        {
+            status = FILE_UNSUPPORTED;
+            goto cleanup;
+        }
+        ASSERT_RET_NE(-1, sys_bytes, cleanup, "sendfile() failed: %s", strerror(errno));
 
-            tmp = realloc(buffer, new_capacity);
-            ASSERT_NOT_NULL(tmp, cleanup, "realloc failed: %s", strerror(errno));
+        if (0 == sys_bytes)
+        {
+            status = FILE_EOF;
+            goto cleanup;
+        }
+        *out_total_sent += (size_t)sys_bytes;
+    }
 
-            buffer = tmp;
-            capacity = new_capacity;
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+static file_status_t splice_all(int out_fd, int in_fd, off_t *offset, size_t total_count, size_t *out_total_sent)
+{
+    file_status_t status = FILE_FAILED;
+    loff_t splice_offset = (NULL != offset) ? *offset : 0;
+    int pipe_fds[2] = { -1, -1 };
+    ssize_t in_pipe = 0;
+    ssize_t sys_bytes = -1;
+
+    // splice needs a pipe on one side, so route the data through one
+    ASSERT_RET_EQ(0, pipe2(pipe_fds, O_CLOEXEC), cleanup, "pipe2 failed: %s", strerror(errno));
+
+    while (*out_total_sent < total_count)
+    {
+        do {
+            in_pipe = splice(in_fd, (NULL != offset) ? &splice_offset : NULL, pipe_fds[1], NULL,
+                             total_count - *out_total_sent, SPLICE_F_MOVE);
+        } while (-1 == in_pipe && (EINTR == errno || EAGAIN == errno));
+
+        if (-1 == in_pipe && 0 == *out_total_sent && EINVAL == errno)
+        {
+            status = FILE_UNSUPPORTED;
+            goto cleanup;
         }
+        ASSERT_RET_NE(-1, in_pipe, cleanup, "splice() in failed: %s", strerror(errno));
 
-        status = read_partial(fd, buffer + total_read, READ_CHUNK_SIZE, &chunk);
-        ASSERT_RET_EQ(FILE_OK, status, cleanup, "read_partial failed");
+        if (0 == in_pipe)
+        {
+            status = FILE_EOF;
+            goto cleanup;
+        }
+
+        while (in_pipe > 0)
+        {
+            do {
+                sys_bytes = splice(pipe_fds[0], NULL, out_fd, NULL, (size_t)in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            } while (-1 == sys_bytes && (EINTR == errno || EAGAIN == errno));
+
+            ASSERT_RET_NE(-1, sys_bytes, cleanup, "splice() out failed: %s", strerror(errno));
+            in_pipe -= sys_bytes;
+            *out_total_sent += (size_t)sys_bytes;
+        }
+    }
+
+    status = FILE_OK;
+cleanup:
+    if (NULL != offset)
+    {
+        *offset = splice_offset;
+    }
+    if (-1 != pipe_fds[0])
+    {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    return status;
+}
+
+static file_status_t copy_all(int out_fd, int in_fd, off_t *offset, size_t total_count, size_t *out_total_sent)
+{
+    file_status_t status = FILE_FAILED;
+    uint8_t buffer[COPY_CHUNK_SIZE];
+    size_t chunk = 0;
+    size_t requested = 0;
+
+    while (*out_total_sent < total_count)
+    {
+        requested = total_count - *out_total_sent;
+        if (requested > sizeof(buffer))
+        {
+            requested = sizeof(buffer);
+        }
+
+        if (NULL != offset)
+        {
+            status = read_partial_at(in_fd, buffer, requested, (uint64_t)*offset, &chunk);
+        }
+        else
+        {
+            status = read_partial(in_fd, buffer, requested, &chunk);
+        }
+        ASSERT_RET_EQ(FILE_OK, status, cleanup, "read failed");
 
         if (0 == chunk)
-	{
-            INFO("EOF reached");
-            break;
+        {
+            status = FILE_EOF;
+            goto cleanup;
         }
-        total_read += chunk;
+
+        status = write_all(out_fd, buffer, chunk);
+        ASSERT_RET_EQ(FILE_OK, status, cleanup, "write_all failed");
+        *out_total_sent += chunk;
+        if (NULL != offset)
+        {
+            *offset += (off_t)chunk;
+        }
+    }
+
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+static file_status_t transfer_all(int out_fd, int in_fd, off_t *offset, size_t total_count, size_t *out_bytes_sent)
+{
+    file_status_t status = FILE_FAILED;
+    size_t total_sent = 0;
+
+    status = sendfile_all(out_fd, in_fd, offset, total_count, &total_sent);
+    if (FILE_UNSUPPORTED == status)
+    {
+        INFO("sendfile unsupported, falling back to splice");
+        status = splice_all(out_fd, in_fd, offset, total_count, &total_sent);
+    }
+    if (FILE_UNSUPPORTED == status)
+    {
+        INFO("splice unsupported, falling back to read/write");
+        status = copy_all(out_fd, in_fd, offset, total_count, &total_sent);
     }
 
-    if (total_read > 0)
+    if (NULL != out_bytes_sent)
     {
-        tmp = realloc(buffer, total_read);
-        ASSERT_NOT_NULL(tmp, cleanup, "realloc failed: %s", strerror(errno));
-        buffer = tmp;
+        *out_bytes_sent = total_sent;
+    }
+    return status;
+}
+
+file_status_t send_file_all(int out_fd, int in_fd, size_t total_count, size_t *out_bytes_sent)
+{
+    return transfer_all(out_fd, in_fd, NULL, total_count, out_bytes_sent);
+}
+
+file_status_t send_file_range(int out_fd, int in_fd, uint64_t offset, size_t total_count, size_t *out_bytes_sent)
+{
+    file_status_t status = FILE_FAILED;
+    off_t position = 0;
+
+    if (offset > INT64_MAX)
+    {
+        ERROR(cleanup, "offset too large");
+    }
+
+    position = (off_t)offset;
+    status = transfer_all(out_fd, in_fd, &position, total_count, out_bytes_sent);
+cleanup:
+    return status;
+}
+
+file_status_t send_pipe_all(int out_fd, int pipe_fd, size_t total_count)
+{
+    file_status_t status = FILE_FAILED;
+    size_t total_sent = 0;
+    ssize_t sys_bytes = -1;
+
+    while (total_sent < total_count)
+    {
+        do {
+            sys_bytes = splice(pipe_fd, NULL, out_fd, NULL, total_count - total_sent, SPLICE_F_MOVE);
+        } while (-1 == sys_bytes && (EINTR == errno || EAGAIN == errno));
+
+        if (-1 == sys_bytes && 0 == total_sent && EINVAL == errno)
+        {
+            INFO("splice unsupported, falling back to read/write");
+            status = copy_all(out_fd, pipe_fd, NULL, total_count, &total_sent);
+            goto cleanup;
+        }
+        ASSERT_RET_NE(-1, sys_bytes, cleanup, "splice() failed: %s", strerror(errno));
+
+        if (0 == sys_bytes)
+        {
+            status = FILE_EOF;
+            goto cleanup;
+        }
+        total_sent += (size_t)sys_bytes;
+    }
+
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+/* Takes the smallest pooled buffer of at least `min_capacity` bytes, NULL if none fits. */
+static uint8_t *pool_take(size_t min_capacity, size_t *out_capacity)
+{
+    uint8_t *data = NULL;
+    size_t best = 0;
+
+    pthread_mutex_lock(&g_pool_lock);
+    best = g_pool_count;
+    for (size_t i = 0; i < g_pool_count; ++i)
+    {
+        if (g_pool[i].capacity >= min_capacity &&
+            (best == g_pool_count || g_pool[i].capacity < g_pool[best].capacity))
+        {
+            best = i;
+        }
+    }
+
+    if (best != g_pool_count)
+    {
+        data = g_pool[best].data;
+        *out_capacity = g_pool[best].capacity;
+        g_pool[best] = g_pool[--g_pool_count];
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+
+    return data;
+}
+
+static void pool_give(uint8_t *data, size_t capacity)
+{
+    if (capacity <= BYTE_BUF_POOL_MAX_CAPACITY)
+    {
+        pthread_mutex_lock(&g_pool_lock);
+        if (g_pool_count < BYTE_BUF_POOL_SIZE)
+        {
+            g_pool[g_pool_count].data = data;
+            g_pool[g_pool_count].capacity = capacity;
+            ++g_pool_count;
+            data = NULL;
+        }
+        pthread_mutex_unlock(&g_pool_lock);
+    }
+
+    free(data);
+}
+
+file_status_t byte_buf_reserve(byte_buf_t *buf, size_t extra)
+{
+    file_status_t status = FILE_FAILED;
+    uint8_t *tmp = NULL;
+    size_t needed = 0;
+    size_t new_capacity = 0;
+
+    ASSERT_NOT_NULL(buf, cleanup, "buf is NULL");
+
+    if (buf->capacity - buf->size >= extra)
+    {
+        status = FILE_OK;
+        goto cleanup;
+    }
+
+    if (extra > SIZE_MAX - buf->size)
+    {
+        ERROR(cleanup, "buffer size overflow");
+    }
+    needed = buf->size + extra;
+
+    if (0 == buf->capacity)
+    {
+        new_capacity = (needed > BYTE_BUF_MIN_CAPACITY) ? needed : BYTE_BUF_MIN_CAPACITY;
     }
     else
     {
-        free(buffer);
-        buffer = NULL;
+        new_capacity = buf->capacity;
+        while (new_capacity < needed)
+        {
+            new_capacity = (new_capacity > SIZE_MAX / 2) ? needed : new_capacity * 2;
+        }
     }
 
-    *out_buffer = buffer;
-    *out_bytes_read = total_read;
-    buffer = NULL;
+    if (0 != buf->limit && new_capacity > buf->limit)
+    {
+        new_capacity = (needed > buf->limit) ? needed : buf->limit;
+    }
+
+    status = FILE_NOMEM;
+    if (NULL == buf->data)
+    {
+        buf->data = pool_take(needed, &buf->capacity);
+        if (NULL != buf->data)
+        {
+            status = FILE_OK;
+            goto cleanup;
+        }
+
+        buf->data = malloc(new_capacity);
+        ASSERT_NOT_NULL(buf->data, cleanup, "malloc failed: %s", strerror(errno));
+    }
+    else
+    {
+        tmp = realloc(buf->data, new_capacity);
+        ASSERT_NOT_NULL(tmp, cleanup, "realloc failed: %s", strerror(errno));
+        buf->data = tmp;
+    }
+    buf->capacity = new_capacity;
 
     status = FILE_OK;
 cleanup:
-    if (NULL != buffer) {
-        free(buffer);
+    return status;
+}
+
+file_status_t byte_buf_append(byte_buf_t *buf, const void *src, size_t len)
+{
+    file_status_t status = FILE_FAILED;
+
+    status = byte_buf_reserve(buf, len);
+    ASSERT_RET_EQ(FILE_OK, status, cleanup, "byte_buf_reserve failed");
+
+    if (0 != len)
+    {
+        memcpy(buf->data + buf->size, src, len);
+        buf->size += len;
     }
+
+cleanup:
+    return status;
+}
+
+uint8_t *byte_buf_detach(byte_buf_t *buf, size_t *out_size)
+{
+    uint8_t *data = NULL;
+
+    if (NULL == buf)
+    {
+        return NULL;
+    }
+
+    *out_size = buf->size;
+    if (0 == buf->size)
+    {
+        byte_buf_release(buf);
+        return NULL;
+    }
+
+    data = buf->data;
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+
+    return data;
+}
+
+void byte_buf_release(byte_buf_t *buf)
+{
+    if (NULL == buf)
+    {
+        return;
+    }
+
+    if (NULL != buf->data)
+    {
+        pool_give(buf->data, buf->capacity);
+    }
+
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+file_status_t read_until_eof(int fd, uint8_t **out_buffer, size_t *out_bytes_read)
+{
+    file_status_t status = FILE_FAILED;
+    byte_buf_t buf = {0};
+    struct stat file_stat = {0};
+    size_t hint = READ_CHUNK_SIZE;
+    size_t chunk = 0;
+
+    ASSERT_NOT_NULL(out_buffer, cleanup, "out_buffer is NULL");
+    ASSERT_NOT_NULL(out_bytes_read, cleanup, "out_bytes_read is NULL");
+
+    *out_buffer = NULL;
+    *out_bytes_read = 0;
+
+    // one byte past the size, so reaching EOF doesn't grow the buffer
+    if (0 == fstat(fd, &file_stat) && S_ISREG(file_stat.st_mode) &&
+        file_stat.st_size > 0 && (uintmax_t)file_stat.st_size < SIZE_MAX)
+    {
+        hint = (size_t)file_stat.st_size + 1;
+    }
+
+    status = byte_buf_reserve(&buf, hint);
+    ASSERT_RET_EQ(FILE_OK, status, cleanup, "byte_buf_reserve failed");
+
+    while (1)
+    {
+        if (buf.capacity == buf.size)
+        {
+            status = byte_buf_reserve(&buf, READ_CHUNK_SIZE);
+            ASSERT_RET_EQ(FILE_OK, status, cleanup, "byte_buf_reserve failed");
+        }
+
+        status = read_partial(fd, buf.data + buf.size, buf.capacity - buf.size, &chunk);
+        ASSERT_RET_EQ(FILE_OK, status, cleanup, "read_partial failed");
+
+        if (0 == chunk)
+	{
+            DEBUG("EOF reached");
+            break;
+        }
+        buf.size += chunk;
+    }
+
+    *out_buffer = byte_buf_detach(&buf, out_bytes_read);
+
+    status = FILE_OK;
+cleanup:
+    byte_buf_release(&buf);
     return status;
 }
 
@@ -190,7 +695,7 @@ file_status_t read_file(int fd, uint8_t **out_buffer, size_t *out_size)
     file_status_t status = FILE_FAILED;
     struct stat file_stat = {0};
     size_t file_size = 0;
-    uint8_t *buffer = NULL;
+    byte_buf_t buf = {0};
 
     ASSERT_NOT_NULL(out_buffer, cleanup, "out_buffer is NULL");
     ASSERT_NOT_NULL(out_size, cleanup, "out_size is NULL");
@@ -208,7 +713,7 @@ file_status_t read_file(int fd, uint8_t **out_buffer, size_t *out_size)
     }
     else if (0 == file_stat.st_size)
     {
-        INFO("file size is zero");
+        DEBUG("file size is zero");
         status = FILE_EMPTY;
         goto cleanup;
     }
@@ -216,24 +721,21 @@ file_status_t read_file(int fd, uint8_t **out_buffer, size_t *out_size)
     // now its safe to cast
     file_size = (size_t)file_stat.st_size;
 
-    buffer = malloc(file_size);
-    ASSERT_NOT_NULL(buffer, cleanup, "malloc failed: %s", strerror(errno));
+    status = byte_buf_reserve(&buf, file_size);
+    ASSERT_RET_EQ(FILE_OK, status, cleanup, "byte_buf_reserve failed");
+    status = FILE_FAILED;
 
     ASSERT_RET_NE(-1, lseek(fd, 0, SEEK_SET), cleanup, "lseek failed");
 
-    status = read_all(fd, buffer, file_size);
+    status = read_all(fd, buf.data, file_size);
     ASSERT_RET_EQ(FILE_OK, status, cleanup, "read_all failed");
+    buf.size = file_size;
 
-    *out_buffer = buffer;
-    *out_size = file_size;
-    buffer = NULL;
+    *out_buffer = byte_buf_detach(&buf, out_size);
 
     status = FILE_OK;
 cleanup:
-    if (FILE_OK != status && NULL != buffer) {
-        free(buffer);
-	buffer = NULL;
-    }
+    byte_buf_release(&buf);
     return status;
 }
 
@@ -262,3 +764,402 @@ cleanup:
     }
     return status;
 }
+
+file_status_t open_regular_file(const char *path, int *out_fd, file_info_t *out_info)
+{
+    file_status_t status = FILE_FAILED;
+    struct stat file_stat = {0};
+    int fd = -1;
+
+    ASSERT_NOT_NULL(path, cleanup, "path is NULL");
+    ASSERT_NOT_NULL(out_fd, cleanup, "out_fd is NULL");
+    ASSERT_NOT_NULL(out_info, cleanup, "out_info is NULL");
+
+    *out_fd = -1;
+    memset(out_info, 0, sizeof(*out_info));
+
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (-1 == fd)
+    {
+	status = FILE_INACCESSIBLE;
+	ERROR(cleanup, "open failed: %s", strerror(errno));
+    }
+
+    ASSERT_RET_NE(-1, fstat(fd, &file_stat), cleanup, "fstat failed: %s", strerror(errno));
+
+    if (!S_ISREG(file_stat.st_mode))
+    {
+	status = FILE_UNSUPPORTED;
+	ERROR(cleanup, "descriptor is not a regular file");
+    }
+
+    if (file_stat.st_size < 0)
+    {
+	ERROR(cleanup, "invalid file size");
+    }
+
+    *out_fd = fd;
+    out_info->size = (uint64_t)file_stat.st_size;
+    out_info->mtime_sec = (int64_t)file_stat.st_mtim.tv_sec;
+    out_info->mtime_nsec = (uint32_t)file_stat.st_mtim.tv_nsec;
+    fd = -1;
+
+    status = FILE_OK;
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    return status;
+}
+
+void file_set_backend(file_backend_t backend)
+{
+    g_file_backend = backend;
+}
+
+static void uring_destroy(uring_t *ring)
+{
+    if (NULL != ring->sqes && MAP_FAILED != (void *)ring->sqes)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (NULL != ring->cq_ring && MAP_FAILED != ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (NULL != ring->sq_ring && MAP_FAILED != ring->sq_ring)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (-1 != ring->fd)
+    {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static file_status_t uring_init(uring_t *ring, unsigned entries)
+{
+    file_status_t status = FILE_UNSUPPORTED;
+    struct io_uring_params params = {0};
+    uint8_t *sq = NULL;
+    uint8_t *cq = NULL;
+
+    memset(ring, 0, sizeof(*ring));
+
+    // glibc has no wrapper, liburing isn't worth a dependency for one ring
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (-1 == ring->fd)
+    {
+        INFO("io_uring_setup failed: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    status = FILE_FAILED;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (0 != (params.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_ring_size > ring->sq_ring_size)
+    {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ASSERT_RET_NE(MAP_FAILED, ring->sq_ring, cleanup, "mmap sq ring failed: %s", strerror(errno));
+
+    if (0 != (params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        ASSERT_RET_NE(MAP_FAILED, ring->cq_ring, cleanup, "mmap cq ring failed: %s", strerror(errno));
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    ASSERT_RET_NE(MAP_FAILED, (void *)ring->sqes, cleanup, "mmap sqes failed: %s", strerror(errno));
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    status = FILE_OK;
+cleanup:
+    if (FILE_OK != status && -1 != ring->fd)
+    {
+        uring_destroy(ring);
+    }
+    return status;
+}
+
+/* Queues a read of what's left of reads[index], the kernel sees it on the next enter. */
+static void uring_queue_read(uring_t *ring, file_read_t *read, size_t index)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    size_t remaining = read->len - read->done;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = read->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(read->buf + read->done);
+    // bigger reads come back short and are queued again for the rest
+    sqe->len = (remaining > UINT32_MAX) ? UINT32_MAX : (uint32_t)remaining;
+    sqe->off = read->offset + read->done;
+    sqe->user_data = index;
+
+    ring->sq_array[slot] = slot;
+    // the kernel may read the entry as soon as it sees the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static file_status_t uring_enter(uring_t *ring, unsigned to_submit, unsigned min_complete)
+{
+    file_status_t status = FILE_FAILED;
+    long ret = -1;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                      (0 != min_complete) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (-1 == ret && EINTR == errno);
+
+    ASSERT_RET_NE(-1, ret, cleanup, "io_uring_enter failed: %s", strerror(errno));
+    ASSERT_RET_EQ((long)to_submit, ret, cleanup, "io_uring_enter submitted %ld of %u", ret, to_submit);
+
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+/* Reads what's left of `read` with pread, for the fallback and for opcodes the kernel refused. */
+static void read_remaining(file_read_t *read)
+{
+    size_t chunk = 0;
+
+    while (read->done < read->len)
+    {
+        if (FILE_OK != read_partial_at(read->fd, read->buf + read->done, read->len - read->done,
+                                       read->offset + read->done, &chunk))
+        {
+            read->status = FILE_FAILED;
+            return;
+        }
+        if (0 == chunk)
+        {
+            read->status = FILE_EOF;
+            return;
+        }
+        read->done += chunk;
+    }
+
+    read->status = FILE_OK;
+}
+
+file_status_t file_batch_create(file_batch_t **out_batch)
+{
+    file_status_t status = FILE_FAILED;
+    file_batch_t *batch = NULL;
+    uring_support_t support = URING_UNKNOWN;
+
+    ASSERT_NOT_NULL(out_batch, cleanup, "out_batch is NULL");
+
+    status = FILE_NOMEM;
+    batch = calloc(1, sizeof(*batch));
+    ASSERT_NOT_NULL(batch, cleanup, "calloc failed: %s", strerror(errno));
+    batch->ring.fd = -1;
+
+    // probing is a syscall plus a log line, so a refusal is remembered
+    support = atomic_load_explicit(&g_uring_support, memory_order_relaxed);
+    if (FILE_BACKEND_URING == g_file_backend && URING_UNAVAILABLE != support)
+    {
+        if (FILE_OK == uring_init(&batch->ring, FILE_BATCH_DEPTH))
+        {
+            atomic_store_explicit(&g_uring_support, URING_AVAILABLE, memory_order_relaxed);
+        }
+        else if (URING_UNKNOWN == support &&
+                 atomic_compare_exchange_strong_explicit(&g_uring_support, &support, URING_UNAVAILABLE,
+                                                         memory_order_relaxed, memory_order_relaxed))
+        {
+            // only the first batch to find out says so
+            INFO("io_uring unavailable, file batches use pread");
+        }
+    }
+
+    *out_batch = batch;
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+file_status_t file_batch_submit(file_batch_t *batch, file_read_t *reads, size_t count)
+{
+    file_status_t status = FILE_FAILED;
+
+    ASSERT_NOT_NULL(batch, cleanup, "batch is NULL");
+    ASSERT_NOT_NULL(reads, cleanup, "reads is NULL");
+
+    if (count > FILE_BATCH_DEPTH || 0 != batch->in_flight)
+    {
+        ERROR(cleanup, "invalid submit of %zu reads with %zu in flight", count, batch->in_flight);
+    }
+
+    batch->reads = reads;
+    batch->count = count;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        reads[i].done = 0;
+        reads[i].status = FILE_FAILED;
+
+        if (-1 == batch->ring.fd || 0 == reads[i].len)
+        {
+            // nothing to queue, file_batch_wait does the work
+            continue;
+        }
+
+        uring_queue_read(&batch->ring, &reads[i], i);
+        ++batch->to_submit;
+    }
+
+    if (0 != batch->to_submit)
+    {
+        ASSERT_RET_EQ(FILE_OK, uring_enter(&batch->ring, (unsigned)batch->to_submit, 0), cleanup,
+                      "uring_enter failed");
+        batch->in_flight = batch->to_submit;
+        batch->to_submit = 0;
+    }
+
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+file_status_t file_batch_wait(file_batch_t *batch)
+{
+    file_status_t status = FILE_FAILED;
+    uring_t *ring = NULL;
+    struct io_uring_cqe *cqe = NULL;
+    file_read_t *read = NULL;
+    unsigned head = 0;
+    int requeue = 0;
+
+    ASSERT_NOT_NULL(batch, cleanup, "batch is NULL");
+    ring = &batch->ring;
+
+    if (-1 == ring->fd)
+    {
+        for (size_t i = 0; i < batch->count; ++i)
+        {
+            read_remaining(&batch->reads[i]);
+        }
+        status = FILE_OK;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < batch->count; ++i)
+    {
+        if (0 == batch->reads[i].len)
+        {
+            batch->reads[i].status = FILE_OK;
+        }
+    }
+
+    while (0 != batch->in_flight)
+    {
+        head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            // nothing completed yet, submit any requeued reads and sleep for one
+            ASSERT_RET_EQ(FILE_OK, uring_enter(ring, (unsigned)batch->to_submit, 1), cleanup, "uring_enter failed");
+            batch->in_flight += batch->to_submit;
+            batch->to_submit = 0;
+            continue;
+        }
+
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        read = &batch->reads[cqe->user_data];
+        requeue = 0;
+
+        if (cqe->res > 0)
+        {
+            // a short read goes back in for the rest
+            read->done += (size_t)cqe->res;
+            read->status = FILE_OK;
+            requeue = (read->done < read->len);
+        }
+        else if (0 == cqe->res)
+        {
+            read->status = FILE_EOF;
+        }
+        else if (-EINTR == cqe->res || -EAGAIN == cqe->res)
+        {
+            requeue = 1;
+        }
+        else if (-EINVAL == cqe->res || -EOPNOTSUPP == cqe->res)
+        {
+            // kernels before 5.6 have the ring but not IORING_OP_READ
+            read_remaining(read);
+        }
+        else
+        {
+            INFO("batched read failed: %s", strerror(-cqe->res));
+            read->status = FILE_FAILED;
+        }
+
+        if (requeue)
+        {
+            uring_queue_read(ring, read, cqe->user_data);
+            ++batch->to_submit;
+        }
+
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        --batch->in_flight;
+
+        if (0 == batch->in_flight && 0 != batch->to_submit)
+        {
+            ASSERT_RET_EQ(FILE_OK, uring_enter(ring, (unsigned)batch->to_submit, 0), cleanup, "uring_enter failed");
+            batch->in_flight = batch->to_submit;
+            batch->to_submit = 0;
+        }
+    }
+
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+void file_batch_destroy(file_batch_t *batch)
+{
+    if (NULL == batch)
+    {
+        return;
+    }
+
+    // the kernel may still write into the reads' buffers until they complete
+    if (0 != batch->in_flight && FILE_OK != file_batch_wait(batch))
+    {
+        INFO("couldn't reap batched reads before tearing the ring down");
+    }
+
+    if (-1 != batch->ring.fd)
+    {
+        uring_destroy(&batch->ring);
+    }
+    free(batch);
+}
@@ -0,0 +1,225 @@
+/**
+ * filename: frame.c
+ * description: Buffered reads and vectored, coalescing writes for the protocol socket.
+ */
+
+// C includes
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// User includes
+#include "frame.h"
+#include "file.h"
+#include "log.h"
+
+void frame_init(frame_conn_t *conn, int fd)
+{
+    conn->fd = fd;
+    conn->rpos = 0;
+    conn->rlen = 0;
+    conn->wlen = 0;
+    memset(&conn->stats, 0, sizeof(conn->stats));
+}
+
+size_t frame_buffered(const frame_conn_t *conn)
+{
+    return conn->rlen - conn->rpos;
+}
+
+frame_status_t frame_read(frame_conn_t *conn, void *buf, size_t len)
+{
+    frame_status_t status = FRAME_FAILED;
+    uint8_t *out = buf;
+    size_t part = 0;
+    size_t done = 0;
+    ssize_t sys_bytes = -1;
+
+    ASSERT_NOT_NULL(conn, cleanup, "conn is NULL");
+    ASSERT_NOT_NULL(buf, cleanup, "buf is NULL");
+
+    while (done < len)
+    {
+        if (conn->rpos < conn->rlen)
+        {
+            part = conn->rlen - conn->rpos;
+            part = (len - done < part) ? len - done : part;
+            memcpy(out + done, conn->rbuf + conn->rpos, part);
+            conn->rpos += part;
+            done += part;
+            continue;
+        }
+
+        // large payloads skip the buffer instead of going through it in pieces
+        if (len - done >= sizeof(conn->rbuf))
+        {
+            do {
+                sys_bytes = read(conn->fd, out + done, len - done);
+            } while (-1 == sys_bytes && (EINTR == errno || EAGAIN == errno));
+        }
+        else
+        {
+            conn->rpos = 0;
+            conn->rlen = 0;
+            do {
+                sys_bytes = read(conn->fd, conn->rbuf, sizeof(conn->rbuf));
+            } while (-1 == sys_bytes && (EINTR == errno || EAGAIN == errno));
+        }
+        ++conn->stats.read_calls;
+
+        ASSERT_RET_NE(-1, sys_bytes, cleanup, "read() failed: %s", strerror(errno));
+
+        if (0 == sys_bytes)
+        {
+            // a clean close only between messages, not in the middle of one
+            status = (0 == done) ? FRAME_EOF : FRAME_FAILED;
+            goto cleanup;
+        }
+
+        if (len - done >= sizeof(conn->rbuf))
+        {
+            done += (size_t)sys_bytes;
+        }
+        else
+        {
+            conn->rlen = (size_t)sys_bytes;
+        }
+    }
+
+    status = FRAME_OK;
+cleanup:
+    return status;
+}
+
+frame_status_t frame_read_some(frame_conn_t *conn, void *buf, size_t len, size_t *done)
+{
+    frame_status_t status = FRAME_FAILED;
+    uint8_t *out = buf;
+    size_t part = 0;
+    ssize_t sys_bytes = -1;
+    int direct = 0;
+
+    ASSERT_NOT_NULL(conn, cleanup, "conn is NULL");
+    ASSERT_NOT_NULL(buf, cleanup, "buf is NULL");
+    ASSERT_NOT_NULL(done, cleanup, "done is NULL");
+
+    while (*done < len)
+    {
+        if (conn->rpos < conn->rlen)
+        {
+            part = conn->rlen - conn->rpos;
+            part = (len - *done < part) ? len - *done : part;
+            memcpy(out + *done, conn->rbuf + conn->rpos, part);
+            conn->rpos += part;
+            *done += part;
+            continue;
+        }
+
+        // same split as frame_read, only without waiting for the data
+        direct = (len - *done >= sizeof(conn->rbuf));
+        do {
+            if (direct)
+            {
+                sys_bytes = recv(conn->fd, out + *done, len - *done, MSG_DONTWAIT);
+            }
+            else
+            {
+                sys_bytes = recv(conn->fd, conn->rbuf, sizeof(conn->rbuf), MSG_DONTWAIT);
+            }
+        } while (-1 == sys_bytes && EINTR == errno);
+        ++conn->stats.read_calls;
+
+        if (-1 == sys_bytes && (EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            status = FRAME_AGAIN;
+            goto cleanup;
+        }
+        ASSERT_RET_NE(-1, sys_bytes, cleanup, "recv() failed: %s", strerror(errno));
+
+        if (0 == sys_bytes)
+        {
+            status = (0 == *done) ? FRAME_EOF : FRAME_FAILED;
+            goto cleanup;
+        }
+
+        if (direct)
+        {
+            *done += (size_t)sys_bytes;
+        }
+        else
+        {
+            conn->rpos = 0;
+            conn->rlen = (size_t)sys_bytes;
+        }
+    }
+
+    status = FRAME_OK;
+cleanup:
+    return status;
+}
+
+frame_status_t frame_write(frame_conn_t *conn, const struct iovec *iov, int iovcnt)
+{
+    frame_status_t status = FRAME_INVALID;
+    struct iovec vec[FRAME_IOV_MAX + 1];
+    size_t total = 0;
+
+    ASSERT_NOT_NULL(conn, cleanup, "conn is NULL");
+    ASSERT_NOT_NULL(iov, cleanup, "iov is NULL");
+
+    if (iovcnt < 0 || iovcnt > FRAME_IOV_MAX)
+    {
+        ERROR(cleanup, "invalid iovcnt %d", iovcnt);
+    }
+
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        total += iov[i].iov_len;
+    }
+
+    if (total <= sizeof(conn->wbuf) - conn->wlen)
+    {
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            memcpy(conn->wbuf + conn->wlen, iov[i].iov_base, iov[i].iov_len);
+            conn->wlen += iov[i].iov_len;
+        }
+        status = FRAME_OK;
+        goto cleanup;
+    }
+
+    // pending bytes first, then the caller's buffers as they are
+    status = FRAME_FAILED;
+    vec[0].iov_base = conn->wbuf;
+    vec[0].iov_len = conn->wlen;
+    memcpy(&vec[1], iov, (size_t)iovcnt * sizeof(*iov));
+
+    ++conn->stats.write_calls;
+    conn->wlen = 0;
+    ASSERT_RET_EQ(FILE_OK, write_vec_all(conn->fd, vec, iovcnt + 1), cleanup, "write_vec_all failed");
+
+    status = FRAME_OK;
+cleanup:
+    return status;
+}
+
+frame_status_t frame_flush(frame_conn_t *conn)
+{
+    frame_status_t status = FRAME_FAILED;
+    size_t pending = 0;
+
+    ASSERT_NOT_NULL(conn, cleanup, "conn is NULL");
+
+    if (0 != conn->wlen)
+    {
+        pending = conn->wlen;
+        conn->wlen = 0;
+        ++conn->stats.write_calls;
+        ASSERT_RET_EQ(FILE_OK, write_all(conn->fd, conn->wbuf, pending), cleanup, "write_all failed");
+    }
+
+    status = FRAME_OK;
+cleanup:
+    return status;
+}
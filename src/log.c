@@ -3,6 +3,9 @@
  * description: Handels logging and unloading logs
  */
 
+// needed for syscall
+#define _GNU_SOURCE
+
 // C includes
 #include <stdio.h>
 #include <string.h>
@@ -11,76 +14,1094 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <printf.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 // User includes
 #include "log.h"
 #include "file.h"
 
 // defines
-#define LOG_BUFFER_SIZE 350
+#define LOG_RECORD_MAX 256
+#define LOG_RECORD_HEADER 12                    // u16 record size, u16 site id, u64 realtime in ns
+#define LOG_ARGS_MAX 8
+#define LOG_SITES_MAX 4096                      // id 0 are lines without a site (log_str)
+#define LOG_LINE_MAX 1024                       // a formatted line, longer ones are cut
+#define LOG_TEXT_RATIO 4                        // rough text bytes per record byte, a size hint
+#define LOG_RING_SLOTS 1024                     // power of 2
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+#define LOG_BATCH_MAX 64                        // records per writev, well below IOV_MAX
+#define LOG_WAKE_THRESHOLD (LOG_RING_SLOTS / 4) // pending records that wake the flusher early
+#define LOG_FLUSH_INTERVAL_MS 100
+#define LOG_CACHE_LINE 64
+#define LOG_PATH_MAX 4096
+#define LOG_MODULES_MAX 64
+#define LOG_MODULE_NAME_MAX 32
+#define LOG_SITE_REPEAT 0x8000                  // in a record's site id: a repeat count of that site
+#define LOG_SITE_ID_MASK 0x7fff
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define NS_PER_MS 1000000
+#define NS_PER_US 1000
+#define NS_PER_SEC 1000000000ULL
 
-static int g_log_fd = -1;
-static int g_logging_in_process = 0;
+/* How an argument is stored in a record, and read back to format it. */
+typedef enum log_arg_e
+{
+    LOG_ARG_INT = 0,        // int and anything promoted to it, 4 bytes
+    LOG_ARG_LONG,           // 8 bytes
+    LOG_ARG_LONG_LONG,      // 8 bytes
+    LOG_ARG_DOUBLE,         // 8 bytes
+    LOG_ARG_POINTER,        // 8 bytes
+    LOG_ARG_STRING,         // u16 length then the text, without \0
+} log_arg_t;
 
-static log_status_t log_write(const char *format, va_list args)
+/*
+ * What a site's records look like. A format that can't be split into one
+ * conversion per argument (`*` widths, %m, wide strings, ...) makes the site
+ * eager: its records carry the text, formatted when logged.
+ */
+typedef struct log_site_info_s
 {
-    log_status_t status = LOG_FAILED;
-    char buffer[LOG_BUFFER_SIZE] = {0};
+    const log_site_t *site;     // set last, NULL while the entry is filled in
+    size_t module;
+    atomic_uint_fast64_t last_hash;     // of the last record written or counted
+    atomic_uint_fast64_t window_start;  // time of the last record written, in ns
+    atomic_uint repeats;                // records identical to it counted since
+    uint8_t eager;
+    uint8_t argc;
+    uint8_t args[LOG_ARGS_MAX];
+    size_t fixed_size;          // record bytes of the arguments, the strings' text aside
+    char *pieces;               // the literal before the first conversion, then the
+                                // format from each conversion to the next, all \0 ended
+} log_site_info_t;
+
+/* Level of the sites of one source file, entries are only ever added. */
+typedef struct log_module_s
+{
+    char name[LOG_MODULE_NAME_MAX];
+    atomic_int level;
+    atomic_int ready;           // name is set
+} log_module_t;
+
+/*
+ * One record. `sequence` tells who may touch the slot: it equals the ticket
+ * of the producer that may fill it, ticket + 1 once the record is in, and
+ * moves a whole lap ahead once the record was written out.
+ */
+typedef struct log_slot_s
+{
+    atomic_size_t sequence;
+    size_t len;
+    uint8_t data[LOG_RECORD_MAX];
+} log_slot_t;
+
+typedef struct log_ring_s
+{
+    alignas(LOG_CACHE_LINE) atomic_size_t tail;    // next ticket for producers
+    alignas(LOG_CACHE_LINE) atomic_size_t head;    // next slot to write out, advanced under drain_lock
+    alignas(LOG_CACHE_LINE) atomic_int wake;       // futex word the flusher sleeps on
+    atomic_int running;
+    pthread_mutex_t drain_lock;                    // the consumer side only, producers never take it
+    pthread_t flusher;
+    log_slot_t slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+/* One file of the log, it holds whole records only. */
+typedef struct log_segment_s
+{
+    int fd;
+    uint64_t base;      // stream position of its first record
+    size_t size;
+} log_segment_t;
+
+// the log is a stream of records cut into segments that are reused in turn,
+// positions in it (cursors) keep growing, all of it under drain_lock
+static int g_log_open = 0;
+static log_segment_t g_segments[LOG_SEGMENT_COUNT];
+static size_t g_current = 0;
+static uint64_t g_end = 0;
+static log_ring_t g_ring = { .drain_lock = PTHREAD_MUTEX_INITIALIZER };
+// set while this thread writes the ring out, a full ring must not drain recursively
+static __thread int g_draining = 0;
+static pthread_once_t g_atfork_once = PTHREAD_ONCE_INIT;
+// entry 0 stands for lines without a site, ids are handed out without a lock
+// so that a forked child logging can't deadlock on one
+static log_site_info_t g_sites[LOG_SITES_MAX] = { [0] = { .eager = 1 } };
+static atomic_uint g_site_count = 1;
+static log_module_t g_modules[LOG_MODULES_MAX];
+static atomic_uint g_module_count = 0;
+static atomic_int g_default_level = LOG_LEVEL_INFO;    // of modules not seen yet
+
+static void ring_reset(void)
+{
+    for (size_t i = 0; i < LOG_RING_SLOTS; ++i)
+    {
+        atomic_store_explicit(&g_ring.slots[i].sequence, i, memory_order_relaxed);
+    }
+    atomic_store_explicit(&g_ring.tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&g_ring.head, 0, memory_order_relaxed);
+}
+
+/* Moves on to the oldest segment, dropping what it holds. */
+static void segment_rotate(void)
+{
+    log_segment_t *segment = NULL;
+
+    g_current = (g_current + 1) % LOG_SEGMENT_COUNT;
+    segment = &g_segments[g_current];
+    // nothing better to do when it fails, the segment keeps its old records
+    (void)ftruncate(segment->fd, 0);
+    segment->base = g_end;
+    segment->size = 0;
+}
+
+/* Appends records to the segments, rotating whenever the current one is full. */
+static void segment_write(struct iovec *iov, int count)
+{
+    log_segment_t *segment = NULL;
+    size_t len = 0;
+    int fit = 0;
+
+    while (count > 0)
+    {
+        segment = &g_segments[g_current];
+        len = 0;
+        for (fit = 0; fit < count && segment->size + len + iov[fit].iov_len <= LOG_SEGMENT_SIZE; ++fit)
+        {
+            len += iov[fit].iov_len;
+        }
+
+        if (0 == fit)
+        {
+            segment_rotate();
+            continue;
+        }
+
+        // records that can't be written are dropped, nothing else could be done with them
+        if (FILE_OK == write_vec_all(segment->fd, iov, fit))
+        {
+            segment->size += len;
+            g_end += len;
+        }
+
+        iov += fit;
+        count -= fit;
+    }
+}
+
+/* Writes out the records ready in order, one writev per batch. Returns the number written. */
+static size_t ring_drain(void)
+{
+    struct iovec iov[LOG_BATCH_MAX];
+    log_slot_t *slot = NULL;
+    size_t head = 0;
+    size_t total = 0;
+    int count = 0;
+
+    pthread_mutex_lock(&g_ring.drain_lock);
+    g_draining = 1;
+    head = atomic_load_explicit(&g_ring.head, memory_order_relaxed);
+
+    do {
+        count = 0;
+        while (count < LOG_BATCH_MAX)
+        {
+            slot = &g_ring.slots[(head + (size_t)count) & LOG_RING_MASK];
+            if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != head + (size_t)count + 1)
+            {
+                break;
+            }
+            iov[count].iov_base = slot->data;
+            iov[count].iov_len = slot->len;
+            ++count;
+        }
+
+        if (0 != g_log_open)
+        {
+            segment_write(iov, count);
+        }
+
+        // hand the slots back to the producers, a lap ahead
+        for (int i = 0; i < count; ++i)
+        {
+            slot = &g_ring.slots[head & LOG_RING_MASK];
+            atomic_store_explicit(&slot->sequence, head + LOG_RING_SLOTS, memory_order_release);
+            ++head;
+        }
+        atomic_store_explicit(&g_ring.head, head, memory_order_relaxed);
+        total += (size_t)count;
+    } while (LOG_BATCH_MAX == count);
+
+    g_draining = 0;
+    pthread_mutex_unlock(&g_ring.drain_lock);
+
+    return total;
+}
+
+static void flusher_wake(void)
+{
+    if (0 == atomic_exchange_explicit(&g_ring.wake, 1, memory_order_acq_rel))
+    {
+        (void)syscall(SYS_futex, &g_ring.wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static void flush_repeats(int expired_only);
+
+static void *flusher_main(void *arg)
+{
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = (long)LOG_FLUSH_INTERVAL_MS * NS_PER_MS };
+
+    (void)arg;
+
+    while (0 != atomic_load_explicit(&g_ring.running, memory_order_acquire))
+    {
+        atomic_store_explicit(&g_ring.wake, 0, memory_order_release);
+        flush_repeats(1);
+        if (0 != ring_drain())
+        {
+            continue;
+        }
+
+        // woken early by a producer once enough records pile up
+        (void)syscall(SYS_futex, &g_ring.wake, FUTEX_WAIT_PRIVATE, 0, &interval, NULL, 0);
+    }
+
+    (void)ring_drain();
+    return NULL;
+}
+
+/* Where the conversion that starts at format[pos] ('%') ends. */
+static size_t skip_conversion(const char *format, size_t pos)
+{
+    ++pos;
+    while ('\0' != format[pos] && NULL != strchr("-+ #0123456789.*'hlLqjzt", format[pos]))
+    {
+        ++pos;
+    }
+
+    return ('\0' == format[pos]) ? pos : pos + 1;
+}
+
+/* Fills `info` from the site's format, leaves it eager when it can't be deferred. */
+static void site_parse(log_site_info_t *info, const char *format)
+{
+    int types[LOG_ARGS_MAX + 1];
+    size_t starts[LOG_ARGS_MAX + 1];
+    size_t argc = 0;
+    size_t count = 0;
+    size_t len = strlen(format);
+    size_t out = 0;
+    size_t end = 0;
+
+    info->eager = 1;
+
+    argc = parse_printf_format(format, LOG_ARGS_MAX + 1, types);
+    if (argc > LOG_ARGS_MAX)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < argc; ++i)
+    {
+        switch (types[i] & ~PA_FLAG_MASK)
+        {
+            case PA_CHAR:
+            case PA_INT:
+                if (types[i] & PA_FLAG_PTR)
+                {
+                    return;     // %n
+                }
+                info->args[i] = (types[i] & PA_FLAG_LONG_LONG) ? LOG_ARG_LONG_LONG :
+                                (types[i] & PA_FLAG_LONG) ? LOG_ARG_LONG : LOG_ARG_INT;
+                info->fixed_size += (LOG_ARG_INT == info->args[i]) ? sizeof(int32_t) : sizeof(int64_t);
+                break;
+            case PA_FLOAT:
+            case PA_DOUBLE:
+                if (types[i] & PA_FLAG_LONG_DOUBLE)
+                {
+                    return;
+                }
+                info->args[i] = LOG_ARG_DOUBLE;
+                info->fixed_size += sizeof(double);
+                break;
+            case PA_POINTER:
+                info->args[i] = LOG_ARG_POINTER;
+                info->fixed_size += sizeof(uint64_t);
+                break;
+            case PA_STRING:
+                info->args[i] = LOG_ARG_STRING;
+                info->fixed_size += sizeof(uint16_t);
+                break;
+            default:
+                return;
+        }
+    }
+
+    // each conversion has to take exactly one argument
+    for (size_t pos = 0; pos < len; ++pos)
+    {
+        if ('%' != format[pos])
+        {
+            continue;
+        }
+        if ('%' == format[pos + 1])
+        {
+            ++pos;
+            continue;
+        }
+        if (count == argc)
+        {
+            return;
+        }
+        starts[count++] = pos;
+        pos = skip_conversion(format, pos) - 1;
+    }
+    if (count != argc)
+    {
+        return;
+    }
+
+    info->pieces = malloc(len + argc + 1);
+    if (NULL == info->pieces)
+    {
+        return;
+    }
+
+    // the leading literal is copied as text, so its %% become %
+    end = (0 == argc) ? len : starts[0];
+    for (size_t pos = 0; pos < end; ++pos)
+    {
+        info->pieces[out++] = format[pos];
+        if ('%' == format[pos] && '%' == format[pos + 1])
+        {
+            ++pos;
+        }
+    }
+    info->pieces[out++] = '\0';
+
+    for (size_t i = 0; i < argc; ++i)
+    {
+        end = (i + 1 < argc) ? starts[i + 1] : len;
+        memcpy(info->pieces + out, format + starts[i], end - starts[i]);
+        out += end - starts[i];
+        info->pieces[out++] = '\0';
+    }
+
+    info->argc = (uint8_t)argc;
+    info->eager = 0;
+}
+
+/*
+ * Index of the module called `name` (`len` bytes), added when `add` is set
+ * and it isn't known yet. LOG_MODULES_MAX when it can't be found or added.
+ * Adding takes no lock either, two threads adding the same module both get
+ * an entry, log_set_level sets them all.
+ */
+static size_t module_find(const char *name, size_t len, int add)
+{
+    size_t count = atomic_load_explicit(&g_module_count, memory_order_acquire);
+    size_t index = 0;
+
+    count = (count < LOG_MODULES_MAX) ? count : LOG_MODULES_MAX;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (0 != atomic_load_explicit(&g_modules[i].ready, memory_order_acquire) &&
+            0 == strncmp(g_modules[i].name, name, len) && '\0' == g_modules[i].name[len])
+        {
+            return i;
+        }
+    }
+
+    if (0 == add || len >= LOG_MODULE_NAME_MAX)
+    {
+        return LOG_MODULES_MAX;
+    }
+
+    index = atomic_fetch_add_explicit(&g_module_count, 1, memory_order_acq_rel);
+    if (index >= LOG_MODULES_MAX)
+    {
+        atomic_store_explicit(&g_module_count, LOG_MODULES_MAX, memory_order_relaxed);
+        return LOG_MODULES_MAX;
+    }
+
+    memcpy(g_modules[index].name, name, len);
+    g_modules[index].name[len] = '\0';
+    atomic_store_explicit(&g_modules[index].level, atomic_load(&g_default_level), memory_order_relaxed);
+    atomic_store_explicit(&g_modules[index].ready, 1, memory_order_release);
+
+    return index;
+}
+
+/* The module of a source file, "src/exec.c" is "exec". */
+static size_t module_of(const char *file)
+{
+    const char *name = strrchr(file, '/');
+    const char *dot = NULL;
+
+    name = (NULL == name) ? file : name + 1;
+    dot = strchr(name, '.');
+
+    return module_find(name, (NULL == dot) ? strlen(name) : (size_t)(dot - name), 1);
+}
+
+static int module_level(size_t module)
+{
+    if (module >= LOG_MODULES_MAX)
+    {
+        return atomic_load_explicit(&g_default_level, memory_order_relaxed);
+    }
+
+    return atomic_load_explicit(&g_modules[module].level, memory_order_relaxed);
+}
+
+/*
+ * Gives `site` its id, or 0 once the table is full. Two threads may race
+ * for the same site, the loser's entry is simply never used.
+ */
+static unsigned site_register(log_site_t *site)
+{
+    unsigned id = atomic_fetch_add_explicit(&g_site_count, 1, memory_order_relaxed);
+    unsigned expected = 0;
+    log_site_info_t *info = NULL;
+
+    if (id >= LOG_SITES_MAX)
+    {
+        atomic_store_explicit(&g_site_count, LOG_SITES_MAX, memory_order_relaxed);
+        return 0;
+    }
+
+    info = &g_sites[id];
+    site_parse(info, site->format);
+    info->module = module_of(site->file);
+    info->site = site;
+
+    if (!atomic_compare_exchange_strong_explicit(&site->id, &expected, id,
+                                                 memory_order_acq_rel, memory_order_acquire))
+    {
+        return expected;
+    }
+
+    return id;
+}
+
+/*
+ * Claims the next slot of the ring, no syscall unless the ring is full, in
+ * which case the producer writes the ring out itself.
+ * NULL when the ring is full while this thread is the one writing it out.
+ */
+static log_slot_t *ring_claim(size_t *out_pos)
+{
+    log_slot_t *slot = NULL;
+    size_t pos = atomic_load_explicit(&g_ring.tail, memory_order_relaxed);
+    size_t sequence = 0;
+    intptr_t diff = 0;
+
+    while (1)
+    {
+        slot = &g_ring.slots[pos & LOG_RING_MASK];
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (0 == diff)
+        {
+            // the slot is free for ticket `pos`, claim it
+            if (atomic_compare_exchange_weak_explicit(&g_ring.tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                *out_pos = pos;
+                return slot;
+            }
+        }
+        else if (diff < 0)
+        {
+            // full, the record waits for the ring to be written out
+            if (0 != g_draining)
+            {
+                return NULL;
+            }
+            (void)ring_drain();
+            pos = atomic_load_explicit(&g_ring.tail, memory_order_relaxed);
+        }
+        else
+        {
+            // another producer got this ticket first
+            pos = atomic_load_explicit(&g_ring.tail, memory_order_relaxed);
+        }
+    }
+}
+
+static void ring_publish(log_slot_t *slot, size_t pos)
+{
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+    if (pos + 1 - atomic_load_explicit(&g_ring.head, memory_order_relaxed) >= LOG_WAKE_THRESHOLD)
+    {
+        flusher_wake();
+    }
+}
+
+/* Stores the formatted text as a single string argument, with the site's location when given. */
+static size_t encode_text(uint8_t *out, size_t room, const log_site_t *site, const char *format, va_list args)
+{
+    char *text = (char *)out + sizeof(uint16_t);
+    size_t cap = room - sizeof(uint16_t);
+    size_t len = 0;
+    uint16_t text_len = 0;
     int written = 0;
 
-    if (g_log_fd < 0)
+    if (NULL != site)
+    {
+        written = snprintf(text, cap, " %-12s | %-4d | %-18s| ", site->file, site->line, site->func);
+        len = (written < 0) ? 0 : ((size_t)written >= cap) ? cap - 1 : (size_t)written;
+    }
+
+    // a line that doesn't fit is cut, the slot has to be published either way
+    written = vsnprintf(text + len, cap - len, format, args);
+    len += (written < 0) ? 0 : ((size_t)written >= cap - len) ? cap - len - 1 : (size_t)written;
+
+    // cast safe, len < LOG_RECORD_MAX
+    text_len = (uint16_t)len;
+    memcpy(out, &text_len, sizeof(text_len));
+
+    return sizeof(text_len) + len;
+}
+
+/* Stores the raw arguments, strings are cut so that the record fits. */
+static size_t encode_args(uint8_t *out, size_t room, const log_site_info_t *info, va_list args)
+{
+    size_t budget = room - info->fixed_size;
+    size_t pos = 0;
+    const char *str = NULL;
+    uint16_t str_len = 0;
+    int32_t value_int = 0;
+    int64_t value_long = 0;
+    uint64_t value_ptr = 0;
+    double value_double = 0;
+
+    for (size_t i = 0; i < info->argc; ++i)
+    {
+        switch (info->args[i])
+        {
+            case LOG_ARG_INT:
+                value_int = va_arg(args, int);
+                memcpy(out + pos, &value_int, sizeof(value_int));
+                pos += sizeof(value_int);
+                break;
+            case LOG_ARG_LONG:
+                value_long = va_arg(args, long);
+                memcpy(out + pos, &value_long, sizeof(value_long));
+                pos += sizeof(value_long);
+                break;
+            case LOG_ARG_LONG_LONG:
+                value_long = va_arg(args, long long);
+                memcpy(out + pos, &value_long, sizeof(value_long));
+                pos += sizeof(value_long);
+                break;
+            case LOG_ARG_DOUBLE:
+                value_double = va_arg(args, double);
+                memcpy(out + pos, &value_double, sizeof(value_double));
+                pos += sizeof(value_double);
+                break;
+            case LOG_ARG_POINTER:
+                value_ptr = (uint64_t)(uintptr_t)va_arg(args, void *);
+                memcpy(out + pos, &value_ptr, sizeof(value_ptr));
+                pos += sizeof(value_ptr);
+                break;
+            case LOG_ARG_STRING:
+                str = va_arg(args, const char *);
+                if (NULL == str)
+                {
+                    str = "(null)";
+                }
+                // cast safe, budget < LOG_RECORD_MAX
+                str_len = (uint16_t)strnlen(str, budget);
+                budget -= str_len;
+                memcpy(out + pos, &str_len, sizeof(str_len));
+                memcpy(out + pos + sizeof(str_len), str, str_len);
+                pos += sizeof(str_len) + str_len;
+                break;
+        }
+    }
+
+    return pos;
+}
+
+/* Queues one record of `site_field` (a site id, possibly with LOG_SITE_REPEAT). */
+static log_status_t ring_push(unsigned site_field, const uint8_t *body, size_t len, uint64_t time_ns)
+{
+    log_slot_t *slot = NULL;
+    uint16_t size = 0;
+    uint16_t site_id = 0;
+    size_t pos = 0;
+
+    slot = ring_claim(&pos);
+    if (NULL == slot)
+    {
+        return LOG_FAILED;
+    }
+
+    // casts safe, a record is at most LOG_RECORD_MAX and ids stay below LOG_SITES_MAX
+    size = (uint16_t)(LOG_RECORD_HEADER + len);
+    site_id = (uint16_t)site_field;
+    memcpy(slot->data, &size, sizeof(size));
+    memcpy(slot->data + sizeof(size), &site_id, sizeof(site_id));
+    memcpy(slot->data + sizeof(size) + sizeof(site_id), &time_ns, sizeof(time_ns));
+    memcpy(slot->data + LOG_RECORD_HEADER, body, len);
+    slot->len = size;
+
+    ring_publish(slot, pos);
+
+    return LOG_OK;
+}
+
+static uint64_t hash_bytes(const uint8_t *data, size_t len)
+{
+    uint64_t hash = FNV_OFFSET;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+ * Whether a record hashing to `hash` repeats the site's last one within
+ * LOG_REPEAT_WINDOW_MS, it is counted instead of written if so.
+ * Threads logging the same site at once may miscount a little.
+ */
+static int site_repeated(log_site_info_t *info, uint64_t hash, uint64_t time_ns)
+{
+    uint64_t last = atomic_exchange_explicit(&info->last_hash, hash, memory_order_relaxed);
+    uint64_t start = atomic_load_explicit(&info->window_start, memory_order_relaxed);
+
+    if (last != hash || time_ns - start >= (uint64_t)LOG_REPEAT_WINDOW_MS * NS_PER_MS)
+    {
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&info->repeats, 1, memory_order_relaxed);
+    return 1;
+}
+
+/* Logs how many repeats site `id` counted since its last record, if any. */
+static void site_flush_repeats(unsigned id, uint64_t time_ns)
+{
+    uint32_t repeats = atomic_exchange_explicit(&g_sites[id].repeats, 0, memory_order_relaxed);
+
+    if (0 != repeats)
+    {
+        (void)ring_push(id | LOG_SITE_REPEAT, (const uint8_t *)&repeats, sizeof(repeats), time_ns);
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now = {0};
+
+    (void)clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * Queues one record: header, then either the raw arguments of site `id`
+ * or, for id 0 and eager sites, the formatted text.
+ */
+static log_status_t log_write(unsigned id, const log_site_t *site, const char *format, va_list args)
+{
+    log_status_t status = LOG_FAILED;
+    log_site_info_t *info = NULL;
+    uint8_t body[LOG_RECORD_MAX - LOG_RECORD_HEADER];
+    uint64_t time_ns = 0;
+    size_t len = 0;
+
+    if (0 == g_log_open)
     {
         goto cleanup;
     }
-    else if (g_logging_in_process)
+
+    time_ns = now_ns();
+
+    if (0 == id)
     {
-	goto done;
+        len = encode_text(body, sizeof(body), site, format, args);
+        status = ring_push(id, body, len, time_ns);
+        goto cleanup;
     }
 
-    g_logging_in_process = 1;
+    info = &g_sites[id];
+    if (info->eager)
+    {
+        len = encode_text(body, sizeof(body), NULL, format, args);
+    }
+    else
+    {
+        len = encode_args(body, sizeof(body), info, args);
+    }
 
-    if (NULL == format)
+    if (site_repeated(info, hash_bytes(body, len), time_ns))
     {
-        status = LOG_INVALID;
+        status = LOG_OK;
         goto cleanup;
     }
 
-    written = vsnprintf(buffer, sizeof(buffer), format, args);
+    // the count goes right before the different line (or the next window's first one)
+    site_flush_repeats(id, time_ns);
+    atomic_store_explicit(&info->window_start, time_ns, memory_order_relaxed);
+
+    status = ring_push(id, body, len, time_ns);
+
+cleanup:
+    return status;
+}
+
+/* Appends `text` to the line, cut at LOG_LINE_MAX. */
+static void line_append(char *line, size_t *pos, const char *text, size_t len)
+{
+    size_t room = LOG_LINE_MAX - 1 - *pos;
+
+    len = (len < room) ? len : room;
+    memcpy(line + *pos, text, len);
+    *pos += len;
+}
+
+/* Formats one argument with its piece of the format. */
+static void line_format(char *line, size_t *pos, const char *piece, log_arg_t arg,
+			const uint8_t *value, size_t value_len)
+{
+    char str[LOG_RECORD_MAX + 1];
+    int32_t value_int = 0;
+    int64_t value_long = 0;
+    uint64_t value_ptr = 0;
+    double value_double = 0;
+    size_t room = LOG_LINE_MAX - *pos;
+    int written = 0;
+
+    switch (arg)
+    {
+        case LOG_ARG_INT:
+            memcpy(&value_int, value, sizeof(value_int));
+            written = snprintf(line + *pos, room, piece, value_int);
+            break;
+        case LOG_ARG_LONG:
+            memcpy(&value_long, value, sizeof(value_long));
+            written = snprintf(line + *pos, room, piece, (long)value_long);
+            break;
+        case LOG_ARG_LONG_LONG:
+            memcpy(&value_long, value, sizeof(value_long));
+            written = snprintf(line + *pos, room, piece, (long long)value_long);
+            break;
+        case LOG_ARG_DOUBLE:
+            memcpy(&value_double, value, sizeof(value_double));
+            written = snprintf(line + *pos, room, piece, value_double);
+            break;
+        case LOG_ARG_POINTER:
+            memcpy(&value_ptr, value, sizeof(value_ptr));
+            written = snprintf(line + *pos, room, piece, (void *)(uintptr_t)value_ptr);
+            break;
+        case LOG_ARG_STRING:
+            memcpy(str, value, value_len);
+            str[value_len] = '\0';
+            written = snprintf(line + *pos, room, piece, str);
+            break;
+    }
+
+    *pos += (written < 0) ? 0 : ((size_t)written >= room) ? room - 1 : (size_t)written;
+}
+
+/*
+ * Formats one record as a text line, without its \0.
+ * Returns 0 for a record that can't be read, which is skipped.
+ */
+static size_t render_record(const uint8_t *record, size_t size, char *line)
+{
+    static const size_t widths[] = {
+        [LOG_ARG_INT] = sizeof(int32_t), [LOG_ARG_LONG] = sizeof(int64_t),
+        [LOG_ARG_LONG_LONG] = sizeof(int64_t), [LOG_ARG_DOUBLE] = sizeof(double),
+        [LOG_ARG_POINTER] = sizeof(uint64_t),
+    };
+    const log_site_info_t *info = NULL;
+    const uint8_t *cur = record + LOG_RECORD_HEADER;
+    const uint8_t *end = record + size;
+    const char *piece = NULL;
+    uint16_t site_id = 0;
+    uint16_t str_len = 0;
+    uint16_t repeat = 0;
+    uint32_t repeats = 0;
+    uint64_t time_ns = 0;
+    size_t value_len = 0;
+    size_t pos = 0;
+    time_t seconds = 0;
+    struct tm tm = {0};
+    int written = 0;
+
+    memcpy(&site_id, record + sizeof(uint16_t), sizeof(site_id));
+    memcpy(&time_ns, record + 2 * sizeof(uint16_t), sizeof(time_ns));
+    repeat = site_id & LOG_SITE_REPEAT;
+    site_id &= LOG_SITE_ID_MASK;
+
+    if (site_id >= LOG_SITES_MAX)
+    {
+        return 0;
+    }
+    info = &g_sites[site_id];
+    if (0 != site_id && NULL == info->site)
+    {
+        return 0;
+    }
+
+    seconds = (time_t)(time_ns / NS_PER_SEC);
+    (void)localtime_r(&seconds, &tm);
+    pos = strftime(line, LOG_LINE_MAX, "%F %T", &tm);
+    written = snprintf(line + pos, LOG_LINE_MAX - pos, ".%06lu |", (unsigned long)(time_ns % NS_PER_SEC / NS_PER_US));
+    pos += (written < 0) ? 0 : (size_t)written;
+
+    if (0 != site_id)
+    {
+        written = snprintf(line + pos, LOG_LINE_MAX - pos, " %-12s | %-4d | %-18s| ",
+                           info->site->file, info->site->line, info->site->func);
+        pos += (written < 0) ? 0 : ((size_t)written >= LOG_LINE_MAX - pos) ? LOG_LINE_MAX - pos - 1 : (size_t)written;
+    }
+
+    if (0 != repeat)
+    {
+        if ((size_t)(end - cur) < sizeof(repeats))
+        {
+            return 0;
+        }
+        memcpy(&repeats, cur, sizeof(repeats));
+        written = snprintf(line + pos, LOG_LINE_MAX - pos, "[same line repeated %u time%s]",
+                           repeats, (1 == repeats) ? "" : "s");
+        pos += (written < 0) ? 0 : ((size_t)written >= LOG_LINE_MAX - pos) ? LOG_LINE_MAX - pos - 1 : (size_t)written;
+        return pos;
+    }
+
+    if (info->eager)
+    {
+        if ((size_t)(end - cur) < sizeof(str_len))
+        {
+            return 0;
+        }
+        memcpy(&str_len, cur, sizeof(str_len));
+        cur += sizeof(str_len);
+        if ((size_t)(end - cur) < str_len)
+        {
+            return 0;
+        }
+        line_append(line, &pos, (const char *)cur, str_len);
+        return pos;
+    }
+
+    line_append(line, &pos, info->pieces, strlen(info->pieces));
+    piece = info->pieces + strlen(info->pieces) + 1;
+
+    for (size_t i = 0; i < info->argc; ++i)
+    {
+        if (LOG_ARG_STRING == info->args[i])
+        {
+            if ((size_t)(end - cur) < sizeof(str_len))
+            {
+                return 0;
+            }
+            memcpy(&str_len, cur, sizeof(str_len));
+            cur += sizeof(str_len);
+            value_len = str_len;
+        }
+        else
+        {
+            value_len = widths[info->args[i]];
+        }
+
+        if ((size_t)(end - cur) < value_len)
+        {
+            return 0;
+        }
+        line_format(line, &pos, piece, info->args[i], cur, value_len);
+        cur += value_len;
+        piece += strlen(piece) + 1;
+    }
+
+    return pos;
+}
 
-    if (written < 0 || (size_t)written >= sizeof(buffer))
+/*
+ * Formats the records of `data` as text lines, each ended by \0.
+ * A record cut at the end of `data` is left out of `out_used`.
+ */
+static log_status_t render_all(const uint8_t *data, size_t size, uint8_t **out_buf, size_t *out_size,
+			       size_t *out_used)
+{
+    log_status_t status = LOG_NOMEM;
+    byte_buf_t text = {0};
+    char line[LOG_LINE_MAX];
+    uint16_t record_size = 0;
+    size_t len = 0;
+    size_t pos = 0;
+
+    if (FILE_OK != byte_buf_reserve(&text, size * LOG_TEXT_RATIO + 1))
     {
-    	// if written is less than zero, couldn't write anything
-    	// if written is more than buffer, buff is too small 
         goto cleanup;
     }
 
-    // in log every lines are seperated by `\0` rather than `\n`
-    for (int i = 0; i < written; ++i)
+    for (pos = 0; pos + LOG_RECORD_HEADER <= size; pos += record_size)
     {
-        if (buffer[i] == '\n')
+        memcpy(&record_size, data + pos, sizeof(record_size));
+        if (record_size < LOG_RECORD_HEADER || record_size > size - pos)
+        {
+            break;
+        }
+
+        len = render_record(data + pos, record_size, line);
+        if (0 == len)
+        {
+            continue;
+        }
+
+        // in log every lines are seperated by `\0` rather than `\n`
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (line[i] == '\n')
+            {
+                line[i] = '\0';
+            }
+        }
+        line[len] = '\0';
+
+        if (FILE_OK != byte_buf_append(&text, line, len + 1))
         {
-            buffer[i] = '\0';
+            goto cleanup;
         }
     }
-	
-    // each write is a new line, and lines are seperated by \0, so write written + 1
-    // so the \0 will be written
-    if (FILE_OK != write_all(g_log_fd, (const uint8_t *)buffer, (size_t)(written + 1)))
+
+    *out_buf = byte_buf_detach(&text, out_size);
+    *out_used = pos;
+    status = LOG_OK;
+
+cleanup:
+    byte_buf_release(&text);
+    return status;
+}
+
+/*
+ * Copies up to `limit` bytes of records from `cursor` on. A cursor older
+ * than the oldest segment starts at that segment, `out_start` says where.
+ */
+static log_status_t segments_read(uint64_t cursor, size_t limit, uint8_t **out_buf, size_t *out_size,
+				  uint64_t *out_start, uint64_t *out_end)
+{
+    log_status_t status = LOG_NOMEM;
+    byte_buf_t records = {0};
+    log_segment_t *segment = NULL;
+    uint64_t start = 0;
+    size_t offset = 0;
+    size_t len = 0;
+    size_t chunk = 0;
+    int locked = 0;
+
+    // the flusher must not reuse a segment while it is read, and the reads
+    // below log on failure: a full ring must not drain from under the lock
+    pthread_mutex_lock(&g_ring.drain_lock);
+    g_draining = 1;
+    locked = 1;
+
+    if (cursor > g_end)
+    {
+        status = LOG_INVALID;
+        goto cleanup;
+    }
+
+    start = g_end;
+    len = (g_end - cursor < limit) ? (size_t)(g_end - cursor) : limit;
+    if (FILE_OK != byte_buf_reserve(&records, len + 1))
     {
         goto cleanup;
     }
-	
+
+    // oldest first, the current segment last
+    for (size_t i = 1; i <= LOG_SEGMENT_COUNT && records.size < limit; ++i)
+    {
+        segment = &g_segments[(g_current + i) % LOG_SEGMENT_COUNT];
+        if (0 == segment->size || cursor >= segment->base + segment->size)
+        {
+            continue;
+        }
+
+        offset = (cursor > segment->base) ? (size_t)(cursor - segment->base) : 0;
+        if (start == g_end)
+        {
+            start = segment->base + offset;
+        }
+        len = segment->size - offset;
+        len = (len < limit - records.size) ? len : limit - records.size;
+        if (FILE_OK != byte_buf_reserve(&records, len))
+        {
+            goto cleanup;
+        }
+
+        status = LOG_FAILED;
+        for (size_t done = 0; done < len; done += chunk)
+        {
+            if (FILE_OK != read_partial_at(segment->fd, records.data + records.size + done, len - done,
+                                           offset + done, &chunk) || 0 == chunk)
+            {
+                goto cleanup;
+            }
+        }
+        records.size += len;
+        status = LOG_NOMEM;
+    }
+
+    *out_start = start;
+    *out_end = g_end;
+    *out_buf = byte_buf_detach(&records, out_size);
     status = LOG_OK;
 
 cleanup:
-    g_logging_in_process = 0;
-done:
+    if (locked)
+    {
+        g_draining = 0;
+        pthread_mutex_unlock(&g_ring.drain_lock);
+    }
+    byte_buf_release(&records);
     return status;
 }
 
+/*
+ * A forked child (e.g. EXEC_BACKEND=FORK) has no flusher, a copy of the ring
+ * and of drain_lock as some other thread may have held it, and the parent's
+ * segment fds. Writing to those would move the parent's offsets under it,
+ * so the child doesn't log at all.
+ */
+static void log_atfork_child(void)
+{
+    g_log_open = 0;
+    g_draining = 0;
+    atomic_store_explicit(&g_ring.running, 0, memory_order_relaxed);
+    pthread_mutex_init(&g_ring.drain_lock, NULL);
+}
+
+static void log_register_atfork(void)
+{
+    (void)pthread_atfork(NULL, NULL, log_atfork_child);
+}
+
 log_status_t log_init(const char *path)
 {
     log_status_t status = LOG_FAILED;
+    char segment_path[LOG_PATH_MAX];
+    sigset_t all;
+    sigset_t old;
+    size_t opened = 0;
 
     if (NULL == path)
     {
@@ -88,25 +1109,263 @@ log_status_t log_init(const char *path)
         goto cleanup;
     }
 
-    g_log_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC);
-    if (g_log_fd < 0)
+    (void)pthread_once(&g_atfork_once, log_register_atfork);
+
+    for (opened = 0; opened < LOG_SEGMENT_COUNT; ++opened)
     {
-        goto cleanup;
+        (void)snprintf(segment_path, sizeof(segment_path), "%s.%zu", path, opened);
+        g_segments[opened].fd = open(segment_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (g_segments[opened].fd < 0)
+        {
+            goto cleanup;
+        }
+        g_segments[opened].base = 0;
+        g_segments[opened].size = 0;
+    }
+    g_current = 0;
+    g_end = 0;
+    g_log_open = 1;
+
+    // a new log repeats nothing of the previous one
+    for (size_t i = 0; i < LOG_SITES_MAX; ++i)
+    {
+        atomic_store_explicit(&g_sites[i].last_hash, 0, memory_order_relaxed);
+        atomic_store_explicit(&g_sites[i].repeats, 0, memory_order_relaxed);
     }
 
+    ring_reset();
+    atomic_store_explicit(&g_ring.running, 1, memory_order_release);
+
+    // the flusher must not take signals meant for the reactor's signalfd
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (0 != pthread_create(&g_ring.flusher, NULL, flusher_main, NULL))
+    {
+        // producers still drain the ring themselves whenever it fills up
+        atomic_store_explicit(&g_ring.running, 0, memory_order_release);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
     status = LOG_OK;
 
 cleanup:
+    if (LOG_OK != status)
+    {
+        while (opened > 0)
+        {
+            close(g_segments[--opened].fd);
+        }
+    }
     return status;
 }
 
+/* Logs the repeat counts pending, or only those whose window is over. */
+static void flush_repeats(int expired_only)
+{
+    unsigned count = atomic_load_explicit(&g_site_count, memory_order_acquire);
+    uint64_t time_ns = now_ns();
+    uint64_t start = 0;
+
+    count = (count < LOG_SITES_MAX) ? count : LOG_SITES_MAX;
+    for (unsigned id = 1; id < count; ++id)
+    {
+        if (0 == atomic_load_explicit(&g_sites[id].repeats, memory_order_relaxed))
+        {
+            continue;
+        }
+
+        start = atomic_load_explicit(&g_sites[id].window_start, memory_order_relaxed);
+        if (expired_only && time_ns - start < (uint64_t)LOG_REPEAT_WINDOW_MS * NS_PER_MS)
+        {
+            continue;
+        }
+
+        site_flush_repeats(id, time_ns);
+        // so that the next identical line is written in full
+        atomic_store_explicit(&g_sites[id].last_hash, 0, memory_order_relaxed);
+    }
+}
+
+void log_flush(void)
+{
+    flush_repeats(0);
+    (void)ring_drain();
+}
+
 void log_destroy()
 {
-    if (g_log_fd > 0)
+    if (0 != atomic_exchange_explicit(&g_ring.running, 0, memory_order_acq_rel))
+    {
+        flusher_wake();
+        pthread_join(g_ring.flusher, NULL);
+    }
+
+    log_flush();
+
+    if (0 != g_log_open)
+    {
+        g_log_open = 0;
+        for (size_t i = 0; i < LOG_SEGMENT_COUNT; ++i)
+        {
+            close(g_segments[i].fd);
+            g_segments[i].fd = -1;
+        }
+    }
+}
+
+log_status_t log_record(log_site_t *site, ...)
+{
+    log_status_t status = LOG_FAILED;
+    unsigned id = 0;
+    va_list args;
+
+    if (NULL == site || NULL == site->format)
+    {
+        status = LOG_INVALID;
+        goto cleanup;
+    }
+
+    id = atomic_load_explicit(&site->id, memory_order_acquire);
+    if (0 == id)
+    {
+        id = site_register(site);
+    }
+
+    va_start(args, site);
+    status = log_write(id, site, site->format, args);
+    va_end(args);
+
+cleanup:
+    return status;
+}
+
+int log_enabled(log_site_t *site)
+{
+    unsigned id = 0;
+
+    if (NULL == site)
+    {
+        return 0;
+    }
+
+    id = atomic_load_explicit(&site->id, memory_order_acquire);
+    if (0 == id)
+    {
+        id = site_register(site);
+    }
+
+    // a site without an id (table full) follows the default level
+    return site->level >= module_level((0 == id) ? LOG_MODULES_MAX : g_sites[id].module);
+}
+
+log_status_t log_set_level(const char *module, int level)
+{
+    log_status_t status = LOG_INVALID;
+    size_t count = 0;
+    size_t index = 0;
+    int found = 0;
+
+    if (level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_NONE)
+    {
+        goto cleanup;
+    }
+
+    if (NULL == module)
+    {
+        atomic_store_explicit(&g_default_level, level, memory_order_relaxed);
+    }
+
+    count = atomic_load_explicit(&g_module_count, memory_order_acquire);
+    count = (count < LOG_MODULES_MAX) ? count : LOG_MODULES_MAX;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (0 != atomic_load_explicit(&g_modules[i].ready, memory_order_acquire) &&
+            (NULL == module || 0 == strcmp(g_modules[i].name, module)))
+        {
+            atomic_store_explicit(&g_modules[i].level, level, memory_order_relaxed);
+            found = 1;
+        }
+    }
+
+    // a module whose sites weren't reached yet starts at its level
+    if (NULL != module && 0 == found)
+    {
+        status = LOG_NOMEM;
+        index = module_find(module, strlen(module), 1);
+        if (LOG_MODULES_MAX == index)
+        {
+            goto cleanup;
+        }
+        atomic_store_explicit(&g_modules[index].level, level, memory_order_relaxed);
+    }
+
+    status = LOG_OK;
+
+cleanup:
+    return status;
+}
+
+log_status_t log_set_levels(const char *spec)
+{
+    static const char *names[] = {
+        [LOG_LEVEL_DEBUG] = "debug", [LOG_LEVEL_INFO] = "info",
+        [LOG_LEVEL_ERROR] = "error", [LOG_LEVEL_NONE] = "none",
+    };
+    log_status_t status = LOG_INVALID;
+    char module[LOG_MODULE_NAME_MAX];
+    const char *item = spec;
+    const char *end = NULL;
+    const char *equal = NULL;
+    const char *level = NULL;
+    size_t level_len = 0;
+    int found = 0;
+
+    if (NULL == spec)
+    {
+        goto cleanup;
+    }
+
+    while ('\0' != *item)
     {
-        close(g_log_fd);
-        g_log_fd = -1;
+        end = strchr(item, ',');
+        end = (NULL == end) ? item + strlen(item) : end;
+        equal = memchr(item, '=', (size_t)(end - item));
+        level = (NULL == equal) ? item : equal + 1;
+        level_len = (size_t)(end - level);
+
+        found = -1;
+        for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_NONE; ++i)
+        {
+            if (strlen(names[i]) == level_len && 0 == strncmp(names[i], level, level_len))
+            {
+                found = i;
+            }
+        }
+        if (-1 == found || (NULL != equal && (size_t)(equal - item) >= sizeof(module)))
+        {
+            goto cleanup;
+        }
+
+        if (NULL != equal)
+        {
+            memcpy(module, item, (size_t)(equal - item));
+            module[equal - item] = '\0';
+        }
+
+        status = log_set_level((NULL == equal) ? NULL : module, found);
+        if (LOG_OK != status)
+        {
+            goto cleanup;
+        }
+        status = LOG_INVALID;
+
+        item = ('\0' == *end) ? end : end + 1;
     }
+
+    status = LOG_OK;
+
+cleanup:
+    return status;
 }
 
 log_status_t log_str(const char *format, ...)
@@ -121,7 +1380,7 @@ log_status_t log_str(const char *format, ...)
     }
 
     va_start(args, format);
-    status = log_write(format, args);
+    status = log_write(0, NULL, format, args);
     va_end(args);
 
 cleanup:
@@ -131,21 +1390,54 @@ cleanup:
 log_status_t log_read_all(uint8_t **out_buf, size_t *out_size)
 {
     log_status_t status = LOG_FAILED;
+    uint64_t start = 0;
+    uint64_t next = 0;
+    uint64_t end = 0;
+
+    if (NULL == out_buf || NULL == out_size)
+    {
+        status = LOG_INVALID;
+        goto cleanup;
+    }
+
+    status = log_read_from(0, LOG_SEGMENT_COUNT * LOG_SEGMENT_SIZE, out_buf, out_size, &start, &next, &end);
+
+cleanup:
+    return status;
+}
+
+log_status_t log_read_from(uint64_t cursor, size_t limit, uint8_t **out_buf, size_t *out_size,
+			   uint64_t *out_start, uint64_t *out_next, uint64_t *out_end)
+{
+    log_status_t status = LOG_FAILED;
+    uint8_t *records = NULL;
+    size_t size = 0;
+    size_t used = 0;
 
-    if (g_log_fd < 0 || NULL == out_buf || NULL == out_size)
+    if (0 == g_log_open || NULL == out_buf || NULL == out_size ||
+        NULL == out_start || NULL == out_next || NULL == out_end)
     {
         status = LOG_INVALID;
         goto cleanup;
     }
 
-    if (FILE_OK != read_file(g_log_fd, out_buf, out_size))
+    log_flush();
+
+    status = segments_read(cursor, limit, &records, &size, out_start, out_end);
+    if (LOG_OK != status)
     {
         goto cleanup;
     }
 
-    status = LOG_OK;
+    status = render_all(records, size, out_buf, out_size, &used);
+    if (LOG_OK != status)
+    {
+        goto cleanup;
+    }
+
+    *out_next = *out_start + used;
 
 cleanup:
+    free(records);
     return status;
 }
-
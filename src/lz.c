@@ -0,0 +1,291 @@
+/**
+ * filename: lz.c
+ * description: Fast LZ77 block codec (LZ4 block format compatible)
+ */
+
+// C includes
+#include <string.h>
+
+// User includes
+#include "lz.h"
+#include "log.h"
+
+// defines
+#define LZ_HASH_LOG       (12)
+#define LZ_HASH_SIZE      (1 << LZ_HASH_LOG)
+#define LZ_HASH_PRIME     (2654435761U)
+#define LZ_MIN_MATCH      (4)
+#define LZ_LAST_LITERALS  (5)
+#define LZ_MF_LIMIT       (12)
+#define LZ_MAX_DISTANCE   (65535)
+#define LZ_RUN_MASK       (15)
+#define LZ_SKIP_TRIGGER   (6)
+
+static uint32_t read32(const uint8_t *ptr)
+{
+    uint32_t value = 0;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+    return (sequence * LZ_HASH_PRIME) >> (32 - LZ_HASH_LOG);
+}
+
+/* Writes a length continuation (the part past the 4-bit token field). */
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static lz_status_t emit_sequence(uint8_t **op_ptr, uint8_t *op_end,
+				 const uint8_t *literals, size_t literal_len,
+				 size_t offset, size_t match_len)
+{
+    lz_status_t status = LZ_NOSPACE;
+    uint8_t *op = *op_ptr;
+    uint8_t *token = NULL;
+    size_t match_code = 0;
+
+    // token + literal length + literals + offset + match length, worst case
+    if ((size_t)(op_end - op) < 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1)
+    {
+        goto cleanup;
+    }
+
+    token = op++;
+    if (literal_len >= LZ_RUN_MASK)
+    {
+        *token = LZ_RUN_MASK << 4;
+        op = write_length(op, literal_len - LZ_RUN_MASK);
+    }
+    else
+    {
+        *token = (uint8_t)(literal_len << 4);
+    }
+
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    // the last sequence is literals only
+    if (0 != match_len)
+    {
+        *op++ = (uint8_t)(offset & 0xff);
+        *op++ = (uint8_t)(offset >> 8);
+
+        match_code = match_len - LZ_MIN_MATCH;
+        if (match_code >= LZ_RUN_MASK)
+        {
+            *token |= LZ_RUN_MASK;
+            op = write_length(op, match_code - LZ_RUN_MASK);
+        }
+        else
+        {
+            *token |= (uint8_t)match_code;
+        }
+    }
+
+    *op_ptr = op;
+    status = LZ_OK;
+cleanup:
+    return status;
+}
+
+lz_status_t lz_compress(const uint8_t *src, size_t src_len,
+			uint8_t *dst, size_t dst_capacity, size_t *out_len)
+{
+    lz_status_t status = LZ_INVALID;
+    uint32_t table[LZ_HASH_SIZE] = {0};
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_capacity;
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t ref = 0;
+    size_t match_len = 0;
+    size_t match_limit = 0;
+    size_t search_limit = 0;
+    uint32_t sequence = 0;
+    uint32_t hash = 0;
+
+    ASSERT_NOT_NULL(src, cleanup, "src is NULL");
+    ASSERT_NOT_NULL(dst, cleanup, "dst is NULL");
+    ASSERT_NOT_NULL(out_len, cleanup, "out_len is NULL");
+
+    *out_len = 0;
+
+    if (src_len > UINT32_MAX)
+    {
+        ERROR(cleanup, "input too large");
+    }
+
+    // the format requires the last bytes to be literals
+    if (src_len > LZ_MF_LIMIT)
+    {
+        search_limit = src_len - LZ_MF_LIMIT;
+        match_limit = src_len - LZ_LAST_LITERALS;
+    }
+
+    while (ip < search_limit)
+    {
+        sequence = read32(src + ip);
+        hash = lz_hash(sequence);
+        ref = table[hash];
+        table[hash] = (uint32_t)ip;
+
+        if (ref >= ip || ip - ref > LZ_MAX_DISTANCE || read32(src + ref) != sequence)
+        {
+            // step faster through data that doesn't compress
+            ip += 1 + ((ip - anchor) >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+
+        // extend backwards over pending literals, then forwards
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+        {
+            --ip;
+            --ref;
+        }
+
+        match_len = LZ_MIN_MATCH;
+        while (ip + match_len < match_limit && src[ref + match_len] == src[ip + match_len])
+        {
+            ++match_len;
+        }
+
+        status = emit_sequence(&op, op_end, src + anchor, ip - anchor, ip - ref, match_len);
+        if (LZ_OK != status)
+        {
+            goto cleanup;
+        }
+
+        ip += match_len;
+        anchor = ip;
+
+        // cheap insert of the position just before the next search
+        if (ip - 2 < search_limit)
+        {
+            table[lz_hash(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+        }
+    }
+
+    status = emit_sequence(&op, op_end, src + anchor, src_len - anchor, 0, 0);
+    if (LZ_OK != status)
+    {
+        goto cleanup;
+    }
+
+    *out_len = (size_t)(op - dst);
+    status = LZ_OK;
+cleanup:
+    return status;
+}
+
+/* Reads a length continuation, returns 0 if it runs past `end`. */
+static int read_length(const uint8_t **ip_ptr, const uint8_t *end, size_t *len)
+{
+    const uint8_t *ip = *ip_ptr;
+    uint8_t byte = 255;
+
+    while (255 == byte)
+    {
+        if (ip >= end)
+        {
+            return 0;
+        }
+        byte = *ip++;
+        *len += byte;
+    }
+
+    *ip_ptr = ip;
+    return 1;
+}
+
+lz_status_t lz_decompress(const uint8_t *src, size_t src_len,
+			  uint8_t *dst, size_t dst_capacity, size_t *out_len)
+{
+    lz_status_t status = LZ_INVALID;
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_capacity;
+    const uint8_t *match = NULL;
+    uint8_t token = 0;
+    size_t literal_len = 0;
+    size_t match_len = 0;
+    size_t offset = 0;
+
+    ASSERT_NOT_NULL(src, cleanup, "src is NULL");
+    ASSERT_NOT_NULL(dst, cleanup, "dst is NULL");
+    ASSERT_NOT_NULL(out_len, cleanup, "out_len is NULL");
+
+    *out_len = 0;
+
+    while (ip < ip_end)
+    {
+        token = *ip++;
+
+        literal_len = token >> 4;
+        if (LZ_RUN_MASK == literal_len && 0 == read_length(&ip, ip_end, &literal_len))
+        {
+            ERROR(cleanup, "truncated literal length");
+        }
+        if (literal_len > (size_t)(ip_end - ip) || literal_len > (size_t)(op_end - op))
+        {
+            ERROR(cleanup, "literals out of bounds");
+        }
+
+        memcpy(op, ip, literal_len);
+        op += literal_len;
+        ip += literal_len;
+
+        // the last sequence has no match
+        if (ip == ip_end)
+        {
+            break;
+        }
+
+        if (ip_end - ip < 2)
+        {
+            ERROR(cleanup, "truncated offset");
+        }
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        if (0 == offset || offset > (size_t)(op - dst))
+        {
+            ERROR(cleanup, "invalid offset");
+        }
+
+        match_len = token & LZ_RUN_MASK;
+        if (LZ_RUN_MASK == match_len && 0 == read_length(&ip, ip_end, &match_len))
+        {
+            ERROR(cleanup, "truncated match length");
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (match_len > (size_t)(op_end - op))
+        {
+            ERROR(cleanup, "match out of bounds");
+        }
+
+        // byte by byte, matches may overlap their own output
+        match = op - offset;
+        for (size_t i = 0; i < match_len; ++i)
+        {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+
+    *out_len = (size_t)(op - dst);
+    status = LZ_OK;
+cleanup:
+    return status;
+}
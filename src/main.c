@@ -10,6 +10,8 @@
 #include "file.h"
 #include "log.h"
 #include "exec.h"
+#include "delta.h"
+#include "lz.h"
 
 int test_file()
 {
@@ -189,6 +191,75 @@ cleanup:
     }
 }
 
+typedef struct delta_test_s
+{
+    const uint8_t *data;
+    size_t delta_size;
+} delta_test_t;
+
+static delta_status_t read_delta_data(void *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    memcpy(buf, ((delta_test_t *)ctx)->data + offset, len);
+    return DELTA_OK;
+}
+
+static delta_status_t count_delta_bytes(void *ctx, const uint8_t *buf, size_t len)
+{
+    (void)buf;
+    ((delta_test_t *)ctx)->delta_size += len;
+    return DELTA_OK;
+}
+
+void test_delta(void)
+{
+    enum { BLOCK = 256, BLOCKS = 64 };
+    uint8_t old_data[BLOCK * BLOCKS];
+    uint8_t new_data[BLOCK * BLOCKS];
+    delta_sig_t sigs[BLOCKS];
+    delta_test_t test = { .data = new_data };
+    delta_status_t status = DELTA_FAILED;
+
+    for (size_t i = 0; i < sizeof(old_data); ++i)
+    {
+        old_data[i] = (uint8_t)(rand() & 0xff);
+    }
+    for (size_t i = 0; i < BLOCKS; ++i)
+    {
+        sigs[i].weak = delta_weak_checksum(old_data + i * BLOCK, BLOCK);
+        sigs[i].strong = delta_strong_hash(old_data + i * BLOCK, BLOCK);
+    }
+
+    // shift everything by 3 bytes, only the head and tail should be literal
+    memcpy(new_data, "abc", 3);
+    memcpy(new_data + 3, old_data, sizeof(new_data) - 3);
+
+    status = delta_generate(sizeof(new_data), BLOCK, sigs, BLOCKS, read_delta_data, count_delta_bytes, &test);
+    printf("delta status %d: %zu bytes for a %zu byte file (should be small)\n", status, test.delta_size, sizeof(new_data));
+}
+
+void test_lz(void)
+{
+    const char *line = "INFO | network.c | handle_command_loop | command done\n";
+    uint8_t input[8192];
+    uint8_t packed[8192];
+    uint8_t unpacked[8192];
+    size_t packed_len = 0;
+    size_t unpacked_len = 0;
+    lz_status_t status = LZ_FAILED;
+
+    for (size_t i = 0; i < sizeof(input); ++i)
+    {
+        input[i] = (uint8_t)line[i % strlen(line)];
+    }
+
+    status = lz_compress(input, sizeof(input), packed, sizeof(packed), &packed_len);
+    printf("lz_compress status %d: %zu -> %zu bytes\n", status, sizeof(input), packed_len);
+
+    status = lz_decompress(packed, packed_len, unpacked, sizeof(unpacked), &unpacked_len);
+    printf("lz_decompress status %d: %zu bytes, round trip %s\n", status, unpacked_len,
+           (unpacked_len == sizeof(input) && 0 == memcmp(input, unpacked, unpacked_len)) ? "OK" : "MISMATCH");
+}
+
 int main(void)
 {
     for (int i = 0; i < 3; i++) {
@@ -203,6 +274,10 @@ int main(void)
 	test_exec();
 	printf("\n\n----------------------------------------------------test_log-------------------------------------------------------------\n\n");
 	test_log();
+	printf("\n\n----------------------------------------------------test_delta-----------------------------------------------------------\n\n");
+	test_delta();
+	printf("\n\n----------------------------------------------------test_lz--------------------------------------------------------------\n\n");
+	test_lz();
         log_destroy();
     }
     return 0;
@@ -5,12 +5,17 @@
 
 // C includes
 #include <arpa/inet.h>
+#include <endian.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 // User includes
 #include "network.h"
@@ -18,462 +23,2583 @@
 #include "log.h"
 #include "file.h"
 #include "exec.h"
+#include "delta.h"
+#include "lz.h"
+#include "prefetch.h"
+#include "worker.h"
+#include "frame.h"
+#include "arena.h"
+
+// defines
+#define READ_PAD_SIZE 4096
+#define DELTA_SIG_WIRE_SIZE (sizeof(uint32_t) + sizeof(uint64_t))
+#define AGENT_CAPS (CAP_LZ | CAP_MUX)
+#define COMPRESS_MIN_SIZE 512
+#define COMPRESS_MAX_FILE_SIZE (64 * 1024 * 1024)
+#define KEEPALIVE_IDLE_SEC 30
+#define KEEPALIVE_INTERVAL_SEC 10
+#define KEEPALIVE_PROBES 3
+#define SESSION_SPARE_ARENAS (WORKER_THREADS + 1)
+#define RESULT_PARTS_MAX (FRAME_IOV_MAX - 1)
+#define GET_FILES_INLINE_MAX (64 * 1024)
+#define GET_FILES_WINDOW 16
+#define GET_FILES_ENTRY_HEADER_SIZE (sizeof(int32_t) + sizeof(uint64_t) + sizeof(uint32_t))
+#define COMMAND_HEADER_MAX (sizeof(uint8_t) + sizeof(uint32_t) * 2)
+
+/* A command read in as many steps as it takes to arrive. */
+typedef struct cmd_reader_s
+{
+    uint8_t header[COMMAND_HEADER_MAX];     // code | [request_id] | len
+    size_t header_len;                      // 0 until the first byte of a command is expected
+    size_t header_done;
+    uint8_t *payload;
+    size_t payload_len;
+    size_t payload_done;
+} cmd_reader_t;
+
+typedef struct exec_pending_s exec_pending_t;
+
+typedef struct session_s
+{
+    int fd;
+    const tool_t *tool;
+    reactor_t *reactor;
+    reactor_source_t *source;   // the socket, paused while the session waits on its own commands
+    int connected;
+    int paused;
+    cmd_reader_t reader;
+    arena_t *arena;             // the command being read
+    exec_pending_t *execs;      // exec commands supervised by the reactor
+    size_t exec_count;
+    int exec_inline;            // without CAP_MUX the next command waits for the exec's reply
+    int held;                   // a barrier command waits for the execs in flight
+    uint8_t held_code;
+    uint32_t held_request_id;
+    uint8_t *held_payload;
+    size_t held_payload_len;
+    int eof;                    // the controller closed its side
+    int closing;                // the session failed and waits for its execs to be killed
+    network_status_t end_status;
+    unsigned int sleep_duration;
+    int should_die;
+    network_done_cb_t on_done;
+    void *done_ctx;
+    frame_conn_t conn;          // buffered reads and writes on fd
+    uint32_t caps;
+    pthread_mutex_t send_lock;  // one reply on the socket at a time
+    worker_pool_t *workers;     // running while CAP_MUX is enabled
+    reactor_source_t *jobs_wake; // fires once jobs went down while the reactor waited on them
+    atomic_size_t jobs;         // submitted to the workers and not finished yet
+    atomic_int jobs_waiting;    // the reactor wants a wake when a job finishes
+    atomic_int failed;          // a worker hit a fatal error
+    pthread_mutex_t arena_lock;
+    arena_t *spare_arenas[SESSION_SPARE_ARENAS];  // reset arenas kept for the next commands
+    size_t spare_count;
+} session_t;
+
+/* A CMD_EXEC_STREAM reply in progress, each piece of it takes the socket on its own. */
+typedef struct exec_relay_s
+{
+    session_t *session;
+    uint32_t request_id;
+    int header_sent;
+} exec_relay_t;
+
+/* Fixed size fields of an exec result, the output itself is sent from where it was captured. */
+typedef struct exec_response_s
+{
+    uint8_t head[sizeof(int32_t) + sizeof(uint32_t)];               // exit_code | stdout_len
+    uint8_t stderr_len[sizeof(uint32_t)];
+    uint8_t trailer[sizeof(uint8_t) + sizeof(uint64_t) * 2];        // truncated | stdout_total | stderr_total
+} exec_response_t;
+
+/*
+ * A run of consecutive GET_FILES entries that are small enough to be read
+ * into memory, or missing, and sent with a single writev.
+ */
+typedef struct files_window_s
+{
+    size_t first;                   // entry index of slot 0
+    size_t count;
+    file_read_t reads[GET_FILES_WINDOW];
+    uint8_t missing[GET_FILES_WINDOW];
+    uint8_t headers[GET_FILES_WINDOW][GET_FILES_ENTRY_HEADER_SIZE];
+    uint8_t *buf;                   // GET_FILES_WINDOW slots of GET_FILES_INLINE_MAX bytes
+} files_window_t;
+
+struct exec_pending_s
+{
+    session_t *session;
+    arena_t *arena;             // holds this, the command's payload and its reply
+    uint32_t request_id;
+    int capped;
+    exec_job_t *job;
+    exec_pending_t *prev;
+    exec_pending_t *next;
+};
+
+typedef struct mux_job_s
+{
+    session_t *session;
+    uint32_t request_id;
+    uint8_t code;
+    uint8_t *payload;
+    size_t payload_len;
+    arena_t *arena;             // holds the job, its payload and its result
+} mux_job_t;
+
+/* A reply built on the reactor, sent by a worker so the reactor never waits for the socket. */
+typedef struct reply_job_s
+{
+    session_t *session;
+    arena_t *arena;             // holds this and whatever the parts point to
+    uint32_t request_id;
+    int32_t ret_code;
+    struct iovec parts[RESULT_PARTS_MAX];
+    int part_count;
+} reply_job_t;
+
+/*
+ * Hands out an arena for one command. Arenas are recycled per session so the
+ * bump region is only malloc'ed once per concurrent command.
+ */
+static arena_t *session_arena_get(session_t *session)
+{
+    arena_t *arena = NULL;
+
+    pthread_mutex_lock(&session->arena_lock);
+    if (0 != session->spare_count)
+    {
+        arena = session->spare_arenas[--session->spare_count];
+    }
+    pthread_mutex_unlock(&session->arena_lock);
+
+    if (NULL != arena)
+    {
+        goto cleanup;
+    }
+
+    arena = malloc(sizeof(*arena));
+    ASSERT_NOT_NULL(arena, cleanup, "malloc failed: %s", strerror(errno));
+
+    if (ARENA_OK != arena_init(arena, ARENA_DEFAULT_SIZE))
+    {
+        free(arena);
+        arena = NULL;
+        ERROR(cleanup, "arena_init failed");
+    }
+
+cleanup:
+    return arena;
+}
+
+/* Releases everything the command allocated and keeps the arena for reuse. */
+static void session_arena_put(session_t *session, arena_t *arena)
+{
+    if (NULL == arena)
+    {
+        return;
+    }
+
+    arena_reset(arena);
+
+    pthread_mutex_lock(&session->arena_lock);
+    if (session->spare_count < SESSION_SPARE_ARENAS)
+    {
+        session->spare_arenas[session->spare_count++] = arena;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&session->arena_lock);
+
+    if (NULL != arena)
+    {
+        arena_destroy(arena);
+        free(arena);
+    }
+}
+
+static void session_arenas_destroy(session_t *session)
+{
+    for (size_t i = 0; i < session->spare_count; ++i)
+    {
+        arena_destroy(session->spare_arenas[i]);
+        free(session->spare_arenas[i]);
+    }
+    session->spare_count = 0;
+}
+
+/*
+ * Compresses the concatenation of `parts`. A single part is compressed in
+ * place, several are gathered first, which only pays off up to
+ * COMPRESS_MAX_FILE_SIZE.
+ */
+static network_status_t compress_result(const struct iovec *parts,
+                                        int part_count,
+                                        size_t payload_len,
+                                        byte_buf_t *packed)
+{
+    network_status_t status = NETWORK_FAILED;
+    byte_buf_t gathered = {0};
+    const uint8_t *payload = NULL;
+    size_t compressed_len = 0;
+    uint32_t net_raw_len = htonl((uint32_t)payload_len);
+
+    if (1 == part_count)
+    {
+	payload = parts[0].iov_base;
+    }
+    else
+    {
+	if (payload_len > COMPRESS_MAX_FILE_SIZE)
+	{
+	    status = NETWORK_INVALID;
+	    goto cleanup;
+	}
+
+	ASSERT_RET_EQ(FILE_OK, byte_buf_reserve(&gathered, payload_len), cleanup, "byte_buf_reserve failed");
+	for (int i = 0; i < part_count; ++i)
+	{
+	    ASSERT_RET_EQ(FILE_OK, byte_buf_append(&gathered, parts[i].iov_base, parts[i].iov_len), cleanup,
+			  "byte_buf_append failed");
+	}
+	payload = gathered.data;
+    }
+
+    ASSERT_RET_EQ(FILE_OK, byte_buf_reserve(packed, payload_len), cleanup, "byte_buf_reserve failed");
+
+    // capacity below the raw size, so only results that shrink are compressed
+    if (LZ_OK != lz_compress(payload, payload_len, packed->data + sizeof(net_raw_len),
+			     payload_len - sizeof(net_raw_len), &compressed_len))
+    {
+	status = NETWORK_INVALID;
+	goto cleanup;
+    }
 
-static network_status_t send_cmd_result(int fd,
+    memcpy(packed->data, &net_raw_len, sizeof(net_raw_len));
+    packed->size = compressed_len + sizeof(net_raw_len);
+
+    status = NETWORK_OK;
+cleanup:
+    byte_buf_release(&gathered);
+    return status;
+}
+
+/*
+ * Sends a result frame whose payload is the concatenation of `parts`, so
+ * callers don't have to pack a payload they already hold in pieces.
+ * A part with a NULL base is counted in the length but not sent: the header
+ * goes out right away and the caller writes that part to the fd itself.
+ */
+static network_status_t send_cmd_result_vec(session_t *session,
+                                            int32_t ret_code,
+                                            const struct iovec *parts,
+                                            int part_count)
+{
+    network_status_t status = NETWORK_FAILED;
+    int32_t net_ret_code = htonl(ret_code);
+    uint32_t net_payload_length = 0;
+    uint8_t header[sizeof(net_ret_code) + sizeof(uint8_t) + sizeof(net_payload_length)] = {0};
+    size_t header_len = 0;
+    struct iovec iov[FRAME_IOV_MAX];
+    int iov_count = 0;
+    size_t payload_len = 0;
+    int header_only = 0;
+    uint8_t flags = 0;
+    byte_buf_t packed = {0};
+
+    if (part_count < 0 || part_count > FRAME_IOV_MAX - 1)
+    {
+	ERROR(cleanup, "too many result parts: %d", part_count);
+    }
+
+    for (int i = 0; i < part_count; ++i)
+    {
+	payload_len += parts[i].iov_len;
+	header_only |= (NULL == parts[i].iov_base && 0 != parts[i].iov_len);
+    }
+
+    if (payload_len > UINT32_MAX)
+    {
+	ERROR(cleanup, "payload too large for a result frame: %zu", payload_len);
+    }
+
+    if (0 != (session->caps & CAP_LZ) && 0 == header_only && payload_len >= COMPRESS_MIN_SIZE &&
+	NETWORK_OK == compress_result(parts, part_count, payload_len, &packed))
+    {
+	flags |= RESULT_FLAG_LZ;
+	iov[1].iov_base = packed.data;
+	iov[1].iov_len = packed.size;
+	iov_count = 2;
+	payload_len = packed.size;
+    }
+    else
+    {
+	for (int i = 0; i < part_count; ++i)
+	{
+	    if (NULL != parts[i].iov_base)
+	    {
+		iov[1 + iov_count++] = parts[i];
+	    }
+	}
+	++iov_count;
+    }
+
+    // cast safe because we checked size is smaller than UINT32_MAX
+    net_payload_length = htonl((uint32_t)payload_len);
+
+    memcpy(header, &net_ret_code, sizeof(net_ret_code));
+    header_len = sizeof(net_ret_code);
+    if (0 != (session->caps & CAP_LZ))
+    {
+	header[header_len++] = flags;
+    }
+    memcpy(header + header_len, &net_payload_length, sizeof(net_payload_length));
+    header_len += sizeof(net_payload_length);
+
+    // header and payload leave together
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+    ASSERT_RET_EQ(FRAME_OK, frame_write(&session->conn, iov, iov_count), cleanup, "frame_write failed");
+
+    if (header_only)
+    {
+	ASSERT_RET_EQ(FRAME_OK, frame_flush(&session->conn), cleanup, "frame_flush failed");
+    }
+
+    status = NETWORK_OK;
+cleanup:
+    // compression buffers are per reply, the pool keeps them around for the next one
+    byte_buf_release(&packed);
+    return status;
+}
+
+/* send_cmd_result_vec of a single buffer, a NULL payload sends the header only. */
+static network_status_t send_cmd_result(session_t *session,
                                         int32_t ret_code,
                                         const uint8_t *payload,
                                         size_t payload_len)
+{
+    struct iovec part = { .iov_base = (void *)payload, .iov_len = payload_len };
+
+    return send_cmd_result_vec(session, ret_code, &part, 1);
+}
+
+static network_status_t reply_begin(session_t *session, uint32_t request_id)
+{
+    network_status_t status = NETWORK_FAILED;
+    uint32_t net_request_id = htonl(request_id);
+
+    pthread_mutex_lock(&session->send_lock);
+
+    // with CAP_MUX every reply starts with the id of the command it answers
+    if (0 != (session->caps & CAP_MUX))
+    {
+	struct iovec iov = { .iov_base = &net_request_id, .iov_len = sizeof(net_request_id) };
+	ASSERT_RET_EQ(FRAME_OK, frame_write(&session->conn, &iov, 1), cleanup, "write request id failed");
+    }
+
+    status = NETWORK_OK;
+cleanup:
+    if (NETWORK_OK != status)
+    {
+	pthread_mutex_unlock(&session->send_lock);
+    }
+    return status;
+}
+
+static network_status_t reply_end(session_t *session)
+{
+    network_status_t status = NETWORK_OK;
+
+    // the reader is blocked on the socket, nobody else would flush a worker's reply
+    if (0 != (session->caps & CAP_MUX) && FRAME_OK != frame_flush(&session->conn))
+    {
+	status = NETWORK_FAILED;
+    }
+
+    pthread_mutex_unlock(&session->send_lock);
+    return status;
+}
+
+static network_status_t session_flush(session_t *session)
+{
+    network_status_t status = NETWORK_FAILED;
+
+    // with CAP_MUX reply_end flushed every reply already, and a worker may hold
+    // the lock for as long as a slow controller takes to read its reply
+    if (0 != (session->caps & CAP_MUX))
+    {
+	return NETWORK_OK;
+    }
+
+    pthread_mutex_lock(&session->send_lock);
+    if (FRAME_OK == frame_flush(&session->conn))
+    {
+	status = NETWORK_OK;
+    }
+    pthread_mutex_unlock(&session->send_lock);
+
+    return status;
+}
+
+static network_status_t send_stream_header(int fd,
+                                           int32_t ret_code,
+                                           uint64_t total_len)
 {
     network_status_t status = NETWORK_FAILED;
     int32_t net_ret_code = htonl(ret_code);
-    uint32_t net_payload_length = htonl(payload_len);
+    uint64_t net_total_len = htobe64(total_len);
+
+    struct iovec iov[2] = {
+	{ .iov_base = &net_ret_code, .iov_len = sizeof(net_ret_code) },
+	{ .iov_base = &net_total_len, .iov_len = sizeof(net_total_len) },
+    };
+
+    ASSERT_RET_EQ(FILE_OK, write_vec_all(fd, iov, 2), cleanup, "write stream header failed");
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+static network_status_t send_stream_chunk(int fd,
+                                          const uint8_t *chunk,
+                                          uint32_t chunk_len)
+{
+    network_status_t status = NETWORK_FAILED;
+    uint32_t net_chunk_len = htonl(chunk_len);
+
+    ASSERT_NOT_NULL(chunk, cleanup, "chunk was NULL");
+
+    if (STREAM_CHUNK_END == chunk_len || STREAM_CHUNK_ABORT == chunk_len)
+    {
+	ERROR(cleanup, "invalid chunk length %u", chunk_len);
+    }
+
+    struct iovec iov[2] = {
+	{ .iov_base = &net_chunk_len, .iov_len = sizeof(net_chunk_len) },
+	{ .iov_base = (void *)chunk, .iov_len = chunk_len },
+    };
+
+    ASSERT_RET_EQ(FILE_OK, write_vec_all(fd, iov, 2), cleanup, "write chunk failed");
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+static network_status_t send_stream_end(int fd, uint32_t marker)
+{
+    network_status_t status = NETWORK_FAILED;
+    uint32_t net_marker = htonl(marker);
+
+    ASSERT_RET_EQ(FILE_OK, write_all(fd, (uint8_t*)(&net_marker), sizeof(net_marker)), cleanup, "write end marker failed");
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+/*
+ * Reads the next command as far as the socket has it. Returns NETWORK_AGAIN
+ * until it is complete, the part read so far is kept in session->reader and
+ * the payload in `arena`, which has to be the same until then.
+ */
+static network_status_t read_command(session_t *session,
+                                    arena_t *arena,
+                                    uint8_t **out_payload,
+                                    size_t *out_payload_len,
+                                    uint8_t *out_code,
+                                    uint32_t *out_request_id)
+{
+    network_status_t status = NETWORK_FAILED;
+    frame_status_t frame_status = FRAME_FAILED;
+    cmd_reader_t *reader = &session->reader;
+    uint32_t net_field = 0;
+    size_t len_offset = sizeof(uint8_t);
+
+    ASSERT_NOT_NULL(out_payload, cleanup, "out_payload NULL");
+    ASSERT_NOT_NULL(out_payload_len, cleanup, "out_payload_len NULL");
+    ASSERT_NOT_NULL(out_code, cleanup, "out_code NULL");
+    ASSERT_NOT_NULL(out_request_id, cleanup, "out_request_id NULL");
+
+    // the framing only changes between commands (CMD_SET_CAPS is a barrier)
+    if (0 != (session->caps & CAP_MUX))
+    {
+	len_offset += sizeof(uint32_t);
+    }
+    if (0 == reader->header_len)
+    {
+	reader->header_len = len_offset + sizeof(uint32_t);
+    }
+
+    if (reader->header_done < reader->header_len)
+    {
+	frame_status = frame_read_some(&session->conn, reader->header, reader->header_len, &reader->header_done);
+	if (FRAME_EOF == frame_status)
+	{
+	    // closed between two commands
+	    status = NETWORK_STOP_COMM;
+	    goto cleanup;
+	}
+	if (FRAME_AGAIN == frame_status)
+	{
+	    status = NETWORK_AGAIN;
+	    goto cleanup;
+	}
+	ASSERT_RET_EQ(FRAME_OK, frame_status, cleanup, "failed reading command header");
+
+	memcpy(&net_field, reader->header + len_offset, sizeof(net_field));
+	reader->payload_len = ntohl(net_field);
+	if (reader->payload_len > 0)
+	{
+	    reader->payload = arena_alloc(arena, reader->payload_len);
+	    ASSERT_NOT_NULL(reader->payload, cleanup, "arena_alloc payload failed");
+	}
+    }
+
+    if (reader->payload_done < reader->payload_len)
+    {
+	frame_status = frame_read_some(&session->conn, reader->payload, reader->payload_len, &reader->payload_done);
+	if (FRAME_AGAIN == frame_status)
+	{
+	    status = NETWORK_AGAIN;
+	    goto cleanup;
+	}
+	ASSERT_RET_EQ(FRAME_OK, frame_status, cleanup, "failed reading payload");
+    }
+
+    *out_code = reader->header[0];
+    *out_request_id = 0;
+    if (0 != (session->caps & CAP_MUX))
+    {
+	memcpy(&net_field, reader->header + sizeof(uint8_t), sizeof(net_field));
+	*out_request_id = ntohl(net_field);
+    }
+    *out_payload = reader->payload;
+    *out_payload_len = reader->payload_len;
+
+    memset(reader, 0, sizeof(*reader));
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+static cmd_status_t handle_unload_logs(arena_t *arena,
+                                       const uint8_t *payload,
+                                       size_t payload_size,
+                                       struct iovec *out_parts,
+                                       int *out_part_count)
+{
+    cmd_status_t status = CMD_FATAL;
+    log_status_t log_status = LOG_FAILED;
+    uint8_t *text = NULL;
+    size_t text_size = 0;
+    uint64_t cursor = 0;
+    uint64_t *positions = NULL;
+
+    ASSERT_NOT_NULL(out_parts, cleanup, "out_parts NULL");
+    ASSERT_NOT_NULL(out_part_count, cleanup, "out_part_count NULL");
+
+    if (0 == payload_size)
+    {
+        ASSERT_RET_EQ(LOG_OK, log_read_all(&text, &text_size), cleanup, "log_read_all failed");
+    }
+    else
+    {
+        if (sizeof(cursor) != payload_size)
+        {
+            // a malformed request, not a broken session: reply -1 like a stale cursor
+            INFO("bad cursor size: %zu", payload_size);
+            status = CMD_ERROR;
+            goto cleanup;
+        }
+        memcpy(&cursor, payload, sizeof(cursor));
+        cursor = be64toh(cursor);
+
+        positions = arena_alloc(arena, sizeof(*positions) * UNLOAD_LOGS_POSITIONS);
+        ASSERT_NOT_NULL(positions, cleanup, "arena_alloc failed");
 
-    ASSERT_RET_EQ(FILE_OK, write_all(fd, (uint8_t*)(&net_ret_code), sizeof(net_ret_code)), cleanup, "write ret code failed");
-    ASSERT_RET_EQ(FILE_OK, write_all(fd, (uint8_t*)(&net_payload_length), sizeof(net_payload_length)), cleanup, "write length failed");
+        log_status = log_read_from(cursor, UNLOAD_LOGS_MAX, &text, &text_size,
+                                   &positions[0], &positions[1], &positions[2]);
+        if (LOG_INVALID == log_status)
+        {
+            INFO("cursor past the end of the log: %llu", (unsigned long long)cursor);
+            status = CMD_ERROR;
+            goto cleanup;
+        }
+        ASSERT_RET_EQ(LOG_OK, log_status, cleanup, "log_read_from failed");
+
+        for (int i = 0; i < UNLOAD_LOGS_POSITIONS; ++i)
+        {
+            positions[i] = htobe64(positions[i]);
+        }
+        out_parts[*out_part_count].iov_base = positions;
+        out_parts[*out_part_count].iov_len = sizeof(*positions) * UNLOAD_LOGS_POSITIONS;
+        ++*out_part_count;
+    }
+
+    if (NULL != text)
+    {
+        // the reply points into the text, so it has to outlive this function
+        ASSERT_RET_EQ(ARENA_OK, arena_adopt(arena, text), cleanup, "arena_adopt failed");
+        out_parts[*out_part_count].iov_base = text;
+        out_parts[*out_part_count].iov_len = text_size;
+        ++*out_part_count;
+    }
+
+    status = CMD_OK;
+cleanup:
+    return status;
+}
+
+static cmd_status_t send_stream_file(int sock_fd, int fd, uint64_t offset, uint64_t total_len)
+{
+    cmd_status_t status = CMD_FATAL;
+    static const uint8_t padding[READ_PAD_SIZE] = {0};
+    file_status_t file_status = FILE_FAILED;
+    uint64_t remaining = total_len;
+    uint32_t chunk_len = 0;
+    uint32_t net_chunk_len = 0;
+    size_t bytes_sent = 0;
+    size_t pad = 0;
+
+    while (remaining > 0)
+    {
+	// cast safe because chunk is at most STREAM_CHUNK_SIZE
+	chunk_len = (remaining < STREAM_CHUNK_SIZE) ? (uint32_t)remaining : STREAM_CHUNK_SIZE;
+	net_chunk_len = htonl(chunk_len);
+
+	ASSERT_RET_EQ(FILE_OK, write_all(sock_fd, (uint8_t*)(&net_chunk_len), sizeof(net_chunk_len)), cleanup, "write chunk length failed");
+
+	file_status = send_file_range(sock_fd, fd, offset, chunk_len, &bytes_sent);
+	if (FILE_OK != file_status)
+	{
+	    // the chunk length is already out, so fill the rest of the chunk
+	    // and tell the controller to drop the stream
+	    INFO("file ended or failed mid chunk (%d), aborting stream", file_status);
+	    for (remaining = chunk_len - bytes_sent; remaining > 0; remaining -= pad)
+	    {
+		pad = (remaining < sizeof(padding)) ? (size_t)remaining : sizeof(padding);
+		ASSERT_RET_EQ(FILE_OK, write_all(sock_fd, padding, pad), cleanup, "write padding failed");
+	    }
+	    ASSERT_RET_EQ(NETWORK_OK, send_stream_end(sock_fd, STREAM_CHUNK_ABORT), cleanup, "send_stream_end failed");
+	    status = CMD_ERROR;
+	    goto cleanup;
+	}
+
+	offset += chunk_len;
+	remaining -= chunk_len;
+    }
+
+    ASSERT_RET_EQ(NETWORK_OK, send_stream_end(sock_fd, STREAM_CHUNK_END), cleanup, "send_stream_end failed");
+
+    status = CMD_OK;
+cleanup:
+    return status;
+}
+
+static cmd_status_t handle_get_file(session_t *session,
+				    arena_t *arena,
+				    const uint8_t *payload,
+				    size_t payload_size)
+{
+    cmd_status_t status = CMD_FATAL;
+    file_status_t file_status = FILE_FAILED;
+    char *path = NULL;
+    int fd = -1;
+    file_info_t info = {0};
+    uint8_t *data = NULL;
+    size_t size = 0;
+
+    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
+
+    path = arena_strndup(arena, payload, payload_size);
+    ASSERT_NOT_NULL(path, cleanup, "arena_strndup failed");
+
+    file_status = open_regular_file(path, &fd, &info);
+    if (FILE_INACCESSIBLE == file_status || FILE_UNSUPPORTED == file_status || info.size > UINT32_MAX)
+    {
+	// files past 4 GiB don't fit the result frame, CMD_GET_FILE_STREAM handles those
+	ASSERT_RET_EQ(NETWORK_OK, send_cmd_result(session, -1, NULL, 0), cleanup, "send_cmd_result failed");
+	status = CMD_ERROR;
+	goto cleanup;
+    }
+    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "open_regular_file failed");
+
+    if (0 != (session->caps & CAP_LZ) && info.size >= COMPRESS_MIN_SIZE && info.size <= COMPRESS_MAX_FILE_SIZE)
+    {
+	// compressing needs the bytes in memory, bigger files are better off zero copy.
+	// Copied rather than mapped: a collected file truncated under a mapping
+	// (e.g. copytruncate rotation) would SIGBUS the agent, a read just comes up short
+	file_status = read_file(fd, &data, &size);
+	if (FILE_EOF == file_status)
+	{
+	    // shrank between the fstat and the read, nothing was sent yet so report it like an unreadable file
+	    INFO("%s shrank while read", path);
+	    ASSERT_RET_EQ(NETWORK_OK, send_cmd_result(session, -1, NULL, 0), cleanup, "send_cmd_result failed");
+	    status = CMD_ERROR;
+	    goto cleanup;
+	}
+	if (FILE_EMPTY != file_status)
+	{
+	    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "read_file failed");
+	}
+	ASSERT_RET_EQ(NETWORK_OK, send_cmd_result(session, 0, data, size), cleanup, "send_cmd_result failed");
+	status = CMD_OK;
+	goto cleanup;
+    }
+
+    // send the header only, the file itself goes from the page cache to the socket
+    ASSERT_RET_EQ(NETWORK_OK, send_cmd_result(session, 0, NULL, (size_t)info.size), cleanup, "send_cmd_result failed");
+
+    // a file that shrank can't be reported after the header, so drop the connection
+    ASSERT_RET_EQ(FILE_OK, send_file_all(session->fd, fd, (size_t)info.size, NULL), cleanup, "send_file_all failed");
+
+    status = CMD_OK;
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    free(data);
+    return status;
+}
+
+static cmd_status_t handle_get_file_stream(int sock_fd,
+                                           arena_t *arena,
+                                           const uint8_t *payload,
+                                           size_t payload_size)
+{
+    cmd_status_t status = CMD_FATAL;
+    file_status_t file_status = FILE_FAILED;
+    char *path = NULL;
+    int fd = -1;
+    file_info_t info = {0};
+
+    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
+
+    path = arena_strndup(arena, payload, payload_size);
+    ASSERT_NOT_NULL(path, cleanup, "arena_strndup failed");
+
+    file_status = open_regular_file(path, &fd, &info);
+    if (FILE_INACCESSIBLE == file_status || FILE_UNSUPPORTED == file_status)
+    {
+	ASSERT_RET_EQ(NETWORK_OK, send_stream_header(sock_fd, -1, 0), cleanup, "send_stream_header failed");
+	status = CMD_ERROR;
+	goto cleanup;
+    }
+    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "open_regular_file failed");
+
+    ASSERT_RET_EQ(NETWORK_OK, send_stream_header(sock_fd, 0, info.size), cleanup, "send_stream_header failed");
+
+    status = send_stream_file(sock_fd, fd, 0, info.size);
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    return status;
+}
+
+static network_status_t send_file_info(int fd, const file_info_t *info)
+{
+    network_status_t status = NETWORK_FAILED;
+    uint64_t net_size = htobe64(info->size);
+    int64_t net_mtime_sec = (int64_t)htobe64((uint64_t)info->mtime_sec);
+    uint32_t net_mtime_nsec = htonl(info->mtime_nsec);
+
+    ASSERT_RET_EQ(FILE_OK, write_all(fd, (uint8_t*)(&net_size), sizeof(net_size)), cleanup, "write size failed");
+    ASSERT_RET_EQ(FILE_OK, write_all(fd, (uint8_t*)(&net_mtime_sec), sizeof(net_mtime_sec)), cleanup, "write mtime failed");
+    ASSERT_RET_EQ(FILE_OK, write_all(fd, (uint8_t*)(&net_mtime_nsec), sizeof(net_mtime_nsec)), cleanup, "write mtime nsec failed");
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+static cmd_status_t handle_get_file_range(int sock_fd,
+                                          arena_t *arena,
+                                          const uint8_t *payload,
+                                          size_t payload_size)
+{
+    cmd_status_t status = CMD_FATAL;
+    file_status_t file_status = FILE_FAILED;
+    char *path = NULL;
+    int fd = -1;
+    file_info_t info = {0};
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    size_t path_len = 0;
+
+    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
+
+    if (payload_size <= sizeof(uint64_t) * 2)
+    {
+        ERROR(cleanup, "payload too small");
+    }
+
+    memcpy(&offset, payload, sizeof(offset));
+    offset = be64toh(offset);
+    memcpy(&length, payload + sizeof(offset), sizeof(length));
+    length = be64toh(length);
+
+    path_len = payload_size - sizeof(offset) - sizeof(length);
+    path = arena_strndup(arena, payload + sizeof(offset) + sizeof(length), path_len);
+    ASSERT_NOT_NULL(path, cleanup, "arena_strndup failed");
+
+    file_status = open_regular_file(path, &fd, &info);
+    if (FILE_INACCESSIBLE == file_status || FILE_UNSUPPORTED == file_status || offset > info.size)
+    {
+	ASSERT_RET_EQ(NETWORK_OK, send_stream_header(sock_fd, -1, 0), cleanup, "send_stream_header failed");
+	status = CMD_ERROR;
+	goto cleanup;
+    }
+    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "open_regular_file failed");
+
+    // a range running past the end is clamped, so the controller can
+    // resume with RANGE_LEN_TO_END without knowing the size upfront
+    if (length > info.size - offset)
+    {
+        length = info.size - offset;
+    }
+
+    ASSERT_RET_EQ(NETWORK_OK, send_stream_header(sock_fd, 0, length), cleanup, "send_stream_header failed");
+    ASSERT_RET_EQ(NETWORK_OK, send_file_info(sock_fd, &info), cleanup, "send_file_info failed");
+
+    status = send_stream_file(sock_fd, fd, offset, length);
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    return status;
+}
+
+typedef struct delta_sink_s
+{
+    int sock_fd;
+    int sock_failed;    // the stream can't be ended, with an abort or otherwise
+    int header_sent;    // sent with the first chunk, a file found short before that gets -1
+    int file_fd;
+} delta_sink_t;
+
+static delta_status_t read_delta_window(void *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    delta_status_t status = DELTA_FAILED;
+    delta_sink_t *sink = ctx;
+    size_t bytes_read = 0;
+
+    // pread, the file is only ever held a window at a time
+    while (len > 0)
+    {
+	ASSERT_RET_EQ(FILE_OK, read_partial_at(sink->file_fd, buf, len, offset, &bytes_read), cleanup,
+		      "read_partial_at failed");
+	if (0 == bytes_read)
+	{
+	    INFO("file shrank to %llu bytes while read", (unsigned long long)offset);
+	    goto cleanup;
+	}
+	buf += bytes_read;
+	offset += bytes_read;
+	len -= bytes_read;
+    }
+
+    status = DELTA_OK;
+cleanup:
+    return status;
+}
+
+static delta_status_t emit_delta_chunk(void *ctx, const uint8_t *buf, size_t len)
+{
+    delta_status_t status = DELTA_FAILED;
+    delta_sink_t *sink = ctx;
+    size_t part = 0;
+
+    if (0 == sink->header_sent)
+    {
+	// the delta size isn't known until it's generated
+	sink->sock_failed = 1;
+	ASSERT_RET_EQ(NETWORK_OK, send_stream_header(sink->sock_fd, 0, STREAM_LEN_UNKNOWN), cleanup,
+		      "send_stream_header failed");
+	sink->sock_failed = 0;
+	sink->header_sent = 1;
+    }
+
+    while (len > 0)
+    {
+	part = (len < STREAM_CHUNK_SIZE) ? len : STREAM_CHUNK_SIZE;
+	sink->sock_failed = 1;
+	// cast safe because part is at most STREAM_CHUNK_SIZE
+	ASSERT_RET_EQ(NETWORK_OK, send_stream_chunk(sink->sock_fd, buf, (uint32_t)part), cleanup,
+		      "send_stream_chunk failed");
+	sink->sock_failed = 0;
+	buf += part;
+	len -= part;
+    }
+
+    status = DELTA_OK;
+cleanup:
+    return status;
+}
+
+static cmd_status_t parse_delta_payload(arena_t *arena,
+                                        const uint8_t *payload,
+                                        size_t payload_len,
+                                        uint32_t *out_block_size,
+                                        char **out_path,
+                                        delta_sig_t **out_sigs,
+                                        uint32_t *out_sig_count)
+{
+    cmd_status_t status = CMD_ERROR;
+    const uint8_t *cursor = payload;
+    uint32_t block_count = 0;
+    uint32_t path_len = 0;
+    uint32_t field = 0;
+    uint64_t strong = 0;
+    delta_sig_t *sigs = NULL;
+
+    if (payload_len < sizeof(uint32_t) * 3)
+    {
+        ERROR(cleanup, "payload too small");
+    }
+
+    memcpy(&field, cursor, sizeof(field));
+    *out_block_size = ntohl(field);
+    cursor += sizeof(field);
+
+    memcpy(&field, cursor, sizeof(field));
+    block_count = ntohl(field);
+    cursor += sizeof(field);
+
+    memcpy(&field, cursor, sizeof(field));
+    path_len = ntohl(field);
+    cursor += sizeof(field);
+
+    if (*out_block_size < DELTA_MIN_BLOCK_SIZE || *out_block_size > DELTA_MAX_BLOCK_SIZE)
+    {
+        ERROR(cleanup, "invalid block size %u", *out_block_size);
+    }
+
+    if (0 == path_len ||
+        (uint64_t)payload_len != sizeof(uint32_t) * 3 + (uint64_t)path_len + (uint64_t)block_count * DELTA_SIG_WIRE_SIZE)
+    {
+        ERROR(cleanup, "invalid delta payload lengths");
+    }
+
+    status = CMD_FATAL;
+    *out_path = arena_strndup(arena, cursor, path_len);
+    ASSERT_NOT_NULL(*out_path, cleanup, "arena_strndup failed");
+    cursor += path_len;
+
+    if (0 != block_count)
+    {
+	sigs = arena_alloc(arena, (size_t)block_count * sizeof(*sigs));
+	ASSERT_NOT_NULL(sigs, cleanup, "arena_alloc failed");
+    }
+
+    for (uint32_t i = 0; i < block_count; ++i)
+    {
+	memcpy(&field, cursor, sizeof(field));
+	sigs[i].weak = ntohl(field);
+	cursor += sizeof(field);
+
+	memcpy(&strong, cursor, sizeof(strong));
+	sigs[i].strong = be64toh(strong);
+	cursor += sizeof(strong);
+    }
+
+    *out_sigs = sigs;
+    *out_sig_count = block_count;
+
+    status = CMD_OK;
+cleanup:
+    return status;
+}
+
+static cmd_status_t handle_get_file_delta(int sock_fd,
+                                          arena_t *arena,
+                                          const uint8_t *payload,
+                                          size_t payload_size)
+{
+    cmd_status_t status = CMD_FATAL;
+    file_status_t file_status = FILE_FAILED;
+    delta_status_t delta_status = DELTA_FAILED;
+    char *path = NULL;
+    delta_sig_t *sigs = NULL;
+    uint32_t sig_count = 0;
+    uint32_t block_size = 0;
+    int fd = -1;
+    file_info_t info = {0};
+    delta_sink_t sink = { .sock_fd = sock_fd };
+
+    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
+
+    status = parse_delta_payload(arena, payload, payload_size, &block_size, &path, &sigs, &sig_count);
+    if (CMD_ERROR == status)
+    {
+	ASSERT_RET_EQ(NETWORK_OK, send_stream_header(sock_fd, -1, 0), cleanup, "send_stream_header failed");
+	goto cleanup;
+    }
+    ASSERT_RET_EQ(CMD_OK, status, cleanup, "parse_delta_payload failed");
+    status = CMD_FATAL;
+
+    file_status = open_regular_file(path, &fd, &info);
+    if (FILE_INACCESSIBLE == file_status || FILE_UNSUPPORTED == file_status)
+    {
+	ASSERT_RET_EQ(NETWORK_OK, send_stream_header(sock_fd, -1, 0), cleanup, "send_stream_header failed");
+	status = CMD_ERROR;
+	goto cleanup;
+    }
+    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "open_regular_file failed");
+
+    // read through pread a window at a time, neither mapped (the file may be truncated
+    // while hashed) nor copied whole
+    sink.file_fd = fd;
+    delta_status = delta_generate(info.size, block_size, sigs, sig_count, read_delta_window, emit_delta_chunk, &sink);
+    if (DELTA_OK != delta_status && 0 == sink.header_sent && 0 == sink.sock_failed)
+    {
+	// nothing went out yet, so a file that came up short is just unreadable
+	INFO("delta_generate failed (%d) before any output", delta_status);
+	ASSERT_RET_EQ(NETWORK_OK, send_stream_header(sock_fd, -1, 0), cleanup, "send_stream_header failed");
+	status = CMD_ERROR;
+	goto cleanup;
+    }
+    if (DELTA_OK != delta_status && 0 == sink.sock_failed)
+    {
+	// the stream is at a chunk boundary, tell the controller to drop it
+	INFO("delta_generate failed (%d), aborting stream", delta_status);
+	ASSERT_RET_EQ(NETWORK_OK, send_stream_end(sock_fd, STREAM_CHUNK_ABORT), cleanup, "send_stream_end failed");
+	status = CMD_ERROR;
+	goto cleanup;
+    }
+    ASSERT_RET_EQ(DELTA_OK, delta_status, cleanup, "delta_generate failed");
+
+    ASSERT_RET_EQ(NETWORK_OK, send_stream_end(sock_fd, STREAM_CHUNK_END), cleanup, "send_stream_end failed");
+
+    status = CMD_OK;
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    return status;
+}
+
+static cmd_status_t parse_get_files_payload(arena_t *arena,
+                                            const uint8_t *payload,
+                                            size_t payload_len,
+                                            prefetch_entry_t **out_entries,
+                                            size_t *out_count)
+{
+    cmd_status_t status = CMD_ERROR;
+    const uint8_t *cursor = payload;
+    const uint8_t *end = payload + payload_len;
+    prefetch_entry_t *entries = NULL;
+    char *paths = NULL;
+    char *path = NULL;
+    uint32_t count = 0;
+    uint32_t field = 0;
+
+    if (payload_len < sizeof(count))
+    {
+        ERROR(cleanup, "payload too small");
+    }
+
+    memcpy(&field, cursor, sizeof(field));
+    count = ntohl(field);
+    cursor += sizeof(field);
+
+    // every entry needs at least its length field
+    if (0 == count || count > (size_t)(end - cursor) / sizeof(field))
+    {
+        ERROR(cleanup, "invalid file count %u", count);
+    }
+
+    status = CMD_FATAL;
+    entries = arena_alloc(arena, count * sizeof(*entries));
+    ASSERT_NOT_NULL(entries, cleanup, "arena_alloc failed");
+    memset(entries, 0, count * sizeof(*entries));
+
+    // each `len | path` becomes `path \0`, so the payload size is always enough
+    paths = arena_alloc(arena, payload_len);
+    ASSERT_NOT_NULL(paths, cleanup, "arena_alloc failed");
+
+    status = CMD_ERROR;
+    path = paths;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if ((size_t)(end - cursor) < sizeof(field))
+        {
+            ERROR(cleanup, "truncated path length");
+        }
+        memcpy(&field, cursor, sizeof(field));
+        field = ntohl(field);
+        cursor += sizeof(field);
+
+        if (0 == field || (size_t)(end - cursor) < field)
+        {
+            ERROR(cleanup, "invalid path length");
+        }
+
+        memcpy(path, cursor, field);
+        path[field] = '\0';
+        entries[i].path = path;
+
+        path += field + 1;
+        cursor += field;
+    }
+
+    *out_entries = entries;
+    *out_count = count;
+
+    status = CMD_OK;
+cleanup:
+    return status;
+}
+
+static network_status_t send_entry_header(int fd, int32_t entry_status, uint64_t size)
+{
+    network_status_t status = NETWORK_FAILED;
+    int32_t net_status = htonl(entry_status);
+    uint64_t net_size = htobe64(size);
+
+    ASSERT_RET_EQ(FILE_OK, write_all(fd, (uint8_t*)(&net_status), sizeof(net_status)), cleanup, "write entry status failed");
+    ASSERT_RET_EQ(FILE_OK, write_all(fd, (uint8_t*)(&net_size), sizeof(net_size)), cleanup, "write entry size failed");
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+/* Waits for the prefetch of every entry up to `index`, entries must be waited for once and in order. */
+static file_status_t files_ready(prefetch_t *pool, size_t *ready, size_t index)
+{
+    file_status_t status = FILE_OK;
+
+    for (; *ready <= index && FILE_OK == status; ++*ready)
+    {
+        status = prefetch_wait(pool, *ready);
+    }
+
+    return status;
+}
+
+/* Fills `window` with the entries from `*next` on until one is too big to inline. */
+static cmd_status_t files_window_collect(files_window_t *window,
+                                         prefetch_entry_t *entries,
+                                         size_t count,
+                                         prefetch_t *pool,
+                                         size_t *ready,
+                                         size_t *next)
+{
+    cmd_status_t status = CMD_FATAL;
+    prefetch_entry_t *entry = NULL;
+    file_read_t *read = NULL;
+
+    window->first = *next;
+    window->count = 0;
+
+    while (*next < count && window->count < GET_FILES_WINDOW)
+    {
+	ASSERT_RET_EQ(FILE_OK, files_ready(pool, ready, *next), cleanup, "prefetch_wait failed");
+
+	entry = &entries[*next];
+	if (FILE_OK == entry->status && entry->info.size > GET_FILES_INLINE_MAX)
+	{
+	    break;
+	}
+
+	read = &window->reads[window->count];
+	read->fd = entry->fd;
+	read->buf = window->buf + window->count * GET_FILES_INLINE_MAX;
+	// cast safe, checked against GET_FILES_INLINE_MAX
+	read->len = (FILE_OK == entry->status) ? (size_t)entry->info.size : 0;
+	read->offset = 0;
+	window->missing[window->count] = (FILE_OK != entry->status);
+
+	++window->count;
+	++*next;
+    }
+
+    status = CMD_OK;
+cleanup:
+    return status;
+}
+
+/*
+ * Sends every entry of a window whose reads completed in one writev and
+ * closes their files. The size sent is what was actually read, so a file
+ * that shrank meanwhile is still a consistent entry.
+ */
+static cmd_status_t files_window_send(int sock_fd, files_window_t *window, prefetch_entry_t *entries)
+{
+    cmd_status_t status = CMD_FATAL;
+    static const uint32_t end_marker = 0;
+    struct iovec iov[GET_FILES_WINDOW * 3];
+    int iov_count = 0;
+    file_read_t *read = NULL;
+    uint8_t *header = NULL;
+    int32_t net_status = 0;
+    uint64_t net_size = 0;
+    uint32_t net_chunk_len = 0;
+
+    for (size_t i = 0; i < window->count; ++i)
+    {
+	read = &window->reads[i];
+	header = window->headers[i];
+
+	if (0 != window->missing[i] || (FILE_OK != read->status && FILE_EOF != read->status))
+	{
+	    // a missing or unreadable file only fails its own entry
+	    net_status = htonl(-1);
+	    net_size = 0;
+	    memcpy(header, &net_status, sizeof(net_status));
+	    memcpy(header + sizeof(net_status), &net_size, sizeof(net_size));
+	    iov[iov_count].iov_base = header;
+	    iov[iov_count++].iov_len = sizeof(net_status) + sizeof(net_size);
+	    continue;
+	}
+
+	net_status = 0;
+	net_size = htobe64(read->done);
+	// cast safe, at most GET_FILES_INLINE_MAX
+	net_chunk_len = htonl((uint32_t)read->done);
+	memcpy(header, &net_status, sizeof(net_status));
+	memcpy(header + sizeof(net_status), &net_size, sizeof(net_size));
+	memcpy(header + sizeof(net_status) + sizeof(net_size), &net_chunk_len, sizeof(net_chunk_len));
+
+	iov[iov_count].iov_base = header;
+	iov[iov_count++].iov_len = (0 != read->done) ? GET_FILES_ENTRY_HEADER_SIZE : sizeof(net_status) + sizeof(net_size);
+	if (0 != read->done)
+	{
+	    iov[iov_count].iov_base = read->buf;
+	    iov[iov_count++].iov_len = read->done;
+	}
+	iov[iov_count].iov_base = (void *)&end_marker;
+	iov[iov_count++].iov_len = sizeof(end_marker);
+    }
+
+    for (size_t i = 0; i < window->count; ++i)
+    {
+	if (-1 != entries[window->first + i].fd)
+	{
+	    close(entries[window->first + i].fd);
+	    entries[window->first + i].fd = -1;
+	}
+    }
+
+    ASSERT_RET_EQ(FILE_OK, write_vec_all(sock_fd, iov, iov_count), cleanup, "write_vec_all failed");
+
+    status = CMD_OK;
+cleanup:
+    return status;
+}
+
+static cmd_status_t handle_get_files(int sock_fd,
+                                     arena_t *arena,
+                                     const uint8_t *payload,
+                                     size_t payload_size)
+{
+    cmd_status_t status = CMD_FATAL;
+    cmd_status_t entry_status = CMD_FATAL;
+    prefetch_entry_t *entries = NULL;
+    prefetch_t *pool = NULL;
+    file_batch_t *batch = NULL;
+    files_window_t windows[2] = {0};
+    files_window_t *sending = &windows[0];
+    files_window_t *reading = &windows[1];
+    files_window_t *swap = NULL;
+    size_t count = 0;
+    size_t ready = 0;
+    size_t next = 0;
+    int32_t net_ret_code = 0;
+    uint32_t net_count = 0;
+
+    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
+
+    status = parse_get_files_payload(arena, payload, payload_size, &entries, &count);
+    if (CMD_ERROR == status)
+    {
+	net_ret_code = htonl(-1);
+	ASSERT_RET_EQ(FILE_OK, write_all(sock_fd, (uint8_t*)(&net_ret_code), sizeof(net_ret_code)), cleanup, "write ret code failed");
+	ASSERT_RET_EQ(FILE_OK, write_all(sock_fd, (uint8_t*)(&net_count), sizeof(net_count)), cleanup, "write count failed");
+	goto cleanup;
+    }
+    ASSERT_RET_EQ(CMD_OK, status, cleanup, "parse_get_files_payload failed");
+    status = CMD_FATAL;
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+	windows[i].buf = arena_alloc(arena, GET_FILES_WINDOW * GET_FILES_INLINE_MAX);
+	ASSERT_NOT_NULL(windows[i].buf, cleanup, "arena_alloc failed");
+    }
+    ASSERT_RET_EQ(FILE_OK, file_batch_create(&batch), cleanup, "file_batch_create failed");
+
+    // readers open and warm up the next files while the current one is sent
+    ASSERT_RET_EQ(FILE_OK, prefetch_start(entries, count, &pool), cleanup, "prefetch_start failed");
+
+    // cast safe because the count came from a uint32 field
+    net_count = htonl((uint32_t)count);
+    ASSERT_RET_EQ(FILE_OK, write_all(sock_fd, (uint8_t*)(&net_ret_code), sizeof(net_ret_code)), cleanup, "write ret code failed");
+    ASSERT_RET_EQ(FILE_OK, write_all(sock_fd, (uint8_t*)(&net_count), sizeof(net_count)), cleanup, "write count failed");
+
+    /*
+     * Small files go in windows: a window's reads are submitted as one batch
+     * and complete while the previous window is written to the socket.
+     * Files too big to inline break the windows and are streamed on their own.
+     */
+    while (1)
+    {
+	ASSERT_RET_EQ(CMD_OK, files_window_collect(reading, entries, count, pool, &ready, &next), cleanup,
+		      "files_window_collect failed");
+
+	if (0 != sending->count)
+	{
+	    ASSERT_RET_EQ(FILE_OK, file_batch_wait(batch), cleanup, "file_batch_wait failed");
+	}
+	if (0 != reading->count)
+	{
+	    ASSERT_RET_EQ(FILE_OK, file_batch_submit(batch, reading->reads, reading->count), cleanup,
+			  "file_batch_submit failed");
+	}
+	if (0 != sending->count)
+	{
+	    ASSERT_RET_EQ(CMD_OK, files_window_send(sock_fd, sending, entries), cleanup, "files_window_send failed");
+	    sending->count = 0;
+	}
+
+	if (0 != reading->count)
+	{
+	    swap = sending;
+	    sending = reading;
+	    reading = swap;
+	    continue;
+	}
+
+	if (next >= count)
+	{
+	    break;
+	}
+
+	// nothing in flight, entry `next` is a big file that was already waited for
+	ASSERT_RET_EQ(NETWORK_OK, send_entry_header(sock_fd, 0, entries[next].info.size), cleanup, "send_entry_header failed");
+
+	entry_status = send_stream_file(sock_fd, entries[next].fd, 0, entries[next].info.size);
+	close(entries[next].fd);
+	entries[next].fd = -1;
+	ASSERT_RET_NE(CMD_FATAL, entry_status, cleanup, "send_stream_file failed");
+	++next;
+    }
+
+    status = CMD_OK;
+cleanup:
+    // the batch owns the buffers of reads in flight until it's torn down
+    file_batch_destroy(batch);
+    for (size_t i = 0; i < ready; ++i)
+    {
+	if (-1 != entries[i].fd)
+	{
+	    close(entries[i].fd);
+	    entries[i].fd = -1;
+	}
+    }
+    prefetch_destroy(pool);
+    return status;
+}
+
+static cmd_status_t handle_set_caps(arena_t *arena,
+                                    const uint8_t *payload,
+                                    size_t payload_len,
+                                    uint8_t **out_buf,
+                                    size_t *out_size,
+                                    uint32_t *out_caps)
+{
+    cmd_status_t status = CMD_FATAL;
+    uint32_t requested = 0;
+    uint32_t *accepted = NULL;
+
+    ASSERT_NOT_NULL(out_buf, cleanup, "out_buf NULL");
+    ASSERT_NOT_NULL(out_size, cleanup, "out_size NULL");
+    ASSERT_NOT_NULL(out_caps, cleanup, "out_caps NULL");
+
+    if (NULL == payload || sizeof(requested) != payload_len)
+    {
+	status = CMD_ERROR;
+	ERROR(cleanup, "invalid caps payload");
+    }
+
+    memcpy(&requested, payload, sizeof(requested));
+    *out_caps = ntohl(requested) & AGENT_CAPS;
+
+    accepted = arena_alloc(arena, sizeof(*accepted));
+    ASSERT_NOT_NULL(accepted, cleanup, "arena_alloc failed");
+    *accepted = htonl(*out_caps);
+
+    *out_buf = (uint8_t *)accepted;
+    *out_size = sizeof(*accepted);
+
+    status = CMD_OK;
+cleanup:
+    return status;
+}
+
+static cmd_status_t handle_sleep_command(const uint8_t *payload,
+                                             unsigned int *out_sleep_time)
+{
+    cmd_status_t status = CMD_FATAL;
+
+    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
+    ASSERT_NOT_NULL(out_sleep_time, cleanup, "out_sleep_time NULL");
+
+    *out_sleep_time = ntohl((unsigned int)(*payload));
+    status = CMD_OK;
+
+cleanup:
+    return status;
+}
+
+
+/*
+ * Turns the NUL separated args blob into an argv array, with the strings stored
+ * right after the pointers in the same arena block.
+ * An empty blob gives { path, NULL }.
+ */
+static cmd_status_t build_exec_argv(arena_t *arena,
+                                    const char *path,
+                                    const uint8_t *blob,
+                                    size_t blob_len,
+                                    char ***argv_out)
+{
+    cmd_status_t status = CMD_FATAL;
+    char **argv = NULL;
+    char *strings = NULL;
+    char *cursor = NULL;
+    size_t argc = 0;
+
+    // a trailing separator doesn't start another arg
+    if (blob_len > 0 && '\0' == blob[blob_len - 1])
+    {
+        --blob_len;
+    }
+
+    argc = 1;
+    for (size_t i = 0; i < blob_len; ++i)
+    {
+        argc += ('\0' == blob[i]);
+    }
+
+    argv = arena_alloc(arena, (argc + 1) * sizeof(*argv) + blob_len + 1);
+    ASSERT_NOT_NULL(argv, cleanup, "arena_alloc failed");
+
+    if (0 == blob_len)
+    {
+        // cast safe, exec never writes to argv strings
+        argv[0] = (char *)path;
+        argv[1] = NULL;
+        *argv_out = argv;
+        status = CMD_OK;
+        goto cleanup;
+    }
+
+    strings = (char *)(argv + argc + 1);
+    memcpy(strings, blob, blob_len);
+    strings[blob_len] = '\0';
+
+    cursor = strings;
+    for (size_t i = 0; i < argc; ++i)
+    {
+        argv[i] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    argv[argc] = NULL;
+
+    *argv_out = argv;
+    status = CMD_OK;
+cleanup:
+    return status;
+}
+
+cmd_status_t parse_exec_payload(arena_t *arena,
+                                const uint8_t *payload,
+                                size_t payload_len,
+                                uint32_t *timeout_ms_out,
+                                char **path_out,
+                                char ***argv_out,
+                                exec_limits_t *limits_out,
+                                int *capped_out)
+{
+    cmd_status_t status = CMD_FATAL;
+    const uint8_t *cursor = payload;
+    const uint8_t *end = payload + payload_len;
+    uint32_t field = 0;
+
+    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
+    ASSERT_NOT_NULL(timeout_ms_out, cleanup, "timeout NULL");
+    ASSERT_NOT_NULL(path_out, cleanup, "path NULL");
+    ASSERT_NOT_NULL(argv_out, cleanup, "argv NULL");
+
+    *path_out = NULL;
+    *argv_out = NULL;
+
+    if (payload_len < sizeof(uint32_t) * 3)
+    {
+        ERROR(cleanup, "payload too small");
+    }
+
+    // timeout
+    field = ntohl(*(const uint32_t *)cursor);
+    *timeout_ms_out = field;
+    cursor += sizeof(uint32_t);
+
+    // path len
+    field = ntohl(*(const uint32_t *)cursor);
+    cursor += sizeof(uint32_t);
+
+    // the path has to leave room for the args len
+    if (0 == field || (size_t)(end - cursor) < (size_t)field + sizeof(uint32_t))
+    {
+        ERROR(cleanup, "invalid path_len");
+    }
+
+    // path
+    *path_out = arena_strndup(arena, cursor, field);
+    ASSERT_NOT_NULL(*path_out, cleanup, "arena_strndup failed");
+    cursor += field;
+
+    // args len 
+    field = ntohl(*(const uint32_t *)cursor);
+    cursor += sizeof(uint32_t);
+
+    if ((size_t)(end - cursor) < field)
+    {
+        ERROR(cleanup, "invalid args_len");
+    }
+
+    // args
+    status = build_exec_argv(arena, *path_out, cursor, field, argv_out);
+    ASSERT_RET_EQ(CMD_OK, status, cleanup, "build_exec_argv failed");
+    status = CMD_FATAL;
+    cursor += field;
+
+    // optional output caps, older controllers don't send them
+    if (NULL != limits_out && NULL != capped_out)
+    {
+        limits_out->head = EXEC_UNLIMITED;
+        limits_out->tail = 0;
+        *capped_out = 0;
+
+        if ((size_t)(end - cursor) >= sizeof(uint32_t) * 2)
+        {
+            limits_out->head = ntohl(*(const uint32_t *)cursor);
+            cursor += sizeof(uint32_t);
+            limits_out->tail = ntohl(*(const uint32_t *)cursor);
+            *capped_out = 1;
+        }
+    }
+
+    status = CMD_OK;
+
+cleanup:
+    return status;
+}
+
+cmd_status_t build_exec_response(arena_t *arena,
+                                 int exit_code,
+                                 const exec_output_t *out_stdout,
+                                 const exec_output_t *out_stderr,
+                                 int capped,
+                                 struct iovec *parts,
+                                 int *out_part_count)
+{
+    cmd_status_t status = CMD_FATAL;
+    exec_response_t *fields = NULL;
+    uint8_t truncated = 0;
+    int32_t net_exit_code = htonl(exit_code);
+    uint32_t net_len = 0;
+    uint64_t net_total = 0;
+
+    ASSERT_NOT_NULL(out_stdout, cleanup, "out_stdout is NULL");
+    ASSERT_NOT_NULL(out_stderr, cleanup, "out_stderr is NULL");
+    ASSERT_NOT_NULL(parts, cleanup, "parts is NULL");
+    ASSERT_NOT_NULL(out_part_count, cleanup, "out_part_count is NULL");
+
+    if (out_stdout->size > UINT32_MAX || out_stderr->size > UINT32_MAX)
+    {
+        ERROR(cleanup, "streams too large stdout %zu, stderr %zu", out_stdout->size, out_stderr->size);
+    }
+
+    // empty streams may come without a buffer
+    if ((0 != out_stdout->size && NULL == out_stdout->buf) || (0 != out_stderr->size && NULL == out_stderr->buf))
+    {
+        ERROR(cleanup, "stream buffer is NULL");
+    }
+
+    fields = arena_alloc(arena, sizeof(*fields));
+    ASSERT_NOT_NULL(fields, cleanup, "arena_alloc failed");
+
+    memcpy(fields->head, &net_exit_code, sizeof(net_exit_code));
+    // cast safe becuase we checked size is smaller than UINT32_MAX
+    net_len = htonl((uint32_t)out_stdout->size);
+    memcpy(fields->head + sizeof(net_exit_code), &net_len, sizeof(net_len));
+
+    // cast safe becuase we checked size is smaller than UINT32_MAX
+    net_len = htonl((uint32_t)out_stderr->size);
+    memcpy(fields->stderr_len, &net_len, sizeof(net_len));
+
+    parts[0].iov_base = fields->head;
+    parts[0].iov_len = sizeof(fields->head);
+    parts[1].iov_base = out_stdout->buf;
+    parts[1].iov_len = out_stdout->size;
+    parts[2].iov_base = fields->stderr_len;
+    parts[2].iov_len = sizeof(fields->stderr_len);
+    parts[3].iov_base = out_stderr->buf;
+    parts[3].iov_len = out_stderr->size;
+    *out_part_count = 4;
+
+    // capped requests get the truncation trailer
+    if (capped)
+    {
+        truncated |= (out_stdout->total > out_stdout->size) ? EXEC_TRUNCATED_STDOUT : 0;
+        truncated |= (out_stderr->total > out_stderr->size) ? EXEC_TRUNCATED_STDERR : 0;
+        fields->trailer[0] = truncated;
+
+        net_total = htobe64(out_stdout->total);
+        memcpy(fields->trailer + sizeof(truncated), &net_total, sizeof(net_total));
+        net_total = htobe64(out_stderr->total);
+        memcpy(fields->trailer + sizeof(truncated) + sizeof(net_total), &net_total, sizeof(net_total));
+
+        parts[4].iov_base = fields->trailer;
+        parts[4].iov_len = sizeof(fields->trailer);
+        *out_part_count = 5;
+    }
+
+    status = CMD_OK;
+
+cleanup:
+    return status;
+}
+
+static network_status_t send_exec_frame_header(int fd, uint8_t tag, uint32_t len)
+{
+    network_status_t status = NETWORK_FAILED;
+    uint8_t header[sizeof(tag) + sizeof(len)] = {0};
+    uint32_t net_len = htonl(len);
+    size_t sent = 0;
+    ssize_t sys_bytes = -1;
+
+    header[0] = tag;
+    memcpy(header + sizeof(tag), &net_len, sizeof(net_len));
+
+    // MSG_MORE lets the header leave in the same segment as the data after it
+    while (sent < sizeof(header))
+    {
+        sys_bytes = send(fd, header + sent, sizeof(header) - sent, MSG_MORE | MSG_NOSIGNAL);
+        if (-1 == sys_bytes && EINTR == errno)
+        {
+            continue;
+        }
+        ASSERT_RET_NE(-1, sys_bytes, cleanup, "send() failed: %s", strerror(errno));
+        sent += (size_t)sys_bytes;
+    }
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+/*
+ * Takes the socket for one piece of the reply, the ret code or a single frame,
+ * so a child that runs for long doesn't hold up the other replies.
+ * The piece is written straight to the socket after the id reply_begin buffered.
+ */
+static network_status_t relay_begin(exec_relay_t *relay)
+{
+    network_status_t status = NETWORK_FAILED;
+
+    ASSERT_RET_EQ(NETWORK_OK, reply_begin(relay->session, relay->request_id), cleanup, "reply_begin failed");
+    if (FRAME_OK != frame_flush(&relay->session->conn))
+    {
+	(void)reply_end(relay->session);
+	ERROR(cleanup, "frame_flush failed");
+    }
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+static network_status_t relay_header(exec_relay_t *relay, int32_t ret_code)
+{
+    network_status_t status = NETWORK_OK;
+    int32_t net_ret_code = htonl(ret_code);
+    int locked = 0;
+
+    if (0 == relay->header_sent)
+    {
+	status = NETWORK_FAILED;
+	ASSERT_RET_EQ(NETWORK_OK, relay_begin(relay), cleanup, "relay_begin failed");
+	locked = 1;
+	ASSERT_RET_EQ(FILE_OK, write_all(relay->session->fd, (uint8_t*)(&net_ret_code), sizeof(net_ret_code)), cleanup,
+		      "write ret code failed");
+	relay->header_sent = 1;
+	status = NETWORK_OK;
+    }
+
+cleanup:
+    if (locked && NETWORK_OK != reply_end(relay->session))
+    {
+	status = NETWORK_FAILED;
+    }
+    return status;
+}
+
+static exec_status_t relay_exec_output(void *ctx, exec_stream_t stream, int fd, size_t available)
+{
+    exec_status_t status = EXEC_FAILED;
+    exec_relay_t *relay = ctx;
+    uint8_t tag = (EXEC_STDOUT == stream) ? EXEC_FRAME_STDOUT : EXEC_FRAME_STDERR;
+    int locked = 0;
+
+    if (available > UINT32_MAX)
+    {
+	available = UINT32_MAX;
+    }
+
+    ASSERT_RET_EQ(NETWORK_OK, relay_header(relay, 0), cleanup, "relay_header failed");
+
+    ASSERT_RET_EQ(NETWORK_OK, relay_begin(relay), cleanup, "relay_begin failed");
+    locked = 1;
+    // cast safe because available was capped above
+    ASSERT_RET_EQ(NETWORK_OK, send_exec_frame_header(relay->session->fd, tag, (uint32_t)available), cleanup,
+		  "send_exec_frame_header failed");
+
+    // straight from the child's pipe to the socket
+    ASSERT_RET_EQ(FILE_OK, send_pipe_all(relay->session->fd, fd, available), cleanup, "send_pipe_all failed");
+
+    status = EXEC_OK;
+cleanup:
+    if (locked && NETWORK_OK != reply_end(relay->session))
+    {
+	status = EXEC_FAILED;
+    }
+    return status;
+}
+
+static network_status_t relay_exit(exec_relay_t *relay, int32_t exit_status, int exit_code)
+{
+    network_status_t status = NETWORK_FAILED;
+    int32_t exit_fields[2] = { htonl(exit_status), htonl(exit_code) };
+    int locked = 0;
+
+    ASSERT_RET_EQ(NETWORK_OK, relay_header(relay, 0), cleanup, "relay_header failed");
+
+    ASSERT_RET_EQ(NETWORK_OK, relay_begin(relay), cleanup, "relay_begin failed");
+    locked = 1;
+    ASSERT_RET_EQ(NETWORK_OK, send_exec_frame_header(relay->session->fd, EXEC_FRAME_EXIT, sizeof(exit_fields)), cleanup,
+		  "send_exec_frame_header failed");
+    ASSERT_RET_EQ(FILE_OK, write_all(relay->session->fd, (uint8_t*)exit_fields, sizeof(exit_fields)), cleanup,
+		  "write exit frame failed");
+
+    status = NETWORK_OK;
+cleanup:
+    if (locked && NETWORK_OK != reply_end(relay->session))
+    {
+	status = NETWORK_FAILED;
+    }
+    return status;
+}
+
+static cmd_status_t handle_exec_stream(session_t *session,
+                                       arena_t *arena,
+                                       uint32_t request_id,
+                                       const uint8_t *payload,
+                                       size_t payload_len)
+{
+    cmd_status_t status = CMD_FATAL;
+    exec_status_t exec_status = EXEC_FAILED;
+    exec_relay_t relay = { .session = session, .request_id = request_id, .header_sent = 0 };
+    char *path = NULL;
+    char **argv = NULL;
+    uint32_t timeout_ms = 0;
+    int exit_code = -1;
+
+    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
+
+    // output goes out as it comes, there is nothing to cap
+    status = parse_exec_payload(arena, payload, payload_len, &timeout_ms, &path, &argv, NULL, NULL);
+    ASSERT_RET_EQ(CMD_OK, status, cleanup, "parse failed");
+    status = CMD_FATAL;
+
+    exec_status = exec_run_stream(path, argv, relay_exec_output, &relay, &exit_code, timeout_ms);
+
+    if (EXEC_INACCESSIBLE == exec_status || (EXEC_FAILED == exec_status && 0 == relay.header_sent))
+    {
+	// nothing ran, so the command fails like a regular exec
+	ASSERT_RET_EQ(NETWORK_OK, relay_header(&relay, -1), cleanup, "relay_header failed");
+	status = CMD_ERROR;
+	goto cleanup;
+    }
+
+    // a failure mid stream leaves the frames in an unknown state
+    ASSERT_RET_NE(EXEC_FAILED, exec_status, cleanup, "exec_run_stream failed");
+
+    ASSERT_RET_EQ(NETWORK_OK, relay_exit(&relay, (EXEC_OK == exec_status) ? 0 : -1, exit_code), cleanup,
+		  "relay_exit failed");
+
+    status = (EXEC_OK == exec_status) ? CMD_OK : CMD_ERROR;
+cleanup:
+    return status;
+}
+
+static network_status_t send_hello(session_t *session,
+                                const tool_t *tool)
+{
+    network_status_t status = NETWORK_FAILED;
+    uint8_t version = PROTOCOL_VERSION;
+    uint32_t net_caps = htonl(AGENT_CAPS);
+    struct iovec iov[3] = {
+	{ .iov_base = &version, .iov_len = sizeof(version) },
+	{ .iov_base = (void *)tool->name, .iov_len = sizeof(tool->name) },
+	{ .iov_base = &net_caps, .iov_len = sizeof(net_caps) },
+    };
+
+    ASSERT_RET_EQ(FRAME_OK, frame_write(&session->conn, iov, 3), cleanup, "couldn't queue hello");
+    ASSERT_RET_EQ(FRAME_OK, frame_flush(&session->conn), cleanup, "couldn't send hello");
+
+    status = NETWORK_OK;
+
+cleanup:
+    return status;
+}
+
+static cmd_status_t run_direct_command(session_t *session,
+                                       arena_t *arena,
+                                       uint8_t code,
+                                       const uint8_t *payload,
+                                       size_t payload_len)
+{
+    cmd_status_t status = CMD_FATAL;
+
+    switch (code)
+    {
+        case CMD_GET_FILE:
+            status = handle_get_file(session, arena, payload, payload_len);
+            break;
+
+        case CMD_GET_FILE_STREAM:
+            status = handle_get_file_stream(session->fd, arena, payload, payload_len);
+            break;
+
+        case CMD_GET_FILE_RANGE:
+            status = handle_get_file_range(session->fd, arena, payload, payload_len);
+            break;
+
+        case CMD_GET_FILE_DELTA:
+            status = handle_get_file_delta(session->fd, arena, payload, payload_len);
+            break;
+
+        case CMD_GET_FILES:
+            status = handle_get_files(session->fd, arena, payload, payload_len);
+            break;
+
+        default:
+            ERROR(cleanup, "unknown command: %u", code);
+            break;
+    }
+
+cleanup:
+    return status;
+}
+
+/* Runs a regular (non control) command and sends its reply, `arena` holds its buffers. */
+static cmd_status_t run_command(session_t *session,
+                                arena_t *arena,
+                                uint32_t request_id,
+                                uint8_t code,
+                                const uint8_t *payload,
+                                size_t payload_len)
+{
+    cmd_status_t status = CMD_FATAL;
+    cmd_status_t cmd_status = CMD_FATAL;
+    struct iovec res_parts[RESULT_PARTS_MAX] = {0};
+    int res_part_count = 0;
+    int32_t ret_code = 0;
+    int locked = 0;
+
+    switch (code)
+    {
+        case CMD_UNLOAD_LOGS:
+            cmd_status = handle_unload_logs(arena, payload, payload_len, res_parts, &res_part_count);
+            break;
+
+        // the child may run for long, its reply takes the socket one frame at a time
+        case CMD_EXEC_STREAM:
+            status = handle_exec_stream(session, arena, request_id, payload, payload_len);
+            goto cleanup;
+
+        // file and stream handlers write their own reply, so they hold the socket throughout
+        case CMD_GET_FILE:
+        case CMD_GET_FILE_STREAM:
+        case CMD_GET_FILE_RANGE:
+        case CMD_GET_FILE_DELTA:
+        case CMD_GET_FILES:
+            ASSERT_RET_EQ(NETWORK_OK, reply_begin(session, request_id), cleanup, "reply_begin failed");
+            locked = 1;
+            ASSERT_RET_EQ(FRAME_OK, frame_flush(&session->conn), cleanup, "frame_flush failed");
+            status = run_direct_command(session, arena, code, payload, payload_len);
+            goto cleanup;
+
+        default:
+            ERROR(cleanup, "unknown command: %u", code);
+            break;
+    }
+
+    ASSERT_RET_NE(CMD_FATAL, cmd_status, cleanup, "cmd returned fatal error");
+    if (CMD_OK != cmd_status)
+    {
+        // generic command failed
+        ret_code = -1;
+    }
+
+    ASSERT_RET_EQ(NETWORK_OK, reply_begin(session, request_id), cleanup, "reply_begin failed");
+    locked = 1;
+    ASSERT_RET_EQ(NETWORK_OK, send_cmd_result_vec(session, ret_code, res_parts, res_part_count), cleanup,
+		  "send_cmd_result_vec failed");
+
+    status = cmd_status;
+cleanup:
+    if (locked && NETWORK_OK != reply_end(session))
+    {
+        status = CMD_FATAL;
+    }
+    return status;
+}
+
+/* send_cmd_result_vec as a whole reply to `request_id`. */
+static network_status_t send_reply(session_t *session,
+                                   uint32_t request_id,
+                                   int32_t ret_code,
+                                   const struct iovec *parts,
+                                   int part_count)
+{
+    network_status_t status = NETWORK_FAILED;
+
+    ASSERT_RET_EQ(NETWORK_OK, reply_begin(session, request_id), cleanup, "reply_begin failed");
+    status = send_cmd_result_vec(session, ret_code, parts, part_count);
+    if (NETWORK_OK != reply_end(session))
+    {
+	status = NETWORK_FAILED;
+    }
+    ASSERT_RET_EQ(NETWORK_OK, status, cleanup, "send_cmd_result_vec failed");
+
+cleanup:
+    return status;
+}
+
+/* Ends a job on the worker pool, `arena` held the job and goes back to the session. */
+static void worker_job_done(session_t *session, arena_t *arena, int fatal)
+{
+    if (0 != fatal)
+    {
+        // the stream may hold half a reply, the reader has to drop the connection
+        atomic_store(&session->failed, 1);
+        (void)shutdown(session->fd, SHUT_RDWR);
+    }
+
+    session_arena_put(session, arena);
+
+    atomic_fetch_sub(&session->jobs, 1);
+    if (0 != atomic_exchange(&session->jobs_waiting, 0) && REACTOR_OK != reactor_wake(session->jobs_wake))
+    {
+        INFO("reactor_wake failed");
+    }
+}
+
+static void run_mux_job(void *arg)
+{
+    mux_job_t *job = arg;
+
+    // the job itself lives in the arena, so it can't be used past this call
+    worker_job_done(job->session, job->arena,
+                    CMD_FATAL == run_command(job->session, job->arena, job->request_id, job->code, job->payload,
+                                             job->payload_len));
+}
+
+static void run_reply_job(void *arg)
+{
+    reply_job_t *job = arg;
+
+    worker_job_done(job->session, job->arena,
+                    NETWORK_OK != send_reply(job->session, job->request_id, job->ret_code, job->parts,
+                                             job->part_count));
+}
+
+/* Queues a job on the workers, counted in session->jobs until worker_job_done. */
+static network_status_t session_submit(session_t *session, worker_job_t run, void *job)
+{
+    network_status_t status = NETWORK_FAILED;
+
+    atomic_fetch_add(&session->jobs, 1);
+    if (WORKER_OK != worker_pool_submit(session->workers, run, job))
+    {
+	atomic_fetch_sub(&session->jobs, 1);
+	ERROR(cleanup, "worker_pool_submit failed");
+    }
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+/*
+ * Returns 1 while more than `limit` jobs are running on the workers, in
+ * which case the reactor gets a wake (session_on_jobs) once one finishes.
+ */
+static int session_jobs_over(session_t *session, size_t limit)
+{
+    if (atomic_load(&session->jobs) <= limit)
+    {
+	return 0;
+    }
+
+    // a job finishing before the store is seen by the load below, one finishing after it wakes the reactor
+    atomic_store(&session->jobs_waiting, 1);
+    return (atomic_load(&session->jobs) > limit);
+}
+
+static network_status_t submit_mux_job(session_t *session,
+                                       arena_t **arena,
+                                       uint32_t request_id,
+                                       uint8_t code,
+                                       uint8_t *payload,
+                                       size_t payload_len)
+{
+    network_status_t status = NETWORK_FAILED;
+    mux_job_t *job = NULL;
+
+    job = arena_alloc(*arena, sizeof(*job));
+    ASSERT_NOT_NULL(job, cleanup, "arena_alloc failed");
+
+    job->session = session;
+    job->arena = *arena;
+    job->request_id = request_id;
+    job->code = code;
+    job->payload = payload;
+    job->payload_len = payload_len;
+
+    ASSERT_RET_EQ(NETWORK_OK, session_submit(session, run_mux_job, job), cleanup, "session_submit failed");
+
+    // the job owns the arena and everything in it now
+    *arena = NULL;
+
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+static void session_on_jobs(void *ctx, uint32_t events);
+
+static network_status_t apply_caps(session_t *session, uint32_t new_caps)
+{
+    network_status_t status = NETWORK_FAILED;
 
-    if (payload_len > 0)
+    if (0 != (new_caps & CAP_MUX) && NULL == session->workers)
+    {
+	ASSERT_RET_EQ(REACTOR_OK, reactor_add_wake(session->reactor, session_on_jobs, session, &session->jobs_wake),
+		      cleanup, "reactor_add_wake failed");
+	if (WORKER_OK != worker_pool_create(WORKER_THREADS, &session->workers))
+	{
+	    reactor_remove(session->jobs_wake);
+	    session->jobs_wake = NULL;
+	    ERROR(cleanup, "worker_pool_create failed");
+	}
+    }
+    else if (0 == (new_caps & CAP_MUX) && NULL != session->workers)
     {
-	ASSERT_NOT_NULL(payload, cleanup, "payload was NULL");	
-        ASSERT_RET_EQ(FILE_OK, write_all(fd, payload, payload_len), cleanup, "write buffer failed");
+	// no job left, the caller waited for them
+	worker_pool_destroy(session->workers);
+	session->workers = NULL;
+	reactor_remove(session->jobs_wake);
+	session->jobs_wake = NULL;
     }
 
+    session->caps = new_caps;
+
     status = NETWORK_OK;
 cleanup:
     return status;
 }
 
-static network_status_t read_command(int fd,
-                                    uint8_t **out_payload,
-                                    size_t *out_payload_len,
-                                    uint8_t *out_code)
+/*
+ * Runs a barrier command, every command before it has replied by now.
+ * Returns NETWORK_STOP_COMM once the session is over (CMD_SLEEP, CMD_DIE).
+ */
+static network_status_t run_control(session_t *session,
+                                    uint8_t code,
+                                    uint32_t request_id,
+                                    const uint8_t *payload,
+                                    size_t payload_len)
 {
     network_status_t status = NETWORK_FAILED;
-    file_status_t file_status = FILE_FAILED;
-    uint32_t net_payload_len = 0;
-    uint8_t *payload = NULL;
+    cmd_status_t cmd_status = CMD_FATAL;
+    uint8_t *res_buf = NULL;
+    size_t res_len = 0;
+    int32_t ret_code = 0;
+    uint32_t new_caps = 0;
+    int locked = 0;
 
-    ASSERT_NOT_NULL(out_payload, cleanup, "out_payload NULL");
-    ASSERT_NOT_NULL(out_payload_len, cleanup, "out_payload_len NULL");
-    ASSERT_NOT_NULL(out_code, cleanup, "out_code NULL");
-   
-    file_status = read_all(fd, out_code, sizeof(*out_code));
+    ASSERT_RET_EQ(0, atomic_load(&session->failed), cleanup, "a command failed fatally");
 
-    if (FILE_EOF == file_status)
+    switch (code)
     {
-	status = NETWORK_STOP_COMM;
-	goto cleanup;
+	case CMD_SLEEP:
+	    cmd_status = handle_sleep_command(payload, &session->sleep_duration);
+	    break;
+
+	case CMD_SET_CAPS:
+	    cmd_status = handle_set_caps(session->arena, payload, payload_len, &res_buf, &res_len, &new_caps);
+	    break;
+
+	case CMD_DIE:
+	    cmd_status = CMD_OK;
+	    session->should_die = 1;
+	    break;
+    }
+
+    ASSERT_RET_NE(CMD_FATAL, cmd_status, cleanup, "cmd returned fatal error");
+    if (CMD_OK != cmd_status)
+    {
+	// generic command failed
+	ret_code = -1;
     }
 
-    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "failed reading cmd code");
-    ASSERT_RET_EQ(FILE_OK, read_all(fd, (uint8_t*)(&net_payload_len), sizeof(*out_payload_len)), cleanup,
-		    "failed reading length");
-    *out_payload_len = ntohl(net_payload_len);
+    ASSERT_RET_EQ(NETWORK_OK, reply_begin(session, request_id), cleanup, "reply_begin failed");
+    locked = 1;
+    ASSERT_RET_EQ(NETWORK_OK, send_cmd_result(session, ret_code, res_buf, res_len), cleanup, "send_cmd_result failed");
+    locked = 0;
+    ASSERT_RET_EQ(NETWORK_OK, reply_end(session), cleanup, "reply_end failed");
+    ASSERT_RET_EQ(NETWORK_OK, session_flush(session), cleanup, "session_flush failed");
 
-    if (*out_payload_len > 0)
+    // the caps reply itself still uses the old framing
+    if (CMD_SET_CAPS == code && CMD_OK == cmd_status)
     {
-	payload = malloc(*out_payload_len);
-        ASSERT_NOT_NULL(payload, cleanup, "malloc payload failed: %s", strerror(errno));
-        ASSERT_RET_EQ(FILE_OK, read_all(fd, payload, *out_payload_len), cleanup, "failed reading payload");
+	ASSERT_RET_EQ(NETWORK_OK, apply_caps(session, new_caps), cleanup, "apply_caps failed");
     }
 
-    status = NETWORK_OK;
+    status = (CMD_SLEEP == code || CMD_DIE == code) ? NETWORK_STOP_COMM : NETWORK_OK;
 cleanup:
-    if (NETWORK_OK != status && NULL != payload)
+    if (locked)
     {
-        free(payload);
+	(void)reply_end(session);
     }
-
     return status;
 }
 
-static cmd_status_t handle_unload_logs(uint8_t **out_buf,
-                                           size_t *out_size)
+static void session_on_socket(void *ctx, uint32_t events);
+static void session_pump(session_t *session);
+
+/* Watches the socket for commands, or stops while the session waits on its own. */
+static network_status_t session_watch(session_t *session, int on)
 {
-    cmd_status_t status = CMD_FATAL;
+    network_status_t status = NETWORK_FAILED;
 
-    ASSERT_NOT_NULL(out_buf, cleanup, "out_buf NULL");
-    ASSERT_NOT_NULL(out_size, cleanup, "out_size NULL");
-    
-    ASSERT_RET_EQ(LOG_OK, log_read_all(out_buf, out_size), cleanup, "log_read_all failed");
+    // removed rather than paused, a hung up socket would keep reporting it
+    if (0 == on && NULL != session->source)
+    {
+	reactor_remove(session->source);
+	session->source = NULL;
+    }
+    else if (0 != on && NULL == session->source)
+    {
+	ASSERT_RET_EQ(REACTOR_OK, reactor_add_fd(session->reactor, session->fd, REACTOR_READ, session_on_socket,
+						 session, &session->source), cleanup, "reactor_add_fd failed");
+    }
 
-    status = CMD_OK;
+    status = NETWORK_OK;
 cleanup:
     return status;
 }
 
-static cmd_status_t handle_get_file(const uint8_t *payload,
-				    size_t payload_size,
-                                        uint8_t **out_buf,
-                                        size_t *out_size)
+/* Closes the session and reports how it went, `session` is gone afterwards. */
+static void session_end(session_t *session)
 {
-    cmd_status_t status = CMD_FATAL;
-    file_status_t file_status = FILE_FAILED;
-    char *path = NULL;
+    network_done_cb_t on_done = session->on_done;
+    void *done_ctx = session->done_ctx;
+    network_status_t status = session->end_status;
+
+    // every job finished before the session got here, this only joins the threads
+    worker_pool_destroy(session->workers);
+    session->workers = NULL;
+    reactor_remove(session->jobs_wake);
+    if (0 != atomic_load(&session->failed))
+    {
+	INFO("a command failed fatally");
+	status = NETWORK_FAILED;
+    }
 
-    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
-    ASSERT_NOT_NULL(out_buf, cleanup, "out_buf NULL");
-    ASSERT_NOT_NULL(out_size, cleanup, "out_size NULL");
+    INFO("session done: %llu read calls, %llu write calls",
+	 (unsigned long long)session->conn.stats.read_calls, (unsigned long long)session->conn.stats.write_calls);
 
+    session_arena_put(session, session->arena);
+    session_arenas_destroy(session);
+    pthread_mutex_destroy(&session->arena_lock);
+    pthread_mutex_destroy(&session->send_lock);
 
-    path = malloc(payload_size + 1);
-    ASSERT_NOT_NULL(path, cleanup, "malloc failed: %s", strerror(errno));
-    memcpy(path, payload, payload_size);
-    path[payload_size] = '\0';
+    reactor_remove(session->source);
+    close(session->fd);
 
-    file_status = read_file_from_path(path, out_buf, out_size);
-    if (FILE_INACCESSIBLE == file_status)
-    {
-	status = CMD_ERROR;
-	goto cleanup;
-    }
-    ASSERT_RET_EQ(FILE_OK, file_status, cleanup, "log_read_all failed");
+    on_done(done_ctx, status, session->sleep_duration, session->should_die);
+    free(session);
+}
 
-    status = CMD_OK;
-cleanup:
-    if (NULL != path)
+/* Ends the session once no exec or job is left to reply, returns 1 if it did. */
+static int session_try_end(session_t *session)
+{
+    if (0 != session->exec_count || session_jobs_over(session, 0))
     {
-	free(path);
-	path = NULL;
+	return 0;
     }
-    return status;
+
+    session_end(session);
+    return 1;
 }
 
-static cmd_status_t handle_sleep_command(const uint8_t *payload,
-                                             unsigned int *out_sleep_time)
+/* Gives up on the session: commands in flight are dropped, children killed. */
+static void session_fail(session_t *session)
 {
-    cmd_status_t status = CMD_FATAL;
+    session->closing = 1;
+    session->end_status = NETWORK_FAILED;
+    (void)session_watch(session, 0);
 
-    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
-    ASSERT_NOT_NULL(out_sleep_time, cleanup, "out_sleep_time NULL");
+    // the stream may hold half a reply, workers writing to it fail fast
+    (void)shutdown(session->fd, SHUT_RDWR);
 
-    *out_sleep_time = ntohl((unsigned int)(*payload));
-    status = CMD_OK;
+    for (exec_pending_t *pending = session->execs; NULL != pending; pending = pending->next)
+    {
+	exec_cancel(pending->job);
+    }
 
-cleanup:
-    return status;
+    (void)session_try_end(session);
 }
 
-
-static cmd_status_t parse_exec_payload(const uint8_t *payload,
-                                           size_t payload_len,
-                                           uint32_t *timeout_ms_out,
-                                           char **path_out,
-                                           char **args_out)
+/*
+ * send_reply from the reactor. With CAP_MUX a worker may hold the socket
+ * while a slow controller reads, so the reply goes to the workers instead,
+ * taking *arena (which `parts` may point into) with it.
+ */
+static network_status_t session_reply(session_t *session,
+                                      arena_t **arena,
+                                      uint32_t request_id,
+                                      int32_t ret_code,
+                                      const struct iovec *parts,
+                                      int part_count)
 {
-    cmd_status_t status = CMD_FATAL;
-    const uint8_t *cursor = payload;
-    const uint8_t *end = payload + payload_len;
-    char *tmp = NULL;
-    uint32_t field = 0;
-
-    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
-    ASSERT_NOT_NULL(timeout_ms_out, cleanup, "timeout NULL");
-    ASSERT_NOT_NULL(path_out, cleanup, "path NULL");
-    ASSERT_NOT_NULL(args_out, cleanup, "args NULL");
+    network_status_t status = NETWORK_FAILED;
+    reply_job_t *job = NULL;
 
-    if (payload_len < sizeof(uint32_t) * 3)
+    if (NULL == session->workers)
     {
-        ERROR(cleanup, "payload too small");
+	// the reactor is the only writer
+	return send_reply(session, request_id, ret_code, parts, part_count);
     }
 
-    // timeout
-    field = ntohl(*(const uint32_t *)cursor);
-    *timeout_ms_out = field;
-    cursor += sizeof(uint32_t);
-
-    // path len
-    field = ntohl(*(const uint32_t *)cursor);
-    cursor += sizeof(uint32_t);
+    job = arena_alloc(*arena, sizeof(*job));
+    ASSERT_NOT_NULL(job, cleanup, "arena_alloc failed");
 
-    if (0 == field || (size_t)(end - cursor) < field)
+    job->session = session;
+    job->arena = *arena;
+    job->request_id = request_id;
+    job->ret_code = ret_code;
+    job->part_count = part_count;
+    if (0 != part_count)
     {
-        ERROR(cleanup, "invalid path_len");
+	memcpy(job->parts, parts, sizeof(*parts) * (size_t)part_count);
     }
 
-    // path
-    tmp = malloc(field + 1);
-    ASSERT_NOT_NULL(tmp, cleanup, "malloc failed: %s", strerror(errno));
-    memcpy(tmp, cursor, field);
-    tmp[field] = '\0';
-    *path_out = tmp;
-    cursor += field;
+    ASSERT_RET_EQ(NETWORK_OK, session_submit(session, run_reply_job, job), cleanup, "session_submit failed");
 
-    // args len 
-    field = ntohl(*(const uint32_t *)cursor);
-    cursor += sizeof(uint32_t);
+    // the job owns the arena and everything in it now
+    *arena = NULL;
 
-    // args
-    if (0 != field)
-    {
-        if ((size_t)(end - cursor) < field)
-        {
-            ERROR(cleanup, "invalid args_len");
-        }
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
 
-    	tmp = malloc(field + 2);
-    	ASSERT_NOT_NULL(tmp, cleanup, "malloc failed: %s", strerror(errno));
-   	memcpy(tmp, cursor, field);
+static void session_exec_done(void *ctx,
+                              exec_status_t exec_status,
+                              exec_output_t *out_stdout,
+                              exec_output_t *out_stderr,
+                              int exit_code)
+{
+    exec_pending_t *pending = ctx;
+    session_t *session = pending->session;
+    arena_t *arena = pending->arena;
+    cmd_status_t status = CMD_FATAL;
+    cmd_status_t cmd_status = CMD_ERROR;
+    struct iovec res_parts[RESULT_PARTS_MAX] = {0};
+    int res_part_count = 0;
+    int adopted = 0;
 
-	// NULL terminate the last arg
-    	tmp[field] = '\0';
-	// add final NULL terminator as the last arg
-    	tmp[field + 1] = '\0';
-        *args_out = tmp;
+    if (NULL != pending->prev)
+    {
+	pending->prev->next = pending->next;
     }
     else
     {
-        *args_out = NULL;
+	session->execs = pending->next;
     }
-
-    status = CMD_OK;
-
-cleanup:
-    if (CMD_OK != status)
+    if (NULL != pending->next)
     {
-	if (NULL != *path_out)
-	{
-	    free(*path_out);
-	    *path_out = NULL;
-	}
-	if (NULL != *args_out)
-	{
-	    free(*args_out);
-	    *args_out = NULL;
-	}
+	pending->next->prev = pending->prev;
     }
-    return status;
-}
+    --session->exec_count;
 
-static cmd_status_t build_exec_response(int exit_code,
-                                            size_t stdout_size,
-                                            const char *stdout_buf,
-                                            size_t stderr_size,
-                                            const char *stderr_buf,
-                                            uint8_t **out_buf,
-                                            size_t *out_size)
-{
-    cmd_status_t status = CMD_FATAL;
-    uint8_t *buf = NULL;
-    uint8_t *ptr = NULL;
-    size_t total = 0;
+    // the reply points into the output, so it has to outlive this function
+    adopted = (ARENA_OK == arena_adopt(arena, out_stdout->buf));
+    adopted &= (ARENA_OK == arena_adopt(arena, out_stderr->buf));
 
-    ASSERT_NOT_NULL(stdout_buf, cleanup, "stdout_buf is NULL");
-    ASSERT_NOT_NULL(stderr_buf, cleanup, "stderr_buf is NULL");
-    ASSERT_NOT_NULL(out_buf, cleanup, "out_buf is NULL");
-    ASSERT_NOT_NULL(out_size, cleanup, "out_size is NULL");
-
-    if (stdout_size > UINT32_MAX || stderr_size > UINT32_MAX)
+    if (0 != session->closing)
     {
-        ERROR(cleanup, "streams too large stdout %d, stderr %d", stdout_size, stderr_size);
+	status = CMD_OK;
+	goto cleanup;
     }
+    ASSERT_RET_EQ(1, adopted, cleanup, "arena_adopt failed");
 
-    total = sizeof(int32_t) +
-            sizeof(uint32_t) + stdout_size +
-            sizeof(uint32_t) + stderr_size;
-
-    buf = malloc(total);
-    ASSERT_NOT_NULL(buf, cleanup, "malloc failed: %s", strerror(errno));
-
-    ptr = buf;
+    if (EXEC_OK == exec_status)
+    {
+	ASSERT_RET_EQ(CMD_OK, build_exec_response(arena, exit_code, out_stdout, out_stderr, pending->capped,
+						  res_parts, &res_part_count), cleanup, "build_exec_response failed");
+	cmd_status = CMD_OK;
+    }
+    else if (EXEC_TIMEOUT != exec_status)
+    {
+	ERROR(cleanup, "exec failed: %d", exec_status);
+    }
 
-    *(int32_t *)ptr = htonl(exit_code);
-    ptr += sizeof(int32_t);
+    ASSERT_RET_EQ(NETWORK_OK, session_reply(session, &arena, pending->request_id, (CMD_OK == cmd_status) ? 0 : -1,
+					    res_parts, res_part_count), cleanup, "session_reply failed");
 
-    // cast safe becuase we checked size is smaller than UINT32_MAX
-    *(uint32_t *)ptr = htonl((uint32_t)stdout_size);
-    ptr += sizeof(uint32_t);
+    status = CMD_OK;
+cleanup:
+    // `pending` lives in the arena as well, unless a worker took it with the reply
+    session_arena_put(session, arena);
 
-    if (0 != stdout_size)
+    if (0 != session->closing)
     {
-        memcpy(ptr, stdout_buf, stdout_size);
-        ptr += stdout_size;
+	(void)session_try_end(session);
+	return;
     }
-
-    // cast safe becuase we checked size is smaller than UINT32_MAX
-    *(uint32_t *)ptr = htonl((uint32_t)stderr_size);
-    ptr += sizeof(uint32_t);
-
-    if (0 != stderr_size)
+    if (CMD_FATAL == status)
     {
-        memcpy(ptr, stderr_buf, stderr_size);
+	session_fail(session);
+	return;
     }
 
-    *out_buf = buf;
-    *out_size = total;
-    status = CMD_OK;
-
-cleanup:
-    return status;
+    session->exec_inline = 0;
+    session_pump(session);
 }
 
-static cmd_status_t handle_exec_command(const uint8_t *payload,
-                                            size_t payload_len,
-                                            uint8_t **out_buf,
-                                            size_t *out_size)
+/*
+ * Hands an exec command to the reactor, session_exec_done replies once the
+ * child is over. On CMD_OK the command took session->arena with it.
+ */
+static cmd_status_t session_start_exec(session_t *session,
+                                       uint32_t request_id,
+                                       const uint8_t *payload,
+                                       size_t payload_len)
 {
     cmd_status_t status = CMD_FATAL;
+    arena_t *arena = session->arena;
+    exec_pending_t *pending = NULL;
+    exec_status_t exec_status = EXEC_FAILED;
     char *path = NULL;
-    char **args = NULL;
+    char **argv = NULL;
     uint32_t timeout_ms = 0;
+    exec_limits_t limits = {0};
+    int capped = 0;
 
-    char *out_stdout = NULL;
-    size_t stdout_size = 0;
-    char *out_stderr = NULL;
-    size_t stderr_size = 0;
-    int exit_code = 0;
-
-    exec_status_t exec_status = EXEC_FAILED;
-
-    ASSERT_NOT_NULL(payload, cleanup, "payload NULL");
-    ASSERT_NOT_NULL(out_buf, cleanup, "out_buf NULL");
-    ASSERT_NOT_NULL(out_size, cleanup, "out_size NULL");
-
-    status = parse_exec_payload(payload, payload_len, &timeout_ms, &path, (char **)&args);
+    status = parse_exec_payload(arena, payload, payload_len, &timeout_ms, &path, &argv, &limits, &capped);
     ASSERT_RET_EQ(CMD_OK, status, cleanup, "parse failed");
-
-    exec_status = exec_run(path, args, &stdout_size, &out_stdout, &stderr_size, &out_stderr, &exit_code, timeout_ms);
-
+    status = CMD_FATAL;
+
+    pending = arena_alloc(arena, sizeof(*pending));
+    ASSERT_NOT_NULL(pending, cleanup, "arena_alloc failed");
+    memset(pending, 0, sizeof(*pending));
+    pending->session = session;
+    pending->arena = arena;
+    pending->request_id = request_id;
+    pending->capped = capped;
+
+    exec_status = exec_start_capped(session->reactor, path, argv, &limits, session_exec_done, pending, timeout_ms,
+				    &pending->job);
     if (EXEC_INACCESSIBLE == exec_status)
     {
+	// nothing to wait for, the failure is the reply
+	ASSERT_RET_EQ(NETWORK_OK, session_reply(session, &session->arena, request_id, -1, NULL, 0), cleanup,
+		      "session_reply failed");
 	status = CMD_ERROR;
 	goto cleanup;
     }
-    ASSERT_RET_EQ(EXEC_OK, exec_status, cleanup, "exec_run failed");
+    ASSERT_RET_EQ(EXEC_OK, exec_status, cleanup, "exec_start_capped failed");
 
-    status = build_exec_response(exit_code, stdout_size, out_stdout, stderr_size, out_stderr, out_buf, out_size);
-    ASSERT_RET_EQ(CMD_OK, status, cleanup, "pack failed");
+    pending->next = session->execs;
+    if (NULL != session->execs)
+    {
+	session->execs->prev = pending;
+    }
+    session->execs = pending;
+    ++session->exec_count;
 
-    status = CMD_OK;
+    // without request ids replies have to come in order
+    session->exec_inline = (0 == (session->caps & CAP_MUX));
+    session->arena = NULL;
 
+    status = CMD_OK;
 cleanup:
-    if (NULL != path)
-    {
-        free(path);
-    }
-    if (NULL != args)
-    {
-        free(args);
-    }
     return status;
 }
 
-static network_status_t send_hello(int sock_fd,
-                                const tool_t *tool)
+/* Runs the command just read, returns CMD_FATAL if the session can't go on. */
+static cmd_status_t session_dispatch(session_t *session,
+                                     uint8_t code,
+                                     uint32_t request_id,
+                                     uint8_t *payload,
+                                     size_t payload_len)
 {
-    network_status_t status = NETWORK_FAILED;
-    uint8_t version = 1;
+    cmd_status_t status = CMD_FATAL;
 
-    ASSERT_RET_EQ(FILE_OK, write_all(sock_fd, &version, sizeof(version)), cleanup, "couldn't send versin");
-    ASSERT_RET_EQ(FILE_OK, write_all(sock_fd, (uint8_t *)(tool->name), sizeof(tool->name)), cleanup, "couldn't send tool name");
+    if (CMD_EXEC_COMMAND == code)
+    {
+	status = session_start_exec(session, request_id, payload, payload_len);
+    }
+    else if (NULL != session->workers)
+    {
+	status = (NETWORK_OK == submit_mux_job(session, &session->arena, request_id, code, payload, payload_len)) ?
+		 CMD_OK : CMD_FATAL;
+    }
+    else
+    {
+	status = run_command(session, session->arena, request_id, code, payload, payload_len);
+    }
 
-    status = NETWORK_OK;
+    if (CMD_FATAL != status && NULL != session->arena)
+    {
+	arena_reset(session->arena);
+    }
 
-cleanup:
     return status;
 }
 
-static network_status_t handle_command_loop(int sock_fd,
-                                            unsigned int *out_sleep_duration,
-					    int *out_should_die)
+/*
+ * Handles every command the socket has for now. Stops watching the socket
+ * while a command has to wait for the execs in flight, session_exec_done
+ * picks up from there.
+ */
+static void session_pump(session_t *session)
 {
-    network_status_t status = NETWORK_FAILED;
-    cmd_status_t cmd_status = CMD_FATAL;
     network_status_t read_cmd_res = NETWORK_FAILED;
+    network_status_t control_res = NETWORK_FAILED;
     uint8_t *payload = NULL;
     size_t payload_len = 0;
-    uint8_t *res_buf = NULL;
-    size_t res_len = 0;
     uint8_t code = 0;
-    int32_t ret_code = 0;
- 	
-    *out_should_die = 0;
+    uint32_t request_id = 0;
 
     while (1)
     {
-        read_cmd_res = read_command(sock_fd, &payload, &payload_len, &code);
-
-	// if couldn't read more messages, just sleep default
-        if (NETWORK_STOP_COMM == read_cmd_res)
-        {
-            *out_sleep_duration = 0;
-            status = NETWORK_OK;
-            break;
-        }
+	if (0 != session->held)
+	{
+	    // control commands take effect only after every command before them replied
+	    if (0 != session->exec_count || session_jobs_over(session, 0))
+	    {
+		break;
+	    }
+
+	    session->held = 0;
+	    control_res = run_control(session, session->held_code, session->held_request_id,
+				      session->held_payload, session->held_payload_len);
+	    if (NETWORK_STOP_COMM == control_res)
+	    {
+		session->end_status = NETWORK_OK;
+		session_end(session);
+		return;
+	    }
+	    ASSERT_RET_EQ(NETWORK_OK, control_res, failed, "run_control failed");
+
+	    arena_reset(session->arena);
+	    continue;
+	}
 
-	ASSERT_RET_EQ(NETWORK_OK, read_cmd_res, cleanup, "read_command failed");
+	if (0 != session->eof)
+	{
+	    if (0 != session->exec_count || session_jobs_over(session, 0))
+	    {
+		break;
+	    }
 
-        ret_code = 0;
-        cmd_status = CMD_FATAL;
+	    // a failed worker shuts the socket down, which also ends up here
+	    session->end_status = NETWORK_OK;
+	    session->sleep_duration = 0;
+	    session_end(session);
+	    return;
+	}
 
-        switch (code)
-        {
-            case CMD_SLEEP:
-                cmd_status = handle_sleep_command(payload, out_sleep_duration);
-                break;
-
-            case CMD_UNLOAD_LOGS:
-                cmd_status = handle_unload_logs(&res_buf, &res_len);
-                break;
-
-            case CMD_GET_FILE:
-                cmd_status = handle_get_file(payload, payload_len, &res_buf, &res_len);
-                break;
-
-            case CMD_EXEC_COMMAND:
-                cmd_status = handle_exec_command(payload, payload_len, &res_buf, &res_len);
-                break;
-	   case CMD_DIE:
-		cmd_status = CMD_OK;
-		*out_should_die = 1;
-		break;
-            default:
-                ERROR(cleanup, "unknown command: %u", code);
-                break;
-        }
-	
-	ASSERT_RET_NE(CMD_FATAL, cmd_status, cleanup, "cmd returned fatal error");
-        if (CMD_OK != cmd_status)
-        {
-	    // generic command failed
-            ret_code = -1;
-        }
-	
-	ASSERT_RET_EQ(NETWORK_OK, send_cmd_result(sock_fd, ret_code, res_buf, res_len), cleanup, "send_cmd_result failed");
+	if (0 != session->exec_inline || session->exec_count >= MUX_EXECS_MAX)
+	{
+	    break;
+	}
 
-        if (CMD_SLEEP == code || CMD_DIE == code)
-        {
-            break;
-        }
+	// room for the reply of every exec in flight as well, so worker_pool_submit never blocks the reactor
+	if (session->exec_count >= WORKER_QUEUE_MAX ||
+	    session_jobs_over(session, WORKER_QUEUE_MAX - 1 - session->exec_count))
+	{
+	    break;
+	}
 
-        if (payload)
-        {
-            free(payload);
-            payload = NULL;
-        }
+	// everything a command allocates lives until its reply is out
+	if (NULL == session->arena)
+	{
+	    session->arena = session_arena_get(session);
+	    ASSERT_NOT_NULL(session->arena, failed, "session_arena_get failed");
+	}
 
-        if (res_buf)
-        {
-            free(res_buf);
-            res_buf = NULL;
-        }
-    }
+	read_cmd_res = read_command(session, session->arena, &payload, &payload_len, &code, &request_id);
+	if (NETWORK_AGAIN == read_cmd_res)
+	{
+	    // about to wait for the controller, so nothing may stay queued
+	    ASSERT_RET_EQ(NETWORK_OK, session_flush(session), failed, "session_flush failed");
+	    ASSERT_RET_EQ(NETWORK_OK, session_watch(session, 1), failed, "session_watch failed");
+	    return;
+	}
+	if (NETWORK_STOP_COMM == read_cmd_res)
+	{
+	    session->eof = 1;
+	    continue;
+	}
+	ASSERT_RET_EQ(NETWORK_OK, read_cmd_res, failed, "read_command failed");
 
-    status = NETWORK_OK;
+	if (CMD_SLEEP == code || CMD_DIE == code || CMD_SET_CAPS == code)
+	{
+	    session->held = 1;
+	    session->held_code = code;
+	    session->held_request_id = request_id;
+	    session->held_payload = payload;
+	    session->held_payload_len = payload_len;
+	    continue;
+	}
 
-cleanup:
-    if (payload)
-    {
-        free(payload);
-	payload = NULL;
+	ASSERT_RET_NE(CMD_FATAL, session_dispatch(session, code, request_id, payload, payload_len), failed,
+		      "command failed fatally");
     }
 
-    if (res_buf)
-    {
-        free(res_buf);
-	res_buf = NULL;
-    }
+    // waiting for execs or jobs, the results queued so far shouldn't wait with them
+    ASSERT_RET_EQ(NETWORK_OK, session_flush(session), failed, "session_flush failed");
+    ASSERT_RET_EQ(NETWORK_OK, session_watch(session, 0), failed, "session_watch failed");
+    return;
 
-    return status;
+failed:
+    session_fail(session);
 }
 
 static network_status_t connect_to_tool(const tool_conf_t *conf, int * out_fd)
@@ -486,7 +2612,8 @@ static network_status_t connect_to_tool(const tool_conf_t *conf, int * out_fd)
     ASSERT_NOT_NULL(conf, done, "conf is NULL");
     ASSERT_NOT_NULL(out_fd, done, "out_fd is NULL");
 
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    // the connect completes in the reactor, see session_connected
+    sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     ASSERT_RET_NE(-1, sock_fd, done, "Failed to create socket: %s", strerror(errno));
 
     addr.sin_family = AF_INET;
@@ -495,6 +2622,10 @@ static network_status_t connect_to_tool(const tool_conf_t *conf, int * out_fd)
     ret = inet_pton(AF_INET, conf->ip, &addr.sin_addr);
     ASSERT_RET_EQ(1, ret, done, "Invalid IP address: %s", conf->ip);
     ret = connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (-1 == ret && EINPROGRESS == errno)
+    {
+	ret = 0;
+    }
     ASSERT_RET_EQ(0, ret, done, "Failed to connect to %s:%d  %s", conf->ip, conf->port, strerror(errno));
 
     *out_fd = sock_fd; 
@@ -508,29 +2639,141 @@ done:
     return status;
 }
 
-network_status_t communicate(const tool_t *tool, unsigned int *out_sleep_duration, int * out_should_die)
+/*
+ * A persistent session idles in the reactor for as long as the controller has
+ * nothing to say, so keepalive probes are what notice a dead peer.
+ */
+static network_status_t enable_keepalive(int sock_fd)
 {
     network_status_t status = NETWORK_FAILED;
-    int sock_fd = -1;
+    int on = 1;
+    int idle = KEEPALIVE_IDLE_SEC;
+    int interval = KEEPALIVE_INTERVAL_SEC;
+    int probes = KEEPALIVE_PROBES;
+
+    ASSERT_RET_EQ(0, setsockopt(sock_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)), cleanup,
+		  "setsockopt(SO_KEEPALIVE) failed: %s", strerror(errno));
+    ASSERT_RET_EQ(0, setsockopt(sock_fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)), cleanup,
+		  "setsockopt(TCP_KEEPIDLE) failed: %s", strerror(errno));
+    ASSERT_RET_EQ(0, setsockopt(sock_fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)), cleanup,
+		  "setsockopt(TCP_KEEPINTVL) failed: %s", strerror(errno));
+    ASSERT_RET_EQ(0, setsockopt(sock_fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)), cleanup,
+		  "setsockopt(TCP_KEEPCNT) failed: %s", strerror(errno));
 
-    ASSERT_NOT_NULL(tool, cleanup, "tool is NULL");
-    ASSERT_NOT_NULL(out_sleep_duration, cleanup, "out_sleep_duration is NULL");
-    ASSERT_NOT_NULL(out_should_die, cleanup, "out_should_die is NULL");
+    status = NETWORK_OK;
+cleanup:
+    return status;
+}
+
+/* The socket turned writable: the connect is done, one way or the other. */
+static void session_connected(session_t *session)
+{
+    const tool_conf_t *conf = &session->tool->conf;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    int flags = 0;
+    int on = 1;
+
+    ASSERT_RET_EQ(0, getsockopt(session->fd, SOL_SOCKET, SO_ERROR, &error, &error_len), failed,
+		  "getsockopt(SO_ERROR) failed: %s", strerror(errno));
+    ASSERT_RET_EQ(0, error, failed, "Failed to connect to %s:%d  %s", conf->ip, conf->port, strerror(error));
+
+    // replies are written blocking, commands are read with MSG_DONTWAIT
+    flags = fcntl(session->fd, F_GETFL);
+    ASSERT_RET_NE(-1, flags, failed, "fcntl(F_GETFL) failed: %s", strerror(errno));
+    ASSERT_RET_NE(-1, fcntl(session->fd, F_SETFL, flags & ~O_NONBLOCK), failed,
+		  "fcntl(F_SETFL) failed: %s", strerror(errno));
+
+    if (0 != conf->persistent)
+    {
+	ASSERT_RET_EQ(NETWORK_OK, enable_keepalive(session->fd), failed, "enable_keepalive failed");
+    }
 
-    ASSERT_RET_EQ(NETWORK_OK, connect_to_tool(&tool->conf, &sock_fd), cleanup, "connect_to_tool failed");
+    // writes are coalesced by the frame layer, Nagle would only add delay
+    ASSERT_RET_EQ(0, setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)), failed,
+		  "setsockopt(TCP_NODELAY) failed: %s", strerror(errno));
 
-    ASSERT_RET_EQ(NETWORK_OK, send_hello(sock_fd, tool), cleanup, "send_hello failed");
+    session->connected = 1;
+    ASSERT_RET_EQ(NETWORK_OK, send_hello(session, session->tool), failed, "send_hello failed");
+    ASSERT_RET_EQ(REACTOR_OK, reactor_set_events(session->source, REACTOR_READ), failed, "reactor_set_events failed");
+    return;
 
-    status = handle_command_loop(sock_fd, out_sleep_duration, out_should_die);
+failed:
+    session->end_status = NETWORK_FAILED;
+    session_end(session);
+}
 
-cleanup:
-    if (-1 != sock_fd)
+static void session_on_socket(void *ctx, uint32_t events)
+{
+    session_t *session = ctx;
+
+    (void)events;
+
+    if (0 == session->connected)
     {
-        close(sock_fd);
+	session_connected(session);
+	return;
     }
 
-    return status;
+    session_pump(session);
+}
+
+static void session_on_jobs(void *ctx, uint32_t events)
+{
+    session_t *session = ctx;
+
+    (void)events;
+
+    if (0 != session->closing)
+    {
+	(void)session_try_end(session);
+	return;
+    }
+
+    session_pump(session);
 }
 
+network_status_t network_session_start(reactor_t *reactor, const tool_t *tool, network_done_cb_t on_done, void *ctx)
+{
+    network_status_t status = NETWORK_FAILED;
+    session_t *session = NULL;
+
+    ASSERT_NOT_NULL(reactor, cleanup, "reactor is NULL");
+    ASSERT_NOT_NULL(tool, cleanup, "tool is NULL");
+    ASSERT_NOT_NULL(on_done, cleanup, "on_done is NULL");
+
+    // holds the frame buffers, too big for the stack of a long call chain
+    session = calloc(1, sizeof(*session));
+    ASSERT_NOT_NULL(session, cleanup, "calloc failed: %s", strerror(errno));
+
+    session->fd = -1;
+    session->reactor = reactor;
+    session->tool = tool;
+    session->on_done = on_done;
+    session->done_ctx = ctx;
+    pthread_mutex_init(&session->send_lock, NULL);
+    pthread_mutex_init(&session->arena_lock, NULL);
+
+    status = connect_to_tool(&tool->conf, &session->fd);
+    ASSERT_RET_EQ(NETWORK_OK, status, cleanup, "connect_to_tool failed");
+    frame_init(&session->conn, session->fd);
 
+    status = NETWORK_FAILED;
+    ASSERT_RET_EQ(REACTOR_OK, reactor_add_fd(reactor, session->fd, REACTOR_WRITE, session_on_socket, session,
+					     &session->source), cleanup, "reactor_add_fd failed");
 
+    session = NULL;
+    status = NETWORK_OK;
+cleanup:
+    if (NULL != session)
+    {
+	if (-1 != session->fd)
+	{
+	    close(session->fd);
+	}
+	pthread_mutex_destroy(&session->arena_lock);
+	pthread_mutex_destroy(&session->send_lock);
+	free(session);
+    }
+    return status;
+}
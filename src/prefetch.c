@@ -0,0 +1,209 @@
+/**
+ * filename: prefetch.c
+ * description: Opens and reads ahead a list of files on a small pool of reader threads.
+ */
+
+// needed for readahead
+#define _GNU_SOURCE
+
+// C includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// User includes
+#include "prefetch.h"
+#include "log.h"
+
+// defines
+#define PREFETCH_READAHEAD_MAX (8 * 1024 * 1024)
+
+struct prefetch_s
+{
+    prefetch_entry_t *entries;
+    size_t count;
+    size_t next;        // next entry a reader will claim
+    size_t consumed;    // entries handed to the consumer
+    size_t thread_count;
+    int *ready;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t claim_cond;
+    pthread_cond_t ready_cond;
+    pthread_t threads[PREFETCH_THREADS];
+};
+
+static void prefetch_entry(prefetch_entry_t *entry)
+{
+    size_t ahead = 0;
+
+    entry->status = open_regular_file(entry->path, &entry->fd, &entry->info);
+    if (FILE_OK != entry->status)
+    {
+        return;
+    }
+
+    (void)posix_fadvise(entry->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // only the head of big files, the kernel's own readahead takes over from there
+    ahead = (entry->info.size < PREFETCH_READAHEAD_MAX) ? (size_t)entry->info.size : PREFETCH_READAHEAD_MAX;
+    if (0 != ahead && -1 == readahead(entry->fd, 0, ahead))
+    {
+        INFO("readahead failed: %s", strerror(errno));
+    }
+}
+
+static void *prefetch_worker(void *arg)
+{
+    prefetch_t *pool = arg;
+    size_t index = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (0 == pool->stop && pool->next < pool->count && pool->next >= pool->consumed + PREFETCH_WINDOW)
+        {
+            pthread_cond_wait(&pool->claim_cond, &pool->lock);
+        }
+
+        if (0 != pool->stop || pool->next >= pool->count)
+        {
+            break;
+        }
+
+        index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        prefetch_entry(&pool->entries[index]);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->ready[index] = 1;
+        pthread_cond_broadcast(&pool->ready_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+file_status_t prefetch_start(prefetch_entry_t *entries, size_t count, prefetch_t **out_pool)
+{
+    file_status_t status = FILE_FAILED;
+    prefetch_t *pool = NULL;
+    size_t wanted = 0;
+
+    ASSERT_NOT_NULL(entries, cleanup, "entries is NULL");
+    ASSERT_NOT_NULL(out_pool, cleanup, "out_pool is NULL");
+
+    *out_pool = NULL;
+
+    status = FILE_NOMEM;
+    pool = calloc(1, sizeof(*pool));
+    ASSERT_NOT_NULL(pool, cleanup, "calloc failed: %s", strerror(errno));
+    pool->ready = calloc(count + 1, sizeof(*pool->ready));
+    ASSERT_NOT_NULL(pool->ready, cleanup, "calloc failed: %s", strerror(errno));
+
+    pool->entries = entries;
+    pool->count = count;
+    for (size_t i = 0; i < count; ++i)
+    {
+        entries[i].fd = -1;
+        entries[i].status = FILE_FAILED;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->claim_cond, NULL);
+    pthread_cond_init(&pool->ready_cond, NULL);
+
+    wanted = (count < PREFETCH_THREADS) ? count : PREFETCH_THREADS;
+    for (pool->thread_count = 0; pool->thread_count < wanted; ++pool->thread_count)
+    {
+        if (0 != pthread_create(&pool->threads[pool->thread_count], NULL, prefetch_worker, pool))
+        {
+            // fewer readers still work, none means prefetch_wait would hang
+            INFO("pthread_create failed after %zu readers", pool->thread_count);
+            break;
+        }
+    }
+
+    status = FILE_FAILED;
+    if (0 == pool->thread_count && 0 != count)
+    {
+        prefetch_destroy(pool);
+        pool = NULL;
+        ERROR(cleanup, "couldn't start any reader thread");
+    }
+
+    *out_pool = pool;
+    pool = NULL;
+    status = FILE_OK;
+cleanup:
+    if (NULL != pool)
+    {
+        free(pool->ready);
+        free(pool);
+    }
+    return status;
+}
+
+file_status_t prefetch_wait(prefetch_t *pool, size_t index)
+{
+    file_status_t status = FILE_FAILED;
+
+    ASSERT_NOT_NULL(pool, cleanup, "pool is NULL");
+
+    if (index >= pool->count || index != pool->consumed)
+    {
+        ERROR(cleanup, "entries must be waited for in order");
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (0 == pool->ready[index])
+    {
+        pthread_cond_wait(&pool->ready_cond, &pool->lock);
+    }
+
+    // the consumer owns this entry now, let the readers move one further
+    pool->consumed = index + 1;
+    pthread_cond_broadcast(&pool->claim_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    status = FILE_OK;
+cleanup:
+    return status;
+}
+
+void prefetch_destroy(prefetch_t *pool)
+{
+    if (NULL == pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->claim_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->thread_count; ++i)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (size_t i = pool->consumed; i < pool->count; ++i)
+    {
+        if (-1 != pool->entries[i].fd)
+        {
+            close(pool->entries[i].fd);
+            pool->entries[i].fd = -1;
+        }
+    }
+
+    pthread_cond_destroy(&pool->ready_cond);
+    pthread_cond_destroy(&pool->claim_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->ready);
+    free(pool);
+}
@@ -0,0 +1,512 @@
+/**
+ * filename: reactor.c
+ * description: Single threaded epoll event loop for sockets, pipes, timers, children, signals
+ *              and wakeups from other threads.
+ */
+
+// needed for waitid's WNOWAIT with P_PID
+#define _GNU_SOURCE
+
+// C includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// User includes
+#include "reactor.h"
+#include "log.h"
+
+// defines
+#define REACTOR_EVENTS_MAX 32
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+
+typedef enum source_kind_e
+{
+    SOURCE_FD = 0,
+    SOURCE_TIMER,
+    SOURCE_CHILD,           // pidfd, readable once the child exited
+    SOURCE_CHILD_POLL,      // timerfd, checks the child on every tick
+    SOURCE_SIGNAL,
+    SOURCE_WAKE,            // eventfd, written by reactor_wake
+} source_kind_t;
+
+struct reactor_source_s
+{
+    reactor_t *reactor;
+    source_kind_t kind;
+    int fd;
+    pid_t pid;              // SOURCE_CHILD_POLL only
+    reactor_cb_t cb;
+    void *ctx;
+    int removed;            // freed once the current batch of events is dispatched
+    reactor_source_t *prev;
+    reactor_source_t *next;
+};
+
+struct reactor_s
+{
+    int epfd;
+    int stop;
+    reactor_source_t *live;
+    reactor_source_t *dead;
+};
+
+static uint32_t to_epoll_events(uint32_t events)
+{
+    uint32_t epoll_events = 0;
+
+    epoll_events |= (0 != (events & REACTOR_READ)) ? EPOLLIN : 0;
+    epoll_events |= (0 != (events & REACTOR_WRITE)) ? EPOLLOUT : 0;
+
+    return epoll_events;
+}
+
+static uint32_t from_epoll_events(uint32_t epoll_events)
+{
+    uint32_t events = 0;
+
+    events |= (0 != (epoll_events & EPOLLIN)) ? REACTOR_READ : 0;
+    events |= (0 != (epoll_events & EPOLLOUT)) ? REACTOR_WRITE : 0;
+    events |= (0 != (epoll_events & (EPOLLHUP | EPOLLERR))) ? REACTOR_HUP : 0;
+
+    return events;
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Registers `fd` and links the source in, the source owns `fd` unless it is SOURCE_FD. */
+static reactor_status_t source_add(reactor_t *reactor, source_kind_t kind, int fd, uint32_t events,
+				   reactor_cb_t cb, void *ctx, reactor_source_t **out_source)
+{
+    reactor_status_t status = REACTOR_NOMEM;
+    reactor_source_t *source = NULL;
+    struct epoll_event event = {0};
+
+    source = calloc(1, sizeof(*source));
+    ASSERT_NOT_NULL(source, cleanup, "calloc failed: %s", strerror(errno));
+
+    source->reactor = reactor;
+    source->kind = kind;
+    source->fd = fd;
+    source->cb = cb;
+    source->ctx = ctx;
+
+    status = REACTOR_FAILED;
+    event.events = to_epoll_events(events);
+    event.data.ptr = source;
+    ASSERT_RET_EQ(0, epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &event), cleanup,
+		  "epoll_ctl(ADD, %d) failed: %s", fd, strerror(errno));
+
+    source->next = reactor->live;
+    if (NULL != reactor->live)
+    {
+	reactor->live->prev = source;
+    }
+    reactor->live = source;
+
+    *out_source = source;
+    source = NULL;
+    status = REACTOR_OK;
+cleanup:
+    free(source);
+    return status;
+}
+
+static void free_dead(reactor_t *reactor)
+{
+    reactor_source_t *source = NULL;
+
+    while (NULL != reactor->dead)
+    {
+	source = reactor->dead;
+	reactor->dead = source->next;
+	free(source);
+    }
+}
+
+reactor_status_t reactor_create(reactor_t **out_reactor)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    reactor_t *reactor = NULL;
+
+    ASSERT_NOT_NULL(out_reactor, cleanup, "out_reactor is NULL");
+
+    status = REACTOR_NOMEM;
+    reactor = calloc(1, sizeof(*reactor));
+    ASSERT_NOT_NULL(reactor, cleanup, "calloc failed: %s", strerror(errno));
+
+    status = REACTOR_FAILED;
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_RET_NE(-1, reactor->epfd, cleanup, "epoll_create1 failed: %s", strerror(errno));
+
+    *out_reactor = reactor;
+    reactor = NULL;
+    status = REACTOR_OK;
+cleanup:
+    free(reactor);
+    return status;
+}
+
+void reactor_destroy(reactor_t *reactor)
+{
+    if (NULL == reactor)
+    {
+	return;
+    }
+
+    while (NULL != reactor->live)
+    {
+	reactor_remove(reactor->live);
+    }
+    free_dead(reactor);
+
+    close(reactor->epfd);
+    free(reactor);
+}
+
+reactor_status_t reactor_add_fd(reactor_t *reactor, int fd, uint32_t events,
+				reactor_cb_t cb, void *ctx, reactor_source_t **out_source)
+{
+    reactor_status_t status = REACTOR_INVALID;
+
+    ASSERT_NOT_NULL(reactor, cleanup, "reactor is NULL");
+    ASSERT_NOT_NULL(cb, cleanup, "cb is NULL");
+    ASSERT_NOT_NULL(out_source, cleanup, "out_source is NULL");
+
+    status = source_add(reactor, SOURCE_FD, fd, events, cb, ctx, out_source);
+cleanup:
+    return status;
+}
+
+reactor_status_t reactor_set_events(reactor_source_t *source, uint32_t events)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    struct epoll_event event = {0};
+
+    ASSERT_NOT_NULL(source, cleanup, "source is NULL");
+
+    status = REACTOR_FAILED;
+    event.events = to_epoll_events(events);
+    event.data.ptr = source;
+    ASSERT_RET_EQ(0, epoll_ctl(source->reactor->epfd, EPOLL_CTL_MOD, source->fd, &event), cleanup,
+		  "epoll_ctl(MOD, %d) failed: %s", source->fd, strerror(errno));
+
+    status = REACTOR_OK;
+cleanup:
+    return status;
+}
+
+reactor_status_t reactor_add_timer(reactor_t *reactor, reactor_cb_t cb, void *ctx,
+				   reactor_source_t **out_source)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    int fd = -1;
+
+    ASSERT_NOT_NULL(reactor, cleanup, "reactor is NULL");
+    ASSERT_NOT_NULL(cb, cleanup, "cb is NULL");
+    ASSERT_NOT_NULL(out_source, cleanup, "out_source is NULL");
+
+    status = REACTOR_FAILED;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ASSERT_RET_NE(-1, fd, cleanup, "timerfd_create failed: %s", strerror(errno));
+
+    status = source_add(reactor, SOURCE_TIMER, fd, REACTOR_READ, cb, ctx, out_source);
+    ASSERT_RET_EQ(REACTOR_OK, status, cleanup, "source_add failed");
+    fd = -1;
+
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    return status;
+}
+
+reactor_status_t reactor_timer_arm(reactor_source_t *source, uint64_t delay_ms, uint64_t interval_ms)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    struct itimerspec spec = {0};
+
+    ASSERT_NOT_NULL(source, cleanup, "source is NULL");
+
+    spec.it_value.tv_sec = (time_t)(delay_ms / MS_PER_SEC);
+    spec.it_value.tv_nsec = (long)(delay_ms % MS_PER_SEC) * NS_PER_MS;
+    spec.it_interval.tv_sec = (time_t)(interval_ms / MS_PER_SEC);
+    spec.it_interval.tv_nsec = (long)(interval_ms % MS_PER_SEC) * NS_PER_MS;
+
+    status = REACTOR_FAILED;
+    ASSERT_RET_EQ(0, timerfd_settime(source->fd, 0, &spec, NULL), cleanup,
+		  "timerfd_settime failed: %s", strerror(errno));
+
+    status = REACTOR_OK;
+cleanup:
+    return status;
+}
+
+reactor_status_t reactor_add_child(reactor_t *reactor, pid_t pid, reactor_cb_t cb, void *ctx,
+				   reactor_source_t **out_source)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    int fd = -1;
+
+    ASSERT_NOT_NULL(reactor, cleanup, "reactor is NULL");
+    ASSERT_NOT_NULL(cb, cleanup, "cb is NULL");
+    ASSERT_NOT_NULL(out_source, cleanup, "out_source is NULL");
+
+    fd = open_pidfd(pid);
+    if (-1 != fd)
+    {
+	status = source_add(reactor, SOURCE_CHILD, fd, REACTOR_READ, cb, ctx, out_source);
+	ASSERT_RET_EQ(REACTOR_OK, status, cleanup, "source_add failed");
+	fd = -1;
+	goto cleanup;
+    }
+
+    INFO("pidfd_open unavailable (%s), polling for exit every %d ms", strerror(errno), REACTOR_CHILD_POLL_MS);
+
+    status = reactor_add_timer(reactor, cb, ctx, out_source);
+    ASSERT_RET_EQ(REACTOR_OK, status, cleanup, "reactor_add_timer failed");
+    (*out_source)->kind = SOURCE_CHILD_POLL;
+    (*out_source)->pid = pid;
+
+    status = reactor_timer_arm(*out_source, REACTOR_CHILD_POLL_MS, REACTOR_CHILD_POLL_MS);
+    if (REACTOR_OK != status)
+    {
+	reactor_remove(*out_source);
+	*out_source = NULL;
+	ERROR(cleanup, "reactor_timer_arm failed");
+    }
+
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    return status;
+}
+
+reactor_status_t reactor_add_signal(reactor_t *reactor, int signo, reactor_cb_t cb, void *ctx,
+				    reactor_source_t **out_source)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    sigset_t mask;
+    int fd = -1;
+    int ret = -1;
+
+    ASSERT_NOT_NULL(reactor, cleanup, "reactor is NULL");
+    ASSERT_NOT_NULL(cb, cleanup, "cb is NULL");
+    ASSERT_NOT_NULL(out_source, cleanup, "out_source is NULL");
+
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+
+    // a blocked signal stays pending until the signalfd is read
+    status = REACTOR_FAILED;
+    ret = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    ASSERT_RET_EQ(0, ret, cleanup, "pthread_sigmask failed: %s", strerror(ret));
+
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    ASSERT_RET_NE(-1, fd, cleanup, "signalfd failed: %s", strerror(errno));
+
+    status = source_add(reactor, SOURCE_SIGNAL, fd, REACTOR_READ, cb, ctx, out_source);
+    ASSERT_RET_EQ(REACTOR_OK, status, cleanup, "source_add failed");
+    fd = -1;
+
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    return status;
+}
+
+reactor_status_t reactor_add_wake(reactor_t *reactor, reactor_cb_t cb, void *ctx, reactor_source_t **out_source)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    int fd = -1;
+
+    ASSERT_NOT_NULL(reactor, cleanup, "reactor is NULL");
+    ASSERT_NOT_NULL(cb, cleanup, "cb is NULL");
+    ASSERT_NOT_NULL(out_source, cleanup, "out_source is NULL");
+
+    status = REACTOR_FAILED;
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ASSERT_RET_NE(-1, fd, cleanup, "eventfd failed: %s", strerror(errno));
+
+    status = source_add(reactor, SOURCE_WAKE, fd, REACTOR_READ, cb, ctx, out_source);
+    ASSERT_RET_EQ(REACTOR_OK, status, cleanup, "source_add failed");
+    fd = -1;
+
+cleanup:
+    if (-1 != fd)
+    {
+	close(fd);
+    }
+    return status;
+}
+
+reactor_status_t reactor_wake(reactor_source_t *source)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    uint64_t one = 1;
+
+    ASSERT_NOT_NULL(source, cleanup, "source is NULL");
+
+    // wakes that pile up before the loop gets to them add up to a single callback
+    status = REACTOR_FAILED;
+    ASSERT_RET_EQ((ssize_t)sizeof(one), write(source->fd, &one, sizeof(one)), cleanup,
+		  "eventfd write failed: %s", strerror(errno));
+
+    status = REACTOR_OK;
+cleanup:
+    return status;
+}
+
+void reactor_remove(reactor_source_t *source)
+{
+    reactor_t *reactor = NULL;
+
+    if (NULL == source || 0 != source->removed)
+    {
+	return;
+    }
+
+    reactor = source->reactor;
+    (void)epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+    if (SOURCE_FD != source->kind)
+    {
+	close(source->fd);
+    }
+    source->fd = -1;
+    source->removed = 1;
+
+    if (NULL != source->prev)
+    {
+	source->prev->next = source->next;
+    }
+    else
+    {
+	reactor->live = source->next;
+    }
+    if (NULL != source->next)
+    {
+	source->next->prev = source->prev;
+    }
+
+    // events for it may still be waiting in the current batch
+    source->prev = NULL;
+    source->next = reactor->dead;
+    reactor->dead = source;
+}
+
+/*
+ * Consumes whatever made a timer, signal or wake source readable, returns 0 when
+ * nothing is due after all (e.g. the timer was re-armed in between).
+ */
+static int source_consume(reactor_source_t *source)
+{
+    uint64_t expirations = 0;
+    struct signalfd_siginfo info;
+    siginfo_t child = {0};
+    int due = 0;
+
+    switch (source->kind)
+    {
+	case SOURCE_TIMER:
+	    due = (sizeof(expirations) == read(source->fd, &expirations, sizeof(expirations)));
+	    break;
+
+	case SOURCE_CHILD_POLL:
+	    (void)read(source->fd, &expirations, sizeof(expirations));
+	    // WNOWAIT leaves the child for the callback to reap
+	    due = (0 == waitid(P_PID, (id_t)source->pid, &child, WEXITED | WNOHANG | WNOWAIT) && 0 != child.si_pid);
+	    break;
+
+	case SOURCE_SIGNAL:
+	    while (sizeof(info) == read(source->fd, &info, sizeof(info)))
+	    {
+		due = 1;
+	    }
+	    break;
+
+	case SOURCE_WAKE:
+	    due = (sizeof(expirations) == read(source->fd, &expirations, sizeof(expirations)));
+	    break;
+
+	default:
+	    due = 1;
+	    break;
+    }
+
+    return due;
+}
+
+reactor_status_t reactor_run(reactor_t *reactor)
+{
+    reactor_status_t status = REACTOR_INVALID;
+    struct epoll_event events[REACTOR_EVENTS_MAX];
+    reactor_source_t *source = NULL;
+    int ready = 0;
+
+    ASSERT_NOT_NULL(reactor, cleanup, "reactor is NULL");
+
+    status = REACTOR_FAILED;
+    while (0 == reactor->stop && NULL != reactor->live)
+    {
+	ready = epoll_wait(reactor->epfd, events, REACTOR_EVENTS_MAX, -1);
+	if (-1 == ready && EINTR == errno)
+	{
+	    continue;
+	}
+	ASSERT_RET_NE(-1, ready, cleanup, "epoll_wait failed: %s", strerror(errno));
+
+	for (int i = 0; i < ready && 0 == reactor->stop; ++i)
+	{
+	    source = events[i].data.ptr;
+	    if (0 != source->removed || 0 == source_consume(source))
+	    {
+		continue;
+	    }
+
+	    source->cb(source->ctx, (SOURCE_FD == source->kind) ? from_epoll_events(events[i].events) : REACTOR_READ);
+	}
+
+	free_dead(reactor);
+    }
+
+    status = REACTOR_OK;
+cleanup:
+    if (NULL != reactor)
+    {
+	free_dead(reactor);
+	reactor->stop = 0;
+    }
+    return status;
+}
+
+void reactor_stop(reactor_t *reactor)
+{
+    if (NULL != reactor)
+    {
+	reactor->stop = 1;
+    }
+}
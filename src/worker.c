@@ -0,0 +1,205 @@
+/**
+ * filename: worker.c
+ * description: Fixed size thread pool running queued jobs in submission order.
+ */
+
+// C includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// User includes
+#include "worker.h"
+#include "log.h"
+
+typedef struct worker_task_s
+{
+    worker_job_t job;
+    void *arg;
+    struct worker_task_s *next;
+} worker_task_t;
+
+struct worker_pool_s
+{
+    worker_task_t *head;
+    worker_task_t *tail;
+    size_t queued;      // tasks waiting in the queue
+    size_t running;     // tasks taken by a worker and not finished yet
+    size_t thread_count;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   // queue got a task, or stop was set
+    pthread_cond_t space_cond;  // queue has room again
+    pthread_cond_t idle_cond;   // queue is empty and nothing is running
+    pthread_t threads[WORKER_THREADS];
+};
+
+static void *worker_main(void *arg)
+{
+    worker_pool_t *pool = arg;
+    worker_task_t *task = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (0 == pool->stop && NULL == pool->head)
+        {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+
+        // queued jobs still run on stop, they own their argument
+        if (NULL == pool->head)
+        {
+            break;
+        }
+
+        task = pool->head;
+        pool->head = task->next;
+        if (NULL == pool->head)
+        {
+            pool->tail = NULL;
+        }
+        --pool->queued;
+        ++pool->running;
+        pthread_cond_signal(&pool->space_cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        task->job(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&pool->lock);
+        --pool->running;
+        if (0 == pool->running && NULL == pool->head)
+        {
+            pthread_cond_broadcast(&pool->idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+worker_status_t worker_pool_create(size_t thread_count, worker_pool_t **out_pool)
+{
+    worker_status_t status = WORKER_FAILED;
+    worker_pool_t *pool = NULL;
+
+    ASSERT_NOT_NULL(out_pool, cleanup, "out_pool is NULL");
+
+    *out_pool = NULL;
+
+    if (0 == thread_count || thread_count > WORKER_THREADS)
+    {
+        thread_count = WORKER_THREADS;
+    }
+
+    status = WORKER_NOMEM;
+    pool = calloc(1, sizeof(*pool));
+    ASSERT_NOT_NULL(pool, cleanup, "calloc failed: %s", strerror(errno));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->space_cond, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (pool->thread_count = 0; pool->thread_count < thread_count; ++pool->thread_count)
+    {
+        if (0 != pthread_create(&pool->threads[pool->thread_count], NULL, worker_main, pool))
+        {
+            INFO("pthread_create failed after %zu workers", pool->thread_count);
+            break;
+        }
+    }
+
+    status = WORKER_FAILED;
+    if (0 == pool->thread_count)
+    {
+        worker_pool_destroy(pool);
+        pool = NULL;
+        ERROR(cleanup, "couldn't start any worker thread");
+    }
+
+    *out_pool = pool;
+    status = WORKER_OK;
+cleanup:
+    return status;
+}
+
+worker_status_t worker_pool_submit(worker_pool_t *pool, worker_job_t job, void *arg)
+{
+    worker_status_t status = WORKER_FAILED;
+    worker_task_t *task = NULL;
+
+    ASSERT_NOT_NULL(pool, cleanup, "pool is NULL");
+    ASSERT_NOT_NULL(job, cleanup, "job is NULL");
+
+    status = WORKER_NOMEM;
+    task = malloc(sizeof(*task));
+    ASSERT_NOT_NULL(task, cleanup, "malloc failed: %s", strerror(errno));
+    task->job = job;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued >= WORKER_QUEUE_MAX)
+    {
+        pthread_cond_wait(&pool->space_cond, &pool->lock);
+    }
+
+    if (NULL == pool->tail)
+    {
+        pool->head = task;
+    }
+    else
+    {
+        pool->tail->next = task;
+    }
+    pool->tail = task;
+    ++pool->queued;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    status = WORKER_OK;
+cleanup:
+    return status;
+}
+
+void worker_pool_drain(worker_pool_t *pool)
+{
+    if (NULL == pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (NULL != pool->head || 0 != pool->running)
+    {
+        pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_destroy(worker_pool_t *pool)
+{
+    if (NULL == pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->thread_count; ++i)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->space_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}